@@ -20,12 +20,16 @@
 //---------------------------------------------------------------------------
 #include <vcl.h>
 #include <clipbrd.hpp>
+#include <System.Threading.hpp>
+#include <vector>
+#include <functional>
+#include <memory>
 #pragma hdrstop
 
 #include "CryptText.h"
 #include "aes.h"
 #include "sha256.h"
-#include "base64.h"
+#include "FastBase64.h"
 #include "minilzo.h"
 #include "Util.h"
 #include "CryptUtil.h"
@@ -192,18 +196,13 @@ int EncryptText(const SecureWString* psText,
 
     word32 lConvertLen = 16 + lCryptLen;
 
-    // get the required base64 buffer size
-    size_t outBufSize = 0;
-    base64_encode(nullptr, &outBufSize, nullptr, lConvertLen, BASE64_LINE_LENGTH);
-
-    // create a new buffer for base64
-    SecureMem<word8> outBuf(outBufSize);
-    base64_encode(outBuf, &outBufSize, buf, lConvertLen, BASE64_LINE_LENGTH);
-
-    //outBuf.back() = '\0';
+    // create a new buffer for base64 (including terminating zero)
+    SecureMem<char> outBuf(fastBase64EncodedLen(lConvertLen,
+      BASE64_LINE_LENGTH) + 1);
+    fastBase64Encode(outBuf, buf, lConvertLen, BASE64_LINE_LENGTH);
 
     // copy the output buffer to the clipboard
-    SetClipboardTextBufAnsi(reinterpret_cast<const char*>(outBuf.c_str()));
+    SetClipboardTextBufAnsi(outBuf.c_str());
   }
   catch (EClipboardException& e) {
     return CRYPTTEXT_ERROR_CLIPBOARD;
@@ -248,18 +247,17 @@ int DecryptText(const SecureWString* psText,
       lTextLen = asText.StrLen();
     }
 
-    // base64-decode the text
-    size_t bufSize = 0;
+    // base64-decode the text (in a single pass, ignoring line breaks)
+    SecureMem<word8> buf(fastBase64DecodedMaxLen(lTextLen));
+    word32 bufSize;
     word32 lMinLen = (nVersion == 0) ? 48 : 64;
-    if (base64_decode(nullptr, &bufSize, asText.Bytes(), lTextLen)
-          == POLARSSL_ERR_BASE64_INVALID_CHARACTER || bufSize < lMinLen)
-      return CRYPTTEXT_ERROR_TEXTCORRUPTED;
-
-    SecureMem<word8> buf(bufSize);
-    base64_decode(buf, &bufSize, asText.Bytes(), lTextLen);
+    bool blValid = fastBase64Decode(buf, &bufSize, asText.c_str(), lTextLen);
 
     asText.Clear();
 
+    if (!blValid || bufSize < lMinLen)
+      return CRYPTTEXT_ERROR_TEXTCORRUPTED;
+
     // length must be a multiple of 16!
     if ((bufSize & 0x0F) != 0)
       return CRYPTTEXT_ERROR_TEXTCORRUPTED;
@@ -403,4 +401,401 @@ int DecryptText(const SecureWString* psText,
   return CRYPTTEXT_OK;
 }
 //---------------------------------------------------------------------------
+static const word8
+CRYPTFILE_MAGIC[4] = { 'P', 'W', 'G', 'F' };
+
+struct CryptFileHeader {
+  word8 Magic[4];
+  word8 Version;
+  word8 Reserved[3];
+  word32 ChunkSize;
+  word8 Salt[16];
+};
+
+struct CryptFileChunkHeader {
+  word32 DataBytes;
+  word32 StoredBytes;
+  word8 Flags;
+  word8 Reserved[7];
+};
+
+static const word8
+CHUNK_FLAG_COMPRESSED = 1,
+CHUNK_FLAG_LAST       = 2;
+
+static const word32
+CHUNK_SIZE_FIELD_LENGTH = 4,
+CHUNK_IV_LENGTH         = 16,
+CHUNK_HEADER_SIZE       = sizeof(CryptFileChunkHeader),
+CHUNK_PREFIX_LENGTH     = CHUNK_SIZE_FIELD_LENGTH + CHUNK_IV_LENGTH;
+
+// chunk being processed by a worker task
+struct CryptFileChunk {
+  SecureMem<word8> Data;    // plaintext
+  SecureMem<word8> Record;  // size, IV, ciphertext, HMAC
+  SecureMem<word8> WorkMem; // LZO work memory (encryption only)
+  word32 DataBytes;
+  word32 RecordBytes;
+  word64 Index;
+  bool Last;
+  int Result;
+};
+
+// thrown internally to abort file processing with an error code
+struct CryptFileError {
+  int Code;
+};
 
+//---------------------------------------------------------------------------
+static void initFileCrypto(const word8* pPassw,
+  int nPasswLen,
+  const word8* pSalt,
+  word8* pEncKey,
+  word8* pMacKey)
+{
+  SecureMem<word8> derivedKey(32);
+  pbkdf2_256bit(pPassw, nPasswLen, pSalt, 16, derivedKey);
+
+  // use independent keys for encryption and authentication
+  static const char ENC_LABEL[] = "encryption", MAC_LABEL[] = "authentication";
+  sha256_hmac(derivedKey, 32, reinterpret_cast<const word8*>(ENC_LABEL),
+    sizeof(ENC_LABEL) - 1, pEncKey, 0);
+  sha256_hmac(derivedKey, 32, reinterpret_cast<const word8*>(MAC_LABEL),
+    sizeof(MAC_LABEL) - 1, pMacKey, 0);
+}
+//---------------------------------------------------------------------------
+static void computeChunkHmac(const word8* pMacKey,
+  word64 qIndex,
+  const word8* pIV,
+  const word8* pCipher,
+  word32 lCipherLen,
+  word8* pHmac)
+{
+  sha256_context hashCtx;
+  sha256_init(&hashCtx);
+  sha256_hmac_starts(&hashCtx, pMacKey, 32, 0);
+  sha256_hmac_update(&hashCtx, reinterpret_cast<const word8*>(&qIndex),
+    sizeof(qIndex));
+  sha256_hmac_update(&hashCtx, pIV, CHUNK_IV_LENGTH);
+  sha256_hmac_update(&hashCtx, pCipher, lCipherLen);
+  sha256_hmac_finish(&hashCtx, pHmac);
+  memzero(&hashCtx, sizeof(hashCtx));
+}
+//---------------------------------------------------------------------------
+static void processChunks(std::vector<CryptFileChunk>& chunks,
+  word32 lNumChunks,
+  const std::function<void(CryptFileChunk&)>& process)
+{
+  if (lNumChunks == 1) {
+    process(chunks[0]);
+    return;
+  }
+
+  std::vector<_di_ITask> tasks;
+  for (word32 i = 0; i < lNumChunks; i++) {
+    CryptFileChunk* pChunk = &chunks[i];
+    tasks.push_back(TTask::Create([&process,pChunk]() {
+      process(*pChunk);
+    }));
+    tasks.back()->Start();
+  }
+  for (auto& pTask : tasks)
+    pTask->Wait();
+}
+//---------------------------------------------------------------------------
+int EncryptFileChunked(const WString& sSrcFileName,
+  const WString& sDestFileName,
+  const word8* pPassw,
+  int nPasswLen,
+  RandomGenerator& randGen)
+{
+  std::unique_ptr<TFileStream> pDest;
+  int nResult = CRYPTTEXT_OK;
+
+  try {
+    std::unique_ptr<TFileStream> pSrc(new TFileStream(sSrcFileName,
+      fmOpenRead | fmShareDenyWrite));
+    const __int64 nSrcSize = pSrc->Size;
+
+    CryptFileHeader header;
+    memcpy(header.Magic, CRYPTFILE_MAGIC, sizeof(CRYPTFILE_MAGIC));
+    header.Version = static_cast<word8>(CRYPTFILE_VERSION);
+    memset(header.Reserved, 0, sizeof(header.Reserved));
+    header.ChunkSize = CRYPTFILE_CHUNK_SIZE;
+    randGen.GetData(header.Salt, sizeof(header.Salt));
+
+    SecureMem<word8> encKey(32), macKey(32);
+    initFileCrypto(pPassw, nPasswLen, header.Salt, encKey, macKey);
+
+    SecureMem<aes_context> cryptCtx(1);
+    aes_setkey_enc(cryptCtx, encKey, 256);
+    encKey.Clear();
+
+    word8 headerHmac[HMAC_LENGTH];
+    sha256_hmac(macKey, 32, reinterpret_cast<const word8*>(&header),
+      sizeof(header), headerHmac, 0);
+
+    pDest.reset(new TFileStream(sDestFileName, fmCreate));
+    pDest->WriteBuffer(&header, sizeof(header));
+    pDest->WriteBuffer(headerHmac, HMAC_LENGTH);
+
+    // the compressed data may exceed the chunk size; in this case, the chunk
+    // is stored uncompressed
+    const word32 lMaxComprLen = CRYPTFILE_CHUNK_SIZE +
+      CRYPTFILE_CHUNK_SIZE / 16 + 64 + 3;
+    const word32 lMaxRecordLen = CHUNK_PREFIX_LENGTH +
+      alignToBlockSize(CHUNK_HEADER_SIZE + lMaxComprLen, 16) + HMAC_LENGTH;
+
+    // process as many chunks at once as there are processors; memory usage
+    // is limited to a few MB per processor regardless of the file size
+    const word32 lMaxChunks = std::max(1, TThread::ProcessorCount);
+    std::vector<CryptFileChunk> chunks(lMaxChunks);
+    for (auto& chunk : chunks) {
+      chunk.Data.New(CRYPTFILE_CHUNK_SIZE);
+      chunk.Record.New(lMaxRecordLen);
+      chunk.WorkMem.New(LZO1X_1_MEM_COMPRESS);
+    }
+
+    aes_context* pCryptCtx = cryptCtx;
+    const word8* pMacKey = macKey;
+
+    auto encryptChunk = [pCryptCtx,pMacKey](CryptFileChunk& chunk)
+    {
+      word8* pIV = &chunk.Record[CHUNK_SIZE_FIELD_LENGTH];
+      word8* pCipher = &chunk.Record[CHUNK_PREFIX_LENGTH];
+      word8* pStored = pCipher + CHUNK_HEADER_SIZE;
+
+      CryptFileChunkHeader ch;
+      memset(&ch, 0, sizeof(ch));
+      ch.DataBytes = chunk.DataBytes;
+
+      lzo_uint comprLen = 0;
+      if (chunk.DataBytes != 0 &&
+          lzo1x_1_compress(chunk.Data, chunk.DataBytes, pStored, &comprLen,
+            chunk.WorkMem) == LZO_E_OK &&
+          comprLen < chunk.DataBytes) {
+        ch.StoredBytes = comprLen;
+        ch.Flags = CHUNK_FLAG_COMPRESSED;
+      }
+      else {
+        memcpy(pStored, chunk.Data, chunk.DataBytes);
+        ch.StoredBytes = chunk.DataBytes;
+      }
+      if (chunk.Last)
+        ch.Flags |= CHUNK_FLAG_LAST;
+
+      memcpy(pCipher, &ch, CHUNK_HEADER_SIZE);
+      word32 lPlainLen = CHUNK_HEADER_SIZE + ch.StoredBytes;
+      word32 lCipherLen = alignToBlockSize(lPlainLen, 16);
+      memset(pCipher + lPlainLen, 0, lCipherLen - lPlainLen);
+      memcpy(&chunk.Record[0], &lCipherLen, CHUNK_SIZE_FIELD_LENGTH);
+
+      word8 iv[CHUNK_IV_LENGTH];
+      memcpy(iv, pIV, CHUNK_IV_LENGTH);
+      aes_crypt_cbc(pCryptCtx, AES_ENCRYPT, lCipherLen, iv, pCipher, pCipher);
+
+      computeChunkHmac(pMacKey, chunk.Index, pIV, pCipher, lCipherLen,
+        pCipher + lCipherLen);
+
+      chunk.RecordBytes = CHUNK_PREFIX_LENGTH + lCipherLen + HMAC_LENGTH;
+      memzero(&ch, sizeof(ch));
+    };
+
+    word64 qIndex = 0;
+    bool blLast = false;
+    while (!blLast) {
+      word32 lNumChunks = 0;
+      while (lNumChunks < lMaxChunks && !blLast) {
+        auto& chunk = chunks[lNumChunks++];
+        chunk.DataBytes = pSrc->Read(chunk.Data, CRYPTFILE_CHUNK_SIZE);
+        chunk.Index = qIndex++;
+        chunk.Last = chunk.DataBytes < CRYPTFILE_CHUNK_SIZE ||
+          pSrc->Position >= nSrcSize;
+        blLast = chunk.Last;
+
+        // the random generator must not be accessed by the worker tasks
+        randGen.GetData(&chunk.Record[CHUNK_SIZE_FIELD_LENGTH],
+          CHUNK_IV_LENGTH);
+      }
+
+      processChunks(chunks, lNumChunks, encryptChunk);
+
+      for (word32 i = 0; i < lNumChunks; i++)
+        pDest->WriteBuffer(chunks[i].Record, chunks[i].RecordBytes);
+    }
+  }
+  catch (EStreamError& e) {
+    nResult = CRYPTTEXT_ERROR_FILE;
+  }
+  catch (std::bad_alloc& e) {
+    nResult = CRYPTTEXT_ERROR_OUTOFMEMORY;
+  }
+  catch (EOutOfMemory& e) {
+    nResult = CRYPTTEXT_ERROR_OUTOFMEMORY;
+  }
+
+  if (nResult != CRYPTTEXT_OK && pDest) {
+    pDest.reset();
+    DeleteFile(sDestFileName);
+  }
+
+  return nResult;
+}
+//---------------------------------------------------------------------------
+int DecryptFileChunked(const WString& sSrcFileName,
+  const WString& sDestFileName,
+  const word8* pPassw,
+  int nPasswLen)
+{
+  std::unique_ptr<TFileStream> pDest;
+  int nResult = CRYPTTEXT_OK;
+
+  try {
+    std::unique_ptr<TFileStream> pSrc(new TFileStream(sSrcFileName,
+      fmOpenRead | fmShareDenyWrite));
+    const __int64 nSrcSize = pSrc->Size;
+
+    CryptFileHeader header;
+    word8 headerHmac[HMAC_LENGTH], checkHmac[HMAC_LENGTH];
+
+    if (nSrcSize < sizeof(header) + HMAC_LENGTH)
+      throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+
+    pSrc->ReadBuffer(&header, sizeof(header));
+    pSrc->ReadBuffer(headerHmac, HMAC_LENGTH);
+
+    if (memcmp(header.Magic, CRYPTFILE_MAGIC, sizeof(CRYPTFILE_MAGIC)) != 0 ||
+        header.Version != CRYPTFILE_VERSION ||
+        header.ChunkSize == 0 || header.ChunkSize > CRYPTFILE_MAX_CHUNK_SIZE)
+      throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+
+    SecureMem<word8> encKey(32), macKey(32);
+    initFileCrypto(pPassw, nPasswLen, header.Salt, encKey, macKey);
+
+    sha256_hmac(macKey, 32, reinterpret_cast<const word8*>(&header),
+      sizeof(header), checkHmac, 0);
+    if (memcmp(headerHmac, checkHmac, HMAC_LENGTH) != 0)
+      throw CryptFileError{ CRYPTTEXT_ERROR_BADKEY };
+
+    SecureMem<aes_context> cryptCtx(1);
+    aes_setkey_dec(cryptCtx, encKey, 256);
+    encKey.Clear();
+
+    const word32 lChunkSize = header.ChunkSize;
+    const word32 lMaxCipherLen = alignToBlockSize(CHUNK_HEADER_SIZE +
+      lChunkSize + lChunkSize / 16 + 64 + 3, 16);
+
+    const word32 lMaxChunks = std::max(1, TThread::ProcessorCount);
+    std::vector<CryptFileChunk> chunks(lMaxChunks);
+    for (auto& chunk : chunks) {
+      chunk.Data.New(lChunkSize);
+      chunk.Record.New(CHUNK_PREFIX_LENGTH + lMaxCipherLen + HMAC_LENGTH);
+    }
+
+    aes_context* pCryptCtx = cryptCtx;
+    const word8* pMacKey = macKey;
+
+    auto decryptChunk = [pCryptCtx,pMacKey,lChunkSize](CryptFileChunk& chunk)
+    {
+      word32 lCipherLen;
+      memcpy(&lCipherLen, &chunk.Record[0], CHUNK_SIZE_FIELD_LENGTH);
+      const word8* pIV = &chunk.Record[CHUNK_SIZE_FIELD_LENGTH];
+      word8* pCipher = &chunk.Record[CHUNK_PREFIX_LENGTH];
+
+      word8 hmac[HMAC_LENGTH];
+      computeChunkHmac(pMacKey, chunk.Index, pIV, pCipher, lCipherLen, hmac);
+      if (memcmp(hmac, pCipher + lCipherLen, HMAC_LENGTH) != 0) {
+        chunk.Result = CRYPTTEXT_ERROR_TEXTCORRUPTED;
+        return;
+      }
+
+      word8 iv[CHUNK_IV_LENGTH];
+      memcpy(iv, pIV, CHUNK_IV_LENGTH);
+      aes_crypt_cbc(pCryptCtx, AES_DECRYPT, lCipherLen, iv, pCipher, pCipher);
+
+      CryptFileChunkHeader ch;
+      memcpy(&ch, pCipher, CHUNK_HEADER_SIZE);
+      const word8* pStored = pCipher + CHUNK_HEADER_SIZE;
+
+      chunk.Result = CRYPTTEXT_OK;
+      if (ch.DataBytes > lChunkSize ||
+          ch.StoredBytes > lCipherLen - CHUNK_HEADER_SIZE)
+        chunk.Result = CRYPTTEXT_ERROR_TEXTCORRUPTED;
+      else if (ch.Flags & CHUNK_FLAG_COMPRESSED) {
+        lzo_uint decomprLen = ch.DataBytes;
+        if (lzo1x_decompress_safe(pStored, ch.StoredBytes, chunk.Data,
+            &decomprLen, nullptr) != LZO_E_OK || decomprLen != ch.DataBytes)
+          chunk.Result = CRYPTTEXT_ERROR_DECOMPRFAILED;
+      }
+      else if (ch.StoredBytes != ch.DataBytes)
+        chunk.Result = CRYPTTEXT_ERROR_TEXTCORRUPTED;
+      else
+        memcpy(chunk.Data, pStored, ch.DataBytes);
+
+      chunk.DataBytes = ch.DataBytes;
+      chunk.Last = (ch.Flags & CHUNK_FLAG_LAST) != 0;
+      memzero(&ch, sizeof(ch));
+    };
+
+    pDest.reset(new TFileStream(sDestFileName, fmCreate));
+
+    word64 qIndex = 0;
+    bool blLast = false;
+    while (!blLast) {
+      word32 lNumChunks = 0;
+      while (lNumChunks < lMaxChunks && pSrc->Position < nSrcSize) {
+        auto& chunk = chunks[lNumChunks++];
+        word32 lCipherLen;
+        if (nSrcSize - pSrc->Position < CHUNK_PREFIX_LENGTH)
+          throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+        pSrc->ReadBuffer(&lCipherLen, CHUNK_SIZE_FIELD_LENGTH);
+        if (lCipherLen < CHUNK_HEADER_SIZE || lCipherLen > lMaxCipherLen ||
+            (lCipherLen & 0x0F) != 0 || nSrcSize - pSrc->Position <
+              CHUNK_IV_LENGTH + lCipherLen + HMAC_LENGTH)
+          throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+        memcpy(&chunk.Record[0], &lCipherLen, CHUNK_SIZE_FIELD_LENGTH);
+        pSrc->ReadBuffer(&chunk.Record[CHUNK_SIZE_FIELD_LENGTH],
+          CHUNK_IV_LENGTH + lCipherLen + HMAC_LENGTH);
+        chunk.Index = qIndex++;
+      }
+
+      // file ends without the last chunk (truncated)
+      if (lNumChunks == 0)
+        throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+
+      processChunks(chunks, lNumChunks, decryptChunk);
+
+      for (word32 i = 0; i < lNumChunks; i++) {
+        if (blLast || chunks[i].Result != CRYPTTEXT_OK)
+          throw CryptFileError{ blLast ? CRYPTTEXT_ERROR_TEXTCORRUPTED :
+            chunks[i].Result };
+        pDest->WriteBuffer(chunks[i].Data, chunks[i].DataBytes);
+        blLast = chunks[i].Last;
+      }
+    }
+
+    // data following the last chunk
+    if (pSrc->Position != nSrcSize)
+      throw CryptFileError{ CRYPTTEXT_ERROR_TEXTCORRUPTED };
+  }
+  catch (CryptFileError& e) {
+    nResult = e.Code;
+  }
+  catch (EStreamError& e) {
+    nResult = CRYPTTEXT_ERROR_FILE;
+  }
+  catch (std::bad_alloc& e) {
+    nResult = CRYPTTEXT_ERROR_OUTOFMEMORY;
+  }
+  catch (EOutOfMemory& e) {
+    nResult = CRYPTTEXT_ERROR_OUTOFMEMORY;
+  }
+
+  if (nResult != CRYPTTEXT_OK && pDest) {
+    pDest.reset();
+    DeleteFile(sDestFileName);
+  }
+
+  return nResult;
+}
+//---------------------------------------------------------------------------
@@ -35,11 +35,19 @@ CRYPTTEXT_ERROR_TEXTTOOLONG   = 3,
 CRYPTTEXT_ERROR_OUTOFMEMORY   = 4,
 CRYPTTEXT_ERROR_TEXTCORRUPTED = 5,
 CRYPTTEXT_ERROR_BADKEY        = 6,
-CRYPTTEXT_ERROR_DECOMPRFAILED = 7;
+CRYPTTEXT_ERROR_DECOMPRFAILED = 7,
+CRYPTTEXT_ERROR_FILE          = 8;
 
 const word32
 CRYPTTEXT_MAXTEXTBYTES = 134217728; // 128MB
 
+const int
+CRYPTFILE_VERSION = 1;
+
+const word32
+CRYPTFILE_CHUNK_SIZE     = 1048576,  // 1MB
+CRYPTFILE_MAX_CHUNK_SIZE = 67108864; // 64MB
+
 // Compresses and encrypts the clipboard text using AES in CBC mode.
 // The user key (password) and a random IV are hashed 8192 times to create
 // the "crunched" 256-bit key which is used to initialize the AES cipher and
@@ -89,4 +97,53 @@ int DecryptText(const SecureWString* psText,
   int nPasswLen,
   int nVersion = CRYPTTEXT_VERSION);
 
+// Compresses and encrypts files of arbitrary size in a streaming fashion,
+// using a constant amount of memory.
+// The key is derived from the password and a random 128-bit salt with the
+// same KDF as above (PBKDF2-SHA256); separate keys for AES-256 and
+// HMAC-SHA256 are derived from this key by HMAC-SHA256. The plaintext is
+// split into chunks of CRYPTFILE_CHUNK_SIZE bytes, which are compressed
+// (LZO), encrypted (AES-CBC with a random IV) and authenticated
+// independently, so that multiple chunks can be processed in parallel.
+// Encrypted files have the following structure:
+//
+//    [header]   [header HMAC]   [chunk 0] ... [chunk n-1]
+//    28 bytes     32 bytes
+//
+// header: "magic" 4-byte identification string, version, chunk size, salt
+// chunk:
+//
+//    [size]    [IV]     [chunk header]  [data]  [padding]    [HMAC]
+//   4 bytes  16 bytes     16 bytes                         32 bytes
+//                     |             encrypted data       |
+//
+// The chunk header contains the number of plaintext bytes, the number of
+// stored (compressed) bytes, and flags indicating compression and the last
+// chunk. The HMAC covers the chunk index, the IV and the ciphertext; thus,
+// chunks cannot be reordered, removed or appended without detection.
+
+// encrypts a file
+// -> name of source file (plaintext)
+// -> name of destination file; deleted if encryption fails
+// -> password
+// -> password length
+// -> random generator to create the salt and the IVs
+// <- error code
+int EncryptFileChunked(const WString& sSrcFileName,
+  const WString& sDestFileName,
+  const word8* pPassw,
+  int nPasswLen,
+  RandomGenerator& randGen);
+
+// decrypts a file encrypted by EncryptFileChunked()
+// -> name of source file (ciphertext)
+// -> name of destination file; deleted if decryption fails
+// -> password
+// -> password length
+// <- error code
+int DecryptFileChunked(const WString& sSrcFileName,
+  const WString& sDestFileName,
+  const word8* pPassw,
+  int nPasswLen);
+
 #endif
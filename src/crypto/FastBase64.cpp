@@ -0,0 +1,465 @@
+// FastBase64.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#pragma hdrstop
+
+#include <string.h>
+#include <algorithm>
+#include "FastBase64.h"
+#include "CpuFeatures.h"
+
+#ifdef CPU_X86_SIMD
+#define FASTBASE64_SSSE3
+#include <tmmintrin.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const char BASE64_ENC_MAP[65] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 0..63 = value, 64 = padding, 65 = line break or space, 127 = invalid
+static const word8
+DEC_PAD        = 64,
+DEC_WHITESPACE = 65,
+DEC_INVALID    = 127;
+
+static const word8 BASE64_DEC_MAP[256] =
+{
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127,  65, 127, 127,  65, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+   65, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,  62, 127, 127, 127,  63,
+   52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 127, 127, 127,  64, 127, 127,
+  127,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+   15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 127, 127, 127, 127, 127,
+  127,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+   41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127,
+  127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127
+};
+
+// state of the decoder between characters
+struct DecodeState {
+  word32 Bits;  // accumulated 6-bit values of the current group
+  int Chars;    // number of characters in the current group
+  int Pad;      // number of padding characters in the current group
+  bool Final;   // padded group complete, only whitespace may follow
+  bool Space;   // spaces were skipped, a line break or the end must follow
+  bool CR;      // carriage return was skipped, a line feed must follow
+};
+
+static const bool s_blUseSsse3 = GetCpuFeatures().SSSE3;
+
+//---------------------------------------------------------------------------
+static inline char* encodeGroupsScalar(char* p,
+  const word8* pSrc,
+  word32 lNumGroups)
+{
+  for ( ; lNumGroups > 0; lNumGroups--, pSrc += 3) {
+    word32 lBits = (pSrc[0] << 16) | (pSrc[1] << 8) | pSrc[2];
+    *p++ = BASE64_ENC_MAP[lBits >> 18];
+    *p++ = BASE64_ENC_MAP[(lBits >> 12) & 0x3F];
+    *p++ = BASE64_ENC_MAP[(lBits >> 6) & 0x3F];
+    *p++ = BASE64_ENC_MAP[lBits & 0x3F];
+  }
+  return p;
+}
+//---------------------------------------------------------------------------
+// processes a single character; returns 'false' if the character is invalid
+// (the rules for whitespace are those of base64_decode() in polarssl: lines
+// may be terminated by LF or CR+LF, and spaces are only allowed at the end of
+// a line or of the string)
+static inline bool decodeCharScalar(word8 c,
+  DecodeState& state,
+  word8*& p)
+{
+  word8 v = BASE64_DEC_MAP[c];
+
+  if (v != DEC_WHITESPACE && (state.Space || state.CR))
+    return false;
+
+  if (v < 64) {
+    if (state.Pad != 0 || state.Final)
+      return false;
+    state.Bits = (state.Bits << 6) | v;
+    if (++state.Chars == 4) {
+      *p++ = static_cast<word8>(state.Bits >> 16);
+      *p++ = static_cast<word8>(state.Bits >> 8);
+      *p++ = static_cast<word8>(state.Bits);
+      state.Bits = 0;
+      state.Chars = 0;
+    }
+  }
+  else if (v == DEC_PAD) {
+    // padding may only complete a group of 2 or 3 characters
+    if (state.Final || state.Chars + state.Pad < 2)
+      return false;
+    if (++state.Pad + state.Chars == 4) {
+      state.Bits <<= 6 * state.Pad;
+      *p++ = static_cast<word8>(state.Bits >> 16);
+      if (state.Pad == 1)
+        *p++ = static_cast<word8>(state.Bits >> 8);
+      state.Bits = 0;
+      state.Chars = 0;
+      state.Pad = 0;
+      state.Final = true;
+    }
+  }
+  else if (v != DEC_WHITESPACE)
+    return false;
+  else if (c == '\n')
+    state.Space = state.CR = false;
+  else if (state.CR)
+    return false;
+  else if (c == '\r')
+    state.CR = true;
+  else
+    state.Space = true;
+
+  return true;
+}
+//---------------------------------------------------------------------------
+static bool decodeScalar(word8*& pDest,
+  const char* pSrc,
+  word32 lSrcLen,
+  DecodeState& decState)
+{
+  // work on local copies which the compiler can keep in registers
+  DecodeState state = decState;
+  word8* p = pDest;
+  bool blValid = true;
+
+  for (word32 i = 0; i < lSrcLen && blValid; i++)
+    blValid = decodeCharScalar(pSrc[i], state, p);
+
+  decState = state;
+  pDest = p;
+
+  return blValid;
+}
+//---------------------------------------------------------------------------
+#ifdef FASTBASE64_SSSE3
+// encodes 12 bytes to 16 characters; reads 16 bytes from the source
+TARGET_SSSE3 static inline void encodeBlockSsse3(char* p,
+  const word8* pSrc)
+{
+  __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+
+  // distribute each 3-byte group over 4 bytes, then move the 6-bit values
+  // to the lower bits of the bytes
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+    7, 6, 8, 7, 10, 9, 11, 10));
+  __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+    _mm_set1_epi32(0x04000040));
+  __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+    _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(t0, t1);
+
+  // translate 6-bit values to ASCII: determine the range of each value
+  // (A-Z, a-z, 0-9, '+', '/') and add the respective offset
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  range = _mm_or_si128(range, _mm_and_si128(
+    _mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i out = _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), out);
+}
+//---------------------------------------------------------------------------
+// decodes 16 characters to 12 bytes; returns a bit mask of characters other
+// than A-Z, a-z, 0-9, '+', '/' (e.g., whitespace or padding), which have to be
+// processed by the scalar code; nothing is written if the mask is not 0
+TARGET_SSSE3 static inline int decodeBlockSsse3(word8* p,
+  const char* pSrc)
+{
+  const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+  const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4),
+    _mm_set1_epi8(0x0f));
+
+  // valid ranges depending on the upper 4 bits: 0x2B ('+'), 0x30-0x39,
+  // 0x41-0x4F, 0x50-0x5A, 0x61-0x6F, 0x70-0x7A; '/' is checked separately
+  const __m128i lowerBounds = _mm_setr_epi8(1, 1, 0x2b, 0x30, 0x41, 0x50,
+    0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1);
+  const __m128i upperBounds = _mm_setr_epi8(0, 0, 0x2b, 0x39, 0x4f, 0x5a,
+    0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i shifts = _mm_setr_epi8(0, 0, 0x3e - 0x2b, 0x34 - 0x30,
+    0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+    0, 0, 0, 0, 0, 0, 0, 0);
+
+  const __m128i below = _mm_cmplt_epi8(in,
+    _mm_shuffle_epi8(lowerBounds, hiNibbles));
+  const __m128i above = _mm_cmpgt_epi8(in,
+    _mm_shuffle_epi8(upperBounds, hiNibbles));
+  const __m128i isSlash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  const __m128i outside = _mm_andnot_si128(isSlash,
+    _mm_or_si128(below, above));
+  int nInvalidMask = _mm_movemask_epi8(outside);
+  if (nInvalidMask != 0)
+    return nInvalidMask;
+
+  __m128i values = _mm_add_epi8(in, _mm_shuffle_epi8(shifts, hiNibbles));
+  values = _mm_add_epi8(values, _mm_and_si128(isSlash, _mm_set1_epi8(-3)));
+
+  // pack 4 6-bit values into 3 bytes
+  values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+  values = _mm_shuffle_epi8(values, _mm_setr_epi8(2, 1, 0, 6, 5, 4,
+    10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(p), values);
+  word32 lLast = _mm_cvtsi128_si32(_mm_srli_si128(values, 8));
+  memcpy(p + 8, &lLast, 4);
+
+  return 0;
+}
+//---------------------------------------------------------------------------
+TARGET_SSSE3 static char* encodeGroupsSsse3(char* p,
+  const word8* pSrc,
+  word32 lNumGroups,
+  const word8* pSrcEnd)
+{
+  for ( ; lNumGroups >= 4 && pSrcEnd - pSrc >= 16; lNumGroups -= 4) {
+    encodeBlockSsse3(p, pSrc);
+    p += 16;
+    pSrc += 12;
+  }
+  return encodeGroupsScalar(p, pSrc, lNumGroups);
+}
+//---------------------------------------------------------------------------
+TARGET_SSSE3 static bool decodeSsse3(word8*& pDest,
+  const char* pSrc,
+  word32 lSrcLen,
+  DecodeState& decState)
+{
+  // work on local copies which the compiler can keep in registers
+  DecodeState state = decState;
+  word8* p = pDest;
+  const char* pSrcEnd = pSrc + lSrcLen;
+  bool blValid = true;
+
+  while (pSrc < pSrcEnd && blValid) {
+    if (state.Chars == 0 && state.Pad == 0 && !state.Final &&
+        !state.Space && !state.CR && pSrcEnd - pSrc >= 16) {
+      int nInvalidMask = decodeBlockSsse3(p, pSrc);
+      if (nInvalidMask == 0) {
+        pSrc += 16;
+        p += 12;
+        continue;
+      }
+      // process the valid characters preceding the first invalid one (e.g.,
+      // the end of a line) as well as the invalid one by the scalar code
+      const char* pStop = pSrc + __builtin_ctz(nInvalidMask) + 1;
+      while (pSrc < pStop && blValid)
+        blValid = decodeCharScalar(*pSrc++, state, p);
+    }
+    else
+      blValid = decodeCharScalar(*pSrc++, state, p);
+  }
+
+  decState = state;
+  pDest = p;
+
+  return blValid;
+}
+#endif
+//---------------------------------------------------------------------------
+static char* encodeGroups(char* p,
+  const word8* pSrc,
+  word32 lNumGroups,
+  const word8* pSrcEnd,
+  bool blSsse3)
+{
+#ifdef FASTBASE64_SSSE3
+  if (blSsse3)
+    return encodeGroupsSsse3(p, pSrc, lNumGroups, pSrcEnd);
+#endif
+  return encodeGroupsScalar(p, pSrc, lNumGroups);
+}
+//---------------------------------------------------------------------------
+word32 fastBase64EncodedLen(word32 lSrcLen,
+  word32 lLineLen)
+{
+  if (lSrcLen == 0)
+    return 0;
+  word32 lLen = (lSrcLen + 2) / 3 * 4;
+  if (lLineLen != 0)
+    lLen += (lLen - 1) / lLineLen * 2;
+  return lLen;
+}
+//---------------------------------------------------------------------------
+// encodes a buffer using the scalar or the SSSE3 implementation
+static word32 encode(char* pDest,
+  const word8* pSrc,
+  word32 lSrcLen,
+  word32 lLineLen,
+  bool blSsse3)
+{
+  const word8* pSrcEnd = pSrc + lSrcLen;
+  const word32 lNumGroups = lSrcLen / 3;
+  const word32 lGroupsPerLine = (lLineLen != 0) ? lLineLen / 4 : lNumGroups;
+  char* p = pDest;
+
+  word32 lGroup = 0;
+  while (lGroup < lNumGroups) {
+    if (lGroup != 0) {
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+    word32 lLineGroups = std::min(lGroupsPerLine, lNumGroups - lGroup);
+    p = encodeGroups(p, pSrc + 3 * lGroup, lLineGroups, pSrcEnd, blSsse3);
+    lGroup += lLineGroups;
+  }
+
+  word32 lRest = lSrcLen % 3;
+  if (lRest != 0) {
+    if (lLineLen != 0 && lGroup != 0 && lGroup % lGroupsPerLine == 0) {
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+    const word8* pRest = pSrc + 3 * lNumGroups;
+    word32 lBits = (pRest[0] << 16) | ((lRest == 2) ? pRest[1] << 8 : 0);
+    *p++ = BASE64_ENC_MAP[lBits >> 18];
+    *p++ = BASE64_ENC_MAP[(lBits >> 12) & 0x3F];
+    *p++ = (lRest == 2) ? BASE64_ENC_MAP[(lBits >> 6) & 0x3F] : '=';
+    *p++ = '=';
+  }
+
+  *p = '\0';
+
+  return p - pDest;
+}
+//---------------------------------------------------------------------------
+// decodes a string using the scalar or the SSSE3 implementation
+static bool decode(word8* pDest,
+  word32* plDestLen,
+  const char* pSrc,
+  word32 lSrcLen,
+  bool blSsse3)
+{
+  DecodeState state = { 0, 0, 0, false, false, false };
+  word8* p = pDest;
+  bool blValid = true;
+
+#ifdef FASTBASE64_SSSE3
+  if (blSsse3)
+    blValid = decodeSsse3(p, pSrc, lSrcLen, state);
+  else
+#endif
+    blValid = decodeScalar(p, pSrc, lSrcLen, state);
+
+  // the last group must be complete (padded), and a CR must be followed by LF
+  if (state.Chars != 0 || state.Pad != 0 || state.CR)
+    blValid = false;
+
+  state.Bits = 0;
+  *plDestLen = blValid ? p - pDest : 0;
+
+  return blValid;
+}
+//---------------------------------------------------------------------------
+word32 fastBase64Encode(char* pDest,
+  const word8* pSrc,
+  word32 lSrcLen,
+  word32 lLineLen)
+{
+  return encode(pDest, pSrc, lSrcLen, lLineLen, s_blUseSsse3);
+}
+//---------------------------------------------------------------------------
+bool fastBase64Decode(word8* pDest,
+  word32* plDestLen,
+  const char* pSrc,
+  word32 lSrcLen)
+{
+  return decode(pDest, plDestLen, pSrc, lSrcLen, s_blUseSsse3);
+}
+//---------------------------------------------------------------------------
+bool fastBase64IsAccelerated(void)
+{
+  return s_blUseSsse3;
+}
+//---------------------------------------------------------------------------
+int fastBase64SelfTest(void)
+{
+  static const word8 TEST_DEC[64] =
+  {
+    0x24, 0x48, 0x6E, 0x56, 0x87, 0x62, 0x5A, 0xBD,
+    0xBF, 0x17, 0xD9, 0xA2, 0xC4, 0x17, 0x1A, 0x01,
+    0x94, 0xED, 0x8F, 0x1E, 0x11, 0xB3, 0xD7, 0x09,
+    0x0C, 0xB6, 0xE9, 0x10, 0x6F, 0x22, 0xEE, 0x13,
+    0xCA, 0xB3, 0x07, 0x05, 0x76, 0xC9, 0xFA, 0x31,
+    0x6C, 0x08, 0x34, 0xFF, 0x8D, 0xC2, 0x6C, 0x38,
+    0x00, 0x43, 0xE9, 0x54, 0x97, 0xAF, 0x50, 0x4B,
+    0xD1, 0x41, 0xBA, 0x95, 0x31, 0x5A, 0x0B, 0x97
+  };
+  static const char TEST_ENC[] =
+    "JEhuVodiWr2/F9mixBcaAZTtjx4Rs9cJDLbpEG8i7hPK"
+    "swcFdsn6MWwINP+Nwmw4AEPpVJevUEvRQbqVMVoLlw==";
+  static const char TEST_ENC_WRAPPED[] =
+    "JEhuVodiWr2/F9mixBcaAZTtjx4Rs9cJDLbpEG8i7hPKswcFdsn6MWwINP+Nwmw4AEPpVJevUEvR\r\n"
+    "QbqVMVoLlw==";
+
+  static const char TEST_ENC_SPACES[] =
+    "JEhuVodiWr2/F9mixBcaAZTtjx4Rs9cJDLbpEG8i7hPKswcFdsn6MWwINP+Nwmw4AEPpVJevUEvR  \n"
+    "QbqVMVoLlw== ";
+
+  int nResult = 0;
+
+  // test the scalar implementation, and the SSSE3 implementation if
+  // supported by the CPU
+  for (int nPass = 0; nPass < (s_blUseSsse3 ? 2 : 1) && nResult == 0;
+       nPass++) {
+    const bool blSsse3 = nPass != 0;
+
+    char enc[128];
+    word8 dec[96];
+    word32 lDecLen;
+
+    if (encode(enc, TEST_DEC, 64, 0, blSsse3) != 88 ||
+        memcmp(enc, TEST_ENC, 89) != 0 ||
+        encode(enc, TEST_DEC, 64, 76, blSsse3) != 90 ||
+        fastBase64EncodedLen(64, 76) != 90 ||
+        memcmp(enc, TEST_ENC_WRAPPED, 91) != 0 ||
+        !decode(dec, &lDecLen, TEST_ENC_WRAPPED, 90, blSsse3) ||
+        lDecLen != 64 || memcmp(dec, TEST_DEC, 64) != 0 ||
+        !decode(dec, &lDecLen, TEST_ENC, 88, blSsse3) ||
+        lDecLen != 64 || memcmp(dec, TEST_DEC, 64) != 0 ||
+        !decode(dec, &lDecLen, TEST_ENC_SPACES, 92, blSsse3) ||
+        lDecLen != 64 || memcmp(dec, TEST_DEC, 64) != 0 ||
+        decode(dec, &lDecLen, TEST_ENC, 86, blSsse3) ||
+        decode(dec, &lDecLen, "JEhuVodiWr2/F9mixBc*AZTtjx4Rs9cJ", 32, blSsse3) ||
+        decode(dec, &lDecLen, "JEhu=odiWr2/F9mixBcaAZTtjx4Rs9cJ", 32, blSsse3) ||
+        decode(dec, &lDecLen, "JEhuVodiWr2/F9mi xBcaAZTtjx4Rs9cJ", 33, blSsse3) ||
+        decode(dec, &lDecLen, "JEhuVodiWr2/F9mi\txBcaAZTtjx4Rs9cJ", 33, blSsse3) ||
+        decode(dec, &lDecLen, "JEhuVodiWr2/F9mi\rxBcaAZTtjx4Rs9cJ", 33, blSsse3) ||
+        decode(dec, &lDecLen, "JEhuV", 5, blSsse3))
+      nResult = 1;
+  }
+
+  return nResult;
+}
+//---------------------------------------------------------------------------
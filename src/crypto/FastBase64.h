@@ -0,0 +1,84 @@
+// FastBase64.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef FastBase64H
+#define FastBase64H
+//---------------------------------------------------------------------------
+#include "types.h"
+
+// Base64 codec (RFC 4648) which processes 12 bytes/16 characters at once
+// using SSSE3 instructions if supported by the CPU, and falls back to a
+// scalar implementation otherwise.
+// Line breaks are inserted while encoding, and whitespace is skipped while
+// decoding, so that no extra passes over the data are required.
+// The output is identical to that of base64_encode() in polarssl. Decoding
+// accepts the same whitespace as base64_decode() in polarssl, but requires
+// the input to be padded to a multiple of 4 characters.
+
+// computes the length of the encoded string
+// -> number of bytes to encode
+// -> max. line length (must be a multiple of 4), 0 = no line breaks
+// <- number of characters (without terminating zero)
+word32 fastBase64EncodedLen(word32 lSrcLen,
+  word32 lLineLen = 0);
+
+// encodes a buffer
+// -> destination buffer; must have space for fastBase64EncodedLen() + 1
+//    characters
+// -> source buffer
+// -> number of bytes to encode
+// -> max. line length (must be a multiple of 4), 0 = no line breaks;
+//    lines are separated by CR+LF
+// <- number of characters written (without terminating zero)
+word32 fastBase64Encode(char* pDest,
+  const word8* pSrc,
+  word32 lSrcLen,
+  word32 lLineLen = 0);
+
+// computes the maximum length of the decoded data
+// -> number of characters to decode
+// <- max. number of bytes
+inline word32 fastBase64DecodedMaxLen(word32 lSrcLen)
+{
+  return lSrcLen / 4 * 3 + 2;
+}
+
+// decodes a string; line breaks (LF or CR+LF) are ignored, as are spaces at
+// the end of a line or of the string
+// -> destination buffer; must have space for fastBase64DecodedMaxLen()
+//    bytes
+// -> number of bytes written
+// -> source string
+// -> number of characters to decode
+// <- 'true' if successful, 'false' if the string contains invalid characters
+//    or is not padded
+bool fastBase64Decode(word8* pDest,
+  word32* plDestLen,
+  const char* pSrc,
+  word32 lSrcLen);
+
+// checks whether the SSSE3 implementation is used
+bool fastBase64IsAccelerated(void);
+
+// tests encoding and decoding of the available implementations
+// <- 0 if successful, 1 if the test failed
+int fastBase64SelfTest(void);
+
+#endif
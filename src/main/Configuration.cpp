@@ -19,6 +19,8 @@
 // 02111-1307, USA.
 //---------------------------------------------------------------------------
 #include <vcl.h>
+#include <IOUtils.hpp>
+#include <map>
 #pragma hdrstop
 
 #include "Configuration.h"
@@ -28,6 +30,8 @@
 #include "TopMostManager.h"
 #include "FastPRNG.h"
 #include "hrtimer.h"
+#include "PasswDatabase.h"
+#include "SecureAlloc.h"
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
 #pragma resource "*.dfm"
@@ -475,6 +479,249 @@ void __fastcall TConfigurationDlg::AutoSaveCheckClick(TObject *Sender)
   AutoSaveList->Enabled = AutoSaveCheck->Checked;
 }
 //---------------------------------------------------------------------------
+// measures throughput of UTF-16 <-> UTF-8 conversion for different kinds
+// of text
+static WString benchmarkTextConversion(word32 lDataSizeMB)
+{
+  const wchar_t* TEXT_TYPES[3] = { L"ASCII", L"Mixed", L"CJK" };
+  const int nNumChars = (lDataSizeMB << 20) / sizeof(wchar_t);
+
+  SecureWString sText(nNumChars);
+  SecureAnsiString asUtf8(3 * nNumChars);
+  WString sResult;
+
+  for (int nType = 0; nType < 3; nType++) {
+    for (int i = 0; i < nNumChars; i++) {
+      word32 lRand = fprng_rand();
+      switch (nType) {
+      case 0:
+        sText[i] = 32 + lRand % 95;
+        break;
+      case 1: // mostly ASCII with some accented letters (Latin-1)
+        sText[i] = (lRand % 8 == 0) ? 0xc0 + (lRand >> 8) % 64 :
+          32 + (lRand >> 8) % 95;
+        break;
+      default: // CJK unified ideographs
+        sText[i] = 0x4e00 + lRand % 0x5200;
+      }
+    }
+
+    Stopwatch clock;
+    int nUtf8Len = GetUtf8EncodedLength(sText, nNumChars);
+    WCharToUtf8(sText, nNumChars, asUtf8);
+    long double encRate = lDataSizeMB / clock.ElapsedSeconds();
+
+    clock.Reset();
+    GetUtf8DecodedLength(asUtf8, nUtf8Len);
+    Utf8ToWChar(asUtf8, nUtf8Len, sText);
+    long double decRate = lDataSizeMB / clock.ElapsedSeconds();
+
+    sResult += "\n" + Format("%s: %.2f MB/s (UTF-16 -> UTF-8), "
+      "%.2f MB/s (UTF-8 -> UTF-16)", ARRAYOFCONST((
+      TEXT_TYPES[nType], encRate, decRate)));
+  }
+
+  return sResult;
+}
+//---------------------------------------------------------------------------
+// performs the steps of TPasswMngForm::ResetListView() which create secure
+// strings (tag list, list entries, user names), without the list controls
+static void refreshPasswList(PasswDatabase& db)
+{
+  const auto& tagIndex = db.GetTagIndex();
+  const auto& tagTable = tagIndex.GetTable();
+
+  std::map<SecureWString, word32> tags;
+  for (word32 lTagId = 0; lTagId < tagTable.GetIdRange(); lTagId++) {
+    const auto& entries = tagIndex.GetEntries(lTagId);
+    if (!entries.IsEmpty())
+      tags.emplace(tagTable.Get(lTagId), entries.GetCount());
+  }
+
+  std::map<SecureWString, SecureWString> caseiTags;
+  for (const auto& kv : tags) {
+    SecureWString ciTag(kv.first);
+    CharLower(ciTag.Data());
+    caseiTags.emplace(ciTag, kv.first);
+  }
+
+  // default columns: title, user name, URL, notes, modification time
+  const int COLUMNS[] = { PasswDbEntry::TITLE, PasswDbEntry::USERNAME,
+    PasswDbEntry::URL, PasswDbEntry::NOTES, PasswDbEntry::MODIFICATIONTIME };
+  const word32 MAX_NOTES_LEN = 200;
+
+  for (const auto pEntry : db) {
+    for (int nField : COLUMNS) {
+      SecureWString sParam;
+      const wchar_t* pwszSrc;
+      if (nField == PasswDbEntry::NOTES) {
+        const auto& sNotes = pEntry->Strings[PasswDbEntry::NOTES];
+        if (sNotes.StrLen() > MAX_NOTES_LEN)
+          sParam.AssignStr(sNotes.c_str(), MAX_NOTES_LEN);
+        else
+          sParam = sNotes;
+        pwszSrc = sParam.c_str();
+      }
+      else if (nField == PasswDbEntry::MODIFICATIONTIME)
+        pwszSrc = pEntry->GetModificationTimeString().c_str();
+      else
+        pwszSrc = pEntry->Strings[nField].c_str();
+      WString sCaption(pwszSrc);
+    }
+  }
+
+  db.GetUserNames();
+}
+//---------------------------------------------------------------------------
+// measures opening a database file and refreshing the password list, with
+// and without storing short strings inside SecureMem objects; the number of
+// secure memory allocations refers to the calling thread, which reads the
+// entries and creates the list
+static WString benchmarkDatabaseLoad(int nNumEntries)
+{
+  const int NUM_TAGS = 50;
+
+  WString sTempFileName = TPath::GetTempFileName();
+  WString sResult;
+
+  try {
+    SecureMem<word8> key(32);
+    g_fastRandGen.GetData(key, key.Size());
+
+    {
+      PasswDatabase db;
+      db.New(key);
+
+      // key derivation would dominate the loading time
+      db.KdfIterations = 1;
+
+      const int PASSW_LEN = 16;
+      SecureWString sPassw(PASSW_LEN + 1), sField;
+      for (int i = 0; i < nNumEntries; i++) {
+        PasswDbEntry* pEntry = db.NewDbEntry();
+        WString sNum = IntToStr(i);
+        pEntry->Strings[PasswDbEntry::TITLE].AssignStr(
+          WString("Account " + sNum).c_str());
+        sField.AssignStr(WString("user" + sNum + "@example.com").c_str());
+        db.SetDbEntryUserName(*pEntry, sField);
+        pEntry->Strings[PasswDbEntry::URL].AssignStr(
+          WString("https://www.example" + IntToStr(i % 1000) +
+          ".com/login").c_str());
+        if (i % 4 == 0)
+          pEntry->Strings[PasswDbEntry::NOTES].AssignStr(
+            WString("Security question: name of first pet\r\n"
+            "PIN: " + IntToStr(static_cast<int>(
+            g_fastRandGen.GetNumRange(10000)))).c_str());
+        sField.AssignStr(WString("Tag " + IntToStr(i % NUM_TAGS)).c_str());
+        pEntry->AddTag(sField);
+        pEntry->UpdateTagsString();
+        for (int j = 0; j < PASSW_LEN; j++)
+          sPassw[j] = '!' + g_fastRandGen.GetNumRange(94);
+        sPassw[PASSW_LEN] = '\0';
+        db.SetDbEntryPassw(*pEntry, sPassw);
+      }
+
+      db.SaveToFile(sTempFileName);
+    }
+
+    for (int nPass = 0; nPass < 2; nPass++) {
+      g_blSecureMemInline = nPass == 0;
+
+      PasswDatabase db;
+
+      word64 qAllocCount = secureAllocCount();
+      Stopwatch clock;
+      db.Open(key, sTempFileName);
+      double dOpenTime = clock.ElapsedSeconds();
+      word64 qOpenAllocs = secureAllocCount() - qAllocCount;
+
+      qAllocCount = secureAllocCount();
+      clock.Reset();
+      refreshPasswList(db);
+      double dRefreshTime = clock.ElapsedSeconds();
+      word64 qRefreshAllocs = secureAllocCount() - qAllocCount;
+
+      sResult += "\n" + Format("%s: open %.3f s (%d allocations), "
+        "list refresh %.3f s (%d allocations)", ARRAYOFCONST((
+        nPass == 0 ? L"Inline buffer" : L"No inline buffer",
+        dOpenTime, static_cast<__int64>(qOpenAllocs),
+        dRefreshTime, static_cast<__int64>(qRefreshAllocs))));
+    }
+  }
+  catch (Exception& e) {
+    sResult = "\n" + e.Message;
+  }
+  catch (std::exception& e) {
+    sResult = "\n" + CppStdExceptionToString(e);
+  }
+
+  g_blSecureMemInline = true;
+  DeleteFile(sTempFileName);
+
+  return sResult;
+}
+//---------------------------------------------------------------------------
+// measures generation of phonetic passwords with the default trigrams and
+// with a 4-gram model; the model is built from a corpus of words generated
+// with the trigrams
+static WString benchmarkPhoneticGen(int nNumPassw)
+{
+  const int CORPUS_WORDS = 200000;
+  const int WORD_LEN = 8;
+  const int PASSW_LEN = 16;
+
+  WString sCorpusFileName = TPath::GetTempFileName();
+  WString sTrigramFileName = TPath::GetTempFileName();
+  WString sModelFileName = TPath::GetTempFileName();
+  WString sResult;
+
+  try {
+    PasswordGenerator passwGen(&g_fastRandGen);
+    SecureW32String sPassw;
+
+    {
+      auto pFile = std::make_unique<TFileStream>(sCorpusFileName, fmCreate);
+      std::vector<char> buf;
+      buf.reserve(CORPUS_WORDS * (WORD_LEN + 1));
+      for (int i = 0; i < CORPUS_WORDS; i++) {
+        passwGen.GetPhoneticPassw(sPassw, WORD_LEN, 0);
+        for (int j = 0; j < WORD_LEN; j++)
+          buf.push_back(sPassw[j]);
+        buf.push_back('\n');
+      }
+      pFile->WriteBuffer(&buf[0], buf.size());
+    }
+
+    PasswordGenerator::CreateTrigramFile(sCorpusFileName, sTrigramFileName,
+      nullptr, nullptr, sModelFileName, 4);
+
+    for (int nPass = 0; nPass < 2; nPass++) {
+      if (nPass == 1 && passwGen.LoadTrigramFile(sModelFileName) <= 0)
+        throw Exception("Could not load n-gram model");
+
+      Stopwatch clock;
+      for (int i = 0; i < nNumPassw; i++)
+        passwGen.GetPhoneticPassw(sPassw, PASSW_LEN, 0);
+      double dTime = clock.ElapsedSeconds();
+
+      sResult += "\n" + Format("%s: %.0f passwords/s", ARRAYOFCONST((
+        nPass == 0 ? L"Trigrams" : L"4-gram model", nNumPassw / dTime)));
+    }
+  }
+  catch (Exception& e) {
+    sResult = "\n" + e.Message;
+  }
+  catch (std::exception& e) {
+    sResult = "\n" + CppStdExceptionToString(e);
+  }
+
+  DeleteFile(sCorpusFileName);
+  DeleteFile(sTrigramFileName);
+  DeleteFile(sModelFileName);
+
+  return sResult;
+}
+//---------------------------------------------------------------------------
 void __fastcall TConfigurationDlg::BenchmarkBtnClick(TObject *Sender)
 {
   RandomPool rp(static_cast<RandomPool::CipherType>(0));
@@ -493,6 +740,18 @@ void __fastcall TConfigurationDlg::BenchmarkBtnClick(TObject *Sender)
     sResult += "\n" + Format("%s: %.2f MB/s", ARRAYOFCONST((
       RANDOM_POOL_CIPHER_NAMES[i], rate)));
   }
+  // the UTF-8 buffer may be 1.5 times the size of the text
+  word32 lTextSizeMB = std::min(lDataSizeMB, 64u);
+  sResult += "\n\n" + TRLFormat("Text conversion (data size: %1 MB):",
+    { IntToStr(static_cast<int>(lTextSizeMB)) }) +
+    benchmarkTextConversion(lTextSizeMB);
+  const int DATABASE_ENTRIES = 100000;
+  sResult += "\n\n" + TRLFormat("Password database (%1 entries):",
+    { IntToStr(DATABASE_ENTRIES) }) + benchmarkDatabaseLoad(DATABASE_ENTRIES);
+  const int PHONETIC_PASSWORDS = 1000000;
+  sResult += "\n\n" + TRLFormat("Phonetic passwords (%1 passwords, 16 "
+    "letters each):", { IntToStr(PHONETIC_PASSWORDS) }) +
+    benchmarkPhoneticGen(PHONETIC_PASSWORDS);
   Screen->Cursor = crDefault;
   MsgBox(TRLFormat("Benchmark results (data size: %1 MB):",
     { IntToStr(static_cast<int>(lDataSizeMB)) }) + sResult, MB_ICONINFORMATION);
@@ -49,6 +49,7 @@ __fastcall TCreateTrigramFileDlg::TCreateTrigramFileDlg(TComponent* Owner)
     TRLCaption(this);
     TRLCaption(SourceFileLbl);
     TRLCaption(DestFileLbl);
+    TRLCaption(NGramCheck);
     TRLCaption(CreateFileBtn);
     TRLCaption(CloseBtn);
     TRLHint(BrowseBtn);
@@ -60,11 +61,16 @@ __fastcall TCreateTrigramFileDlg::TCreateTrigramFileDlg(TComponent* Owner)
 void __fastcall TCreateTrigramFileDlg::LoadConfig(void)
 {
   Width = g_pIni->ReadInteger(CONFIG_ID, "WindowWidth", Width);
+  NGramCheck->Checked = g_pIni->ReadBool(CONFIG_ID, "CreateNGramModel", false);
+  NGramOrderList->ItemIndex = std::max(0, std::min(1,
+    g_pIni->ReadInteger(CONFIG_ID, "NGramOrder", 4) - 4));
 }
 //---------------------------------------------------------------------------
 void __fastcall TCreateTrigramFileDlg::SaveConfig(void)
 {
   g_pIni->WriteInteger(CONFIG_ID, "WindowWidth", Width);
+  g_pIni->WriteBool(CONFIG_ID, "CreateNGramModel", NGramCheck->Checked);
+  g_pIni->WriteInteger(CONFIG_ID, "NGramOrder", NGramOrderList->ItemIndex + 4);
 }
 //---------------------------------------------------------------------------
 void __fastcall TCreateTrigramFileDlg::FormActivate(TObject *Sender)
@@ -117,6 +123,11 @@ void __fastcall TCreateTrigramFileDlg::CreateFileBtnClick(TObject *Sender)
   if (ExtractFilePath(sDestFileName).IsEmpty())
     sDestFileName = g_sExePath + sDestFileName;
 
+  WString sNGramFileName;
+  int nNGramOrder = NGramOrderList->ItemIndex + 4;
+  if (NGramCheck->Checked)
+    sNGramFileName = ChangeFileExt(sDestFileName, ".ngm");
+
   Screen->Cursor = crHourGlass;
   bool blSuccess = false;
   WString sMsg;
@@ -125,7 +136,7 @@ void __fastcall TCreateTrigramFileDlg::CreateFileBtnClick(TObject *Sender)
     word32 lNumOfTris;
     double dEntropy;
     PasswordGenerator::CreateTrigramFile(sSrcFileName, sDestFileName,
-      &lNumOfTris, &dEntropy);
+      &lNumOfTris, &dEntropy, sNGramFileName, nNGramOrder);
 
     blSuccess = true;
     sMsg = TRLFormat("Trigram file \"%1\" successfully created.\n\n%2 trigrams "
@@ -133,6 +144,9 @@ void __fastcall TCreateTrigramFileDlg::CreateFileBtnClick(TObject *Sender)
       { ExtractFileName(sDestFileName),
         IntToStr(static_cast<__int64>(lNumOfTris)),
         FormatFloat("%1.2f", dEntropy) });
+    if (!sNGramFileName.IsEmpty())
+      sMsg += "\n\n" + TRLFormat("%1-gram model file \"%2\" created.",
+        { IntToStr(nNGramOrder), ExtractFileName(sNGramFileName) });
   }
   catch (Exception& e) {
     sMsg = TRLFormat("Error while creating file\n\"%1\":\n%2.",
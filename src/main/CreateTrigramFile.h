@@ -37,6 +37,8 @@ __published:	// IDE-managed Components
   TButton *BrowseBtn2;
   TButton *CreateFileBtn;
   TButton *CloseBtn;
+  TCheckBox *NGramCheck;
+  TComboBox *NGramOrderList;
   void __fastcall FormActivate(TObject *Sender);
   void __fastcall BrowseBtnClick(TObject *Sender);
   void __fastcall BrowseBtn2Click(TObject *Sender);
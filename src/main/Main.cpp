@@ -36,6 +36,7 @@
 #include "Main.h"
 #include "ProgramDef.h"
 #include "StringFileStreamW.h"
+#include "MappedFile.h"
 #include "Language.h"
 #include "hrtimer.h"
 #include "PasswList.h"
@@ -43,6 +44,7 @@
 #include "Util.h"
 #include "PasswEnter.h"
 #include "base64.h"
+#include "FastBase64.h"
 #include "Progress.h"
 #include "About.h"
 #include "CreateRandDataFile.h"
@@ -103,7 +105,8 @@ extern HANDLE g_hAppMutex;
 
 const WString
 CONFIG_ID             = "Main",
-CONFIG_PROFILE_ID     = "PWGenProfile";
+CONFIG_PROFILE_ID     = "PWGenProfile",
+CRYPTFILE_EXT         = ".pwgf";
 
 const int
 ENTROPY_TIMER_MAX     = 8,
@@ -294,6 +297,8 @@ __fastcall TMainForm::TMainForm(TComponent* Owner)
     throw Exception("BLAKE2 self test failed");
   if (base64_self_test(0) != 0)
     throw Exception("Base64 self test failed");
+  if (fastBase64SelfTest() != 0)
+    throw Exception("Base64 (fast) self test failed");
 
   // set up PRNGs and related stuff
   HighResTimerCheck();
@@ -316,6 +321,23 @@ __fastcall TMainForm::TMainForm(TComponent* Owner)
   CharsLengthSpinBtn->Max = PASSW_MAX_CHARS;
   WordsNumSpinBtn->Max = PASSW_MAX_WORDS;
 
+  // add menu items for file encryption below the clipboard items
+  // (captions are translated along with the rest of the main menu)
+  {
+    TMenuItem* pToolsMenu = MainMenu_Tools_DecryptClip->Parent;
+    int nIndex = MainMenu_Tools_DecryptClip->MenuIndex;
+
+    TMenuItem* pEncryptItem = new TMenuItem(pToolsMenu);
+    pEncryptItem->Caption = "Encrypt File...";
+    pEncryptItem->OnClick = MainMenu_Tools_EncryptFileClick;
+    pToolsMenu->Insert(nIndex + 1, pEncryptItem);
+
+    TMenuItem* pDecryptItem = new TMenuItem(pToolsMenu);
+    pDecryptItem->Caption = "Decrypt File...";
+    pDecryptItem->OnClick = MainMenu_Tools_DecryptFileClick;
+    pToolsMenu->Insert(nIndex + 2, pDecryptItem);
+  }
+
   if (g_blConsole) {
     SetConsoleOutputCP(CP_UTF8);
     Caption = Caption + " (console)";
@@ -457,8 +479,8 @@ __fastcall TMainForm::TMainForm(TComponent* Owner)
 
   PasswSecurityBarPanel->Width = 0;
 
-  OpenDlg->Filter = FormatW("%1 (*.*)|*.*|%2 (*.txt)|*.txt|%3 (*.tgm)|"
-      "*.tgm|%4 (*.lua)|*.lua",
+  OpenDlg->Filter = FormatW("%1 (*.*)|*.*|%2 (*.txt)|*.txt|%3 (*.tgm;*.ngm)|"
+      "*.tgm;*.ngm|%4 (*.lua)|*.lua",
     { TRL("All files"),
       TRL("Text files"),
       TRL("Trigram files"),
@@ -1612,6 +1634,120 @@ void __fastcall TMainForm::CryptText(bool blEncrypt,
   }
 }
 //---------------------------------------------------------------------------
+void __fastcall TMainForm::CryptFile(bool blEncrypt)
+{
+  OpenDlg->FilterIndex = 1;
+  OpenDlg->Title = blEncrypt ? TRL("Select file to encrypt") :
+    TRL("Select file to decrypt");
+
+  BeforeDisplayDlg();
+  bool blSuccess = OpenDlg->Execute();
+
+  WString sSrcFileName, sDestFileName;
+  if (blSuccess) {
+    sSrcFileName = OpenDlg->FileName;
+
+    // suggest removing the extension of encrypted files when decrypting
+    WString sDefaultName = ExtractFileName(sSrcFileName);
+    if (blEncrypt)
+      sDefaultName += CRYPTFILE_EXT;
+    else if (SameText(ExtractFileExt(sDefaultName), CRYPTFILE_EXT))
+      sDefaultName = ChangeFileExt(sDefaultName, "");
+
+    SaveDlg->FilterIndex = 1;
+    SaveDlg->Title = blEncrypt ? TRL("Save encrypted file as") :
+      TRL("Save decrypted file as");
+    SaveDlg->FileName = sDefaultName;
+    SaveDlg->InitialDir = ExtractFilePath(sSrcFileName);
+
+    blSuccess = SaveDlg->Execute();
+    if (blSuccess)
+      sDestFileName = SaveDlg->FileName;
+
+    SaveDlg->FileName = "";
+    SaveDlg->InitialDir = "";
+  }
+
+  AfterDisplayDlg();
+
+  if (!blSuccess)
+    return;
+
+  if (SameFileName(sSrcFileName, sDestFileName)) {
+    MsgBox(TRL("Source and destination files must be different."),
+      MB_ICONERROR);
+    return;
+  }
+
+  int nFlags = PASSWENTER_FLAG_ENABLEPASSWCACHE;
+  nFlags |= blEncrypt ? PASSWENTER_FLAG_ENCRYPT | PASSWENTER_FLAG_CONFIRMPASSW :
+    PASSWENTER_FLAG_DECRYPT;
+  blSuccess = PasswEnterDlg->Execute(nFlags, WString()) == mrOk;
+
+  SecureWString sPassw;
+  if (blSuccess)
+    sPassw = PasswEnterDlg->GetPassw();
+
+  PasswEnterDlg->Clear();
+  m_randPool.Flush();
+
+  if (!blSuccess)
+    return;
+
+  Refresh();
+  Screen->Cursor = crHourGlass;
+
+  int nResult;
+  if (blEncrypt) {
+    nResult = EncryptFileChunked(sSrcFileName, sDestFileName, sPassw.Bytes(),
+      sPassw.StrLenBytes(), m_randPool);
+    m_randPool.Flush();
+  }
+  else
+    nResult = DecryptFileChunked(sSrcFileName, sDestFileName, sPassw.Bytes(),
+      sPassw.StrLenBytes());
+
+  Screen->Cursor = crDefault;
+
+  WString sMsg;
+  switch (nResult) {
+  case CRYPTTEXT_OK:
+    if (blEncrypt)
+      sMsg = TRLFormat("File \"%1\" successfully encrypted.",
+        { ExtractFileName(sDestFileName) });
+    else
+      sMsg = TRLFormat("File \"%1\" successfully decrypted.",
+        { ExtractFileName(sDestFileName) });
+    break;
+  case CRYPTTEXT_ERROR_FILE:
+    sMsg = TRL("Error while reading or writing the file.");
+    break;
+  case CRYPTTEXT_ERROR_OUTOFMEMORY:
+    sMsg = TRL("Not enough memory available to perform\nthe operation.");
+    break;
+  case CRYPTTEXT_ERROR_TEXTCORRUPTED:
+  case CRYPTTEXT_ERROR_BADKEY:
+    sMsg = TRL("Decryption failed. This may be attributed\nto the following reasons:")
+      + WString("\n");
+    if (nResult == CRYPTTEXT_ERROR_BADKEY)
+      sMsg += TRL("- You entered a wrong password.") + WString("\n");
+    sMsg += TRL("- The file is corrupted.\n"
+        "- The file is not encrypted.");
+    break;
+  case CRYPTTEXT_ERROR_DECOMPRFAILED:
+    sMsg = TRL("This should not have happened:\nDecryption successful, but "
+        "decompression\nfailed.");
+    break;
+  default:
+    sMsg = "Unknown error"; // should never happen
+  }
+
+  if (nResult == CRYPTTEXT_OK)
+    InfoBoxForm->ShowInfo(sMsg);
+  else
+    MsgBox(sMsg, MB_ICONERROR);
+}
+//---------------------------------------------------------------------------
 void __fastcall TMainForm::OnSetSensitiveClipboardData(void)
 {
   if (g_config.AutoClearClip)
@@ -2271,6 +2407,10 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
   SecureW32String sChars;
   SecureW32String sWords;
   SecureW32String sFormatted;
+  SecureAnsiString sAsciiChars;
+  SecureAnsiString sAsciiWords;
+  SecureAnsiString sAsciiFormatted;
+  SecureWString sAsciiPasswW;
   SecureWString sFromScript;
   SecureWString sPasswList;
   wchar_t nullChar = '\0';
@@ -2317,6 +2457,18 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
       int nPasswFlags = 0, nPassphrFlags = 0, nFormatFlags = 0;
       bool blFirstCharNotLC = nFlags & PASSWOPTION_FIRSTCHARNOTLC;
 
+      // when writing to a file, generate 8-bit strings if all parts of the
+      // password consist of ASCII characters; the strings are written to
+      // ANSI/UTF-8 files without transcoding (the other destinations
+      // expect UTF-16 strings)
+      const bool blAsciiPassw = dest == gpdFileList &&
+        (nCharsLen == 0 ||
+         ((m_passwGen.CustomCharSetType == cstStandard ||
+           m_passwGen.CustomCharSetType == cstStandardWithFreq) &&
+          m_passwGen.IsCustomCharSetAscii)) &&
+        (nNumOfWords == 0 || m_passwGen.IsPassphraseAscii()) &&
+        (sFormatPassw.empty() || m_passwGen.IsFormatAscii(sFormatPassw));
+
       if (nCharsLen != 0) {
         if (blFirstCharNotLC)
           nPasswFlags |= PASSW_FLAG_FIRSTCHARNOTLC;
@@ -2326,8 +2478,6 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
           nPasswFlags |= PASSW_FLAG_INCLUDESUBSET;
         if (nFlags & PASSWOPTION_EACHCHARONLYONCE)
           nPasswFlags |= PASSW_FLAG_EACHCHARONLYONCE;
-        if (nCharSetSize >= 128 && nCharsLen >= 128)
-          nPasswFlags |= PASSW_FLAG_CHECKDUPLICATESBYSET;
         if (nFlags & PASSWOPTION_REMOVEWHITESPACE)
           nPasswFlags |= PASSW_FLAG_REMOVEWHITESPACE;
         for (int nI = 0; nI < PASSWGEN_NUMINCLUDECHARSETS; nI++) {
@@ -2339,7 +2489,10 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
         else if (m_passwGen.CustomCharSetType == cstPhoneticMixedCase)
           nPasswFlags |= PASSW_FLAG_PHONETICMIXEDCASE;
 
-        sChars.New(nCharsLen + 1);
+        if (blAsciiPassw)
+          sAsciiChars.New(nCharsLen + 1);
+        else
+          sChars.New(nCharsLen + 1);
       }
 
       if (nNumOfWords != 0) {
@@ -2362,12 +2515,17 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
         //sWords.New(m_passwGen.GetPassphraseBufSize(nNumOfWords, nCharsLen,
         //  nPassphrFlags));
         // estimate max. passphrase length
-        sWords.BufferedGrow(nCharsLen + nNumOfWords * 10 + 1);
-
         // clear mark will be reset by PasswordGenerator::GetPassphrase()
         // depending on the resulting passphrase length (which is not known
         // in advance)
-        sWords.SetClearMark(0);
+        if (blAsciiPassw) {
+          sAsciiWords.BufferedGrow(nCharsLen + nNumOfWords * 10 + 1);
+          sAsciiWords.SetClearMark(0);
+        }
+        else {
+          sWords.BufferedGrow(nCharsLen + nNumOfWords * 10 + 1);
+          sWords.SetClearMark(0);
+        }
       }
 
       if (!sFormatPassw.empty()) {
@@ -2376,8 +2534,14 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
         if (nFlags & PASSWOPTION_REMOVEWHITESPACE)
           nFormatFlags |= PASSFORMAT_FLAG_REMOVEWHITESPACE;
 
-        sFormatted.New(PASSWFORMAT_MAX_CHARS + 1);
-        sFormatted.SetClearMark(0);
+        if (blAsciiPassw) {
+          sAsciiFormatted.New(PASSWFORMAT_MAX_CHARS + 1);
+          sAsciiFormatted.SetClearMark(0);
+        }
+        else {
+          sFormatted.New(PASSWFORMAT_MAX_CHARS + 1);
+          sFormatted.SetClearMark(0);
+        }
       }
 
       if (blScripting) {
@@ -2441,16 +2605,29 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
       if (pScriptThread)
         pScriptThread->Start();
 
+      // the duplicate check and the common password test need UTF-16
+      // strings
+      const bool blWidenAsciiPassw = blAsciiPassw &&
+        ((qNumOfPassw > 1 && blExcludeDuplicates) ||
+         ((qNumOfPassw == 1 || blCheckEachPassw) &&
+          g_config.TestCommonPassw && !m_commonPassw.empty()));
+
       double dBasePasswSec = 0;
       while (qPasswCnt < qNumOfPassw && !cancelToken) {
         int nGenCharsLen = 0;
         word32* pPassw = nullptr;
+        char* pszAsciiPassw = nullptr;
 
         if (nCharsLen != 0 && !blKeepPrevPassw) {
           switch (m_passwGen.CustomCharSetType) {
           case cstStandard:
           case cstStandardWithFreq:
-            nGenCharsLen = m_passwGen.GetPassword(sChars, nCharsLen, nPasswFlags);
+            if (blAsciiPassw)
+              nGenCharsLen = m_passwGen.GetPassword(sAsciiChars, nCharsLen,
+                  nPasswFlags);
+            else
+              nGenCharsLen = m_passwGen.GetPassword(sChars, nCharsLen,
+                  nPasswFlags);
             break;
           case cstPhonetic:
           case cstPhoneticUpperCase:
@@ -2464,22 +2641,36 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
                 m_passwOptions.Flags & PASSWOPTION_EACHCHARONLYONCE)
               dBasePasswSec = m_passwGen.CalcPermSetEntropy(
                 nCharSetSize, nGenCharsLen);
+            else if (m_passwGen.CustomCharSetType == cstPhonetic ||
+                m_passwGen.CustomCharSetType == cstPhoneticUpperCase ||
+                m_passwGen.CustomCharSetType == cstPhoneticMixedCase)
+              dBasePasswSec = m_passwGen.CalcPhoneticEntropy(nGenCharsLen,
+                nPasswFlags);
             else
               dBasePasswSec = m_passwGen.CustomCharSetEntropy * nGenCharsLen;
           }
 
           nPasswLen = nGenCharsLen;
-          pPassw = sChars;
+          if (blAsciiPassw)
+            pszAsciiPassw = sAsciiChars;
+          else
+            pPassw = sChars;
         }
 
         if (nNumOfWords != 0) {
           int nNetWordsLen;
-          nPasswLen = m_passwGen.GetPassphrase(sWords, nNumOfWords, sChars,
-            nGenCharsLen, nPassphrFlags, &nNetWordsLen);
-
           // buffer may be significantly larger than actual data contents,
           // so there's no need to zeroize the entire buffer
-          sWords.GrowClearMark(nPasswLen);
+          if (blAsciiPassw) {
+            nPasswLen = m_passwGen.GetPassphrase(sAsciiWords, nNumOfWords,
+              sAsciiChars, nGenCharsLen, nPassphrFlags, &nNetWordsLen);
+            sAsciiWords.GrowClearMark(nPasswLen);
+          }
+          else {
+            nPasswLen = m_passwGen.GetPassphrase(sWords, nNumOfWords, sChars,
+              nGenCharsLen, nPassphrFlags, &nNetWordsLen);
+            sWords.GrowClearMark(nPasswLen);
+          }
 
           if (nPassphrMinLength >= 0) {
             int nBaseLen = blPassphrLenAllChars ? nPasswLen : nNetWordsLen;
@@ -2498,7 +2689,10 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
               dBasePasswSec += m_passwGen.WordListEntropy * nNumOfWords;
           }
 
-          pPassw = sWords;
+          if (blAsciiPassw)
+            pszAsciiPassw = sAsciiWords;
+          else
+            pPassw = sWords;
         }
 
         dPasswSec = dBasePasswSec;
@@ -2509,16 +2703,30 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
           double dFormatSec = 0;
           w32string sInvalidSpec;
           int nPasswPhUsed, nFormattedLen;
-          nFormattedLen = m_passwGen.GetFormatPassw(
-            sFormatted,
-            sFormatPassw,
-            nFormatFlags,
-            pPassw,
-            &nPasswPhUsed,
-            &sInvalidSpec,
-            (blFirstGen || blCheckEachPassw) ? &dFormatSec : nullptr);
-
-          sFormatted.GrowClearMark(nFormattedLen);
+          if (blAsciiPassw) {
+            nFormattedLen = m_passwGen.GetFormatPassw(
+              sAsciiFormatted,
+              sFormatPassw,
+              nFormatFlags,
+              pszAsciiPassw,
+              &nPasswPhUsed,
+              &sInvalidSpec,
+              (blFirstGen || blCheckEachPassw) ? &dFormatSec : nullptr);
+
+            sAsciiFormatted.GrowClearMark(nFormattedLen);
+          }
+          else {
+            nFormattedLen = m_passwGen.GetFormatPassw(
+              sFormatted,
+              sFormatPassw,
+              nFormatFlags,
+              pPassw,
+              &nPasswPhUsed,
+              &sInvalidSpec,
+              (blFirstGen || blCheckEachPassw) ? &dFormatSec : nullptr);
+
+            sFormatted.GrowClearMark(nFormattedLen);
+          }
 
           if (dFormatSec > 0) {
             if (nPasswPhUsed == PASSFORMAT_PWUSED_NOSPECIFIER)
@@ -2534,6 +2742,8 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
               //dPasswSec = dFormatSec;
               sChars.Clear();
               sWords.Clear();
+              sAsciiChars.Clear();
+              sAsciiWords.Clear();
               nCharsLen = nNumOfWords = 0;
               dBasePasswSec = 0;
               sFormatErrMsg = TRL("\"P\" is not specified");
@@ -2560,7 +2770,10 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
             }));
           }
 
-          pPassw = sFormatted;
+          if (blAsciiPassw)
+            pszAsciiPassw = sAsciiFormatted;
+          else
+            pPassw = sFormatted;
           nPasswLen = nFormattedLen;
         }
 
@@ -2571,6 +2784,17 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
           if (blFirstCharNotLC)
             pwszPassw[0] = toupper(pwszPassw[0]);
         }
+        else if (pszAsciiPassw != nullptr) {
+          if (blFirstCharNotLC)
+            pszAsciiPassw[0] = toupper(pszAsciiPassw[0]);
+          nPasswLenWChars = strlen(pszAsciiPassw);
+          if (pScriptThread || blWidenAsciiPassw) {
+            sAsciiPasswW.BufferedGrow(nPasswLenWChars + 1);
+            for (int nI = 0; nI <= nPasswLenWChars; nI++)
+              sAsciiPasswW[nI] = pszAsciiPassw[nI];
+            pwszPassw = sAsciiPasswW;
+          }
+        }
 
         if (pScriptThread) {
           pScriptThread->CallGenerate(
@@ -2591,6 +2815,7 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
                     PASSWSCRIPT_MAX_CHARS, sScriptPassw.StrLen()));
                 //sFromScript.back() = '\0';
                 pwszPassw = sFromScript;
+                pszAsciiPassw = nullptr;
                 nPasswLen = GetNumOfUnicodeChars(sFromScript);
                 nPasswLenWChars = sFromScript.StrLen();
               }
@@ -2739,7 +2964,10 @@ void __fastcall TMainForm::GeneratePassw(GeneratePasswDest dest,
 
         case gpdFileList:
 
-          pFile->WriteString(pwszPassw, nPasswLenWChars);
+          if (pszAsciiPassw != nullptr)
+            pFile->WriteAsciiString(pszAsciiPassw, nPasswLenWChars);
+          else
+            pFile->WriteString(pwszPassw, nPasswLenWChars);
           pFile->WriteString(sPasswAppendix.c_str(), sPasswAppendix.Length());
           break;
 
@@ -3976,6 +4204,16 @@ void __fastcall TMainForm::MainMenu_Tools_CreateRandDataFileClick(
   CreateRandDataFileDlg->ShowModal();
 }
 //---------------------------------------------------------------------------
+void __fastcall TMainForm::MainMenu_Tools_EncryptFileClick(TObject *Sender)
+{
+  CryptFile(true);
+}
+//---------------------------------------------------------------------------
+void __fastcall TMainForm::MainMenu_Tools_DecryptFileClick(TObject *Sender)
+{
+  CryptFile(false);
+}
+//---------------------------------------------------------------------------
 void __fastcall TMainForm::FormResize(TObject *Sender)
 {
   Tag = MAINFORM_TAG_REPAINT_COMBOBOXES;
@@ -4012,16 +4250,21 @@ void __fastcall TMainForm::MainMenu_Tools_ProvideAddEntropy_FromFileClick(
     Screen->Cursor = crHourGlass;
 
     try {
-      std::unique_ptr<TFileStream> pFile(new TFileStream(OpenDlg->FileName, fmOpenRead));
+      MappedFile file(OpenDlg->FileName);
 
-      const int IO_BUFSIZE = 65536;
-      SecureMem<word8> buf(IO_BUFSIZE);
-      int nBytesRead;
+      // entropy is estimated per chunk, so keep the chunk size of 64 KB
+      const word32 CHUNK_SIZE = 65536;
+      const word8* pData;
+      word32 lLen;
       word32 lEntBits = 0;
 
-      while ((nBytesRead = pFile->Read(buf, IO_BUFSIZE)) != 0 &&
-             lEntBits < 1'000'000'000) {
-        lEntBits += m_entropyMng.AddData(buf, nBytesRead, 4, 4);
+      while (lEntBits < 1'000'000'000 &&
+             (pData = file.ReadNext(lLen)) != nullptr) {
+        for (word32 lPos = 0; lPos < lLen && lEntBits < 1'000'000'000;
+             lPos += CHUNK_SIZE) {
+          lEntBits += m_entropyMng.AddData(pData + lPos,
+            std::min(CHUNK_SIZE, lLen - lPos), 4, 4);
+        }
       }
 
       sMsg = TRLFormat("%1 bits of entropy have been added to the random pool.",
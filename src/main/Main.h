@@ -502,6 +502,9 @@ private:	// User declarations
   void __fastcall RestoreAction(void);
   void __fastcall OnSetSensitiveClipboardData(void);
   void __fastcall OnQueryEndSession(TWMQueryEndSession& msg);
+  void __fastcall CryptFile(bool blEncrypt);
+  void __fastcall MainMenu_Tools_EncryptFileClick(TObject *Sender);
+  void __fastcall MainMenu_Tools_DecryptFileClick(TObject *Sender);
 public:		// User declarations
   __fastcall TMainForm(TComponent* Owner);
   __fastcall ~TMainForm();
@@ -116,7 +116,8 @@ const int
 
   PASSWBOX_TAG_PASSW_GEN  = 1,
 
-  WEAK_PASSW_THRESHOLD = 75;
+  WEAK_PASSW_THRESHOLD = 75,
+  SIMILAR_PASSW_MAX_EDIT_DIST = 2;
 
 const int
   STD_EXPIRY_DAYS[] = { 7, 14, 30, 90, 180, 365 };
@@ -168,79 +169,135 @@ const wchar_t* getDbEntryAutotypeSeq(const PasswDbEntry* pEntry)
     g_config.Database.DefaultAutotypeSequence.c_str();
 }
 
-word32 levenshteinDist(const wchar_t* pSrc, word32 lSrcLen,
-  const wchar_t* pTarget, word32 lTargetLen)
-{
-  static const int
-    INSERT_COST = 2,
-    DELETE_COST = 1,
-    REPLACE_COST = 1;
+// bit-parallel approximate substring matching (Myers' algorithm, blocked
+// variant by Hyyroe for patterns longer than 64 characters); the pattern is
+// preprocessed once and can then be matched against any number of strings
+class FuzzyMatcher {
+public:
+  explicit FuzzyMatcher(const wchar_t* pwszPattern)
+    : m_lPatternLen(wcslen(pwszPattern)),
+      m_lNumBlocks((m_lPatternLen + 63) / 64),
+      m_peq(256 * m_lNumBlocks), m_zeroEq(m_lNumBlocks),
+      m_pv(m_lNumBlocks), m_mv(m_lNumBlocks)
+  {
+    // characters outside the Latin-1 range are kept in a sorted list
+    for (word32 i = 0; i < m_lPatternLen; i++) {
+      wchar_t c = pwszPattern[i];
+      if (c >= 256) {
+        auto it = std::lower_bound(m_otherChars.begin(), m_otherChars.end(), c);
+        if (it == m_otherChars.end() || *it != c)
+          m_otherChars.insert(it, c);
+      }
+    }
+    m_peqOther.resize(m_otherChars.size() * m_lNumBlocks);
 
-  if (lSrcLen > lTargetLen) {
-    return levenshteinDist(pTarget, lTargetLen, pSrc, lSrcLen);
+    for (word32 i = 0; i < m_lPatternLen; i++) {
+      word64* pEq = const_cast<word64*>(GetPeq(pwszPattern[i]));
+      pEq[i / 64] |= 1ull << (i % 64);
+    }
   }
 
-  const word32 lMinSize = lSrcLen;
-  const word32 lMaxSize = lTargetLen;
-  std::vector<word32> levDist(lMinSize + 1);
-  levDist[0] = 0;
-  for (word32 i = 1; i <= lMinSize; i++)
-    levDist[i] = levDist[i - 1] + DELETE_COST;
+  word32 GetPatternLen(void) const
+  {
+    return m_lPatternLen;
+  }
 
-  for (word32 j = 1; j <= lMaxSize; j++) {
-    word32 lPrev = levDist[0], lPrevSave;
-    levDist[0] += INSERT_COST;
-    for (word32 i = 1; i <= lMinSize; i++) {
-      lPrevSave = levDist[i];
-      if (pSrc[i - 1] == pTarget[j - 1])
-        levDist[i] = lPrev;
-      else
-        levDist[i] = std::min(std::min(levDist[i] + INSERT_COST,
-          levDist[i - 1] + DELETE_COST), lPrev + REPLACE_COST);
-      lPrev = lPrevSave;
+  // determine min. edit distance between pattern and any substring of text
+  // -> text
+  // -> length of text
+  // <- edit distance (0 if text contains pattern)
+  word32 MinDistance(const wchar_t* pText, word32 lTextLen) const
+  {
+    if (m_lPatternLen == 0)
+      return 0;
+
+    const word32 lLast = m_lNumBlocks - 1;
+    const word64 qHighBit = 1ull << 63;
+    const word64 qLastBit = 1ull << ((m_lPatternLen - 1) % 64);
+
+    std::fill(m_pv.begin(), m_pv.end(), ~0ull);
+    std::fill(m_mv.begin(), m_mv.end(), 0);
+
+    word32 lScore = m_lPatternLen, lMinScore = lScore;
+    for (word32 j = 0; j < lTextLen; j++) {
+      const word64* pEq = GetPeq(pText[j]);
+      // horizontal delta in the top row is zero, since matches may start
+      // at any position
+      int nHout = 0;
+      for (word32 b = 0; b < lLast; b++)
+        nHout = AdvanceBlock(pEq[b], m_pv[b], m_mv[b], nHout, qHighBit);
+      lScore += AdvanceBlock(pEq[lLast], m_pv[lLast], m_mv[lLast], nHout,
+        qLastBit);
+      if (lScore < lMinScore) {
+        lMinScore = lScore;
+        if (lMinScore == 0)
+          break;
+      }
     }
-  }
 
-  return levDist.back();
-}
+    return lMinScore;
+  }
 
-float strFindFuzzy(const wchar_t* pSrc, const wchar_t* pPattern)
-{
-  const word32 lSrcLen = wcslen(pSrc);
-  const word32 lPatternLen = wcslen(pPattern);
-  float fBestScore = 0;
+private:
+  word32 m_lPatternLen;
+  word32 m_lNumBlocks;
+  std::vector<word64> m_peq;
+  std::vector<word64> m_zeroEq;
+  std::vector<wchar_t> m_otherChars;
+  std::vector<word64> m_peqOther;
+  mutable std::vector<word64> m_pv;
+  mutable std::vector<word64> m_mv;
 
-  auto levenshteinScore = [&](const wchar_t* p, word32 lLen)
+  // get match vectors of a character (one word per block)
+  const word64* GetPeq(wchar_t c) const
   {
-    word32 lDist = levenshteinDist(p, lLen, pPattern, lPatternLen);
-    return (lDist < lPatternLen) ?
-      (lPatternLen - lDist) / static_cast<float>(lPatternLen) : 0.0f;
-  };
-
-  if (lSrcLen <= lPatternLen) {
-    if (lSrcLen == lPatternLen && wcscmp(pSrc, pPattern) == 0)
-      fBestScore = 2;
-    else
-      fBestScore = levenshteinScore(pSrc, lSrcLen);
-  }
-  else {
-    const wchar_t* pNext = pSrc;
-    int i = 0;
-    while ((pNext = wcschr(pNext, pPattern[0])) != nullptr) {
-      if (i == 0 && wcsstr(pNext, pPattern) != nullptr) {
-        fBestScore = 1;
-        break;
-      }
-      else {
-        fBestScore = std::max(fBestScore, levenshteinScore(pNext,
-          std::min(lPatternLen, static_cast<word32>(pSrc + lSrcLen - pNext))));
-      }
-      i++;
-      pNext++;
-    }
+    if (c < 256)
+      return &m_peq[c * m_lNumBlocks];
+    auto it = std::lower_bound(m_otherChars.begin(), m_otherChars.end(), c);
+    if (it == m_otherChars.end() || *it != c)
+      return &m_zeroEq[0];
+    return &m_peqOther[(it - m_otherChars.begin()) * m_lNumBlocks];
+  }
+
+  // compute one column of the DP matrix for a block of 64 rows
+  // -> match vector of current text character
+  // -> vertical delta vectors (positive/negative)
+  // -> horizontal delta entering the block from above (-1, 0, +1)
+  // -> bit of the row whose horizontal delta is returned
+  // <- horizontal delta leaving the block
+  static int AdvanceBlock(word64 qEq, word64& qPv, word64& qMv, int nHin,
+    word64 qOutBit)
+  {
+    const word64 qHinNeg = (nHin < 0) ? 1 : 0;
+    const word64 qHinPos = (nHin > 0) ? 1 : 0;
+    const word64 qXv = qEq | qMv;
+    qEq |= qHinNeg;
+    const word64 qXh = (((qEq & qPv) + qPv) ^ qPv) | qEq;
+    word64 qPh = qMv | ~(qXh | qPv);
+    word64 qMh = qPv & qXh;
+    int nHout = ((qPh & qOutBit) != 0) - ((qMh & qOutBit) != 0);
+    qPh = (qPh << 1) | qHinPos;
+    qMh = (qMh << 1) | qHinNeg;
+    qPv = qMh | ~(qXv | qPh);
+    qMv = qPh & qXv;
+    return nHout;
   }
+};
+
+float strFindFuzzy(const wchar_t* pSrc, word32 lSrcLen,
+  const wchar_t* pPattern, const FuzzyMatcher& matcher)
+{
+  const word32 lPatternLen = matcher.GetPatternLen();
 
-  return fBestScore;
+  if (lSrcLen == lPatternLen && wmemcmp(pSrc, pPattern, lSrcLen) == 0)
+    return 2;
+
+  word32 lDist = matcher.MinDistance(pSrc, lSrcLen);
+  if (lDist == 0)
+    return 1;
+
+  return (lDist < lPatternLen) ?
+    (lPatternLen - lDist) / static_cast<float>(lPatternLen) : 0.0f;
 }
 
 void getExpiryCheckDates(word32& lCurrDate, word32& lExpirySoonDate)
@@ -308,7 +365,7 @@ void __fastcall TSelectItemThread::ApplyNow(void)
 __fastcall TPasswMngForm::TPasswMngForm(TComponent* Owner)
   : TForm(Owner), m_pSelectedItem(nullptr), m_nSortByIdx(-1),
     m_nSortOrderFactor(1), m_nTagsSortByIdx(0), m_nTagsSortOrderFactor(1),
-    m_nSearchFlags(INT_MAX), m_nPasswEntropyBits(0)
+    m_nSearchFlags(INT_MAX), m_nPasswEntropyBits(0), m_blSavePending(false)
 {
   SetFormComponentsAnchors(this);
 
@@ -431,6 +488,8 @@ __fastcall TPasswMngForm::TPasswMngForm(TComponent* Owner)
 //---------------------------------------------------------------------------
 __fastcall TPasswMngForm::~TPasswMngForm()
 {
+  WaitForBackgroundSave();
+  WaitForPasswStrengthEstimation();
   UnregisterDropWindow(PasswBox->Handle, m_pPasswBoxDropTarget);
 }
 //---------------------------------------------------------------------------
@@ -476,7 +535,9 @@ void __fastcall TPasswMngForm::LoadConfig(void)
     int nItemIdx = (nSortByIdx < 0) ? 0 : 2 + nSortByIdx;
     MainMenu_View_SortBy->Items[nItemIdx]->Checked = true;
   }
-  DbView->SortType = m_nSortByIdx >= 0 ? TSortType::stData : TSortType::stNone;
+  // DbView is never sorted implicitly by the VCL (SortType remains stNone);
+  // SortListView() sorts explicitly using precomputed ranks
+  DbView->SortType = TSortType::stNone;
 
   int nSortOrder = g_pIni->ReadInteger(CONFIG_ID, "SortOrder", 1);
   if (nSortOrder == 1 || nSortOrder == -1) {
@@ -908,6 +969,9 @@ bool __fastcall TPasswMngForm::CloseDatabase(bool blForce, int nLock)
       return false;
   }
 
+  WaitForBackgroundSave();
+  WaitForPasswStrengthEstimation();
+
 #ifdef _DEBUG
   if (m_passwDb.use_count() > 1) {
     ShowMessage("Database object is still in use somewhere!");
@@ -1008,10 +1072,20 @@ void __fastcall TPasswMngForm::ClearEditPanel(void)
   m_tempPasswHistory.reset();
 }
 //---------------------------------------------------------------------------
-bool __fastcall TPasswMngForm::SaveDatabase(const WString& sFileName)
+bool __fastcall TPasswMngForm::SaveDatabase(const WString& sFileName,
+  bool blBackground)
 {
   SuspendIdleTimer;
 
+  if (m_saveTask) {
+    if (blBackground && AnsiSameText(sFileName, m_sDbFileName)) {
+      // changes will be saved as soon as the running save has finished
+      m_blSavePending = true;
+      return true;
+    }
+    WaitForBackgroundSave();
+  }
+
   if (g_config.Database.CreateBackup && FileExists(sFileName)) {
     const WString BACKUP_EXT = ".bak";
     WString sBackupFileName = ExtractFilePath(sFileName) +
@@ -1058,11 +1132,48 @@ bool __fastcall TPasswMngForm::SaveDatabase(const WString& sFileName)
     if (!CopyFile(sFileName.c_str(), sBackupFileName.c_str(), false))
       MsgBox(TRLFormat("Could not save backup file\n\"%1\".", { sBackupFileName }),
         MB_ICONERROR);
+    else {
+      // the journal contains the latest changes and belongs to the backup
+      WString sJournalFileName = PasswDatabase::GetJournalFileName(sFileName),
+        sBackupJournalFileName = PasswDatabase::GetJournalFileName(sBackupFileName);
+      if (FileExists(sJournalFileName))
+        CopyFile(sJournalFileName.c_str(), sBackupJournalFileName.c_str(), false);
+      else if (FileExists(sBackupJournalFileName))
+        DeleteFile(sBackupJournalFileName);
+    }
   }
 
   WString sError;
   try {
-    m_passwDb->SaveToFile(sFileName);
+    if (blBackground) {
+      std::shared_ptr<PasswDbSnapshot> pSnapshot(
+        m_passwDb->CreateSnapshot(sFileName, true));
+      if (pSnapshot) {
+        // encrypt and write snapshot in the background,
+        // the result will be reported to the main thread and applied to
+        // the database which created the snapshot
+        std::shared_ptr<PasswDatabase> pDb = m_passwDb;
+        m_saveTask = TTask::Create([this,pDb,pSnapshot]() {
+          WString sTaskError;
+          try {
+            PasswDatabase::WriteSnapshot(*pSnapshot);
+          }
+          catch (Exception& e) {
+            sTaskError = e.Message;
+          }
+          catch (std::exception& e) {
+            sTaskError = CppStdExceptionToString(e);
+          }
+          TThread::Queue(nullptr, _di_TThreadProcedure(
+            [this,pDb,pSnapshot,sTaskError] {
+              OnBackgroundSaveFinished(pDb, pSnapshot, sTaskError);
+            }));
+        });
+        m_saveTask->Start();
+      }
+    }
+    else
+      m_passwDb->SaveToFile(sFileName, true);
   }
   catch (Exception& e) {
     sError = e.Message;
@@ -1080,6 +1191,134 @@ bool __fastcall TPasswMngForm::SaveDatabase(const WString& sFileName)
   return true;
 }
 //---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::WaitForBackgroundSave(void)
+{
+  if (!m_saveTask)
+    return;
+
+  // pending changes are saved synchronously below, so that
+  // OnBackgroundSaveFinished() does not start another background save
+  bool blSavePending = m_blSavePending;
+  m_blSavePending = false;
+
+  Screen->Cursor = crHourGlass;
+  while (m_saveTask) {
+    // execute OnBackgroundSaveFinished() queued by the task, which resets
+    // m_saveTask
+    if (m_saveTask->Wait(100))
+      CheckSynchronize();
+  }
+  Screen->Cursor = crDefault;
+
+  if (blSavePending && IsDbOpen() && !SaveDatabase(m_sDbFileName)) {
+    // do not call SetDbChanged() here to avoid triggering an autosave
+    m_blDbChanged = true;
+    ChangeCaption();
+    ToggleShutdownBlocker(TRL("Password database contains unsaved changes."));
+  }
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::OnBackgroundSaveFinished(
+  std::shared_ptr<PasswDatabase> pDb,
+  std::shared_ptr<PasswDbSnapshot> pSnapshot, const WString& sTaskError)
+{
+  m_saveTask = nullptr;
+
+  WString sError = sTaskError;
+  try {
+    pDb->CompleteSave(*pSnapshot, sError.IsEmpty());
+  }
+  catch (Exception& e) {
+    sError = e.Message;
+  }
+
+  // database has been closed in the meantime
+  if (pDb != m_passwDb) {
+    m_blSavePending = false;
+    return;
+  }
+
+  bool blSuccess = sError.IsEmpty();
+  if (!blSuccess)
+    MsgBox(TRLFormat("Error while saving database file:\n%1.", { sError }),
+      MB_ICONERROR);
+  else if (m_blSavePending)
+    blSuccess = SaveDatabase(m_sDbFileName, true);
+
+  m_blSavePending = false;
+
+  // do not call SetDbChanged() here to avoid triggering another autosave
+  if (!blSuccess && !m_blDbChanged) {
+    m_blDbChanged = true;
+    ChangeCaption();
+  }
+
+  ToggleShutdownBlocker(m_blDbChanged || m_saveTask ?
+    TRL("Password database contains unsaved changes.") : WString());
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::StartPasswStrengthEstimation(void)
+{
+  // the list is reset when the running estimation has finished, which
+  // starts estimating passwords changed in the meantime
+  if (m_strengthTask)
+    return;
+
+  bool blAdvancedEst = g_config.UseAdvancedPasswEst;
+  std::shared_ptr<PasswStrengthJob> pJob(
+    m_passwDb->CreatePasswStrengthJob(blAdvancedEst ? 1 : 0));
+  if (!pJob)
+    return;
+
+  // estimate passwords in the background, the results will be added to the
+  // cache of the database in the main thread
+  std::shared_ptr<PasswDatabase> pDb = m_passwDb;
+  m_strengthTask = TTask::Create([this,pDb,pJob,blAdvancedEst]() {
+    try {
+      PasswDatabase::EstimatePasswStrength(*pJob,
+        [blAdvancedEst](const SecureWString& sPassw)
+        {
+          if (blAdvancedEst)
+            return FloorEntropyBits(ZxcvbnMatch(
+              WStringToUtf8(sPassw).c_str(), nullptr, nullptr));
+          return static_cast<int>(
+            PasswordGenerator::EstimatePasswSecurity(sPassw.c_str()));
+        });
+    }
+    catch (...) {
+    }
+    TThread::Queue(nullptr, _di_TThreadProcedure([this,pDb,pJob] {
+      OnPasswStrengthEstimated(pDb, pJob);
+    }));
+  });
+  m_strengthTask->Start();
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::WaitForPasswStrengthEstimation(void)
+{
+  while (m_strengthTask) {
+    // execute OnPasswStrengthEstimated() queued by the task, which resets
+    // m_strengthTask
+    if (m_strengthTask->Wait(100))
+      CheckSynchronize();
+  }
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::OnPasswStrengthEstimated(
+  std::shared_ptr<PasswDatabase> pDb, std::shared_ptr<PasswStrengthJob> pJob)
+{
+  m_strengthTask = nullptr;
+
+  // database has been closed in the meantime
+  if (pDb != m_passwDb)
+    return;
+
+  m_passwDb->CompletePasswStrengthJob(*pJob);
+
+  if (MainMenu_View_Filter_WeakPassw->Checked)
+    ResetListView();
+}
+//---------------------------------------------------------------------------
 void __fastcall TPasswMngForm::ResetDbOpenControls(void)
 {
   bool blOpen = IsDbOpen();
@@ -1250,6 +1489,8 @@ void __fastcall TPasswMngForm::SearchDatabase(WString sStr,
   if (!blCaseSensitive)
     sBuf.New(1024);
 
+  FuzzyMatcher matcher(sStr.c_str());
+
   int nNumFound = 0;
 
   for (auto *pEntry : *m_passwDb)
@@ -1275,7 +1516,8 @@ void __fastcall TPasswMngForm::SearchDatabase(WString sStr,
           }
           float fScore;
           if (blFuzzy)
-            fScore = strFindFuzzy(psSrc->c_str(), sStr.c_str());
+            fScore = strFindFuzzy(psSrc->c_str(), wcslen(psSrc->c_str()),
+              sStr.c_str(), matcher);
           else
             fScore = wcsstr(psSrc->c_str(), sStr.c_str()) ? 1 : 0;
           if (fScore >= 0.5) {
@@ -1458,20 +1700,20 @@ void __fastcall TPasswMngForm::AddModifyListViewEntry(TListItem* pItem,
             pwszSrc = sParam.c_str();
             break;
           case PasswDbEntry::CREATIONTIME:
-            pwszSrc = pEntry->CreationTimeString.c_str();
+            pwszSrc = pEntry->GetCreationTimeString().c_str();
             break;
           case PasswDbEntry::MODIFICATIONTIME:
-            pwszSrc = pEntry->ModificationTimeString.c_str();
+            pwszSrc = pEntry->GetModificationTimeString().c_str();
             break;
           case PasswDbEntry::PASSWCHANGETIME:
-            pwszSrc = pEntry->PasswChangeTimeString.c_str();
+            pwszSrc = pEntry->GetPasswChangeTimeString().c_str();
             break;
           case PasswDbEntry::PASSWEXPIRYDATE:
-            pwszSrc = pEntry->PasswExpiryDateString.c_str();
+            pwszSrc = pEntry->GetPasswExpiryDateString().c_str();
             break;
           case PasswDbEntry::PASSWHISTORY:
             sCustomStr = IntToStr(static_cast<int>(
-              pEntry->GetPasswHistory().GetSize()));
+              pEntry->GetPasswHistorySize()));
             pwszSrc = sCustomStr.c_str();
             break;
           default:
@@ -1574,30 +1816,41 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
     //const PasswDbList& db = m_passwDb->GetDatabase();
 
     if (nFlags & RELOAD_TAGS) {
-      std::map<SecureWString, word32> tags, searchResultTags;
+      // tag counts are taken from the entry sets of the tag index;
+      // search results are counted by intersecting these sets with the
+      // bitmap of found entries
+      const auto& tagIndex = m_passwDb->GetTagIndex();
+      const auto& tagTable = tagIndex.GetTable();
+      std::vector<word64> foundEntries;
       word32 lNumUntagged = 0;
       word32 lNumUntaggedSearch = 0;
       word32 lNumSearchResults = 0;
+      if (m_nSearchMode != SEARCH_MODE_OFF)
+        foundEntries.resize((m_passwDb->Size + 63) / 64);
       for (const auto pEntry : *m_passwDb) {
-        if (pEntry->GetTagList().size() == 0)
+        bool blUntagged = pEntry->GetTagIds().empty();
+        if (blUntagged)
           lNumUntagged++;
-        else {
-          for (const auto& sTag : pEntry->GetTagList()) {
-            auto ret = tags.emplace(sTag, 0);
-            ret.first->second++;
-          }
-        }
         if (m_nSearchMode != SEARCH_MODE_OFF &&
             (pEntry->UserFlags & DB_FLAG_FOUND)) {
+          word32 lIndex = pEntry->GetIndex();
+          foundEntries[lIndex / 64] |= 1ull << (lIndex % 64);
           lNumSearchResults++;
-          if (pEntry->GetTagList().size() == 0)
+          if (blUntagged)
             lNumUntaggedSearch++;
-          else {
-            for (const auto& sTag : pEntry->GetTagList()) {
-              auto ret = searchResultTags.emplace(sTag, 0);
-              ret.first->second++;
-            }
-          }
+        }
+      }
+
+      std::map<SecureWString, word32> tags, searchResultTags;
+      for (word32 lTagId = 0; lTagId < tagTable.GetIdRange(); lTagId++) {
+        const auto& entries = tagIndex.GetEntries(lTagId);
+        if (entries.IsEmpty())
+          continue;
+        tags.emplace(tagTable.Get(lTagId), entries.GetCount());
+        if (lNumSearchResults != 0) {
+          word32 lCount = entries.CountIntersection(foundEntries);
+          if (lCount != 0)
+            searchResultTags.emplace(tagTable.Get(lTagId), lCount);
         }
       }
 
@@ -1696,7 +1949,9 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
       None,
       Expired,
       ExpireSoon,
-      WeakPassw
+      WeakPassw,
+      ReusedPassw,
+      SimilarPassw
     } filterType = FilterType::None;
     if (MainMenu_View_Filter_Expired->Checked)
       filterType = FilterType::Expired;
@@ -1704,15 +1959,51 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
       filterType = FilterType::ExpireSoon;
     else if (MainMenu_View_Filter_WeakPassw->Checked)
       filterType = FilterType::WeakPassw;
-    std::map<SecureWString, SecureWString> userNamesMap;
+    else if (MainMenu_View_Filter_ReusedPassw->Checked)
+      filterType = FilterType::ReusedPassw;
+    else if (MainMenu_View_Filter_SimilarPassw->Checked)
+      filterType = FilterType::SimilarPassw;
+
+    // strength of passwords is estimated once in the background and kept
+    // in the cache of the database until a password or the estimator is
+    // changed; entries are added to the list as soon as their passwords
+    // have been estimated
+    if (filterType == FilterType::WeakPassw)
+      StartPasswStrengthEstimation();
+
+    // mark entries sharing their password with other entries, or having
+    // passwords similar to those of other entries
+    std::vector<bool> passwGroupMembers;
+    if (filterType == FilterType::ReusedPassw ||
+        filterType == FilterType::SimilarPassw) {
+      passwGroupMembers.resize(m_passwDb->Size);
+      auto groups = (filterType == FilterType::ReusedPassw) ?
+        m_passwDb->FindReusedPassw() :
+        m_passwDb->FindSimilarPassw(SIMILAR_PASSW_MAX_EDIT_DIST);
+      for (const auto& group : groups) {
+        for (const auto pEntry : group)
+          passwGroupMembers[pEntry->GetIndex()] = true;
+      }
+    }
 
-    for (const auto pEntry : *m_passwDb) {
-      if (!pEntry->Strings[PasswDbEntry::USERNAME].IsStrEmpty()) {
-        SecureWString sUserNameLC = pEntry->Strings[PasswDbEntry::USERNAME];
-        CharLower(sUserNameLC.Data());
-        userNamesMap.emplace(sUserNameLC, pEntry->Strings[PasswDbEntry::USERNAME]);
+    // combine entry sets of the tags in the filter into a single bitmap
+    std::vector<word64> tagFilterEntries;
+    bool blUntaggedFilter = false;
+    if (!m_tagFilter.empty()) {
+      const auto& tagIndex = m_passwDb->GetTagIndex();
+      tagFilterEntries.resize((m_passwDb->Size + 63) / 64);
+      for (const auto& sFilter : m_tagFilter) {
+        if (sFilter.IsEmpty())
+          blUntaggedFilter = true;
+        else {
+          word32 lTagId = tagIndex.GetTable().Find(sFilter);
+          if (lTagId != PasswDbStringTable::npos)
+            tagIndex.GetEntries(lTagId).AddToBitmap(tagFilterEntries);
+        }
       }
+    }
 
+    for (const auto pEntry : *m_passwDb) {
       pEntry->UserFlags &= ~(DB_FLAG_EXPIRED | DB_FLAG_EXPIRES_SOON);
       if (pEntry->PasswExpiryDate != 0) {
         if (lCurrDate >= pEntry->PasswExpiryDate)
@@ -1727,36 +2018,20 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
         continue;
 
       if (filterType == FilterType::WeakPassw) {
-        auto sPassw = m_passwDb->GetDbEntryPassw(*pEntry);
-        if (!sPassw.IsStrEmpty()) {
-          int nEntropyBits;
-          if (g_config.UseAdvancedPasswEst)
-            nEntropyBits = FloorEntropyBits(ZxcvbnMatch(
-              WStringToUtf8(sPassw).c_str(), nullptr, nullptr));
-          else
-            nEntropyBits = PasswordGenerator::EstimatePasswSecurity(sPassw.c_str());
-          if (nEntropyBits >= WEAK_PASSW_THRESHOLD)
-            continue;
-        }
-        else
+        int nEntropyBits = m_passwDb->GetCachedPasswStrength(*pEntry);
+        if (nEntropyBits < 0 || nEntropyBits >= WEAK_PASSW_THRESHOLD)
           continue;
       }
 
+      if ((filterType == FilterType::ReusedPassw ||
+           filterType == FilterType::SimilarPassw) &&
+          !passwGroupMembers[pEntry->GetIndex()])
+        continue;
+
       if (!m_tagFilter.empty()) {
-        bool blMatch = false;
-        if (pEntry->GetTagList().size() == 0) {
-          if (m_tagFilter.count(SecureWString()) != 0)
-            blMatch = true;
-        }
-        else {
-          for (const auto& sFilter : m_tagFilter) {
-            if (pEntry->CheckTag(sFilter)) {
-              blMatch = true;
-              break;
-            }
-          }
-        }
-        if (!blMatch)
+        word32 lIndex = pEntry->GetIndex();
+        bool blMatch = (tagFilterEntries[lIndex / 64] >> (lIndex % 64)) & 1;
+        if (!blMatch && (!blUntaggedFilter || !pEntry->GetTagIds().empty()))
           continue;
       }
 
@@ -1770,9 +2045,9 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
     if (m_nSearchMode == SEARCH_MODE_OFF && filterType == FilterType::None)
       AddModifyListViewEntry();
 
-    if (DbView->Items->Count >= 2 && m_nSearchMode == SEARCH_MODE_FUZZY &&
-        m_nSortByIdx < 0)
-      DbView->AlphaSort();
+    if (DbView->Items->Count >= 2 && (m_nSortByIdx >= 0 ||
+        m_nSearchMode == SEARCH_MODE_FUZZY))
+      SortListView();
 
     DbView->Items->EndUpdate();
 
@@ -1795,11 +2070,8 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
       //m_pSelectedItem = nullptr;
       //DbViewSelectItem(this, nullptr, false);
 
-    if (!userNamesMap.empty()) {
-      std::vector<SecureWString> userNames;
-      for (const auto& kv : userNamesMap) {
-        userNames.push_back(kv.second);
-      }
+    std::vector<SecureWString> userNames = m_passwDb->GetUserNames();
+    if (!userNames.empty()) {
 
       //std::sort(userNames.begin(), userNames.end());
       //for (auto& s:userNames)
@@ -1821,6 +2093,10 @@ void __fastcall TPasswMngForm::ResetListView(int nFlags)
         sInfo = MainMenu_View_Filter_ExpireSoon->Caption; break;
       case FilterType::WeakPassw:
         sInfo = MainMenu_View_Filter_WeakPassw->Caption; break;
+      case FilterType::ReusedPassw:
+        sInfo = MainMenu_View_Filter_ReusedPassw->Caption; break;
+      case FilterType::SimilarPassw:
+        sInfo = MainMenu_View_Filter_SimilarPassw->Caption; break;
       }
 
       FilterInfoPanel->Hint = RemoveAccessKeysFromStr(sInfo);
@@ -1849,31 +2125,35 @@ void __fastcall TPasswMngForm::SetShowColMask(void)
 //---------------------------------------------------------------------------
 void __fastcall TPasswMngForm::MoveDbEntries(int nDir)
 {
-  const word32 lDbSize = m_passwDb->Size;
-  bool blChanged = false;
-  for (word32 i = 0, j = 0; i < DbView->Items->Count; i++) {
+  std::vector<PasswDbEntry*> selEntries;
+  for (word32 i = 0; i < DbView->Items->Count; i++) {
     if (DbView->Items->Item[i]->Selected) {
       PasswDbEntry* pEntry = reinterpret_cast<PasswDbEntry*>(
         DbView->Items->Item[i]->Data);
-      if (pEntry != nullptr) {
-        word32 lPos = pEntry->GetIndex();
-        word32 lNewPos = -1;
-        if (nDir == MOVE_TOP)
-          lNewPos = j++;
-        else if (nDir == MOVE_UP && lPos > 0)
-          lNewPos = lPos - 1;
-        else if (nDir == MOVE_DOWN && lPos < lDbSize - 1)
-          lNewPos = lPos + 1;
-        else if (nDir == MOVE_BOTTOM)
-          lNewPos = lDbSize - 1;
-        if (lNewPos != -1 && lNewPos != lPos) {
-          m_passwDb->MoveDbEntry(lPos, lNewPos);
-          blChanged = true;
-        }
-      }
+      if (pEntry != nullptr)
+        selEntries.push_back(pEntry);
     }
   }
 
+  if (selEntries.empty())
+    return;
+
+  bool blChanged = false;
+  switch (nDir) {
+  case MOVE_TOP:
+    blChanged = m_passwDb->MoveDbEntries(selEntries, 0);
+    break;
+  case MOVE_UP:
+    blChanged = m_passwDb->ShiftDbEntries(selEntries, true);
+    break;
+  case MOVE_DOWN:
+    blChanged = m_passwDb->ShiftDbEntries(selEntries, false);
+    break;
+  case MOVE_BOTTOM:
+    blChanged = m_passwDb->MoveDbEntries(selEntries,
+      m_passwDb->Size - selEntries.size());
+  }
+
   if (blChanged) {
     SetDbChanged();
     ResetListView();
@@ -1967,10 +2247,10 @@ void __fastcall TPasswMngForm::ApplyDbViewItemSelection(TListItem* pItem)
 
     //ExpiryCheckClick(this);
 
-    CreationTimeInfo->Caption = WString(pEntry->CreationTimeString.c_str());
-    LastModificationInfo->Caption = WString(pEntry->ModificationTimeString.c_str());
-    PasswChangeInfo->Caption = pEntry->PasswChangeTimeString.IsStrEmpty() ?
-      "-" : WString(pEntry->PasswChangeTimeString.c_str());
+    CreationTimeInfo->Caption = WString(pEntry->GetCreationTimeString().c_str());
+    LastModificationInfo->Caption = WString(pEntry->GetModificationTimeString().c_str());
+    PasswChangeInfo->Caption = pEntry->GetPasswChangeTimeString().IsStrEmpty() ?
+      "-" : WString(pEntry->GetPasswChangeTimeString().c_str());
 
     SecureWString sPassw = m_passwDb->GetDbEntryPassw(*pEntry);
 
@@ -2075,7 +2355,7 @@ void __fastcall TPasswMngForm::AddModifyBtnClick(TObject *Sender)
 
   //SecureWString sTitle, sUserName, sUrl, sKeyword, sNotes;
   pEntry->Strings[PasswDbEntry::TITLE] = GetEditBoxTextBuf(TitleBox);
-  pEntry->Strings[PasswDbEntry::USERNAME] = GetEditBoxTextBuf(UserNameBox);
+  m_passwDb->SetDbEntryUserName(*pEntry, GetEditBoxTextBuf(UserNameBox));
   pEntry->Strings[PasswDbEntry::URL] = GetEditBoxTextBuf(UrlBox);
   pEntry->Strings[PasswDbEntry::KEYWORD] = GetEditBoxTextBuf(KeywordBox);
   pEntry->Strings[PasswDbEntry::NOTES] = GetEditBoxTextBuf(NotesBox);
@@ -2158,7 +2438,6 @@ void __fastcall TPasswMngForm::AddModifyBtnClick(TObject *Sender)
     lExpiryDate = pEntry->EncodeExpiryDate(wYear, wMonth, wDay);
   }
   pEntry->PasswExpiryDate = lExpiryDate;
-  pEntry->PasswExpiryDateString = pEntry->ExpiryDateToString(lExpiryDate);
 
   pEntry->UpdateModificationTime(blPasswChanged);
 
@@ -2187,7 +2466,7 @@ void __fastcall TPasswMngForm::AddModifyBtnClick(TObject *Sender)
     }
 
     if (m_nSortByIdx >= 0 || m_nSearchMode == SEARCH_MODE_FUZZY)
-      DbView->AlphaSort();
+      SortListView();
   }
   else
     ResetListView(RELOAD_TAGS);
@@ -2329,15 +2608,19 @@ void __fastcall TPasswMngForm::DeleteBtnClick(TObject *Sender)
   if (MsgBox(sMsg, MB_ICONWARNING + MB_YESNO + MB_DEFBUTTON2) == IDNO)
     return;
 
+  std::vector<PasswDbEntry*> selEntries;
+  selEntries.reserve(nNumValid);
   for (int nI = 0; nI < DbView->Items->Count; nI++) {
     if (DbView->Items->Item[nI]->Selected) {
       PasswDbEntry* pEntry = reinterpret_cast<PasswDbEntry*>
         (DbView->Items->Item[nI]->Data);
       if (pEntry != nullptr)
-        m_passwDb->DeleteDbEntry(*pEntry);
+        selEntries.push_back(pEntry);
     }
   }
 
+  m_passwDb->DeleteDbEntries(selEntries);
+
   ResetListView(RELOAD_TAGS);
   ResetNavControls();
   SetDbChanged();
@@ -2350,12 +2633,84 @@ void __fastcall TPasswMngForm::MainMenu_View_SortByClick(TObject *Sender)
   int nIdx = reinterpret_cast<TMenuItem*>(Sender)->Tag;
   if (nIdx != m_nSortByIdx) {
     m_nSortByIdx = nIdx;
-    DbView->SortType = (nIdx >= 0) ? TSortType::stData : TSortType::stNone;
-    DbView->AlphaSort();
+    SortListView();
     SetListViewSortFlag();
   }
 }
 //---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::BuildSortRanks(void)
+{
+  m_sortRanks.clear();
+
+  if (!IsDbOpen() || m_nSearchMode == SEARCH_MODE_FUZZY || m_nSortByIdx < 0 ||
+      (m_nSortByIdx != PasswDbEntry::PASSWORD &&
+       m_nSortByIdx >= PasswDbEntry::NUM_STRING_FIELDS))
+    return;
+
+  std::vector<const PasswDbEntry*> entries;
+  entries.reserve(DbView->Items->Count);
+  for (int i = 0; i < DbView->Items->Count; i++) {
+    auto pEntry = reinterpret_cast<const PasswDbEntry*>(
+      DbView->Items->Item[i]->Data);
+    if (pEntry != nullptr)
+      entries.push_back(pEntry);
+  }
+
+  if (entries.size() < 2)
+    return;
+
+  // passwords are decrypted once into a single secure buffer which is wiped
+  // when leaving this function; text fields are compared in place, using
+  // the same collation as DbViewCompare()
+  std::vector<const wchar_t*> keys;
+  keys.reserve(entries.size());
+  SecureWString sPasswords;
+  int (*pCompare)(const wchar_t*, const wchar_t*);
+
+  if (m_nSortByIdx == PasswDbEntry::PASSWORD) {
+    std::vector<word32> keyPos = m_passwDb->GetDbEntryPasswBatch(entries,
+      sPasswords);
+    for (word32 lPos : keyPos)
+      keys.push_back(sPasswords.c_str() + lPos);
+    pCompare = wcscmp;
+  }
+  else {
+    for (const auto pEntry : entries)
+      keys.push_back(pEntry->Strings[m_nSortByIdx].c_str());
+    pCompare = _wcsicmp;
+  }
+
+  std::vector<word32> order(entries.size());
+  for (word32 lI = 0; lI < order.size(); lI++)
+    order[lI] = lI;
+
+  std::sort(order.begin(), order.end(),
+    [&keys,pCompare](word32 lA, word32 lB)
+    {
+      return pCompare(keys[lA], keys[lB]) < 0;
+    });
+
+  // equal keys receive equal ranks, like equal strings compared before
+  m_sortRanks.assign(m_passwDb->Size, 0);
+  word32 lRank = 0;
+  for (word32 lI = 0; lI < order.size(); lI++) {
+    if (lI > 0 && pCompare(keys[order[lI-1]], keys[order[lI]]) != 0)
+      lRank++;
+    m_sortRanks[entries[order[lI]]->GetIndex()] = lRank;
+  }
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswMngForm::SortListView(void)
+{
+  BuildSortRanks();
+  try {
+    DbView->AlphaSort();
+  }
+  __finally {
+    m_sortRanks.clear();
+  }
+}
+//---------------------------------------------------------------------------
 void __fastcall TPasswMngForm::DbViewCompare(TObject *Sender,
   TListItem *Item1, TListItem *Item2, int Data, int &Compare)
 {
@@ -2368,6 +2723,11 @@ void __fastcall TPasswMngForm::DbViewCompare(TObject *Sender,
     Compare = -1;
   else if (m_nSearchMode == SEARCH_MODE_FUZZY)
     Compare = pEntry2->UserTag - pEntry1->UserTag;
+  else if (!m_sortRanks.empty()) {
+    int nRank1 = m_sortRanks[pEntry1->GetIndex()],
+        nRank2 = m_sortRanks[pEntry2->GetIndex()];
+    Compare = (nRank1 - nRank2) * m_nSortOrderFactor;
+  }
   else {
     switch (m_nSortByIdx) {
     case -1:
@@ -2400,8 +2760,8 @@ void __fastcall TPasswMngForm::DbViewCompare(TObject *Sender,
         m_nSortOrderFactor;
       break;
     case PasswDbEntry::PASSWHISTORY:
-      Compare = (pEntry1->GetPasswHistory().GetSize() -
-        pEntry2->GetPasswHistory().GetSize()) * m_nSortOrderFactor;
+      Compare = (pEntry1->GetPasswHistorySize() -
+        pEntry2->GetPasswHistorySize()) * m_nSortOrderFactor;
       break;
     default:
       if (m_nSortByIdx < PasswDbEntry::NUM_STRING_FIELDS)
@@ -2421,7 +2781,7 @@ void __fastcall TPasswMngForm::MainMenu_View_SortOrderClick(TObject *Sender)
   if (nFactor != m_nSortOrderFactor) {
     m_nSortOrderFactor = nFactor;
     if (m_nSortByIdx >= 0)
-      DbView->AlphaSort();
+      SortListView();
   }
 }
 //---------------------------------------------------------------------------
@@ -2526,7 +2886,7 @@ void __fastcall TPasswMngForm::SetDbChanged(bool blChanged, bool blEntryChanged)
       (g_config.Database.AutoSaveOption == asdEveryChange ||
       (g_config.Database.AutoSaveOption == asdEntryModification && blEntryChanged)))
   {
-    if (SaveDatabase(m_sDbFileName))
+    if (SaveDatabase(m_sDbFileName, true))
       blChanged = false;
   }
 
@@ -2535,7 +2895,8 @@ void __fastcall TPasswMngForm::SetDbChanged(bool blChanged, bool blEntryChanged)
     ChangeCaption();
   }
 
-  ToggleShutdownBlocker(blChanged ?
+  // keep blocking shutdown while saving in the background
+  ToggleShutdownBlocker(blChanged || m_saveTask ?
     TRL("Password database contains unsaved changes.") : WString());
 }
 //---------------------------------------------------------------------------
@@ -2734,6 +3095,7 @@ void __fastcall TPasswMngForm::MainMenu_File_DbSettingsClick(
   s.NumKdfRounds = m_passwDb->KdfIterations;
   s.Compressed = m_passwDb->Compressed;
   s.CompressionLevel = m_passwDb->CompressionLevel;
+  s.CompressionAlgo = m_passwDb->CompressionAlgo;
 
   PasswDbSettingsDlg->SetSettings(s, m_passwDb->HasRecoveryKey);
   if (PasswDbSettingsDlg->ShowModal() == mrOk &&
@@ -2744,7 +3106,8 @@ void __fastcall TPasswMngForm::MainMenu_File_DbSettingsClick(
       m_passwDb->CipherType != s.CipherType ||
       m_passwDb->KdfIterations != s.NumKdfRounds ||
       m_passwDb->Compressed != s.Compressed ||
-      m_passwDb->CompressionLevel != s.CompressionLevel))
+      m_passwDb->CompressionLevel != s.CompressionLevel ||
+      m_passwDb->CompressionAlgo != s.CompressionAlgo))
     SetDbChanged();
 }
 //---------------------------------------------------------------------------
@@ -2899,8 +3262,7 @@ void __fastcall TPasswMngForm::DbViewColumnClick(TObject *Sender,
   MainMenu_View_SortBy->Items[MainMenu_View_SortBy->Count - 2 +
     (m_nSortOrderFactor>0?0:1)]->Checked = true;
   SetListViewSortFlag();
-  DbView->SortType = TSortType::stData;
-  DbView->AlphaSort();
+  SortListView();
 }
 //---------------------------------------------------------------------------
 void __fastcall TPasswMngForm::SearchBoxSelect(TObject *Sender)
@@ -3402,6 +3764,7 @@ bool __fastcall TPasswMngForm::ApplyDbSettings(const PasswDbSettings& settings)
     m_passwDb->CipherType = settings.CipherType;
   m_passwDb->Compressed = settings.Compressed;
   m_passwDb->CompressionLevel = settings.CompressionLevel;
+  m_passwDb->CompressionAlgo = settings.CompressionAlgo;
   //m_passwDb->KdfIterations = settings.NumKdfRounds;
 
   return true;
@@ -41,6 +41,7 @@
 #include <Vcl.VirtualImageList.hpp>
 #include <map>
 #include <list>
+#include <System.Threading.hpp>
 //---------------------------------------------------------------------------
 #include <ComCtrls.hpp>
 #include <Buttons.hpp>
@@ -237,6 +238,8 @@ __published:	// IDE-managed Components
     TMenuItem *MainMenu_View_ResetListFont;
   TMenuItem *MainMenu_View_Filter;
   TMenuItem *MainMenu_View_Filter_WeakPassw;
+  TMenuItem *MainMenu_View_Filter_ReusedPassw;
+  TMenuItem *MainMenu_View_Filter_SimilarPassw;
   TPanel *FilterInfoPanel;
   TSpeedButton *ClearFilterBtn;
   void __fastcall MainMenu_File_NewClick(TObject *Sender);
@@ -344,6 +347,9 @@ private:	// User declarations
   std::shared_ptr<PasswDatabase> m_passwDb;
   std::unique_ptr<TSelectItemThread> m_dbViewSelItemThread;
   std::unique_ptr<TSelectItemThread> m_tagViewSelItemThread;
+  _di_ITask m_saveTask;
+  bool m_blSavePending;
+  _di_ITask m_strengthTask;
   WString m_sDbFileName;
   bool m_blDbReadOnly;
   TListItem* m_pSelectedItem;
@@ -375,6 +381,7 @@ private:	// User declarations
   std::set<SecureWString> m_tagFilter;
   std::unique_ptr<PasswDbEntry::KeyValueList> m_tempKeyVal;
   std::unique_ptr<PasswDbEntry::PasswHistory> m_tempPasswHistory;
+  std::vector<word32> m_sortRanks;
   IDropTarget* m_pPasswBoxDropTarget;
 
   void __fastcall LoadConfig(void);
@@ -384,7 +391,17 @@ private:	// User declarations
   void __fastcall LockOrUnlockDatabase(bool blAuto);
   void __fastcall ClearEditPanel(void);
   void __fastcall ClearListView(void);
-  bool __fastcall SaveDatabase(const WString& sFileName);
+  bool __fastcall SaveDatabase(const WString& sFileName,
+    bool blBackground = false);
+  void __fastcall WaitForBackgroundSave(void);
+  void __fastcall OnBackgroundSaveFinished(
+    std::shared_ptr<PasswDatabase> pDb,
+    std::shared_ptr<PasswDbSnapshot> pSnapshot, const WString& sTaskError);
+  void __fastcall StartPasswStrengthEstimation(void);
+  void __fastcall WaitForPasswStrengthEstimation(void);
+  void __fastcall OnPasswStrengthEstimated(
+    std::shared_ptr<PasswDatabase> pDb,
+    std::shared_ptr<PasswStrengthJob> pJob);
   void __fastcall ResetDbOpenControls(void);
   void __fastcall SetItemChanged(bool blChanged);
   void __fastcall ResetNavControls(void);
@@ -414,6 +431,8 @@ private:	// User declarations
   void __fastcall ApplyDbViewItemSelection(TListItem* pItem = nullptr);
   void __fastcall ApplyTagViewItemSelection(void);
   void __fastcall SetListViewSortFlag(void);
+  void __fastcall BuildSortRanks(void);
+  void __fastcall SortListView(void);
   void __fastcall OnQueryEndSession(TWMQueryEndSession& msg);
   void __fastcall ToggleShutdownBlocker(const WString& sMsg = WString());
 public:		// User declarations
@@ -19,6 +19,7 @@
 // 02111-1307, USA.
 //---------------------------------------------------------------------------
 #include <vcl.h>
+#include <IOUtils.hpp>
 #pragma hdrstop
 
 #include "PasswMngDbSettings.h"
@@ -48,6 +49,19 @@ const int CIPHER_KEY_SIZES[NUM_CIPHERS] =
   256, 256
 };
 
+const int NUM_COMPRESSION_ALGOS = 2;
+const wchar_t* COMPRESSION_ALGO_NAMES[NUM_COMPRESSION_ALGOS] =
+{
+  L"Deflate",
+  L"LZO1X (fastest, lower compression)"
+};
+
+const int COMPRESSION_ALGO_IDS[NUM_COMPRESSION_ALGOS] =
+{
+  PasswDatabase::COMPRESSION_DEFLATE,
+  PasswDatabase::COMPRESSION_LZO1X
+};
+
 const WString CONFIG_ID = "PasswMngDbSettings";
 
 //---------------------------------------------------------------------------
@@ -63,6 +77,9 @@ __fastcall TPasswDbSettingsDlg::TPasswDbSettingsDlg(TComponent* Owner)
     EncryptionAlgoList->Items->Add(sCipher);
   }
 
+  for (int i = 0; i < NUM_COMPRESSION_ALGOS; i++)
+    CompressionAlgoList->Items->Add(TRL(COMPRESSION_ALGO_NAMES[i]));
+
   PasswHistorySpinBtn->Max = PasswDatabase::MAX_PASSW_HISTORY_SIZE;
 
   if (g_pLangSupp) {
@@ -78,9 +95,12 @@ __fastcall TPasswDbSettingsDlg::TPasswDbSettingsDlg(TComponent* Owner)
     TRLCaption(PasswHistoryLbl);
     TRLCaption(EnableCompressionCheck);
     TRLCaption(CompressionLevelLbl);
+    TRLCaption(CompressionAlgoLbl);
+    TRLCaption(CompressionBenchmarkBtn);
 
     TRLHint(PasswGenTestBtn);
     TRLHint(CalcRoundsBtn);
+    TRLHint(CompressionBenchmarkBtn);
 
     TRLCaption(OKBtn);
     TRLCaption(CancelBtn);
@@ -112,6 +132,8 @@ PasswDbSettings __fastcall TPasswDbSettingsDlg::GetSettings(void)
   s.NumKdfRounds = StrToUInt(NumKdfRoundsBox->Text);
   s.Compressed = EnableCompressionCheck->Checked;
   s.CompressionLevel = s.Compressed ? CompressionLevelBar->Position : 0;
+  s.CompressionAlgo = COMPRESSION_ALGO_IDS[
+    std::max(0, CompressionAlgoList->ItemIndex)];
   return s;
 }
 //---------------------------------------------------------------------------
@@ -128,6 +150,8 @@ void __fastcall TPasswDbSettingsDlg::SetSettings(const PasswDbSettings& s,
   NumKdfRoundsBox->Enabled = !blHasRecoveryPassw;
   EnableCompressionCheck->Checked = s.Compressed;
   CompressionLevelBar->Position = s.Compressed ? s.CompressionLevel : 6;
+  CompressionAlgoList->ItemIndex =
+    (s.CompressionAlgo == PasswDatabase::COMPRESSION_LZO1X) ? 1 : 0;
   EnableCompressionCheckClick(this);
 }
 //---------------------------------------------------------------------------
@@ -224,8 +248,119 @@ void __fastcall TPasswDbSettingsDlg::EnableCompressionCheckClick(TObject *Sender
 
 {
   bool blChecked = EnableCompressionCheck->Checked;
-  CompressionLevelBar->Enabled = blChecked;
-  CompressionLevelLbl->Enabled = blChecked;
+  CompressionAlgoLbl->Enabled = blChecked;
+  CompressionAlgoList->Enabled = blChecked;
+  CompressionAlgoListChange(this);
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswDbSettingsDlg::CompressionAlgoListChange(TObject *Sender)
+{
+  // LZO1X has no compression levels
+  bool blLevels = EnableCompressionCheck->Checked &&
+    COMPRESSION_ALGO_IDS[std::max(0, CompressionAlgoList->ItemIndex)] ==
+    PasswDatabase::COMPRESSION_DEFLATE;
+  CompressionLevelBar->Enabled = blLevels;
+  CompressionLevelLbl->Enabled = blLevels;
+}
+//---------------------------------------------------------------------------
+void __fastcall TPasswDbSettingsDlg::CompressionBenchmarkBtnClick(
+  TObject *Sender)
+{
+  const int NUM_ENTRIES = 100000;
+
+  struct BenchmarkMode {
+    const wchar_t* Name;
+    int Algo; // 0 = uncompressed
+    int Level;
+  };
+
+  const BenchmarkMode MODES[] = {
+    { L"Uncompressed", 0, 0 },
+    { L"Deflate (level 1)", PasswDatabase::COMPRESSION_DEFLATE, 1 },
+    { L"Deflate (level 6)", PasswDatabase::COMPRESSION_DEFLATE, 6 },
+    { L"Deflate (level 9)", PasswDatabase::COMPRESSION_DEFLATE, 9 },
+    { L"LZO1X", PasswDatabase::COMPRESSION_LZO1X, 0 }
+  };
+
+  Screen->Cursor = crHourGlass;
+
+  WString sTempFileName = TPath::GetTempFileName();
+  WString sResult;
+
+  try {
+    SecureMem<word8> key(32);
+    g_fastRandGen.GetData(key, key.Size());
+
+    PasswDatabase db;
+    db.New(key);
+
+    // key derivation would dominate the loading time
+    db.KdfIterations = 1;
+
+    // synthetic entries: unique titles and user names, recurring URLs and
+    // partially repetitive notes, random passwords
+    const int PASSW_LEN = 16;
+    SecureWString sPassw(PASSW_LEN + 1), sField;
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+      PasswDbEntry* pEntry = db.NewDbEntry();
+      WString sNum = IntToStr(i);
+      pEntry->Strings[PasswDbEntry::TITLE].AssignStr(
+        WString("Account " + sNum).c_str());
+      sField.AssignStr(WString("user" + sNum + "@example.com").c_str());
+      db.SetDbEntryUserName(*pEntry, sField);
+      pEntry->Strings[PasswDbEntry::URL].AssignStr(
+        WString("https://www.example" + IntToStr(i % 1000) +
+        ".com/login").c_str());
+      if (i % 4 == 0)
+        pEntry->Strings[PasswDbEntry::NOTES].AssignStr(
+          WString("Security question: name of first pet\r\n"
+          "PIN: " + IntToStr(static_cast<int>(
+          g_fastRandGen.GetNumRange(10000)))).c_str());
+      for (int j = 0; j < PASSW_LEN; j++)
+        sPassw[j] = '!' + g_fastRandGen.GetNumRange(94);
+      sPassw[PASSW_LEN] = '\0';
+      db.SetDbEntryPassw(*pEntry, sPassw);
+    }
+
+    for (const auto& mode : MODES) {
+      db.Compressed = mode.Algo != 0;
+      db.CompressionAlgo = mode.Algo != 0 ? mode.Algo :
+        PasswDatabase::COMPRESSION_DEFLATE;
+      db.CompressionLevel = mode.Level;
+
+      Stopwatch clock;
+      db.SaveToFile(sTempFileName);
+      double dSaveTime = clock.ElapsedSeconds();
+
+      double dLoadTime;
+      __int64 nFileSize;
+      {
+        PasswDatabase checkDb;
+        clock.Reset();
+        checkDb.Open(key, sTempFileName);
+        dLoadTime = clock.ElapsedSeconds();
+        std::unique_ptr<TFileStream> pFile(new TFileStream(sTempFileName,
+          fmOpenRead | fmShareDenyNone));
+        nFileSize = pFile->Size;
+      }
+
+      sResult += "\n" + Format("%s: %d KB, save %.3f s, load %.3f s",
+        ARRAYOFCONST((mode.Name, static_cast<int>(nFileSize / 1024),
+        dSaveTime, dLoadTime)));
+    }
+  }
+  catch (Exception& e) {
+    sResult = "\n" + e.Message;
+  }
+  catch (std::exception& e) {
+    sResult = "\n" + CppStdExceptionToString(e);
+  }
+
+  DeleteFile(sTempFileName);
+  Screen->Cursor = crDefault;
+
+  MsgBox(TRLFormat("Compression benchmark (%1 entries):",
+    { IntToStr(NUM_ENTRIES) }) + sResult, MB_ICONINFORMATION);
 }
 //---------------------------------------------------------------------------
 
@@ -40,6 +40,7 @@ struct PasswDbSettings {
   word32 NumKdfRounds = 0;
   bool Compressed;
   int CompressionLevel;
+  int CompressionAlgo = 0;
 };
 
 class TPasswDbSettingsDlg : public TForm
@@ -72,6 +73,9 @@ __published:	// IDE-managed Components
     TLabel *PasswHistoryLbl;
     TEdit *PasswHistoryBox;
     TUpDown *PasswHistorySpinBtn;
+  TLabel *CompressionAlgoLbl;
+  TComboBox *CompressionAlgoList;
+  TButton *CompressionBenchmarkBtn;
   void __fastcall FormShow(TObject *Sender);
   void __fastcall OKBtnClick(TObject *Sender);
   void __fastcall CalcRoundsBtnClick(TObject *Sender);
@@ -79,6 +83,8 @@ __published:	// IDE-managed Components
   void __fastcall PasswGenTestBtnClick(TObject *Sender);
   void __fastcall FormClose(TObject *Sender, TCloseAction &Action);
     void __fastcall EnableCompressionCheckClick(TObject *Sender);
+  void __fastcall CompressionAlgoListChange(TObject *Sender);
+  void __fastcall CompressionBenchmarkBtnClick(TObject *Sender);
 private:	// User declarations
   void __fastcall LoadConfig(void);
 public:		// User declarations
@@ -0,0 +1,271 @@
+// SecureAlloc.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#include <windows.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#pragma hdrstop
+
+#include "SecureAlloc.h"
+#include "MemUtil.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+namespace {
+
+const size_t
+SLAB_SIZE        = 65536,
+MIN_BLOCK_SIZE   = 16,
+MAX_BLOCK_SIZE   = 2048,
+WORKING_SET_GROW = 16 << 20; // 16 MB
+
+const int
+NUM_SIZE_CLASSES = 8,  // 16, 32, ..., 2048 bytes
+CACHE_SIZE       = 32, // max. number of free blocks per size class in the
+                       // thread-local caches
+CACHE_BATCH      = CACHE_SIZE / 2;
+
+struct FreeBlock {
+  FreeBlock* Next;
+};
+
+class SlabPool {
+public:
+  SlabPool()
+    : m_blLockMem(true), m_blWorkingSetGrown(false)
+  {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    m_pageSize = si.dwPageSize;
+    for (auto& pList : m_freeLists)
+      pList = nullptr;
+  }
+
+  // moves up to nMax blocks of a size class from the global free list to
+  // the given array
+  int Pop(int nClass, FreeBlock** ppBlocks, int nMax)
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (m_freeLists[nClass] == nullptr)
+      AddSlab(nClass);
+
+    int nCount = 0;
+    while (nCount < nMax && m_freeLists[nClass] != nullptr) {
+      ppBlocks[nCount++] = m_freeLists[nClass];
+      m_freeLists[nClass] = m_freeLists[nClass]->Next;
+    }
+    return nCount;
+  }
+
+  // returns blocks to the global free list
+  void Push(int nClass, FreeBlock** ppBlocks, int nCount)
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (int i = 0; i < nCount; i++) {
+      ppBlocks[i]->Next = m_freeLists[nClass];
+      m_freeLists[nClass] = ppBlocks[i];
+    }
+  }
+
+private:
+  // allocates a new slab surrounded by guard pages and splits it into
+  // blocks of the given size class
+  void AddSlab(int nClass)
+  {
+    // reserve the guard pages, but commit only the slab itself, so that
+    // accessing the guard pages raises an access violation
+    word8* pRegion = reinterpret_cast<word8*>(VirtualAlloc(nullptr,
+      SLAB_SIZE + 2 * m_pageSize, MEM_RESERVE, PAGE_NOACCESS));
+    if (pRegion == nullptr)
+      throw std::bad_alloc();
+
+    word8* pSlab = reinterpret_cast<word8*>(VirtualAlloc(pRegion + m_pageSize,
+      SLAB_SIZE, MEM_COMMIT, PAGE_READWRITE));
+    if (pSlab == nullptr) {
+      VirtualFree(pRegion, 0, MEM_RELEASE);
+      throw std::bad_alloc();
+    }
+
+    if (m_blLockMem)
+      LockSlab(pSlab);
+
+    const size_t blockSize = MIN_BLOCK_SIZE << nClass;
+    for (size_t offset = SLAB_SIZE; offset >= blockSize; ) {
+      offset -= blockSize;
+      FreeBlock* pBlock = reinterpret_cast<FreeBlock*>(pSlab + offset);
+      pBlock->Next = m_freeLists[nClass];
+      m_freeLists[nClass] = pBlock;
+    }
+  }
+
+  // locks slab in physical memory; the minimum working set of a process is
+  // small by default, so it is increased once if locking fails
+  void LockSlab(void* pSlab)
+  {
+    if (VirtualLock(pSlab, SLAB_SIZE))
+      return;
+
+    if (!m_blWorkingSetGrown) {
+      m_blWorkingSetGrown = true;
+      SIZE_T minSize, maxSize;
+      HANDLE hProcess = GetCurrentProcess();
+      if (GetProcessWorkingSetSize(hProcess, &minSize, &maxSize) &&
+          SetProcessWorkingSetSize(hProcess, minSize + WORKING_SET_GROW,
+            maxSize + WORKING_SET_GROW) &&
+          VirtualLock(pSlab, SLAB_SIZE))
+        return;
+    }
+
+    // give up locking, but continue to provide memory
+    m_blLockMem = false;
+  }
+
+  std::mutex m_lock;
+  FreeBlock* m_freeLists[NUM_SIZE_CLASSES];
+  size_t m_pageSize;
+  bool m_blLockMem;
+  bool m_blWorkingSetGrown;
+};
+
+// the pool is never destroyed, since secure memory blocks may still be
+// freed by destructors of static objects during program termination
+SlabPool& getPool(void)
+{
+  static SlabPool* pPool = new SlabPool;
+  return *pPool;
+}
+
+// set when the thread-local cache has been destroyed; blocks allocated or
+// freed afterwards (e.g., by destructors of static objects) bypass the cache
+thread_local bool t_blCacheReleased = false;
+
+// number of blocks allocated by the thread (for benchmarking)
+thread_local word64 t_qAllocCount = 0;
+
+struct ThreadCache {
+  FreeBlock* Blocks[NUM_SIZE_CLASSES][CACHE_SIZE];
+  int Count[NUM_SIZE_CLASSES];
+
+  ThreadCache()
+  {
+    for (auto& nCount : Count)
+      nCount = 0;
+  }
+
+  // return cached blocks to the pool when the thread terminates
+  ~ThreadCache()
+  {
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+      if (Count[i] != 0)
+        getPool().Push(i, Blocks[i], Count[i]);
+    }
+    t_blCacheReleased = true;
+  }
+};
+
+thread_local ThreadCache t_cache;
+
+inline int getSizeClass(size_t size)
+{
+  int nClass = 0;
+  for (size_t blockSize = MIN_BLOCK_SIZE; blockSize < size; blockSize <<= 1)
+    nClass++;
+  return nClass;
+}
+
+}
+
+bool g_blSecureMemInline = true;
+
+//---------------------------------------------------------------------------
+void* secureAlloc(size_t size)
+{
+  t_qAllocCount++;
+
+  if (size > MAX_BLOCK_SIZE)
+    return ::operator new(size);
+
+  const int nClass = getSizeClass(size);
+
+  if (t_blCacheReleased) {
+    FreeBlock* pBlock = nullptr;
+    getPool().Pop(nClass, &pBlock, 1);
+    pBlock->Next = nullptr;
+    return pBlock;
+  }
+
+  ThreadCache& cache = t_cache;
+  int& nCount = cache.Count[nClass];
+
+  if (nCount == 0)
+    nCount = getPool().Pop(nClass, cache.Blocks[nClass], CACHE_BATCH);
+
+  FreeBlock* pBlock = cache.Blocks[nClass][--nCount];
+  pBlock->Next = nullptr;
+
+  return pBlock;
+}
+//---------------------------------------------------------------------------
+size_t secureAllocBlockSize(size_t size)
+{
+  return (size > MAX_BLOCK_SIZE) ? size : MIN_BLOCK_SIZE << getSizeClass(size);
+}
+//---------------------------------------------------------------------------
+word64 secureAllocCount(void)
+{
+  return t_qAllocCount;
+}
+//---------------------------------------------------------------------------
+void secureFree(void* p,
+  size_t size,
+  size_t wipeSize)
+{
+  if (p == nullptr)
+    return;
+
+  memzero(p, std::min(size, wipeSize));
+
+  if (size > MAX_BLOCK_SIZE) {
+    ::operator delete(p);
+    return;
+  }
+
+  const int nClass = getSizeClass(size);
+  FreeBlock* pBlock = reinterpret_cast<FreeBlock*>(p);
+
+  if (t_blCacheReleased) {
+    getPool().Push(nClass, &pBlock, 1);
+    return;
+  }
+
+  ThreadCache& cache = t_cache;
+  int& nCount = cache.Count[nClass];
+
+  if (nCount == CACHE_SIZE) {
+    getPool().Push(nClass, &cache.Blocks[nClass][CACHE_BATCH],
+      CACHE_SIZE - CACHE_BATCH);
+    nCount = CACHE_BATCH;
+  }
+
+  cache.Blocks[nClass][nCount++] = pBlock;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+// SecureAlloc.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef SecureAllocH
+#define SecureAllocH
+//---------------------------------------------------------------------------
+#include <cstddef>
+#include "types.h"
+
+// Allocator for secure memory blocks (used by SecureMem).
+// Small blocks are served from size classes (16 to 2048 bytes) carved out
+// of 64 KB slabs, which are locked in physical memory (VirtualLock) to
+// prevent them from being swapped to disk, and surrounded by inaccessible
+// guard pages. Each thread keeps a small cache of free blocks per size
+// class, so that most allocations neither lock a mutex nor call the heap.
+// Larger blocks are allocated on the heap.
+// Blocks are wiped when freed; slabs are never returned to the system.
+
+// allocates a memory block
+// -> size in bytes (> 0)
+// <- pointer to the block (aligned to at least 16 bytes for small blocks);
+//    throws std::bad_alloc if no memory is available
+void* secureAlloc(size_t size);
+
+// determines the usable size of a block allocated by secureAlloc()
+// -> requested size in bytes
+// <- actual block size in bytes
+size_t secureAllocBlockSize(size_t size);
+
+// returns the number of blocks allocated by the calling thread so far
+word64 secureAllocCount(void);
+
+// wipes and frees a memory block
+// -> pointer to the block (nullptr is ignored)
+// -> size in bytes passed to secureAlloc()
+// -> number of bytes to wipe from the beginning of the block
+void secureFree(void* p,
+  size_t size,
+  size_t wipeSize);
+
+// determines whether SecureMem objects store small arrays inside the object
+// instead of allocating a block (see SecureMem.h); may be disabled for
+// benchmarking, objects keep the memory they are currently using
+extern bool g_blSecureMemInline;
+
+#endif
@@ -24,8 +24,10 @@
 #include <algorithm>
 #include <cstring>
 #include <cwchar>
+#include <type_traits>
 #include "types.h"
 #include "MemUtil.h"
+#include "SecureAlloc.h"
 
 class SecureMemError : public std::runtime_error
 {
@@ -69,18 +71,120 @@ inline word32 roundUpNextPowerOf2(word32 v)
 }
 
 
+// number of elements stored inside SecureMem objects without allocating
+// memory; string types can hold typical user names, tags and passwords
+// (up to 23/31 characters plus terminating zero)
+template <class T>
+struct SecureMemInlineSize {
+  static constexpr word32 value = 0;
+};
+
+template <>
+struct SecureMemInlineSize<char> {
+  static constexpr word32 value = 32;
+};
+
+template <>
+struct SecureMemInlineSize<wchar_t> {
+  static constexpr word32 value = 24;
+};
+
+template <>
+struct SecureMemInlineSize<word32> {
+  static constexpr word32 value = 24;
+};
+
+template <class T, word32 N>
+class SecureMemInlineBuffer
+{
+protected:
+  T* InlineData(void)
+  {
+    return m_inlineData;
+  }
+  const T* InlineData(void) const
+  {
+    return m_inlineData;
+  }
+
+private:
+  T m_inlineData[N];
+};
+
+template <class T>
+class SecureMemInlineBuffer<T,0>
+{
+protected:
+  T* InlineData(void)
+  {
+    return nullptr;
+  }
+  const T* InlineData(void) const
+  {
+    return nullptr;
+  }
+};
+
+
 // class for secure memory operations, fast implementation
 // inspired by secblock.h in the Crypto++ package by Wei Dai
+// memory is provided by secureAlloc() (see SecureAlloc.h), therefore T must
+// be a POD type; arrays with up to INLINE_SIZE elements are stored in the
+// object itself (small-buffer optimization)
 
-template <class T>
-class SecureMem
+template <class T, word32 INLINE_SIZE = SecureMemInlineSize<T>::value>
+class SecureMem : private SecureMemInlineBuffer<T,INLINE_SIZE>
 {
 private:
+  static_assert(std::is_trivially_copyable<T>::value,
+    "SecureMem requires a trivially copyable type");
+
   // members
   T* m_pData;
   word32 m_lSize;
   word32 m_lClearMark;
 
+  T* Allocate(word32 lSize)
+  {
+    if (lSize <= INLINE_SIZE && g_blSecureMemInline)
+      return this->InlineData();
+    return static_cast<T*>(secureAlloc(lSize * sizeof(T)));
+  }
+
+  bool IsInline(void) const
+  {
+    return INLINE_SIZE != 0 && m_pData == this->InlineData();
+  }
+
+  // checks whether an array of the given size can be stored in the current
+  // memory block
+  bool FitsCurrentBlock(word32 lNewSize) const
+  {
+    if (IsInline())
+      return lNewSize <= INLINE_SIZE;
+    return !IsEmpty() && (lNewSize > INLINE_SIZE || !g_blSecureMemInline) &&
+      secureAllocBlockSize(lNewSize * sizeof(T)) ==
+      secureAllocBlockSize(SizeBytes());
+  }
+
+  // takes over the content of src (this object must be empty);
+  // inline data is copied and wiped in src
+  void MoveFrom(SecureMem& src)
+  {
+    if (src.IsInline()) {
+      m_pData = this->InlineData();
+      memcpy(m_pData, src.m_pData, src.SizeBytes());
+      memzero(src.m_pData, src.SizeBytes());
+    }
+    else
+      m_pData = src.m_pData;
+    m_lSize = src.m_lSize;
+    m_lClearMark = src.m_lClearMark;
+    src.m_pData = nullptr;
+    src.m_lSize = 0;
+    src.m_lClearMark = npos;
+  }
+
   void CheckBounds(word32 lIndex)
   {
     if (lIndex >= m_lSize)
@@ -106,7 +210,7 @@ public:
     if (m_lSize != 0) {
       if (m_lSize > MAX_SIZE)
         throw SecureMemSizeError();
-      m_pData = new T[m_lSize];
+      m_pData = Allocate(m_lSize);
     }
   }
 
@@ -120,7 +224,7 @@ public:
     if (m_lSize != 0) {
       if (m_lSize > MAX_SIZE)
         throw SecureMemSizeError();
-      m_pData = new T[m_lSize];
+      m_pData = Allocate(m_lSize);
       memcpy(m_pData, pData, SizeBytes());
     }
   }
@@ -131,18 +235,16 @@ public:
     : m_pData(nullptr), m_lSize(src.m_lSize), m_lClearMark(src.m_lClearMark)
   {
     if (m_lSize != 0) {
-      m_pData = new T[m_lSize];
+      m_pData = Allocate(m_lSize);
       memcpy(m_pData, src.m_pData, SizeBytes());
     }
   }
 
   // move constructor
   SecureMem(SecureMem&& src)
-    : m_pData(src.m_pData), m_lSize(src.m_lSize), m_lClearMark(src.m_lClearMark)
+    : m_pData(nullptr), m_lSize(0), m_lClearMark(npos)
   {
-    src.m_pData = nullptr;
-    src.m_lSize = 0;
-    src.m_lClearMark = npos;
+    MoveFrom(src);
   }
 
   // destructor
@@ -156,8 +258,11 @@ public:
   {
     if (!IsEmpty())
     {
-      memzero(m_pData, std::min(m_lClearMark, m_lSize) * sizeof(T));
-      delete [] m_pData;
+      word32 lWipeSize = std::min(m_lClearMark, m_lSize) * sizeof(T);
+      if (IsInline())
+        memzero(m_pData, lWipeSize);
+      else
+        secureFree(m_pData, SizeBytes(), lWipeSize);
       m_pData = nullptr;
       m_lSize = 0;
       m_lClearMark = npos;
@@ -203,9 +308,16 @@ public:
   // swap content with that of another instance
   void Swap(SecureMem& other)
   {
-    std::swap(m_pData, other.m_pData);
-    std::swap(m_lSize, other.m_lSize);
-    std::swap(m_lClearMark, other.m_lClearMark);
+    if (IsInline() || other.IsInline()) {
+      SecureMem temp(std::move(other));
+      other.MoveFrom(*this);
+      MoveFrom(temp);
+    }
+    else {
+      std::swap(m_pData, other.m_pData);
+      std::swap(m_lSize, other.m_lSize);
+      std::swap(m_lClearMark, other.m_lClearMark);
+    }
   }
 
   // copy elements to data array at specified position
@@ -441,7 +553,7 @@ public:
     word32 lLen,
     word32& lPos);
 
-  void StrCat(const SecureMem<T>& src,
+  void StrCat(const SecureMem& src,
     word32& lPos)
   {
     return StrCat(src.m_pData, src.StrLen(), lPos);
@@ -630,8 +742,8 @@ public:
   }
 };
 
-template <class T>
-void SecureMem<T>::Resize(word32 lNewSize,
+template <class T, word32 INLINE_SIZE>
+void SecureMem<T,INLINE_SIZE>::Resize(word32 lNewSize,
   bool blPreserve)
 {
   if (lNewSize == 0)
@@ -640,7 +752,16 @@ void SecureMem<T>::Resize(word32 lNewSize,
     if (lNewSize > MAX_SIZE)
       throw SecureMemSizeError();
 
-    T* pNewData = new T[lNewSize];
+    // reuse the block if the new size fits in the same block
+    if (FitsCurrentBlock(lNewSize)) {
+      if (lNewSize < m_lSize)
+        memzero(m_pData + lNewSize, (m_lSize - lNewSize) * sizeof(T));
+      m_lSize = lNewSize;
+      m_lClearMark = npos;
+      return;
+    }
+
+    T* pNewData = Allocate(lNewSize);
 
     if (blPreserve && !IsEmpty())
       memcpy(pNewData, m_pData, std::min(m_lSize, lNewSize) * sizeof(T));
@@ -653,8 +774,8 @@ void SecureMem<T>::Resize(word32 lNewSize,
   m_lClearMark = npos;
 }
 
-template<class T>
-word32 SecureMem<T>::Find(const T& element,
+template<class T, word32 INLINE_SIZE>
+word32 SecureMem<T,INLINE_SIZE>::Find(const T& element,
   word32 lStart,
   word32 lLen) const
 {
@@ -671,8 +792,8 @@ word32 SecureMem<T>::Find(const T& element,
   return npos;
 }
 
-template<class T>
-word32 SecureMem<T>::StrLen(void) const
+template<class T, word32 INLINE_SIZE>
+word32 SecureMem<T,INLINE_SIZE>::StrLen(void) const
 {
   if (m_lSize < 2)
     return 0;
@@ -692,8 +813,8 @@ word32 SecureMem<T>::StrLen(void) const
   return lStrLen;
 }
 
-template<class T>
-void SecureMem<T>::StrCat(const T* pStr, word32 lLen, word32& lPos)
+template<class T, word32 INLINE_SIZE>
+void SecureMem<T,INLINE_SIZE>::StrCat(const T* pStr, word32 lLen, word32& lPos)
 {
   if (lLen == npos)
     lLen = _tcslen(pStr);
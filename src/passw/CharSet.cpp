@@ -0,0 +1,187 @@
+// CharSet.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#include <vcl.h>
+#include <algorithm>
+#include <iterator>
+#pragma hdrstop
+
+#include "CharSet.h"
+#include "MemUtil.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+//---------------------------------------------------------------------------
+bool CharSet::ContainsAstral(word32 lChar) const
+{
+  return std::binary_search(m_astral.begin(), m_astral.end(), lChar);
+}
+//---------------------------------------------------------------------------
+bool CharSet::Insert(word32 lChar)
+{
+  if (lChar < BMP_SIZE) {
+    const word32 lWord = lChar >> 6;
+    if (lWord >= m_bmp.size())
+      m_bmp.resize(lWord + 1, 0);
+    const word64 qBit = 1ull << (lChar & 63);
+    if (m_bmp[lWord] & qBit)
+      return false;
+    m_bmp[lWord] |= qBit;
+  }
+  else {
+    auto it = std::lower_bound(m_astral.begin(), m_astral.end(), lChar);
+    if (it != m_astral.end() && *it == lChar)
+      return false;
+    m_astral.insert(it, lChar);
+  }
+
+  m_lSize++;
+  m_blCharsValid = false;
+  return true;
+}
+//---------------------------------------------------------------------------
+void CharSet::Insert(const w32string& sChars)
+{
+  for (word32 lChar : sChars)
+    Insert(lChar);
+}
+//---------------------------------------------------------------------------
+bool CharSet::Erase(word32 lChar)
+{
+  if (lChar < BMP_SIZE) {
+    const word32 lWord = lChar >> 6;
+    const word64 qBit = 1ull << (lChar & 63);
+    if (lWord >= m_bmp.size() || !(m_bmp[lWord] & qBit))
+      return false;
+    m_bmp[lWord] &= ~qBit;
+  }
+  else {
+    auto it = std::lower_bound(m_astral.begin(), m_astral.end(), lChar);
+    if (it == m_astral.end() || *it != lChar)
+      return false;
+    m_astral.erase(it);
+  }
+
+  m_lSize--;
+  m_blCharsValid = false;
+  return true;
+}
+//---------------------------------------------------------------------------
+bool CharSet::ContainsAll(const word32* pChars,
+  word32 lLen) const
+{
+  for (word32 lI = 0; lI < lLen; lI++) {
+    if (!Contains(pChars[lI]))
+      return false;
+  }
+  return true;
+}
+//---------------------------------------------------------------------------
+void CharSet::Shrink(void)
+{
+  word32 lSize = 0;
+  for (word64 qWord : m_bmp)
+    lSize += __builtin_popcountll(qWord);
+
+  while (!m_bmp.empty() && m_bmp.back() == 0)
+    m_bmp.pop_back();
+
+  m_lSize = lSize + m_astral.size();
+  m_blCharsValid = false;
+}
+//---------------------------------------------------------------------------
+CharSet& CharSet::operator|= (const CharSet& other)
+{
+  if (other.m_bmp.size() > m_bmp.size())
+    m_bmp.resize(other.m_bmp.size(), 0);
+  for (word32 lI = 0; lI < other.m_bmp.size(); lI++)
+    m_bmp[lI] |= other.m_bmp[lI];
+
+  if (!other.m_astral.empty()) {
+    std::vector<word32> astral;
+    std::set_union(m_astral.begin(), m_astral.end(), other.m_astral.begin(),
+      other.m_astral.end(), std::back_inserter(astral));
+    m_astral = std::move(astral);
+  }
+
+  Shrink();
+  return *this;
+}
+//---------------------------------------------------------------------------
+CharSet& CharSet::operator&= (const CharSet& other)
+{
+  if (m_bmp.size() > other.m_bmp.size())
+    m_bmp.resize(other.m_bmp.size());
+  for (word32 lI = 0; lI < m_bmp.size(); lI++)
+    m_bmp[lI] &= other.m_bmp[lI];
+
+  if (!m_astral.empty()) {
+    std::vector<word32> astral;
+    std::set_intersection(m_astral.begin(), m_astral.end(),
+      other.m_astral.begin(), other.m_astral.end(), std::back_inserter(astral));
+    m_astral = std::move(astral);
+  }
+
+  Shrink();
+  return *this;
+}
+//---------------------------------------------------------------------------
+CharSet& CharSet::operator-= (const CharSet& other)
+{
+  const word32 lNum = std::min(m_bmp.size(), other.m_bmp.size());
+  for (word32 lI = 0; lI < lNum; lI++)
+    m_bmp[lI] &= ~other.m_bmp[lI];
+
+  if (!m_astral.empty() && !other.m_astral.empty()) {
+    std::vector<word32> astral;
+    std::set_difference(m_astral.begin(), m_astral.end(),
+      other.m_astral.begin(), other.m_astral.end(), std::back_inserter(astral));
+    m_astral = std::move(astral);
+  }
+
+  Shrink();
+  return *this;
+}
+//---------------------------------------------------------------------------
+void CharSet::Clear(void)
+{
+  eraseVector(m_bmp);
+  eraseVector(m_astral);
+  eraseStlString(m_chars);
+  m_lSize = 0;
+  m_blCharsValid = true;
+}
+//---------------------------------------------------------------------------
+const w32string& CharSet::Chars(void) const
+{
+  if (!m_blCharsValid) {
+    m_chars.clear();
+    m_chars.reserve(m_lSize);
+    for (word32 lI = 0; lI < m_bmp.size(); lI++) {
+      for (word64 qBits = m_bmp[lI]; qBits != 0; qBits &= qBits - 1)
+        m_chars.push_back((lI << 6) | __builtin_ctzll(qBits));
+    }
+    m_chars.append(m_astral.begin(), m_astral.end());
+    m_blCharsValid = true;
+  }
+
+  return m_chars;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,123 @@
+// CharSet.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef CharSetH
+#define CharSetH
+//---------------------------------------------------------------------------
+#include <vector>
+#include "types.h"
+#include "UnicodeUtil.h"
+
+// class CharSet: set of Unicode characters (code points)
+// - characters of the Basic Multilingual Plane (BMP) are stored in a bitset,
+//   which grows up to the highest character in the set (e.g., 16 bytes for
+//   ASCII characters); insertion, removal and membership tests are O(1)
+// - characters beyond the BMP are rare and stored in a sorted array
+// - the characters can be retrieved as a string sorted in ascending order
+//   (i.e., in the same order as from std::set<word32>), which serves as
+//   dense index for picking random characters
+
+class CharSet
+{
+public:
+
+  // constructors
+  CharSet()
+    : m_lSize(0), m_blCharsValid(true)
+  {
+  }
+
+  // -> characters to be inserted (may contain duplicates)
+  explicit CharSet(const w32string& sChars)
+    : m_lSize(0), m_blCharsValid(true)
+  {
+    Insert(sChars);
+  }
+
+  // inserts a character
+  // <- 'true' if the character has been inserted, 'false' if it is already
+  //    contained in the set
+  bool Insert(word32 lChar);
+
+  // inserts all characters of a string
+  void Insert(const w32string& sChars);
+
+  // removes a character
+  // <- 'true' if the character has been removed, 'false' if it is not
+  //    contained in the set
+  bool Erase(word32 lChar);
+
+  // checks whether a character is contained in the set
+  bool Contains(word32 lChar) const
+  {
+    if (lChar < BMP_SIZE) {
+      const word32 lWord = lChar >> 6;
+      return lWord < m_bmp.size() && (m_bmp[lWord] >> (lChar & 63)) & 1;
+    }
+    return !m_astral.empty() && ContainsAstral(lChar);
+  }
+
+  // checks whether the set contains all characters of a string
+  bool ContainsAll(const word32* pChars,
+    word32 lLen) const;
+
+  // set algebra: union, intersection and difference
+  CharSet& operator|= (const CharSet& other);
+  CharSet& operator&= (const CharSet& other);
+  CharSet& operator-= (const CharSet& other);
+
+  // removes all characters and overwrites the memory used
+  void Clear(void);
+
+  // returns the number of characters in the set
+  word32 Size(void) const
+  {
+    return m_lSize;
+  }
+
+  bool Empty(void) const
+  {
+    return m_lSize == 0;
+  }
+
+  // returns the characters sorted in ascending order; the string is cached
+  // until the set is modified
+  const w32string& Chars(void) const;
+
+  // returns the character with the given index in the sorted string
+  word32 operator[] (word32 lIndex) const
+  {
+    return Chars()[lIndex];
+  }
+
+private:
+  static const word32 BMP_SIZE = 0x10000;
+
+  std::vector<word64> m_bmp;
+  std::vector<word32> m_astral;
+  word32 m_lSize;
+  mutable w32string m_chars;
+  mutable bool m_blCharsValid;
+
+  bool ContainsAstral(word32 lChar) const;
+  void Shrink(void);
+};
+
+#endif
@@ -21,27 +21,40 @@
 #include <vcl.h>
 #include <vector>
 #include <array>
+#include <map>
+#include <algorithm>
+#include <atomic>
 #include <StrUtils.hpp>
+#include <System.Threading.hpp>
 #pragma hdrstop
 
 #include "PasswDatabase.h"
 #include "FastPRNG.h"
 #include "RandomPool.h"
-#include "sha1.h"
 #include "CryptUtil.h"
 #include "Main.h"
 #include "StringFileStreamW.h"
+#include "MappedFile.h"
 #include "Language.h"
 #include "sha256.h"
 #include "sha512.h"
 #include "Util.h"
+#include "PasswSimilarity.h"
+#include "minilzo.h"
+#ifdef _WIN64
+#include "../crypto/blake2/blake2.h"
+#else
+#include "../crypto/blake2/ref/blake2.h"
+#endif
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
 
 #define TEST_DECRYPTION
 
 static const word8
-  PASSW_DB_MAGIC[4] = { 'P', 'W', 'd', 'b' };
+  PASSW_DB_MAGIC[4] = { 'P', 'W', 'd', 'b' },
+  JOURNAL_MAGIC[4] = { 'P', 'W', 'j', 'n' },
+  JOURNAL_RECORD_MAGIC[4] = { 'P', 'W', 'j', 'r' };
 
 static const word32
   FH_FLAG_RECOVERY_KEY            = 1, // file header flags
@@ -51,8 +64,21 @@ static const word32
   FLAG_PASSW_EXPIRY_DAYS          = 4,
   FLAG_DEFAULT_PASSW_HISTORY_SIZE = 8,
 
+  JR_FLAG_ORDER                   = 1, // journal record flags
+
   MAX_FILE_SIZE = 104857600,
-  DEFAULT_BUF_SIZE = 65536;
+  DEFAULT_BUF_SIZE = 65536,
+
+  JOURNAL_VERSION = 1,
+  JOURNAL_MIN_COMPACTION_SIZE = 262144, // journal may always grow to 256 KB,
+  JOURNAL_COMPACTION_RATIO = 2,         // ... or to half the database size
+
+  PARALLEL_DECRYPT_MIN_SIZE = 16384, // total characters of a batch
+
+  COMPRESSION_CHUNK_SIZE = 1048576;
+
+static const word64
+  JOURNAL_MAX_AGE = 7ull * 24 * 3600 * 10000000; // 7 days in FILETIME units
 
 static const char
   PARAMSTR_DEFAULT_USER_NAME[] = "DefUserName",
@@ -89,6 +115,33 @@ struct PasswHistoryHeader {
   word8 HistorySize;
   word8 MaxHistorySize;
 };
+
+// journal file: header followed by records, each record consisting of
+// - size of encrypted data (word32)
+// - initialization vector
+// - encrypted data (JournalRecordHeader + parameters + entries + IDs)
+// - HMAC of the database file HMAC and the plaintext data
+struct JournalHeader {
+  word8 Magic[4];
+  word8 HeaderSize;
+  word16 Version;
+  FILETIME CreationTime;
+  word8 BaseHmac[64]; // HMAC of the database file the journal belongs to
+};
+
+struct JournalRecordHeader {
+  word8 Magic[4];
+  word16 HeaderSize;
+  word32 Sequence;
+  word32 Flags;
+  word32 ParamFlags;
+  word8 NumOfVariableParam;
+  word8 CompressionAlgo;
+  word8 CompressionLevel;
+  word32 NumOfEntries;
+  word32 NumOfDeleted;
+  word32 NumOfOrderIds;
+};
 #pragma pack()
 
 using namespace EncryptionAlgorithm;
@@ -99,6 +152,467 @@ inline void CheckKeyEmpty(const SecureMem<word8>& key)
     throw EPasswDbError("Specified \"key\" parameter is empty");
 }
 
+// process items in chunks by tasks of the system thread pool
+// -> number of items
+// -> function processing items from start (inclusive) to end (exclusive);
+//    must not throw exceptions
+static void RunInParallel(word32 lNumItems,
+  const std::function<void(word32,word32)>& processRange)
+{
+  const word32 lNumTasks = std::min<word32>(lNumItems,
+    std::max(1, TThread::ProcessorCount));
+  if (lNumTasks <= 1) {
+    processRange(0, lNumItems);
+    return;
+  }
+
+  const word32 lChunkSize = (lNumItems + lNumTasks - 1) / lNumTasks;
+  std::vector<_di_ITask> tasks;
+  for (word32 lStart = 0; lStart < lNumItems; lStart += lChunkSize) {
+    word32 lEnd = std::min(lStart + lChunkSize, lNumItems);
+    tasks.push_back(TTask::Create([&processRange,lStart,lEnd]() {
+      processRange(lStart, lEnd);
+    }));
+    tasks.back()->Start();
+  }
+  for (auto& pTask : tasks)
+    pTask->Wait();
+}
+
+// compresses data in independent chunks of COMPRESSION_CHUNK_SIZE bytes on
+// multiple threads; output format:
+// - number of chunks (word32)
+// - uncompressed size of each chunk except the last one (word32)
+// - compressed size of each chunk (word32 each)
+// - compressed chunks (zlib streams or LZO1X-1 blocks)
+// -> compression algorithm (COMPRESSION_DEFLATE_CHUNKED or COMPRESSION_LZO1X)
+// -> source data
+// -> size of source data
+// -> compression level (Deflate only)
+// -> buffer receiving the compressed data (reallocated)
+// -> position in buffer at which the compressed data starts
+// <- size of compressed data
+static word32 CompressChunked(int nAlgo, const word8* pSrc, word32 lSrcSize,
+  int nLevel, SecureMem<word8>& dest, word32 lDestPos)
+{
+  const bool blLzo = nAlgo == PasswDatabase::COMPRESSION_LZO1X;
+  const word32 lNumChunks = std::max<word32>(1, (lSrcSize +
+    COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE);
+  const word32 lTableSize = (2 + lNumChunks) * sizeof(word32);
+  const word32 lMaxComprSize = blLzo ?
+    COMPRESSION_CHUNK_SIZE + COMPRESSION_CHUNK_SIZE / 16 + 64 + 3 :
+    compressBound(COMPRESSION_CHUNK_SIZE);
+
+  // each chunk is compressed into a slot of maximum size first; the slots
+  // are compacted afterwards
+  dest.New(lDestPos + lTableSize + lNumChunks * lMaxComprSize);
+  word8* pData = dest + lDestPos;
+  std::vector<word32> comprSizes(lNumChunks);
+  std::atomic<bool> blFailed(false);
+
+  RunInParallel(lNumChunks, [&](word32 lStart, word32 lEnd)
+    {
+      SecureMem<word8> workMem(blLzo ? LZO1X_1_MEM_COMPRESS : 0);
+      for (word32 lI = lStart; lI < lEnd; lI++) {
+        word32 lOffset = lI * COMPRESSION_CHUNK_SIZE;
+        word32 lSize = std::min<word32>(COMPRESSION_CHUNK_SIZE,
+          lSrcSize - lOffset);
+        word8* pDest = pData + lTableSize + lI * lMaxComprSize;
+        if (blLzo) {
+          lzo_uint lComprSize;
+          if (lzo1x_1_compress(pSrc + lOffset, lSize, pDest, &lComprSize,
+              workMem) != LZO_E_OK)
+            blFailed = true;
+          else
+            comprSizes[lI] = lComprSize;
+        }
+        else {
+          mz_ulong lComprSize = lMaxComprSize;
+          if (compress2(pDest, &lComprSize, pSrc + lOffset, lSize,
+              nLevel) != Z_OK)
+            blFailed = true;
+          else
+            comprSizes[lI] = lComprSize;
+        }
+      }
+    });
+
+  if (blFailed)
+    throw CompressorError("Chunk compression failed");
+
+  word32* pTable = reinterpret_cast<word32*>(pData);
+  pTable[0] = lNumChunks;
+  pTable[1] = COMPRESSION_CHUNK_SIZE;
+
+  word32 lPos = lTableSize;
+  for (word32 lI = 0; lI < lNumChunks; lI++) {
+    pTable[2 + lI] = comprSizes[lI];
+    memmove(pData + lPos, pData + lTableSize + lI * lMaxComprSize,
+      comprSizes[lI]);
+    lPos += comprSizes[lI];
+  }
+
+  // the buffer is encrypted only up to the end of the compressed data
+  memzero(pData + lPos, dest.Size() - lDestPos - lPos);
+
+  return lPos;
+}
+
+// decompresses data compressed by CompressChunked() on multiple threads
+// -> compression algorithm
+// -> compressed data
+// -> size of compressed data
+// -> destination buffer
+// -> size of destination buffer (= uncompressed size)
+// <- 'true' if successful
+static bool DecompressChunked(int nAlgo, const word8* pSrc, word32 lSrcSize,
+  word8* pDest, word32 lDestSize)
+{
+  if (lSrcSize < 2 * sizeof(word32))
+    return false;
+
+  const word32* pTable = reinterpret_cast<const word32*>(pSrc);
+  const word32 lNumChunks = pTable[0], lChunkSize = pTable[1];
+  if (lNumChunks == 0 || lChunkSize == 0 ||
+      lNumChunks > (lSrcSize / sizeof(word32)) - 2 ||
+      lNumChunks != std::max<word32>(1, (lDestSize + lChunkSize - 1) /
+      lChunkSize))
+    return false;
+
+  std::vector<word32> srcPos(lNumChunks);
+  word32 lPos = (2 + lNumChunks) * sizeof(word32);
+  for (word32 lI = 0; lI < lNumChunks; lI++) {
+    srcPos[lI] = lPos;
+    if (pTable[2 + lI] > lSrcSize - lPos)
+      return false;
+    lPos += pTable[2 + lI];
+  }
+
+  std::atomic<bool> blFailed(false);
+
+  RunInParallel(lNumChunks, [&](word32 lStart, word32 lEnd)
+    {
+      for (word32 lI = lStart; lI < lEnd && !blFailed; lI++) {
+        word32 lOffset = lI * lChunkSize;
+        word32 lSize = std::min(lChunkSize, lDestSize - lOffset);
+        if (nAlgo == PasswDatabase::COMPRESSION_LZO1X) {
+          lzo_uint lDataSize = lSize;
+          if (lzo1x_decompress_safe(pSrc + srcPos[lI], pTable[2 + lI],
+              pDest + lOffset, &lDataSize, nullptr) != LZO_E_OK ||
+              lDataSize != lSize)
+            blFailed = true;
+        }
+        else {
+          mz_ulong lDataSize = lSize;
+          if (uncompress(pDest + lOffset, &lDataSize, pSrc + srcPos[lI],
+              pTable[2 + lI]) != Z_OK || lDataSize != lSize)
+            blFailed = true;
+        }
+      }
+    });
+
+  return !blFailed;
+}
+
+//---------------------------------------------------------------------------
+word32 PasswDbStringTable::AddRef(const SecureWString& sStr)
+{
+  auto it = m_index.find(sStr);
+  if (it != m_index.end()) {
+    m_items[it->second].RefCount++;
+    return it->second;
+  }
+
+  word32 lId;
+  if (!m_freeIds.empty()) {
+    lId = m_freeIds.back();
+    m_freeIds.pop_back();
+  }
+  else {
+    lId = m_items.size();
+    m_items.emplace_back();
+  }
+
+  m_items[lId].It = m_index.emplace(sStr, lId).first;
+  m_items[lId].RefCount = 1;
+
+  return lId;
+}
+//---------------------------------------------------------------------------
+void PasswDbStringTable::Release(word32 lId)
+{
+  auto& item = m_items[lId];
+  if (item.RefCount == 0 || --item.RefCount != 0)
+    return;
+
+  m_index.erase(item.It);
+  item.It = m_index.end();
+  m_freeIds.push_back(lId);
+}
+//---------------------------------------------------------------------------
+word32 PasswDbStringTable::Find(const SecureWString& sStr) const
+{
+  auto it = m_index.find(sStr);
+  return (it != m_index.end()) ? it->second : npos;
+}
+//---------------------------------------------------------------------------
+void PasswDbStringTable::Clear(void)
+{
+  m_index.clear();
+  m_items.clear();
+  m_freeIds.clear();
+}
+//---------------------------------------------------------------------------
+void PasswDbIndexSet::Add(word32 lIndex)
+{
+  const word16 wKey = lIndex >> BLOCK_BITS;
+  const word16 wLow = lIndex & 0xffff;
+
+  auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), wKey,
+    [](const Block& block, word16 wValue)
+    {
+      return block.Key < wValue;
+    });
+  if (it == m_blocks.end() || it->Key != wKey) {
+    it = m_blocks.emplace(it);
+    it->Key = wKey;
+    it->Count = 0;
+  }
+
+  if (it->Bitmap.empty()) {
+    auto pos = std::lower_bound(it->Array.begin(), it->Array.end(), wLow);
+    if (pos != it->Array.end() && *pos == wLow)
+      return;
+    it->Array.insert(pos, wLow);
+
+    // convert to bitmap
+    if (it->Array.size() > MAX_ARRAY_SIZE) {
+      it->Bitmap.assign(BITMAP_WORDS, 0);
+      for (word16 w : it->Array)
+        it->Bitmap[w >> 6] |= 1ull << (w & 63);
+      std::vector<word16>().swap(it->Array);
+    }
+  }
+  else {
+    word64& qWord = it->Bitmap[wLow >> 6];
+    const word64 qBit = 1ull << (wLow & 63);
+    if (qWord & qBit)
+      return;
+    qWord |= qBit;
+  }
+
+  it->Count++;
+  m_lCount++;
+}
+//---------------------------------------------------------------------------
+void PasswDbIndexSet::Remove(word32 lIndex)
+{
+  const word16 wKey = lIndex >> BLOCK_BITS;
+  const word16 wLow = lIndex & 0xffff;
+
+  auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), wKey,
+    [](const Block& block, word16 wValue)
+    {
+      return block.Key < wValue;
+    });
+  if (it == m_blocks.end() || it->Key != wKey)
+    return;
+
+  if (it->Bitmap.empty()) {
+    auto pos = std::lower_bound(it->Array.begin(), it->Array.end(), wLow);
+    if (pos == it->Array.end() || *pos != wLow)
+      return;
+    it->Array.erase(pos);
+  }
+  else {
+    word64& qWord = it->Bitmap[wLow >> 6];
+    const word64 qBit = 1ull << (wLow & 63);
+    if (!(qWord & qBit))
+      return;
+    qWord &= ~qBit;
+
+    // convert back to array
+    if (it->Count - 1 <= MAX_ARRAY_SIZE) {
+      it->Array.reserve(it->Count - 1);
+      for (word32 lI = 0; lI < BITMAP_WORDS; lI++) {
+        for (word64 qBits = it->Bitmap[lI]; qBits != 0; qBits &= qBits - 1)
+          it->Array.push_back((lI << 6) | __builtin_ctzll(qBits));
+      }
+      std::vector<word64>().swap(it->Bitmap);
+    }
+  }
+
+  m_lCount--;
+  if (--it->Count == 0)
+    m_blocks.erase(it);
+}
+//---------------------------------------------------------------------------
+bool PasswDbIndexSet::Contains(word32 lIndex) const
+{
+  const word16 wKey = lIndex >> BLOCK_BITS;
+  const word16 wLow = lIndex & 0xffff;
+
+  auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), wKey,
+    [](const Block& block, word16 wValue)
+    {
+      return block.Key < wValue;
+    });
+  if (it == m_blocks.end() || it->Key != wKey)
+    return false;
+
+  if (it->Bitmap.empty())
+    return std::binary_search(it->Array.begin(), it->Array.end(), wLow);
+
+  return it->Bitmap[wLow >> 6] & (1ull << (wLow & 63));
+}
+//---------------------------------------------------------------------------
+void PasswDbIndexSet::AddToBitmap(std::vector<word64>& bitmap) const
+{
+  const word32 lMaxIndex = bitmap.size() * 64;
+  for (const auto& block : m_blocks) {
+    const word32 lBase = static_cast<word32>(block.Key) << BLOCK_BITS;
+    if (lBase >= lMaxIndex)
+      break;
+    if (block.Bitmap.empty()) {
+      for (word16 w : block.Array) {
+        word32 lIndex = lBase | w;
+        if (lIndex >= lMaxIndex)
+          break;
+        bitmap[lIndex >> 6] |= 1ull << (lIndex & 63);
+      }
+    }
+    else {
+      const word32 lWords = std::min<word32>(BITMAP_WORDS,
+        (lMaxIndex - lBase) / 64);
+      word64* pDest = &bitmap[lBase >> 6];
+      for (word32 lI = 0; lI < lWords; lI++)
+        pDest[lI] |= block.Bitmap[lI];
+    }
+  }
+}
+//---------------------------------------------------------------------------
+word32 PasswDbIndexSet::CountIntersection(
+  const std::vector<word64>& bitmap) const
+{
+  const word32 lMaxIndex = bitmap.size() * 64;
+  word32 lCount = 0;
+  for (const auto& block : m_blocks) {
+    const word32 lBase = static_cast<word32>(block.Key) << BLOCK_BITS;
+    if (lBase >= lMaxIndex)
+      break;
+    if (block.Bitmap.empty()) {
+      for (word16 w : block.Array) {
+        word32 lIndex = lBase | w;
+        if (lIndex >= lMaxIndex)
+          break;
+        if (bitmap[lIndex >> 6] & (1ull << (lIndex & 63)))
+          lCount++;
+      }
+    }
+    else {
+      const word32 lWords = std::min<word32>(BITMAP_WORDS,
+        (lMaxIndex - lBase) / 64);
+      const word64* pSrc = &bitmap[lBase >> 6];
+      for (word32 lI = 0; lI < lWords; lI++)
+        lCount += __builtin_popcountll(pSrc[lI] & block.Bitmap[lI]);
+    }
+  }
+  return lCount;
+}
+//---------------------------------------------------------------------------
+word32 PasswDbTagIndex::AddRef(const SecureWString& sTag, word32 lIndex)
+{
+  word32 lTagId = m_table.AddRef(sTag);
+  if (m_blValid) {
+    if (lTagId >= m_entries.size())
+      m_entries.resize(lTagId + 1);
+    m_entries[lTagId].Add(lIndex);
+  }
+  return lTagId;
+}
+//---------------------------------------------------------------------------
+void PasswDbTagIndex::AddRef(word32 lTagId, word32 lIndex)
+{
+  m_table.AddRef(lTagId);
+  if (m_blValid) {
+    if (lTagId >= m_entries.size())
+      m_entries.resize(lTagId + 1);
+    m_entries[lTagId].Add(lIndex);
+  }
+}
+//---------------------------------------------------------------------------
+void PasswDbTagIndex::Release(word32 lTagId, word32 lIndex)
+{
+  if (m_blValid && lTagId < m_entries.size())
+    m_entries[lTagId].Remove(lIndex);
+  m_table.Release(lTagId);
+}
+//---------------------------------------------------------------------------
+const PasswDbIndexSet& PasswDbTagIndex::GetEntries(word32 lTagId) const
+{
+  static const PasswDbIndexSet emptySet;
+  return (m_blValid && lTagId < m_entries.size()) ?
+    m_entries[lTagId] : emptySet;
+}
+//---------------------------------------------------------------------------
+void PasswDbTagIndex::Renumber(
+  const std::vector<std::pair<const PasswDbEntry*,word32>>& renumbered)
+{
+  if (!m_blValid)
+    return;
+
+  // remove all previous indices first, since an entry may take over the
+  // previous index of another renumbered entry
+  for (const auto& p : renumbered) {
+    for (word32 lTagId : p.first->GetTagIds())
+      m_entries[lTagId].Remove(p.second);
+  }
+  for (const auto& p : renumbered) {
+    for (word32 lTagId : p.first->GetTagIds())
+      m_entries[lTagId].Add(p.first->GetIndex());
+  }
+}
+//---------------------------------------------------------------------------
+void PasswDbTagIndex::Rebuild(const std::vector<PasswDbEntry*>& db)
+{
+  m_entries.clear();
+  m_entries.resize(m_table.GetIdRange());
+  for (const auto pEntry : db) {
+    for (word32 lTagId : pEntry->GetTagIds())
+      m_entries[lTagId].Add(pEntry->GetIndex());
+  }
+  m_blValid = true;
+}
+//---------------------------------------------------------------------------
+void PasswDbTagIndex::Clear(void)
+{
+  m_table.Clear();
+  m_entries.clear();
+  m_blValid = true;
+}
+//---------------------------------------------------------------------------
+PasswDbEntry::PasswDbEntry(PasswDbTagIndex* pTagIndex, word32 lId,
+  word32 lIndex, bool blSetTimeStamps, word32 lMaxPasswHistorySize,
+  bool blPasswHistoryActive)
+  : PasswExpiryDate(0), UserFlags(0), UserTag(0), m_lId(lId),
+    m_lIndex(lIndex), m_passwTag(PasswDatabase::PASSW_TAG_LENGTH),
+    m_pTagIndex(pTagIndex),
+    m_passwHistory(lMaxPasswHistorySize, blPasswHistoryActive),
+    m_pHistorySrc(nullptr), m_lPasswStamp(0), m_blChanged(false)
+{
+  if (blSetTimeStamps) {
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    SystemTimeToFileTime(&st, &CreationTime);
+    ModificationTime = CreationTime;
+  }
+  else {
+    CreationTime.dwLowDateTime = CreationTime.dwHighDateTime = 0;
+    ModificationTime.dwLowDateTime = ModificationTime.dwHighDateTime = 0;
+  }
+  PasswChangeTime.dwLowDateTime = PasswChangeTime.dwHighDateTime = 0;
+  m_savedModificationTime = ModificationTime;
+}
 //---------------------------------------------------------------------------
 const char* PasswDbEntry::GetFieldName(FieldType type)
 {
@@ -136,6 +650,51 @@ SecureWString PasswDbEntry::TimeStampToString(const FILETIME& ft)
   return sBuf;
 }
 //---------------------------------------------------------------------------
+const SecureWString& PasswDbEntry::GetTimeStampString(const FILETIME& ft,
+  TimeStampString& cache)
+{
+  word64 qValue = (static_cast<word64>(ft.dwHighDateTime) << 32) |
+    ft.dwLowDateTime;
+  if (qValue != cache.Value) {
+    cache.Str = (qValue != 0) ? TimeStampToString(ft) : SecureWString();
+    cache.Value = qValue;
+  }
+  return cache.Str;
+}
+//---------------------------------------------------------------------------
+const SecureWString& PasswDbEntry::GetPasswExpiryDateString(void) const
+{
+  auto& cache = m_timeStrings[3];
+  if (PasswExpiryDate != cache.Value) {
+    cache.Str = ExpiryDateToString(PasswExpiryDate);
+    cache.Value = PasswExpiryDate;
+  }
+  return cache.Str;
+}
+//---------------------------------------------------------------------------
+bool PasswDbEntry::CheckExpiryDate(word32 lDate)
+{
+  int nYear, nMonth, nDay;
+  if (lDate == 0 || !DecodeExpiryDate(lDate, nYear, nMonth, nDay))
+    return false;
+
+  SYSTEMTIME st;
+  memzero(&st, sizeof(st));
+
+  st.wYear = nYear;
+  st.wMonth = nMonth;
+  st.wDay = nDay;
+
+  // conversion fails for invalid dates
+  FILETIME ft;
+  return SystemTimeToFileTime(&st, &ft);
+}
+//---------------------------------------------------------------------------
+void PasswDbEntry::DecodePasswHistoryFromSrc(void) const
+{
+  m_pHistorySrc->DecodePasswHistory(const_cast<PasswDbEntry&>(*this));
+}
+//---------------------------------------------------------------------------
 SecureWString PasswDbEntry::ExpiryDateToString(word32 lDate)
 {
   int nYear, nMonth, nDay;
@@ -281,27 +840,51 @@ void PasswDbEntry::ParseKeyValueList(const SecureWString& sList)
 //---------------------------------------------------------------------------
 bool PasswDbEntry::CheckTag(const SecureWString& sTag) const
 {
-  return m_tags.count(sTag) != 0;
+  word32 lTagId = m_pTagIndex->GetTable().Find(sTag);
+  return lTagId != PasswDbStringTable::npos && CheckTagId(lTagId);
+}
+//---------------------------------------------------------------------------
+bool PasswDbEntry::CheckTagId(word32 lTagId) const
+{
+  return std::find(m_tagIds.begin(), m_tagIds.end(), lTagId) != m_tagIds.end();
 }
 //---------------------------------------------------------------------------
 bool PasswDbEntry::AddTag(const SecureWString& sTag)
 {
-  auto ret = m_tags.insert(sTag);
-  return ret.second;
+  // keep tags sorted in the same order as in a std::set<SecureWString>
+  const auto& table = m_pTagIndex->GetTable();
+  auto it = std::lower_bound(m_tagIds.begin(), m_tagIds.end(), sTag,
+    [&table](word32 lId, const SecureWString& s)
+    {
+      return table.Get(lId) < s;
+    });
+  if (it != m_tagIds.end() && table.Get(*it) == sTag)
+    return false;
+
+  m_tagIds.insert(it, m_pTagIndex->AddRef(sTag, m_lIndex));
+  return true;
+}
+//---------------------------------------------------------------------------
+void PasswDbEntry::ClearTagList(void)
+{
+  for (word32 lTagId : m_tagIds)
+    m_pTagIndex->Release(lTagId, m_lIndex);
+  m_tagIds.clear();
+  Strings[TAGS].Clear();
 }
 //---------------------------------------------------------------------------
 SecureWString PasswDbEntry::GetTagsAsString(wchar_t sep) const
 {
-  if (m_tags.empty())
+  if (m_tagIds.empty())
     return SecureWString();
 
   /*word32 lSize = 0;
-  for (const auto& s : m_tags)
+  for (const auto& s : GetTagList())
     lSize += s.StrLen() + 1;
 
   SecureWString sDest(lSize);
   word32 lPos = 0;
-  for (const auto& s : m_tags) {
+  for (const auto& s : GetTagList()) {
     wcscpy(&sDest[lPos], s.c_str());
     lPos += s.StrLen();
     sDest[lPos++] = sep;
@@ -309,7 +892,7 @@ SecureWString PasswDbEntry::GetTagsAsString(wchar_t sep) const
 
   SecureWString sDest(128);
   word32 lPos = 0;
-  for (const auto& tag : m_tags) {
+  for (const auto& tag : GetTagList()) {
     if (lPos != 0)
       sDest.StrCat(sep, lPos);
     sDest.StrCat(tag, lPos);
@@ -327,8 +910,8 @@ void PasswDbEntry::ParseTagList(const SecureWString& sList)
     return;
 
   auto items = SplitStringBuf(sList.c_str(), L"\n");
-  for (auto& sTag : items) {
-    m_tags.insert(std::move(sTag));
+  for (const auto& sTag : items) {
+    AddTag(sTag);
   }
 
   /*const wchar_t* p = sList.c_str();
@@ -344,7 +927,7 @@ void PasswDbEntry::ParseTagList(const SecureWString& sList)
     word32 lTagLen = static_cast<word32>(pSep - p);
     SecureWString sTag(p, lTagLen + 1);
     sTag[lTagLen] = '\0';
-    m_tags.insert(sTag);
+    AddTag(sTag);
     if (*pSep == '\0')
       break;
     p = pSep + 1;
@@ -370,7 +953,11 @@ PasswDatabase::PasswDatabase()
     m_bCipherType(CIPHER_AES256), m_lKdfIterations(KEY_HASH_ITERATIONS),
     m_lDefaultPasswExpiryDays(0), m_lDefaultMaxPasswHistorySize(0),
     m_blRecoveryKey(false), m_blCompressed(false),
-    m_nCompressionLevel(0)
+    m_nCompressionLevel(0), m_nCompressionAlgo(COMPRESSION_DEFLATE),
+    m_lJournalSeq(0), m_lJournalSize(0),
+    m_blOrderChanged(false), m_blFullSaveRequired(false),
+    m_blSaveInProgress(false), m_lHistoryArenaSize(0),
+    m_blUserNamesValid(false), m_nPasswStrengthEstimator(-1)
 {
 }
 //---------------------------------------------------------------------------
@@ -396,6 +983,14 @@ void PasswDatabase::Close(void)
   for (auto pEntry : m_db)
 	  delete pEntry;
 
+  m_historyArena.Clear();
+  m_lHistoryArenaSize = 0;
+  m_tagIndex.Clear();
+  m_userNames.clear();
+  m_blUserNamesValid = false;
+  m_passwStrengthCache.clear();
+  m_nPasswStrengthEstimator = -1;
+
   m_db.clear();
   m_pFile.reset();
   m_lDbEntryId = 0;
@@ -405,13 +1000,23 @@ void PasswDatabase::Close(void)
   m_blRecoveryKey = false;
   m_blCompressed = false;
   m_nCompressionLevel = 0;
+  m_nCompressionAlgo = COMPRESSION_DEFLATE;
+  m_sFileName = WString();
+  m_journalBase.Clear();
+  m_lJournalSeq = 0;
+  m_lJournalSize = 0;
+  m_deletedIds.clear();
+  m_blOrderChanged = false;
+  m_blFullSaveRequired = false;
+  m_blSaveInProgress = false;
 }
 //---------------------------------------------------------------------------
 void PasswDatabase::Initialize(const SecureMem<word8>& key)
 {
   // cryptographic data stored in RAM
   // - ChaCha20 context (68 bytes) for encrypting passwords
-  // - salt (16 bytes) for calculating SHA-1 hashes of passwords
+  // - salt (16 bytes) used as key of the BLAKE2s tags of passwords
+  // - key (32 bytes) for comparing passwords by their BLAKE2 hashes
   // - database master key (32 bytes)
   // - database salt (32 bytes)
   // - database recovery key block (128 bytes), if recovery key is set
@@ -439,6 +1044,10 @@ void PasswDatabase::Initialize(const SecureMem<word8>& key)
   pMemOffset += SECMEM_SALT_LENGTH;
   randPool.GetData(m_pMemSalt, SECMEM_SALT_LENGTH);
 
+  m_pMemHashKey = pMemOffset;
+  pMemOffset += SECMEM_HASH_KEY_LENGTH;
+  randPool.GetData(m_pMemHashKey, SECMEM_HASH_KEY_LENGTH);
+
   m_pDbKey = pMemOffset;
   pMemOffset += DB_KEY_LENGTH;
   m_pDbSalt = pMemOffset;
@@ -550,7 +1159,7 @@ void PasswDatabase::Open(const SecureMem<word8>& key,
   word32 lFileSize = pFile->Size - fh.HeaderSize;
   m_cryptBuf.New(std::max(1024u, lFileSize));
 
-  SecureMem<word8> masterKey;
+  SecureMem<word8> masterKey, baseHmac;
   word32 lBufPos, lCryptParamLen, lHmacLen;
   PasswDbHeader header;
 
@@ -661,6 +1270,7 @@ void PasswDatabase::Open(const SecureMem<word8>& key,
         throw EPasswDbInvalidKey(TRL("File contents modified, or invalid key"));
     }
 
+    baseHmac = hmac;
     break;
   }
 
@@ -674,57 +1284,50 @@ void PasswDatabase::Open(const SecureMem<word8>& key,
     memcpy(m_pDbRecoveryKeyBlock, m_cryptBuf, DB_RECOVERY_KEY_BLOCK_LENGTH);
 
   if (fh.Version >= 0x104 && header.CompressionAlgo != 0) {
-    if (header.CompressionAlgo > COMPRESSION_DEFLATE)
-      throw EPasswDbError("Compression algorithm not supported");
+    if (header.CompressionAlgo > COMPRESSION_LZO1X ||
+        (header.CompressionAlgo != COMPRESSION_DEFLATE && fh.Version < 0x106))
+      throw EPasswDbInvalidFormat("Compression algorithm not supported");
 
     SecureMem<word8> dataBuf(header.UncompressedSize);
-    Inflate decompr;
-    word32 lDataSize;
-    bool blFinished = decompr.Process(
-      m_cryptBuf + m_lCryptBufPos,
-      header.CompressedSize,
-      dataBuf,
-      dataBuf.Size(),
-      true,
-      lDataSize);
-
-    if (!blFinished || lDataSize != header.UncompressedSize)
-      throw EPasswDbError("Error while decompressing data");
+
+    if (header.CompressionAlgo != COMPRESSION_DEFLATE) {
+      if (header.CompressedSize > m_cryptBuf.Size() - m_lCryptBufPos ||
+          !DecompressChunked(header.CompressionAlgo,
+          m_cryptBuf + m_lCryptBufPos, header.CompressedSize,
+          dataBuf, dataBuf.Size()))
+        throw EPasswDbError("Error while decompressing data");
+    }
+    else {
+      Inflate decompr;
+      word32 lDataSize;
+      bool blFinished = decompr.Process(
+        m_cryptBuf + m_lCryptBufPos,
+        header.CompressedSize,
+        dataBuf,
+        dataBuf.Size(),
+        true,
+        lDataSize);
+
+      if (!blFinished || lDataSize != header.UncompressedSize)
+        throw EPasswDbError("Error while decompressing data");
+    }
 
     m_cryptBuf.Swap(dataBuf);
     m_lCryptBufPos = 0;
     m_blCompressed = true;
     m_nCompressionLevel = header.CompressionLevel;
+    m_nCompressionAlgo = (header.CompressionAlgo == COMPRESSION_LZO1X) ?
+      COMPRESSION_LZO1X : COMPRESSION_DEFLATE;
   }
   else {
     m_blCompressed = false;
     m_nCompressionLevel = 0;
+    m_nCompressionAlgo = COMPRESSION_DEFLATE;
   }
 
   // read global database settings
-  if (fh.Version >= 0x102) {
-    for (int i = 0; i < header.NumOfVariableParam; i++) {
-      word32 lFlag = ReadType<word32>();
-      if ((header.Flags & FLAG_DEFAULT_USER_NAME) &&
-          lFlag == FLAG_DEFAULT_USER_NAME) {
-        m_sDefaultUserName = ReadString();
-      }
-      else if ((header.Flags & FLAG_PASSW_FORMAT_SEQ) &&
-               lFlag == FLAG_PASSW_FORMAT_SEQ) {
-        m_sPasswFormatSeq = ReadString();
-      }
-      else if ((header.Flags & FLAG_PASSW_EXPIRY_DAYS) &&
-               lFlag == FLAG_PASSW_EXPIRY_DAYS) {
-        m_lDefaultPasswExpiryDays = std::min(3650u, ReadType<word32>());
-      }
-      else if ((header.Flags & FLAG_DEFAULT_PASSW_HISTORY_SIZE) &&
-               lFlag == FLAG_DEFAULT_PASSW_HISTORY_SIZE) {
-        m_lDefaultMaxPasswHistorySize = ReadType<word8>();
-      }
-      else
-        SkipField();
-    }
-  }
+  if (fh.Version >= 0x102)
+    ReadDbParams(header.Flags, header.NumOfVariableParam);
   else {
     for (int i = 0; i < header.NumOfVariableParam; i++) {
       SecureAnsiString sParamName = ReadAnsiString();
@@ -773,70 +1376,7 @@ void PasswDatabase::Open(const SecureMem<word8>& key,
   //int nMaxNumFields = header.NumOfFields + 1;
   for (int nI = 0; nI < header.NumOfEntries; nI++) {
     PasswDbEntry* pEntry = AddDbEntry();
-    for (int nJ = 0; nJ <= header.NumOfFields; nJ++) {
-      int nFieldIndex = ReadFieldIndex();
-      if (nFieldIndex == PasswDbEntry::END)
-        break;
-      if (nFieldIndex < idxConv.size() && idxConv[nFieldIndex] >= 0) {
-        SecureWString sField;
-        int nIdx = idxConv[nFieldIndex];
-        switch (nIdx) {
-        case PasswDbEntry::KEYVALUELIST:
-          sField = ReadString();
-          pEntry->ParseKeyValueList(sField);
-          pEntry->UpdateKeyValueString();
-          break;
-        case PasswDbEntry::TAGS:
-          sField = ReadString();
-          pEntry->ParseTagList(sField);
-          pEntry->UpdateTagsString();
-          break;
-        case PasswDbEntry::CREATIONTIME:
-          pEntry->CreationTime = ReadField<FILETIME>();
-          pEntry->CreationTimeString =
-            pEntry->TimeStampToString(pEntry->CreationTime);
-          break;
-        case PasswDbEntry::MODIFICATIONTIME:
-          pEntry->ModificationTime = ReadField<FILETIME>();
-          pEntry->ModificationTimeString =
-            pEntry->TimeStampToString(pEntry->ModificationTime);
-          break;
-        case PasswDbEntry::PASSWCHANGETIME:
-          pEntry->PasswChangeTime = ReadField<FILETIME>();
-          pEntry->PasswChangeTimeString =
-            pEntry->TimeStampToString(pEntry->PasswChangeTime);
-          break;
-        case PasswDbEntry::PASSWEXPIRYDATE:
-          pEntry->PasswExpiryDate = ReadField<word32>();
-          pEntry->PasswExpiryDateString =
-            pEntry->ExpiryDateToString(pEntry->PasswExpiryDate);
-          if (pEntry->PasswExpiryDateString.IsStrEmpty())
-            pEntry->PasswExpiryDate = 0;
-          break;
-        case PasswDbEntry::PASSWHISTORY:
-          {
-            PasswHistoryHeader pwh = ReadType<PasswHistoryHeader>();
-            auto& history = pEntry->GetPasswHistory();
-            history.SetActive(pwh.Flags & 1);
-            history.SetMaxSize(pwh.MaxHistorySize);
-            for (word32 i = 0; i < pwh.HistorySize; i++) {
-              FILETIME ft = ReadType<FILETIME>();
-              sField = ReadString();
-              history.AddEntry({ ft, sField }, false);
-            }
-          }
-          break;
-        default:
-          sField = ReadString();
-          if (nIdx == PasswDbEntry::PASSWORD)
-            SetDbEntryPassw(*pEntry, sField);
-          else
-            pEntry->Strings[nIdx] = sField;
-        }
-      }
-      else
-        SkipField();
-    }
+    ReadDbEntry(*pEntry, idxConv);
 #ifdef _DEBUG
     if (pEntry->Strings[PasswDbEntry::TITLE].IsEmpty() && pEntry->IsPasswEmpty())
       ShowMessage("Entry with empty title and password detected!");
@@ -845,28 +1385,28 @@ void PasswDatabase::Open(const SecureMem<word8>& key,
 
   m_cryptBuf.Clear();
   memzero(&header, sizeof(header));
+
+  // only databases in the current format can be updated via journal
+  if (fh.Version >= VERSION_UNCHUNKED && fh.HashType == HASH_SHA512)
+    ReplayJournal(sFileName, baseHmac);
+
   memzero(&fh, sizeof(fh));
 
+  m_sFileName = sFileName;
+  ResetChangeState();
+
   m_dbOpenState = DbOpenState::Open;
   m_pFile.swap(pFile);
 }
 //---------------------------------------------------------------------------
-void PasswDatabase::Write(const void* pBuf, word32 lNumOfBytes)
+word8* PasswDatabase::ReserveWrite(word32 lNumOfBytes)
 {
-  if (pBuf == nullptr || lNumOfBytes == 0)
-    return;
-
-  const word8* pSrcBuf = reinterpret_cast<const word8*>(pBuf);
-
   m_cryptBuf.BufferedGrow(m_lCryptBufPos + lNumOfBytes);
-  //word32 lNewSize = m_lCryptBufPos + lNumOfBytes;
-  //if (lNewSize > m_cryptBuf.Size()) {
-  //  m_cryptBuf.GrowBy(alignToBlockSize(
-  //    std::max(lNumOfBytes, m_cryptBuf.Size()), DEFAULT_BUF_SIZE));
-  //}
-
-  //memcpy(&m_cryptBuf[m_lCryptBufPos], pSrcBuf, lNumOfBytes);
-  m_cryptBuf.Copy(m_lCryptBufPos, pSrcBuf, lNumOfBytes);
+  return m_cryptBuf + m_lCryptBufPos;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::CommitWrite(word32 lNumOfBytes)
+{
   m_lCryptBufPos += lNumOfBytes;
 
   m_cryptBuf.GrowClearMark(m_lCryptBufPos);
@@ -875,71 +1415,211 @@ void PasswDatabase::Write(const void* pBuf, word32 lNumOfBytes)
     throw EPasswDbError("Database size exceeds file size limit");
 }
 //---------------------------------------------------------------------------
-void PasswDatabase::WriteFieldBuf(const void* pBuf, word32 lNumOfBytes, int nIndex)
+void PasswDatabase::Write(const void* pBuf, word32 lNumOfBytes)
 {
-  if (nIndex >= 0) {
-    word8 bIndex = nIndex;
-    Write(&bIndex, 1);
-  }
-  Write(&lNumOfBytes, 4);
-  Write(pBuf, lNumOfBytes);
+  if (pBuf == nullptr || lNumOfBytes == 0)
+    return;
+
+  memcpy(ReserveWrite(lNumOfBytes), pBuf, lNumOfBytes);
+  CommitWrite(lNumOfBytes);
 }
 //---------------------------------------------------------------------------
-void PasswDatabase::WriteString(const char* pszStr, word32 lLen, int nIndex)
+void PasswDatabase::WriteFieldBuf(const void* pBuf, word32 lNumOfBytes, int nIndex)
 {
-  /*if (nIndex >= 0) {
-    if (pszStr != nullptr && *pszStr != '\0')
-      WriteFieldBuf(pszStr, strlen(pszStr), nIndex);
+  if (lNumOfBytes > MAX_FILE_SIZE)
+    throw EPasswDbError("Database size exceeds file size limit");
+
+  word8* pDest = ReserveWrite(1 + 4 + lNumOfBytes);
+  word32 lWritten = 4 + lNumOfBytes;
+  if (nIndex >= 0) {
+    *pDest++ = nIndex;
+    lWritten++;
   }
-  else
-    WriteFieldBuf(pszStr, (pszStr != nullptr) ? strlen(pszStr) : 0);*/
+  memcpy(pDest, &lNumOfBytes, 4);
+  if (lNumOfBytes != 0)
+    memcpy(pDest + 4, pBuf, lNumOfBytes);
+
+  CommitWrite(lWritten);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteString(const char* pszStr, word32 lLen, int nIndex)
+{
   if (lLen == -1)
     lLen = strlen(pszStr);
   if (nIndex < 0 || lLen > 0)
     WriteFieldBuf(pszStr, lLen, nIndex);
 }
 //---------------------------------------------------------------------------
-void PasswDatabase::WriteString(const SecureWString& sStr, int nIndex)
+word32 PasswDatabase::BeginField(int nIndex)
 {
-  if (!sStr.IsStrEmpty()) {
-#ifdef _DEBUG
-    sStr.StrLen();
-#endif
-    SecureAnsiString asUtf8 = WStringToUtf8(sStr);
-    WriteString(asUtf8.c_str(), asUtf8.StrLen(), nIndex);
+  word8* pDest = ReserveWrite(1 + 4);
+  word32 lWritten = 4;
+  if (nIndex >= 0) {
+    *pDest++ = nIndex;
+    lWritten++;
+  }
+  memset(pDest, 0, 4);
+
+  CommitWrite(lWritten);
+
+  return m_lCryptBufPos - 4;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::EndField(word32 lSizePos)
+{
+  word32 lSize = m_lCryptBufPos - lSizePos - 4;
+  memcpy(m_cryptBuf + lSizePos, &lSize, 4);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteUtf8(const wchar_t* pwszStr, word32 lLen)
+{
+  if (lLen == 0)
+    return;
+
+  if (lLen > MAX_FILE_SIZE)
+    throw EPasswDbError("Database size exceeds file size limit");
+
+  // a UTF-16 code unit takes up to 3 bytes in UTF-8
+  // (surrogate pairs: 4 bytes per 2 code units), so the string can be
+  // converted directly into the buffer without determining its length first
+  word8* pDest = ReserveWrite(3 * lLen);
+
+  CommitWrite(WCharToUtf8(pwszStr, lLen, reinterpret_cast<char*>(pDest)));
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteString(const wchar_t* pwszStr, word32 lLen, int nIndex)
+{
+  if (lLen != 0) {
+    word32 lSizePos = BeginField(nIndex);
+    WriteUtf8(pwszStr, lLen);
+    EndField(lSizePos);
   }
   else if (nIndex < 0)
     WriteFieldBuf(nullptr, 0);
 }
 //---------------------------------------------------------------------------
-void PasswDatabase::SaveToFile(const WString& sFileName)
+void PasswDatabase::WriteKeyValueList(const PasswDbEntry& entry)
+{
+  if (entry.m_keyValueList.empty())
+    return;
+
+  // same format as PasswDbEntry::GetKeyValueListAsString()
+  word32 lSizePos = BeginField(PasswDbEntry::KEYVALUELIST);
+  bool blFirst = true;
+  for (const auto& kv : entry.m_keyValueList) {
+    if (!blFirst)
+      WriteType('\n');
+    WriteUtf8(kv.first.c_str(), kv.first.StrLen());
+    WriteType('=');
+    WriteUtf8(kv.second.c_str(), kv.second.StrLen());
+    blFirst = false;
+  }
+  EndField(lSizePos);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteTags(const PasswDbEntry& entry)
+{
+  if (entry.m_tagIds.empty())
+    return;
+
+  // same format as PasswDbEntry::GetTagsAsString()
+  word32 lSizePos = BeginField(PasswDbEntry::TAGS);
+  for (const auto& tag : entry.GetTagList()) {
+    if (m_lCryptBufPos != lSizePos + 4)
+      WriteType('\n');
+    WriteUtf8(tag.c_str(), tag.StrLen());
+  }
+
+  // omit field if all tags are empty
+  if (m_lCryptBufPos == lSizePos + 4)
+    m_lCryptBufPos = lSizePos - 1;
+  else
+    EndField(lSizePos);
+}
+//---------------------------------------------------------------------------
+word32 PasswDatabase::EstimateSerializedSize(void) const
+{
+  // field sizes are taken from the buffer sizes, which assumes that most
+  // characters are ASCII; BufferedGrow() takes care of the rest
+  const word32 FIELD_OVERHEAD = 1 + 4;
+  word64 qSize = sizeof(PasswDbHeader) + 1024;
+
+  for (const auto pEntry : m_db) {
+    // timestamps, expiry date and end-of-entry mark
+    qSize += 4 * (FIELD_OVERHEAD + sizeof(FILETIME)) + 1;
+    for (const auto& s : pEntry->Strings)
+      qSize += FIELD_OVERHEAD + s.Size();
+    qSize += FIELD_OVERHEAD + pEntry->m_encPassw.Size();
+    for (const auto& kv : pEntry->m_keyValueList)
+      qSize += kv.first.Size() + kv.second.Size();
+    for (const auto& tag : pEntry->GetTagList())
+      qSize += tag.Size();
+    if (pEntry->m_pHistorySrc != nullptr)
+      qSize += pEntry->m_historyRef.Size;
+    else {
+      for (const auto& he : pEntry->m_passwHistory)
+        qSize += sizeof(he.first) + 4 + he.second.Size();
+    }
+    qSize += 1 + sizeof(PasswHistoryHeader);
+  }
+
+  return std::min<word64>(qSize, MAX_FILE_SIZE);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::SaveToFile(const WString& sFileName, bool blUseJournal)
+{
+  auto pSnapshot = CreateSnapshot(sFileName, blUseJournal);
+  if (!pSnapshot)
+    return;
+
+  try {
+    WriteSnapshot(*pSnapshot);
+  }
+  catch (...) {
+    CompleteSave(*pSnapshot, false);
+    throw;
+  }
+
+  CompleteSave(*pSnapshot, true);
+}
+//---------------------------------------------------------------------------
+std::unique_ptr<PasswDbSnapshot> PasswDatabase::CreateSnapshot(
+  const WString& sFileName, bool blUseJournal)
 {
   CheckDbOpen();
 
+  if (m_blSaveInProgress)
+    throw EPasswDbError("Database is currently being saved");
+
   if (m_bCipherType > CIPHER_CHACHA20)
     throw EPasswDbError("Invalid cipher");
   if (m_lKdfIterations == 0)
     throw EPasswDbError("Invalid number of KDF iterations");
 
-  FileHeader fh;
-  memcpy(fh.Magic, PASSW_DB_MAGIC, sizeof(PASSW_DB_MAGIC));
-  fh.HeaderSize = sizeof(FileHeader);
-  fh.Version = VERSION;
-  fh.Flags = 0;
+  if (blUseJournal && AppendToJournal(sFileName))
+    return std::unique_ptr<PasswDbSnapshot>();
+
+  std::unique_ptr<PasswDbSnapshot> pSnapshot(new PasswDbSnapshot);
+  pSnapshot->m_sFileName = sFileName;
+  pSnapshot->m_bCipherType = m_bCipherType;
+  pSnapshot->m_lKdfIterations = m_lKdfIterations;
+  pSnapshot->m_blRecoveryKey = m_blRecoveryKey;
+  pSnapshot->m_key.Assign(m_pDbKey, DB_KEY_LENGTH);
   if (m_blRecoveryKey)
-    fh.Flags |= FH_FLAG_RECOVERY_KEY;
-  fh.CipherType = m_bCipherType;
-  fh.HashType = HASH_SHA512;
-  fh.KdfType = KDF_PBKDF2_SHA256;
-  fh.KdfIterations = m_lKdfIterations;
+    pSnapshot->m_keyParam.Assign(m_pDbRecoveryKeyBlock,
+      DB_RECOVERY_KEY_BLOCK_LENGTH);
+  else
+    pSnapshot->m_keyParam.Assign(m_pDbSalt, DB_SALT_LENGTH);
 
+  // random data is generated here since the random pool must not be
+  // accessed from other threads
   auto cipher = CreateCipher(m_bCipherType, m_pDbKey,
     EncryptionAlgorithm::Mode::ENCRYPT);
-
-  word32 lIVLen = cipher->GetIVSize();
-  SecureMem<word8> iv(lIVLen);
-  RandomPool::GetInstance().GetData(iv, lIVLen);
-  cipher->SetIV(iv);
+  pSnapshot->m_iv.New(cipher->GetIVSize());
+  pSnapshot->m_padding.New(cipher->GetBlockSize());
+  RandomPool::GetInstance().GetData(pSnapshot->m_iv, pSnapshot->m_iv.Size());
+  RandomPool::GetInstance().GetData(pSnapshot->m_padding,
+    pSnapshot->m_padding.Size());
 
   PasswDbHeader header;
   memcpy(header.Magic, PASSW_DB_MAGIC, sizeof(PASSW_DB_MAGIC));
@@ -951,7 +1631,8 @@ void PasswDatabase::SaveToFile(const WString& sFileName)
   header.NumOfEntries = m_db.size();
 
   if (m_blCompressed) {
-    header.CompressionAlgo = COMPRESSION_DEFLATE;
+    header.CompressionAlgo = (m_nCompressionAlgo == COMPRESSION_LZO1X) ?
+      COMPRESSION_LZO1X : COMPRESSION_DEFLATE;
     header.CompressionLevel = m_nCompressionLevel =
       m_nCompressionLevel <= 0 ? MZ_DEFAULT_LEVEL :
         std::min<int>(MZ_BEST_COMPRESSION, m_nCompressionLevel);
@@ -961,102 +1642,420 @@ void PasswDatabase::SaveToFile(const WString& sFileName)
     header.CompressionLevel = 0;
   }
 
-  if (!m_sDefaultUserName.IsStrEmpty()) {
-    header.Flags |= FLAG_DEFAULT_USER_NAME;
-    header.NumOfVariableParam++;
+  m_cryptBuf.New(std::max<word32>(DEFAULT_BUF_SIZE, EstimateSerializedSize()));
+  m_lCryptBufPos = sizeof(header);
+
+  header.NumOfVariableParam = WriteDbParams(header.Flags);
+
+  for (int nI = 0; nI < PasswDbEntry::NUM_FIELDS; nI++) {
+    WriteString(PasswDbEntry::GetFieldName(
+      static_cast<PasswDbEntry::FieldType>(nI)));
   }
 
-  if (!m_sPasswFormatSeq.IsStrEmpty()) {
-    header.Flags |= FLAG_PASSW_FORMAT_SEQ;
-    header.NumOfVariableParam++;
+  for (auto pEntry : m_db)
+    WriteDbEntry(*pEntry);
+
+  m_passwBuf.Clear();
+
+  header.UncompressedSize = header.CompressedSize = m_lCryptBufPos - sizeof(header);
+
+  memcpy(m_cryptBuf, &header, sizeof(header));
+  memzero(&header, sizeof(header));
+
+  pSnapshot->m_data.Swap(m_cryptBuf);
+  pSnapshot->m_lDataSize = m_lCryptBufPos;
+  m_cryptBuf.Clear();
+  m_lCryptBufPos = 0;
+
+  // the snapshot represents the saved state from now on; if saving fails,
+  // the next save will rewrite the entire database
+  ResetChangeState();
+  m_blFullSaveRequired = false;
+
+  // keep the database file write-protected until CompleteSave() replaces it
+  // (the protection may have been released to create a backup copy)
+  if (!m_pFile && !m_sFileName.IsEmpty() && FileExists(m_sFileName))
+    m_pFile.reset(new TFileStream(m_sFileName, fmOpenRead | fmShareDenyWrite));
+
+  m_blSaveInProgress = true;
+
+  return pSnapshot;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteSnapshot(PasswDbSnapshot& snapshot)
+{
+  PasswDbHeader header;
+  memcpy(&header, snapshot.m_data, sizeof(header));
+
+  auto& dataBuf = snapshot.m_data;
+  word32 lDataSize = snapshot.m_lDataSize;
+
+  if (header.CompressionAlgo == COMPRESSION_LZO1X ||
+      (header.CompressionAlgo == COMPRESSION_DEFLATE &&
+       header.UncompressedSize > COMPRESSION_CHUNK_SIZE)) {
+    // LZO1X data and large Deflate data are compressed in parallel; chunks
+    // are independent (no preset dictionaries) so that they can be
+    // decompressed in parallel as well, the loss in compression ratio is
+    // marginal for 1 MB chunks
+    if (header.CompressionAlgo == COMPRESSION_DEFLATE)
+      header.CompressionAlgo = COMPRESSION_DEFLATE_CHUNKED;
+
+    SecureMem<word8> comprBuf;
+    lDataSize = sizeof(header) + CompressChunked(header.CompressionAlgo,
+      dataBuf + sizeof(header), header.UncompressedSize,
+      header.CompressionLevel, comprBuf, sizeof(header));
+
+    dataBuf.Swap(comprBuf);
+    header.CompressedSize = lDataSize - sizeof(header);
+    memcpy(dataBuf, &header, sizeof(header));
+  }
+  else if (header.CompressionAlgo == COMPRESSION_DEFLATE) {
+    word32 lToCompress = header.UncompressedSize;
+    SecureMem<word8> workBuf(DEFAULT_BUF_SIZE),
+      comprBuf(alignToBlockSize(std::max(DEFAULT_BUF_SIZE, lToCompress), 16));
+
+    Deflate compr(header.CompressionLevel);
+    bool blFinished;
+    word32 lComprBufPos = sizeof(header);
+
+    do {
+      word32 lChunkSize;
+      blFinished = compr.Process(
+        dataBuf + sizeof(header),
+        lToCompress,
+        workBuf,
+        workBuf.Size(),
+        true,
+        lChunkSize);
+      if (lChunkSize) {
+        comprBuf.BufferedGrow(lComprBufPos + lChunkSize);
+        comprBuf.Copy(lComprBufPos, workBuf, lChunkSize);
+        lComprBufPos += lChunkSize;
+      }
+      lToCompress = 0;
+    } while (!blFinished);
+
+    dataBuf.Swap(comprBuf);
+    lDataSize = lComprBufPos;
+    header.CompressedSize = lComprBufPos;
+    memcpy(dataBuf, &header, sizeof(header));
   }
 
-  if (m_lDefaultPasswExpiryDays != 0) {
-    header.Flags |= FLAG_PASSW_EXPIRY_DAYS;
-    header.NumOfVariableParam++;
+  // chunked data cannot be read by earlier versions
+  snapshot.m_nVersion = (header.CompressionAlgo == COMPRESSION_DEFLATE_CHUNKED ||
+    header.CompressionAlgo == COMPRESSION_LZO1X) ? VERSION : VERSION_UNCHUNKED;
+
+  memzero(&header, sizeof(header));
+
+  auto cipher = CreateCipher(snapshot.m_bCipherType, snapshot.m_key,
+    EncryptionAlgorithm::Mode::ENCRYPT);
+  cipher->SetIV(snapshot.m_iv);
+
+  word32 lAlignedSize = lDataSize;
+  if (cipher->AlignToBlockSize()) {
+    lAlignedSize = alignToBlockSize(lAlignedSize, cipher->GetBlockSize());
+    if (lAlignedSize > lDataSize) {
+      dataBuf.Grow(lAlignedSize);
+      dataBuf.Copy(lDataSize, snapshot.m_padding, lAlignedSize - lDataSize);
+    }
   }
 
-  if (m_lDefaultMaxPasswHistorySize != 0) {
-    header.Flags |= FLAG_DEFAULT_PASSW_HISTORY_SIZE;
-    header.NumOfVariableParam++;
+  SecureMem<sha512_context> hashCtx(1);
+  sha512_init(hashCtx);
+  sha512_hmac_starts(hashCtx, snapshot.m_key, DB_KEY_LENGTH, 0);
+  sha512_hmac_update(hashCtx, dataBuf, lAlignedSize);
+
+  cipher->Encrypt(dataBuf, dataBuf, lAlignedSize);
+
+  // buffer contents are encrypted now, so there's no need to zeroize it anymore
+  dataBuf.SetClearMark(0);
+
+#if defined(_DEBUG) && defined(TEST_DECRYPTION)
+  {
+    auto checkCipher = CreateCipher(snapshot.m_bCipherType, snapshot.m_key,
+      EncryptionAlgorithm::Mode::DECRYPT);
+    checkCipher->SetIV(snapshot.m_iv);
+    SecureMem<word8> block(checkCipher->GetBlockSize());
+    checkCipher->Decrypt(dataBuf, block, block.Size());
+    if (memcmp(block, PASSW_DB_MAGIC, sizeof(PASSW_DB_MAGIC)) != 0)
+      throw EPasswDbError("Decryption failed!");
   }
+#endif
 
-  m_cryptBuf.New(DEFAULT_BUF_SIZE);
-  m_lCryptBufPos = sizeof(header);
+  snapshot.m_hmac.New(SHA512_HMAC_LENGTH);
+  sha512_hmac_finish(hashCtx, snapshot.m_hmac);
+
+  FileHeader fh;
+  memcpy(fh.Magic, PASSW_DB_MAGIC, sizeof(PASSW_DB_MAGIC));
+  fh.HeaderSize = sizeof(FileHeader);
+  fh.Version = snapshot.m_nVersion;
+  fh.Flags = 0;
+  if (snapshot.m_blRecoveryKey)
+    fh.Flags |= FH_FLAG_RECOVERY_KEY;
+  fh.CipherType = snapshot.m_bCipherType;
+  fh.HashType = HASH_SHA512;
+  fh.KdfType = KDF_PBKDF2_SHA256;
+  fh.KdfIterations = snapshot.m_lKdfIterations;
+
+  // write to temporary file first, which replaces the database file in
+  // CompleteSave(), so that the existing file remains intact if anything
+  // goes wrong
+  WString sTempFileName = GetSaveTempFileName(snapshot.m_sFileName);
+
+  try {
+    std::unique_ptr<TFileStream> pFile(new TFileStream(sTempFileName,
+      fmCreate | fmShareDenyWrite));
+
+    // file header
+    pFile->Write(&fh, sizeof(fh));
+
+    // recovery key block or salt
+    pFile->Write(snapshot.m_keyParam, snapshot.m_keyParam.Size());
+
+    // initialization vector
+    pFile->Write(snapshot.m_iv, snapshot.m_iv.Size());
+
+    // encrypted database contents
+    pFile->Write(dataBuf, lAlignedSize);
+
+    pFile->Write(snapshot.m_hmac, snapshot.m_hmac.Size());
+
+    if (!FlushFileBuffers(reinterpret_cast<HANDLE>(pFile->Handle)))
+      RaiseLastOSError();
+  }
+  catch (...) {
+    dataBuf.Clear();
+    DeleteFile(sTempFileName);
+    throw;
+  }
+
+  dataBuf.Clear();
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::CompleteSave(const PasswDbSnapshot& snapshot, bool blSuccess)
+{
+  m_blSaveInProgress = false;
+
+  int nMoveError = 0;
+  if (blSuccess) {
+    // release write protection so that the file can be replaced
+    m_pFile.reset();
+
+    WString sTempFileName = GetSaveTempFileName(snapshot.m_sFileName);
+    if (!MoveFileEx(sTempFileName.c_str(), snapshot.m_sFileName.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+      nMoveError = GetLastError();
+      DeleteFile(sTempFileName);
+      blSuccess = false;
+    }
+  }
+
+  if (blSuccess) {
+    // database file contains all changes now, so any journal has become obsolete
+    WString sJournalFileName = GetJournalFileName(snapshot.m_sFileName);
+    if (FileExists(sJournalFileName))
+      DeleteFile(sJournalFileName);
+
+    m_sFileName = snapshot.m_sFileName;
+    m_journalBase = snapshot.m_hmac;
+    m_lJournalSeq = 0;
+    m_lJournalSize = 0;
+    m_nLastVersion = snapshot.m_nVersion;
+  }
+  else
+    m_blFullSaveRequired = true;
+
+  if (!m_pFile && !m_sFileName.IsEmpty() && FileExists(m_sFileName))
+    m_pFile.reset(new TFileStream(m_sFileName, fmOpenRead | fmShareDenyWrite));
+
+  if (nMoveError != 0)
+    RaiseLastOSError(nMoveError);
+}
+//---------------------------------------------------------------------------
+word32 PasswDatabase::ReadFieldSize(void)
+{
+  if (m_lCryptBufPos + 4 > m_cryptBuf.Size())
+    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+  word32 lSize;
+  memcpy(&lSize, &m_cryptBuf[m_lCryptBufPos], 4);
+  m_lCryptBufPos += 4;
+  return lSize;
+}
+//---------------------------------------------------------------------------
+int PasswDatabase::ReadFieldIndex(void)
+{
+  if (m_lCryptBufPos + 1 > m_cryptBuf.Size())
+    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+  return m_cryptBuf[m_lCryptBufPos++];
+}
+//---------------------------------------------------------------------------
+SecureAnsiString PasswDatabase::ReadAnsiString(void)
+{
+  SecureAnsiString asDest;
+  word32 lSize = ReadFieldSize();
+  if (lSize != 0) {
+    if (m_lCryptBufPos + lSize > m_cryptBuf.Size())
+      throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+    //asDest.New(lSize + 1);
+    //memcpy(asDest, &m_cryptBuf[m_lCryptBufPos], lSize);
+    asDest.AssignStr(reinterpret_cast<char*>(&m_cryptBuf[m_lCryptBufPos]), lSize);
+    //asDest[lSize] = '\0';
+    m_lCryptBufPos += lSize;
+  }
+  return asDest;
+}
+//---------------------------------------------------------------------------
+SecureWString PasswDatabase::ReadString(void)
+{
+  word32 lSize = ReadFieldSize();
+  if (lSize == 0)
+    return SecureWString();
+  if (m_lCryptBufPos + lSize > m_cryptBuf.Size())
+    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+
+  // decode directly from the buffer; like ReadAnsiString(), stop at the
+  // first zero byte
+  const char* pszSrc = reinterpret_cast<const char*>(
+    &m_cryptBuf[m_lCryptBufPos]);
+  int nSrcLen = strnlen(pszSrc, lSize);
+  m_lCryptBufPos += lSize;
+
+  if (nSrcLen == 0)
+    return SecureWString();
+
+  int nLen = GetUtf8DecodedLength(pszSrc, nSrcLen);
+  SecureWString sDest(nLen + 1);
+  Utf8ToWChar(pszSrc, nSrcLen, sDest);
+  sDest[nLen] = '\0';
+
+  return sDest;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::SkipField(void)
+{
+  m_lCryptBufPos += ReadFieldSize();
+  if (m_lCryptBufPos > m_cryptBuf.Size())
+    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+}
+//---------------------------------------------------------------------------
+word8 PasswDatabase::WriteDbParams(word32& lFlags)
+{
+  word8 bNumOfParams = 0;
 
-  word32 lFlag = FLAG_DEFAULT_USER_NAME;
-  if (header.Flags & lFlag) {
-    //WriteString(DEFAULT_USER_NAME);
-    WriteType(lFlag);
+  if (!m_sDefaultUserName.IsStrEmpty()) {
+    lFlags |= FLAG_DEFAULT_USER_NAME;
+    WriteType(FLAG_DEFAULT_USER_NAME);
     WriteString(m_sDefaultUserName);
+    bNumOfParams++;
   }
 
-  lFlag = FLAG_PASSW_FORMAT_SEQ;
-  if (header.Flags & lFlag) {
-    //WriteString(PASSW_FORMAT_SEQ);
-    WriteType(lFlag);
+  if (!m_sPasswFormatSeq.IsStrEmpty()) {
+    lFlags |= FLAG_PASSW_FORMAT_SEQ;
+    WriteType(FLAG_PASSW_FORMAT_SEQ);
     WriteString(m_sPasswFormatSeq);
+    bNumOfParams++;
   }
 
-  lFlag = FLAG_PASSW_EXPIRY_DAYS;
-  if (header.Flags & lFlag) {
-    WriteType(lFlag);
+  if (m_lDefaultPasswExpiryDays != 0) {
+    lFlags |= FLAG_PASSW_EXPIRY_DAYS;
+    WriteType(FLAG_PASSW_EXPIRY_DAYS);
     WriteType(m_lDefaultPasswExpiryDays);
+    bNumOfParams++;
   }
 
-  lFlag = FLAG_DEFAULT_PASSW_HISTORY_SIZE;
-  if (header.Flags & lFlag) {
-    WriteType(lFlag);
+  if (m_lDefaultMaxPasswHistorySize != 0) {
+    lFlags |= FLAG_DEFAULT_PASSW_HISTORY_SIZE;
+    WriteType(FLAG_DEFAULT_PASSW_HISTORY_SIZE);
     word8 bVal = m_lDefaultMaxPasswHistorySize;
     WriteType(bVal);
+    bNumOfParams++;
   }
 
-  for (int nI = 0; nI < PasswDbEntry::NUM_FIELDS; nI++) {
-    WriteString(PasswDbEntry::GetFieldName(
-      static_cast<PasswDbEntry::FieldType>(nI)));
+  return bNumOfParams;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ReadDbParams(word32 lFlags, int nNumOfParams)
+{
+  for (int i = 0; i < nNumOfParams; i++) {
+    word32 lFlag = ReadType<word32>();
+    if ((lFlags & FLAG_DEFAULT_USER_NAME) &&
+        lFlag == FLAG_DEFAULT_USER_NAME) {
+      m_sDefaultUserName = ReadString();
+    }
+    else if ((lFlags & FLAG_PASSW_FORMAT_SEQ) &&
+             lFlag == FLAG_PASSW_FORMAT_SEQ) {
+      m_sPasswFormatSeq = ReadString();
+    }
+    else if ((lFlags & FLAG_PASSW_EXPIRY_DAYS) &&
+             lFlag == FLAG_PASSW_EXPIRY_DAYS) {
+      m_lDefaultPasswExpiryDays = std::min(3650u, ReadType<word32>());
+    }
+    else if ((lFlags & FLAG_DEFAULT_PASSW_HISTORY_SIZE) &&
+             lFlag == FLAG_DEFAULT_PASSW_HISTORY_SIZE) {
+      m_lDefaultMaxPasswHistorySize = ReadType<word8>();
+    }
+    else
+      SkipField();
   }
-
-  const word8 bEndOfEntry = PasswDbEntry::END;
-
-  for (auto pEntry : m_db)
-  {
-	for (int nI = 0; nI < PasswDbEntry::NUM_STRING_FIELDS; nI++) {
-      //SecureWString sField;
-      switch (nI) {
-      case PasswDbEntry::PASSWORD:
-        WriteString(GetDbEntryPassw(*pEntry), nI);
-        break;
-      case PasswDbEntry::KEYVALUELIST:
-        WriteString(pEntry->GetKeyValueListAsString(), nI);
-        break;
-      case PasswDbEntry::TAGS:
-        WriteString(pEntry->GetTagsAsString(), nI);
-        break;
-      default:
-        WriteString(pEntry->Strings[nI], nI);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::WriteDbEntry(const PasswDbEntry& entry)
+{
+  for (int nI = 0; nI < PasswDbEntry::NUM_STRING_FIELDS; nI++) {
+    switch (nI) {
+    case PasswDbEntry::PASSWORD:
+      if (entry.HasPlaintextPassw())
+        WriteString(entry.Strings[nI], nI);
+      else {
+        GetDbEntryPassw(entry, m_passwBuf);
+        WriteString(m_passwBuf, nI);
       }
+      break;
+    case PasswDbEntry::KEYVALUELIST:
+      WriteKeyValueList(entry);
+      break;
+    case PasswDbEntry::TAGS:
+      WriteTags(entry);
+      break;
+    default:
+      WriteString(entry.Strings[nI], nI);
     }
+  }
 
-    WriteField(pEntry->CreationTime, PasswDbEntry::CREATIONTIME);
-    WriteField(pEntry->ModificationTime, PasswDbEntry::MODIFICATIONTIME);
-    if (pEntry->PasswChangeTime.dwLowDateTime != 0 ||
-        pEntry->PasswChangeTime.dwHighDateTime != 0)
-      WriteField(pEntry->PasswChangeTime, PasswDbEntry::PASSWCHANGETIME);
-
-    const auto& passwHistory = pEntry->GetPasswHistory();
-    if (!passwHistory.IsEmpty()) {
-      PasswHistoryHeader pwh;
-      pwh.BlockSize = sizeof(PasswHistoryHeader);
-      pwh.Flags = passwHistory.GetActive() ? 1 : 0;
+  WriteField(entry.CreationTime, PasswDbEntry::CREATIONTIME);
+  WriteField(entry.ModificationTime, PasswDbEntry::MODIFICATIONTIME);
+  if (entry.PasswChangeTime.dwLowDateTime != 0 ||
+      entry.PasswChangeTime.dwHighDateTime != 0)
+    WriteField(entry.PasswChangeTime, PasswDbEntry::PASSWCHANGETIME);
+
+  // access history directly to avoid decoding it
+  const auto& passwHistory = entry.m_passwHistory;
+  if (!passwHistory.IsEmpty()) {
+    PasswHistoryHeader pwh;
+    pwh.BlockSize = sizeof(PasswHistoryHeader);
+    pwh.Flags = passwHistory.GetActive() ? 1 : 0;
+    pwh.MaxHistorySize = std::min<word32>(MAX_PASSW_HISTORY_SIZE,
+      passwHistory.GetMaxSize());
+    const word8 bIndex = PasswDbEntry::PASSWHISTORY;
+    if (entry.m_pHistorySrc != nullptr) {
+      // serialized history is stored in the same format as in the file
+      const auto& ref = entry.m_historyRef;
+      pwh.HistorySize = ref.Count;
+      pwh.BlockSize = ref.BlockSize;
+      WriteType(bIndex);
+      WriteType(pwh);
+      if (ref.Size != 0) {
+        CryptHistoryArena(ref.Pos, ref.Size, ReserveWrite(ref.Size));
+        CommitWrite(ref.Size);
+      }
+    }
+    else {
       pwh.HistorySize = std::min<word32>(MAX_PASSW_HISTORY_SIZE,
         passwHistory.GetSize());
-      pwh.MaxHistorySize = std::min<word32>(MAX_PASSW_HISTORY_SIZE,
-        passwHistory.GetMaxSize());
       const auto endIt = passwHistory.begin() + pwh.HistorySize;
       for (auto it = passwHistory.begin(); it != endIt; it++) {
         pwh.BlockSize += sizeof(it->first) + 4 + it->second.StrLen();
       }
-      const word8 bIndex = PasswDbEntry::PASSWHISTORY;
       WriteType(bIndex);
       WriteType(pwh);
       for (auto it = passwHistory.begin(); it != endIt; it++) {
@@ -1064,168 +2063,534 @@ void PasswDatabase::SaveToFile(const WString& sFileName)
         WriteString(it->second);
       }
     }
+  }
 
-    if (pEntry->PasswExpiryDate != 0)
-      WriteField(pEntry->PasswExpiryDate, PasswDbEntry::PASSWEXPIRYDATE);
+  if (entry.PasswExpiryDate != 0)
+    WriteField(entry.PasswExpiryDate, PasswDbEntry::PASSWEXPIRYDATE);
 
-    Write(&bEndOfEntry, 1);
+  const word8 bEndOfEntry = PasswDbEntry::END;
+  Write(&bEndOfEntry, 1);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ReadDbEntry(PasswDbEntry& entry,
+  const std::vector<int>& idxConv)
+{
+  // max. number is number of fields + "end of entry" mark
+  for (word32 lI = 0; lI <= idxConv.size(); lI++) {
+    int nFieldIndex = ReadFieldIndex();
+    if (nFieldIndex == PasswDbEntry::END)
+      break;
+    if (nFieldIndex < idxConv.size() && idxConv[nFieldIndex] >= 0) {
+      SecureWString sField;
+      int nIdx = idxConv[nFieldIndex];
+      switch (nIdx) {
+      case PasswDbEntry::KEYVALUELIST:
+        sField = ReadString();
+        entry.ParseKeyValueList(sField);
+        entry.UpdateKeyValueString();
+        break;
+      case PasswDbEntry::TAGS:
+        sField = ReadString();
+        entry.ParseTagList(sField);
+        entry.UpdateTagsString();
+        break;
+      case PasswDbEntry::CREATIONTIME:
+        entry.CreationTime = ReadField<FILETIME>();
+        break;
+      case PasswDbEntry::MODIFICATIONTIME:
+        entry.ModificationTime = ReadField<FILETIME>();
+        break;
+      case PasswDbEntry::PASSWCHANGETIME:
+        entry.PasswChangeTime = ReadField<FILETIME>();
+        break;
+      case PasswDbEntry::PASSWEXPIRYDATE:
+        entry.PasswExpiryDate = ReadField<word32>();
+        if (!PasswDbEntry::CheckExpiryDate(entry.PasswExpiryDate))
+          entry.PasswExpiryDate = 0;
+        break;
+      case PasswDbEntry::PASSWHISTORY:
+        {
+          PasswHistoryHeader pwh = ReadType<PasswHistoryHeader>();
+          auto& history = entry.m_passwHistory;
+          history.SetActive(pwh.Flags & 1);
+          history.SetMaxSize(pwh.MaxHistorySize);
+          ReadPasswHistoryDeferred(entry, pwh.HistorySize);
+        }
+        break;
+      default:
+        sField = ReadString();
+        if (nIdx == PasswDbEntry::PASSWORD)
+          SetDbEntryPassw(entry, sField);
+        else
+          entry.Strings[nIdx] = sField;
+      }
+    }
+    else
+      SkipField();
   }
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ReadPasswHistoryDeferred(PasswDbEntry& entry,
+  word32 lNumOfItems)
+{
+  const auto& history = entry.m_passwHistory;
+  const word32 lStartPos = m_lHistoryArenaSize;
+  word32 lCount = 0, lBlockSize = sizeof(PasswHistoryHeader);
+
+  for (word32 lI = 0; lI < lNumOfItems; lI++) {
+    FILETIME ft = ReadType<FILETIME>();
+    word32 lSize = ReadFieldSize();
+    if (lSize == 0)
+      continue;
+    if (lSize > m_cryptBuf.Size() - m_lCryptBufPos)
+      throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
 
-  header.UncompressedSize = header.CompressedSize = m_lCryptBufPos - sizeof(header);
+    const char* pszSrc = reinterpret_cast<const char*>(
+      &m_cryptBuf[m_lCryptBufPos]);
+    m_lCryptBufPos += lSize;
 
-  if (m_blCompressed) {
-    word32 lToCompress = header.UncompressedSize;
-    SecureMem<word8> workBuf(DEFAULT_BUF_SIZE),
-      comprBuf(alignToBlockSize(std::max(DEFAULT_BUF_SIZE, lToCompress), 16));
+    // apply the same rules as PasswHistory::AddEntry()
+    word32 lLen = strnlen(pszSrc, lSize);
+    if (!history.GetActive() || lLen == 0 || lCount >= history.GetMaxSize())
+      continue;
+
+    int nWideLen = GetUtf8DecodedLength(pszSrc, lLen);
+
+    // item is stored in the same format as in the file
+    const word32 lItemSize = sizeof(ft) + 4 + lLen;
+    m_historyArena.BufferedGrow(m_lHistoryArenaSize + lItemSize);
+    word8* pDest = &m_historyArena[m_lHistoryArenaSize];
+    memcpy(pDest, &ft, sizeof(ft));
+    memcpy(pDest + sizeof(ft), &lLen, 4);
+    memcpy(pDest + sizeof(ft) + 4, pszSrc, lLen);
+    m_lHistoryArenaSize += lItemSize;
+    m_historyArena.GrowClearMark(m_lHistoryArenaSize);
+
+    // block size is based on the number of UTF-16 characters
+    lBlockSize += sizeof(ft) + 4 + nWideLen;
+    lCount++;
+  }
 
-    Deflate compr(header.CompressionLevel);
-    bool blFinished;
-    word32 lComprBufPos = sizeof(header);
+  if (lCount == 0)
+    return;
 
-    do {
-      word32 lChunkSize;
-      blFinished = compr.Process(
-        m_cryptBuf + sizeof(header),
-        lToCompress,
-        workBuf,
-        workBuf.Size(),
-        true,
-        lChunkSize);
-      if (lChunkSize) {
-        comprBuf.BufferedGrow(lComprBufPos + lChunkSize);
-        //if (lComprBufPos + lChunkSize > comprBuf.Size())
-        //  comprBuf.GrowBy(comprBuf.Size());
-        //memcpy(comprBuf + lComprBufPos, workBuf, lChunkSize);
-        comprBuf.Copy(lComprBufPos, workBuf, lChunkSize);
-        lComprBufPos += lChunkSize;
+  const word32 lSize = m_lHistoryArenaSize - lStartPos;
+  CryptHistoryArena(lStartPos, lSize, &m_historyArena[lStartPos]);
+
+  entry.m_historyRef = { lStartPos, lSize, lCount, lBlockSize };
+  entry.m_pHistorySrc = this;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::CryptHistoryArena(word32 lPos, word32 lSize, word8* pDest)
+{
+  // IVs of passwords consist of the entry ID and zeros; use a different
+  // upper half to obtain distinct key streams
+  word8 iv[SECMEM_IV_LENGTH];
+  memcpy(iv, &lPos, 4);
+  memcpy(iv + 4, "HIST", 4);
+
+  chacha_ivsetup(m_pMemCipherCtx, iv, nullptr);
+  chacha_encrypt_bytes(m_pMemCipherCtx, &m_historyArena[lPos], pDest, lSize);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::DecodePasswHistory(PasswDbEntry& entry)
+{
+  const auto& ref = entry.m_historyRef;
+
+  SecureMem<word8> buf(ref.Size);
+  CryptHistoryArena(ref.Pos, ref.Size, buf);
+
+  auto& history = entry.m_passwHistory;
+  entry.m_pHistorySrc = nullptr;
+
+  word32 lPos = 0;
+  for (word32 lI = 0; lI < ref.Count; lI++) {
+    FILETIME ft;
+    word32 lLen;
+    memcpy(&ft, &buf[lPos], sizeof(ft));
+    lPos += sizeof(ft);
+    memcpy(&lLen, &buf[lPos], 4);
+    lPos += 4;
+
+    const char* pszSrc = reinterpret_cast<const char*>(&buf[lPos]);
+    int nWideLen = GetUtf8DecodedLength(pszSrc, lLen);
+    SecureWString sPassw(nWideLen + 1);
+    Utf8ToWChar(pszSrc, lLen, sPassw);
+    sPassw[nWideLen] = '\0';
+    lPos += lLen;
+
+    history.AddEntry({ ft, sPassw }, false);
+  }
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ResetChangeState(void)
+{
+  for (auto pEntry : m_db)
+    pEntry->ResetChangeState();
+
+  m_deletedIds.clear();
+  m_blOrderChanged = false;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ReplayJournal(const WString& sFileName,
+  const SecureMem<word8>& baseHmac)
+{
+  m_journalBase = baseHmac;
+  m_lJournalSeq = 0;
+  m_lJournalSize = 0;
+
+  WString sJournalFileName = GetJournalFileName(sFileName);
+  if (!FileExists(sJournalFileName))
+    return;
+
+  std::unique_ptr<TFileStream> pJournal(new TFileStream(sJournalFileName,
+    fmOpenRead | fmShareDenyWrite));
+
+  if (pJournal->Size > MAX_FILE_SIZE)
+    throw EPasswDbError("Journal file too large");
+
+  const word32 lJournalSize = pJournal->Size;
+
+  // journal may be stale (database file has been rewritten without deleting
+  // the journal) or damaged; in this case, ignore it and rewrite the database
+  // file with the next save
+  m_blFullSaveRequired = true;
+
+  JournalHeader jh;
+  if (lJournalSize < sizeof(jh) ||
+      pJournal->Read(&jh, sizeof(jh)) != sizeof(jh) ||
+      memcmp(jh.Magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+      jh.HeaderSize < sizeof(jh) || jh.HeaderSize > lJournalSize ||
+      jh.Version != JOURNAL_VERSION ||
+      baseHmac.Size() != sizeof(jh.BaseHmac) ||
+      memcmp(jh.BaseHmac, baseHmac, sizeof(jh.BaseHmac)) != 0)
+    return;
+
+  // entries are replaced and renumbered below
+  m_tagIndex.Invalidate();
+  m_blUserNamesValid = false;
+
+  std::map<word32, PasswDbEntry*> idMap;
+  for (auto pEntry : m_db)
+    idMap[pEntry->m_lId] = pEntry;
+
+  // journal entries contain all fields in their natural order
+  std::vector<int> idxConv(PasswDbEntry::NUM_FIELDS);
+  for (int nI = 0; nI < PasswDbEntry::NUM_FIELDS; nI++)
+    idxConv[nI] = nI;
+
+  auto cipher = CreateCipher(m_bCipherType, m_pDbKey,
+    EncryptionAlgorithm::Mode::DECRYPT);
+  const word32 lIVLen = cipher->GetIVSize();
+
+  SecureMem<word8> iv(lIVLen), hmac(SHA512_HMAC_LENGTH),
+    checkHmac(SHA512_HMAC_LENGTH);
+  SecureMem<sha512_context> hashCtx(1);
+
+  word32 lPos = jh.HeaderSize;
+  word32 lSeq = 0;
+  pJournal->Seek(lPos, soFromBeginning);
+
+  while (lPos + 4 <= lJournalSize) {
+    word32 lSize;
+    pJournal->Read(&lSize, 4);
+
+    // incomplete record at the end of the file (e.g., interrupted write)
+    if (lPos + 4 + lIVLen + SHA512_HMAC_LENGTH > lJournalSize ||
+        lSize < sizeof(JournalRecordHeader) ||
+        lSize > lJournalSize - lPos - 4 - lIVLen - SHA512_HMAC_LENGTH)
+      break;
+
+    pJournal->Read(iv, lIVLen);
+    m_cryptBuf.New(lSize);
+    pJournal->Read(m_cryptBuf, lSize);
+    pJournal->Read(hmac, SHA512_HMAC_LENGTH);
+
+    cipher->SetIV(iv);
+    cipher->Decrypt(m_cryptBuf, m_cryptBuf, lSize);
+
+    sha512_init(hashCtx);
+    sha512_hmac_starts(hashCtx, m_pDbKey, DB_KEY_LENGTH, 0);
+    sha512_hmac_update(hashCtx, baseHmac, baseHmac.Size());
+    sha512_hmac_update(hashCtx, m_cryptBuf, lSize);
+    sha512_hmac_finish(hashCtx, checkHmac);
+
+    if (checkHmac != hmac)
+      break;
+
+    m_lCryptBufPos = 0;
+    JournalRecordHeader rh = ReadType<JournalRecordHeader>();
+    // unsupported records are treated like the end of the journal, so that
+    // the records before remain usable and the database file is rewritten
+    // with the next save
+    if (memcmp(rh.Magic, JOURNAL_RECORD_MAGIC, sizeof(JOURNAL_RECORD_MAGIC)) != 0 ||
+        rh.HeaderSize < sizeof(rh) || rh.HeaderSize > lSize ||
+        rh.Sequence != lSeq || rh.CompressionAlgo > COMPRESSION_LZO1X)
+      break;
+
+    m_lCryptBufPos = rh.HeaderSize;
+
+    // global settings are always stored completely
+    m_sDefaultUserName.Clear();
+    m_sPasswFormatSeq.Clear();
+    m_lDefaultPasswExpiryDays = 0;
+    m_lDefaultMaxPasswHistorySize = 0;
+    ReadDbParams(rh.ParamFlags, rh.NumOfVariableParam);
+
+    m_blCompressed = rh.CompressionAlgo != 0;
+    m_nCompressionLevel = rh.CompressionLevel;
+    m_nCompressionAlgo = (rh.CompressionAlgo == COMPRESSION_LZO1X) ?
+      COMPRESSION_LZO1X : COMPRESSION_DEFLATE;
+
+    // new or changed entries
+    for (word32 lI = 0; lI < rh.NumOfEntries; lI++) {
+      word32 lId = ReadType<word32>();
+      std::unique_ptr<PasswDbEntry> pEntry(new PasswDbEntry(&m_tagIndex, lId, 0,
+        false, 1, false));
+      ReadDbEntry(*pEntry, idxConv);
+      auto it = idMap.find(lId);
+      if (it != idMap.end()) {
+        pEntry->m_lIndex = it->second->m_lIndex;
+        m_db[pEntry->m_lIndex] = pEntry.get();
+        delete it->second;
+        it->second = pEntry.release();
       }
-      lToCompress = 0;
-    } while (!blFinished);
+      else {
+        pEntry->m_lIndex = m_db.size();
+        m_db.push_back(pEntry.get());
+        idMap[lId] = pEntry.release();
+      }
+      m_lDbEntryId = std::max(m_lDbEntryId, lId + 1);
+    }
+
+    // deleted entries
+    for (word32 lI = 0; lI < rh.NumOfDeleted; lI++) {
+      word32 lId = ReadType<word32>();
+      auto it = idMap.find(lId);
+      if (it != idMap.end()) {
+        m_db[it->second->m_lIndex] = nullptr;
+        delete it->second;
+        idMap.erase(it);
+      }
+      m_lDbEntryId = std::max(m_lDbEntryId, lId + 1);
+    }
+
+    if (rh.NumOfDeleted != 0)
+      m_db.erase(std::remove(m_db.begin(), m_db.end(), nullptr), m_db.end());
+
+    // new order of entries
+    if (rh.Flags & JR_FLAG_ORDER) {
+      if (rh.NumOfOrderIds != m_db.size())
+        throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+      PasswDbList newOrder;
+      newOrder.reserve(m_db.size());
+      for (word32 lI = 0; lI < rh.NumOfOrderIds; lI++) {
+        auto it = idMap.find(ReadType<word32>());
+        if (it == idMap.end() || it->second == nullptr)
+          throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+        newOrder.push_back(it->second);
+        it->second = nullptr; // every ID must occur only once
+      }
+      m_db.swap(newOrder);
+      for (auto pEntry : m_db)
+        idMap[pEntry->m_lId] = pEntry;
+    }
+
+    word32 lIndex = 0;
+    for (auto pEntry : m_db)
+      pEntry->m_lIndex = lIndex++;
+
+    lPos += 4 + lIVLen + lSize + SHA512_HMAC_LENGTH;
+    lSeq++;
+  }
+
+  m_cryptBuf.Clear();
+
+  m_lJournalSeq = lSeq;
+  m_lJournalSize = lPos;
+
+  // journal may only be extended if it has been read completely
+  m_blFullSaveRequired = lPos != lJournalSize;
+}
+//---------------------------------------------------------------------------
+bool PasswDatabase::AppendToJournal(const WString& sFileName)
+{
+  if (m_blFullSaveRequired || m_journalBase.IsEmpty() ||
+      m_sFileName.IsEmpty() || !SameFileName(sFileName, m_sFileName) ||
+      m_nLastVersion < VERSION_UNCHUNKED || !FileExists(sFileName))
+    return false;
+
+  // check whether the database file is still the one the journal refers to
+  word32 lDbFileSize;
+  {
+    std::unique_ptr<TFileStream> pDbFile(new TFileStream(sFileName,
+      fmOpenRead | fmShareDenyNone));
+    if (pDbFile->Size < SHA512_HMAC_LENGTH || pDbFile->Size > MAX_FILE_SIZE)
+      return false;
+    lDbFileSize = pDbFile->Size;
+    SecureMem<word8> hmac(SHA512_HMAC_LENGTH);
+    pDbFile->Seek(lDbFileSize - SHA512_HMAC_LENGTH, soFromBeginning);
+    pDbFile->Read(hmac, hmac.Size());
+    if (hmac != m_journalBase)
+      return false;
+  }
+
+  WString sJournalFileName = GetJournalFileName(sFileName);
+  bool blJournalExists = FileExists(sJournalFileName);
+  if (blJournalExists != (m_lJournalSize != 0))
+    return false;
+
+  std::unique_ptr<TFileStream> pJournal;
+  JournalHeader jh;
+  if (blJournalExists) {
+    pJournal.reset(new TFileStream(sJournalFileName,
+      fmOpenReadWrite | fmShareDenyWrite));
+
+    if (pJournal->Size != m_lJournalSize)
+      throw EPasswDbError("Journal file has been modified by another process");
+
+    pJournal->Read(&jh, sizeof(jh));
+
+    // merge journal into database file if it is too old
+    FILETIME ftNow;
+    GetSystemTimeAsFileTime(&ftNow);
+    word64 qNow = (static_cast<word64>(
+      ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime;
+    word64 qCreated = (static_cast<word64>(
+      jh.CreationTime.dwHighDateTime) << 32) | jh.CreationTime.dwLowDateTime;
+    if (qNow > qCreated && qNow - qCreated > JOURNAL_MAX_AGE)
+      return false;
+  }
+  else {
+    memcpy(jh.Magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    jh.HeaderSize = sizeof(jh);
+    jh.Version = JOURNAL_VERSION;
+    GetSystemTimeAsFileTime(&jh.CreationTime);
+    memcpy(jh.BaseHmac, m_journalBase, sizeof(jh.BaseHmac));
+  }
+
+  JournalRecordHeader rh;
+  memcpy(rh.Magic, JOURNAL_RECORD_MAGIC, sizeof(JOURNAL_RECORD_MAGIC));
+  rh.HeaderSize = sizeof(rh);
+  rh.Sequence = m_lJournalSeq;
+  rh.Flags = m_blOrderChanged ? JR_FLAG_ORDER : 0;
+  rh.ParamFlags = 0;
+  rh.CompressionAlgo = !m_blCompressed ? 0 :
+    (m_nCompressionAlgo == COMPRESSION_LZO1X) ?
+      COMPRESSION_LZO1X : COMPRESSION_DEFLATE;
+  rh.CompressionLevel = m_blCompressed ? m_nCompressionLevel : 0;
+  rh.NumOfEntries = 0;
+  rh.NumOfDeleted = m_deletedIds.size();
+  rh.NumOfOrderIds = m_blOrderChanged ? m_db.size() : 0;
+
+  m_cryptBuf.New(DEFAULT_BUF_SIZE);
+  m_lCryptBufPos = sizeof(rh);
+
+  rh.NumOfVariableParam = WriteDbParams(rh.ParamFlags);
+
+  for (auto pEntry : m_db) {
+    if (pEntry->IsChangedSinceSave()) {
+      WriteType(pEntry->m_lId);
+      WriteDbEntry(*pEntry);
+      rh.NumOfEntries++;
+    }
+  }
 
-    m_cryptBuf.Swap(comprBuf);
-    m_lCryptBufPos = lComprBufPos;
-    header.CompressedSize = lComprBufPos;
+  m_passwBuf.Clear();
+
+  for (word32 lId : m_deletedIds)
+    WriteType(lId);
+
+  if (m_blOrderChanged) {
+    for (auto pEntry : m_db)
+      WriteType(pEntry->m_lId);
   }
 
-  memcpy(m_cryptBuf, &header, sizeof(header));
-  memzero(&header, sizeof(header));
+  memcpy(m_cryptBuf, &rh, sizeof(rh));
+  memzero(&rh, sizeof(rh));
+
+  auto cipher = CreateCipher(m_bCipherType, m_pDbKey,
+    EncryptionAlgorithm::Mode::ENCRYPT);
 
   word32 lAlignedSize = m_lCryptBufPos;
-  if (cipher->AlignToBlockSize()) {
+  if (cipher->AlignToBlockSize())
     lAlignedSize = alignToBlockSize(lAlignedSize, cipher->GetBlockSize());
-    if (lAlignedSize > m_lCryptBufPos) {
-      m_cryptBuf.Grow(lAlignedSize);
-      RandomPool::GetInstance().GetData(m_cryptBuf + m_lCryptBufPos,
-        lAlignedSize - m_lCryptBufPos);
-    }
+
+  const word32 lIVLen = cipher->GetIVSize();
+
+  // rewrite database file if journal would exceed its size limit
+  word32 lNewJournalSize = (blJournalExists ? m_lJournalSize : sizeof(jh)) +
+    4 + lIVLen + lAlignedSize + SHA512_HMAC_LENGTH;
+  if (lNewJournalSize > std::max(JOURNAL_MIN_COMPACTION_SIZE,
+      lDbFileSize / JOURNAL_COMPACTION_RATIO)) {
+    m_cryptBuf.Clear();
+    return false;
+  }
+
+  if (lAlignedSize > m_lCryptBufPos) {
+    m_cryptBuf.Grow(lAlignedSize);
+    RandomPool::GetInstance().GetData(m_cryptBuf + m_lCryptBufPos,
+      lAlignedSize - m_lCryptBufPos);
   }
 
+  SecureMem<word8> iv(lIVLen);
+  RandomPool::GetInstance().GetData(iv, lIVLen);
+  cipher->SetIV(iv);
+
+  SecureMem<word8> hmac(SHA512_HMAC_LENGTH);
   SecureMem<sha512_context> hashCtx(1);
   sha512_init(hashCtx);
   sha512_hmac_starts(hashCtx, m_pDbKey, DB_KEY_LENGTH, 0);
+  sha512_hmac_update(hashCtx, m_journalBase, m_journalBase.Size());
   sha512_hmac_update(hashCtx, m_cryptBuf, lAlignedSize);
+  sha512_hmac_finish(hashCtx, hmac);
 
   cipher->Encrypt(m_cryptBuf, m_cryptBuf, lAlignedSize);
 
   // buffer contents are encrypted now, so there's no need to zeroize it anymore
   m_cryptBuf.SetClearMark(0);
 
-  // now open file and write data
-  m_pFile.reset();
-  m_pFile.reset(new TFileStream(sFileName, fmCreate | fmShareDenyWrite));
-
   try {
-    // file header
-    m_pFile->Write(&fh, sizeof(fh));
-
-    // recovery key block or salt
-    if (m_blRecoveryKey)
-      m_pFile->Write(m_pDbRecoveryKeyBlock, DB_RECOVERY_KEY_BLOCK_LENGTH);
-    else
-      m_pFile->Write(m_pDbSalt, DB_SALT_LENGTH);
-
-    // initialization vector
-    m_pFile->Write(iv, lIVLen);
-
-    // encrypted database contents
-    m_pFile->Write(m_cryptBuf, lAlignedSize);
-
-  #if defined(_DEBUG) && defined(TEST_DECRYPTION)
-    {
-      auto checkCipher = CreateCipher(m_bCipherType, m_pDbKey,
-        EncryptionAlgorithm::Mode::DECRYPT);
-      checkCipher->SetIV(iv);
-      SecureMem<word8> block(checkCipher->GetBlockSize());
-      checkCipher->Decrypt(m_cryptBuf, block, block.Size());
-      if (memcmp(block, PASSW_DB_MAGIC, sizeof(PASSW_DB_MAGIC)) != 0)
-        throw EPasswDbError("Decryption failed!");
+    if (blJournalExists)
+      pJournal->Seek(m_lJournalSize, soFromBeginning);
+    else {
+      pJournal.reset(new TFileStream(sJournalFileName,
+        fmCreate | fmShareDenyWrite));
+      pJournal->Write(&jh, sizeof(jh));
     }
-  #endif
 
-    SecureMem<word8> hmac(SHA512_HMAC_LENGTH);
-    sha512_hmac_finish(hashCtx, hmac);
+    pJournal->Write(&lAlignedSize, 4);
+    pJournal->Write(iv, lIVLen);
+    pJournal->Write(m_cryptBuf, lAlignedSize);
+    pJournal->Write(hmac, hmac.Size());
 
-    m_pFile->Write(hmac, hmac.Size());
+    // the record must not be considered durable unless it has been
+    // written to disk
+    if (!FlushFileBuffers(reinterpret_cast<HANDLE>(pJournal->Handle)))
+      RaiseLastOSError();
   }
-  __finally {
+  catch (...) {
+    // journal may contain an incomplete record now
     m_cryptBuf.Clear();
-    m_pFile.reset();
+    m_blFullSaveRequired = true;
+    throw;
   }
 
-  m_pFile.reset(new TFileStream(sFileName, fmOpenRead | fmShareDenyWrite));
+  m_cryptBuf.Clear();
 
-  m_nLastVersion = VERSION;
-}
-//---------------------------------------------------------------------------
-word32 PasswDatabase::ReadFieldSize(void)
-{
-  if (m_lCryptBufPos + 4 > m_cryptBuf.Size())
-    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
-  word32 lSize;
-  memcpy(&lSize, &m_cryptBuf[m_lCryptBufPos], 4);
-  m_lCryptBufPos += 4;
-  return lSize;
-}
-//---------------------------------------------------------------------------
-int PasswDatabase::ReadFieldIndex(void)
-{
-  if (m_lCryptBufPos + 1 > m_cryptBuf.Size())
-    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
-  return m_cryptBuf[m_lCryptBufPos++];
-}
-//---------------------------------------------------------------------------
-SecureAnsiString PasswDatabase::ReadAnsiString(void)
-{
-  SecureAnsiString asDest;
-  word32 lSize = ReadFieldSize();
-  if (lSize != 0) {
-    if (m_lCryptBufPos + lSize > m_cryptBuf.Size())
-      throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
-    //asDest.New(lSize + 1);
-    //memcpy(asDest, &m_cryptBuf[m_lCryptBufPos], lSize);
-    asDest.AssignStr(reinterpret_cast<char*>(&m_cryptBuf[m_lCryptBufPos]), lSize);
-    //asDest[lSize] = '\0';
-    m_lCryptBufPos += lSize;
-  }
-  return asDest;
-}
-//---------------------------------------------------------------------------
-SecureWString PasswDatabase::ReadString(void)
-{
-  SecureAnsiString asUtf8 = ReadAnsiString();
-  return Utf8ToWString(asUtf8);
-}
-//---------------------------------------------------------------------------
-void PasswDatabase::SkipField(void)
-{
-  m_lCryptBufPos += ReadFieldSize();
-  if (m_lCryptBufPos > m_cryptBuf.Size())
-    throw EPasswDbInvalidFormat(E_INVALID_FORMAT);
+  m_lJournalSize = lNewJournalSize;
+  m_lJournalSeq++;
+  ResetChangeState();
+
+  if (!m_pFile)
+    m_pFile.reset(new TFileStream(sFileName, fmOpenRead | fmShareDenyWrite));
+
+  return true;
 }
 //---------------------------------------------------------------------------
 PasswDbEntry* PasswDatabase::AddDbEntry(void)
 {
-  PasswDbEntry* pEntry = new PasswDbEntry(m_lDbEntryId++, m_db.size(),
+  PasswDbEntry* pEntry = new PasswDbEntry(&m_tagIndex, m_lDbEntryId++, m_db.size(),
     false, 1, false);
   m_db.push_back(pEntry);
   return pEntry;
@@ -1233,24 +2598,25 @@ PasswDbEntry* PasswDatabase::AddDbEntry(void)
 //---------------------------------------------------------------------------
 PasswDbEntry* PasswDatabase::NewDbEntry(void)
 {
-  PasswDbEntry* pEntry = new PasswDbEntry(m_lDbEntryId++, m_db.size(),
+  PasswDbEntry* pEntry = new PasswDbEntry(&m_tagIndex, m_lDbEntryId++, m_db.size(),
     true, m_lDefaultMaxPasswHistorySize,
     m_lDefaultMaxPasswHistorySize > 0);
   m_db.push_back(pEntry);
-  pEntry->Strings[PasswDbEntry::USERNAME] = m_sDefaultUserName;
+  pEntry->m_blChanged = true;
+  SetDbEntryUserName(*pEntry, m_sDefaultUserName);
   return pEntry;
 }
 //---------------------------------------------------------------------------
 PasswDbEntry* PasswDatabase::DuplicateDbEntry(const PasswDbEntry& original,
   const SecureWString& sTitle)
 {
-  PasswDbEntry* pDuplicate = new PasswDbEntry(m_lDbEntryId++, m_db.size(),
+  PasswDbEntry* pDuplicate = new PasswDbEntry(&m_tagIndex, m_lDbEntryId++, m_db.size(),
     true, 1, false);
   m_db.push_back(pDuplicate);
+  pDuplicate->m_blChanged = true;
 
   pDuplicate->Strings[PasswDbEntry::TITLE] = sTitle;
-  pDuplicate->Strings[PasswDbEntry::USERNAME] =
-    original.Strings[PasswDbEntry::USERNAME];
+  SetDbEntryUserName(*pDuplicate, original.Strings[PasswDbEntry::USERNAME]);
   pDuplicate->Strings[PasswDbEntry::URL] =
     original.Strings[PasswDbEntry::URL];
   pDuplicate->Strings[PasswDbEntry::KEYWORD] =
@@ -1260,10 +2626,12 @@ PasswDbEntry* PasswDatabase::DuplicateDbEntry(const PasswDbEntry& original,
   SetDbEntryPassw(*pDuplicate, GetDbEntryPassw(original));
 
   pDuplicate->SetKeyValueList(original.GetKeyValueList());
-  pDuplicate->SetTagList(original.GetTagList());
+  for (word32 lTagId : original.m_tagIds)
+    m_tagIndex.AddRef(lTagId, pDuplicate->m_lIndex);
+  pDuplicate->m_tagIds = original.m_tagIds;
+  pDuplicate->UpdateTagsString();
   pDuplicate->GetPasswHistory() = original.GetPasswHistory();
   pDuplicate->PasswExpiryDate = original.PasswExpiryDate;
-  pDuplicate->PasswExpiryDateString = original.PasswExpiryDateString;
   pDuplicate->PasswChangeTime = original.PasswChangeTime;
 
   return pDuplicate;
@@ -1271,15 +2639,7 @@ PasswDbEntry* PasswDatabase::DuplicateDbEntry(const PasswDbEntry& original,
 //---------------------------------------------------------------------------
 void PasswDatabase::DeleteDbEntry(PasswDbEntry& entry)
 {
-  word32 lIndex = entry.m_lIndex;
-  if (lIndex < m_db.size()) {
-	PasswDbList::iterator it = m_db.begin() + lIndex;
-    delete &entry;
-    it = m_db.erase(it);
-
-    for (; it != m_db.end(); it++)
-      (*it)->m_lIndex = lIndex++;
-  }
+  DeleteDbEntries({ &entry });
 }
 //---------------------------------------------------------------------------
 void PasswDatabase::MoveDbEntry(word32 lCurrPos, word32 lNewPos)
@@ -1298,10 +2658,9 @@ void PasswDatabase::MoveDbEntry(word32 lCurrPos, word32 lNewPos)
       last = dest + 1;
     }
     std::rotate(first, dest, last);
+    m_blOrderChanged = true;
 
-    word32 lIndex = 0;
-    for (auto pEntry : m_db)
-      pEntry->m_lIndex = lIndex++;
+    UpdateIndices();
 
     /*
     PasswDbList moved(lSize);
@@ -1328,18 +2687,200 @@ void PasswDatabase::MoveDbEntry(word32 lCurrPos, word32 lNewPos)
   }
 }
 //---------------------------------------------------------------------------
+std::vector<bool> PasswDatabase::GetIndexMask(
+  const std::vector<PasswDbEntry*>& entries) const
+{
+  std::vector<bool> mask(m_db.size());
+  for (const auto pEntry : entries) {
+    word32 lIndex = pEntry->m_lIndex;
+    if (lIndex < m_db.size() && m_db[lIndex] == pEntry)
+      mask[lIndex] = true;
+  }
+  return mask;
+}
+//---------------------------------------------------------------------------
+bool PasswDatabase::UpdateIndices(void)
+{
+  std::vector<std::pair<const PasswDbEntry*,word32>> renumbered;
+  word32 lIndex = 0;
+  for (auto pEntry : m_db) {
+    if (pEntry->m_lIndex != lIndex) {
+      renumbered.emplace_back(pEntry, pEntry->m_lIndex);
+      pEntry->m_lIndex = lIndex;
+    }
+    lIndex++;
+  }
+  m_tagIndex.Renumber(renumbered);
+  return !renumbered.empty();
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::AddUserNameRef(const SecureWString& sUserName)
+{
+  if (sUserName.IsStrEmpty())
+    return;
+
+  SecureWString sKey = sUserName;
+  CharLower(sKey.Data());
+
+  auto it = m_userNames.find(sKey);
+  if (it != m_userNames.end())
+    it->second.second++;
+  else
+    m_userNames.emplace(sKey, std::make_pair(sUserName, 1u));
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ReleaseUserNameRef(const SecureWString& sUserName)
+{
+  if (sUserName.IsStrEmpty())
+    return;
+
+  SecureWString sKey = sUserName;
+  CharLower(sKey.Data());
+
+  auto it = m_userNames.find(sKey);
+  if (it != m_userNames.end() && --it->second.second == 0)
+    m_userNames.erase(it);
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::SetDbEntryUserName(PasswDbEntry& entry,
+  const SecureWString& sUserName)
+{
+  auto& sEntryUserName = entry.Strings[PasswDbEntry::USERNAME];
+  if (m_blUserNamesValid && sEntryUserName != sUserName) {
+    ReleaseUserNameRef(sEntryUserName);
+    AddUserNameRef(sUserName);
+  }
+  sEntryUserName = sUserName;
+}
+//---------------------------------------------------------------------------
+std::vector<SecureWString> PasswDatabase::GetUserNames(void)
+{
+  if (!m_blUserNamesValid) {
+    m_userNames.clear();
+    for (const auto pEntry : m_db)
+      AddUserNameRef(pEntry->Strings[PasswDbEntry::USERNAME]);
+    m_blUserNamesValid = true;
+  }
+
+  std::vector<SecureWString> userNames;
+  userNames.reserve(m_userNames.size());
+  for (const auto& kv : m_userNames)
+    userNames.push_back(kv.second.first);
+
+  return userNames;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::DeleteDbEntries(const std::vector<PasswDbEntry*>& entries)
+{
+  auto mask = GetIndexMask(entries);
+
+  // tags of deleted entries are released using their current indices, so
+  // the remaining entries are renumbered in the tag index afterwards
+  std::vector<std::pair<const PasswDbEntry*,word32>> renumbered;
+  word32 lDest = 0;
+  for (word32 lI = 0; lI < m_db.size(); lI++) {
+    PasswDbEntry* pEntry = m_db[lI];
+    if (mask[lI]) {
+      m_deletedIds.push_back(pEntry->m_lId);
+      m_passwStrengthCache.erase(pEntry->m_lId);
+      if (m_blUserNamesValid)
+        ReleaseUserNameRef(pEntry->Strings[PasswDbEntry::USERNAME]);
+      // wipe serialized password history (contents are encrypted anyway)
+      if (pEntry->m_pHistorySrc != nullptr) {
+        const auto& ref = pEntry->m_historyRef;
+        memzero(&m_historyArena[ref.Pos], ref.Size);
+      }
+      delete pEntry;
+    }
+    else {
+      if (pEntry->m_lIndex != lDest) {
+        renumbered.emplace_back(pEntry, pEntry->m_lIndex);
+        pEntry->m_lIndex = lDest;
+      }
+      m_db[lDest++] = pEntry;
+    }
+  }
+
+  m_db.resize(lDest);
+  m_tagIndex.Renumber(renumbered);
+}
+//---------------------------------------------------------------------------
+bool PasswDatabase::MoveDbEntries(const std::vector<PasswDbEntry*>& entries,
+  word32 lNewPos)
+{
+  auto mask = GetIndexMask(entries);
+
+  PasswDbList block, rest;
+  block.reserve(entries.size());
+  rest.reserve(m_db.size());
+  for (word32 lI = 0; lI < m_db.size(); lI++)
+    (mask[lI] ? block : rest).push_back(m_db[lI]);
+
+  if (block.empty())
+    return false;
+
+  lNewPos = std::min<word32>(lNewPos, rest.size());
+
+  auto it = std::copy(rest.begin(), rest.begin() + lNewPos, m_db.begin());
+  it = std::copy(block.begin(), block.end(), it);
+  std::copy(rest.begin() + lNewPos, rest.end(), it);
+
+  if (!UpdateIndices())
+    return false;
+
+  m_blOrderChanged = true;
+  return true;
+}
+//---------------------------------------------------------------------------
+bool PasswDatabase::ShiftDbEntries(const std::vector<PasswDbEntry*>& entries,
+  bool blUp)
+{
+  auto mask = GetIndexMask(entries);
+  const word32 lSize = m_db.size();
+
+  // a run of selected entries moves by one position as a whole, since the
+  // unselected neighbor is swapped through the entire run
+  if (blUp) {
+    for (word32 lI = 1; lI < lSize; lI++) {
+      if (mask[lI] && !mask[lI - 1]) {
+        std::swap(m_db[lI - 1], m_db[lI]);
+        mask[lI - 1] = true;
+        mask[lI] = false;
+      }
+    }
+  }
+  else {
+    for (word32 lI = lSize; lI-- > 1; ) {
+      if (mask[lI - 1] && !mask[lI]) {
+        std::swap(m_db[lI - 1], m_db[lI]);
+        mask[lI - 1] = false;
+        mask[lI] = true;
+      }
+    }
+  }
+
+  if (!UpdateIndices())
+    return false;
+
+  m_blOrderChanged = true;
+  return true;
+}
+//---------------------------------------------------------------------------
 void PasswDatabase::SetDbEntryPassw(PasswDbEntry& entry,
   const SecureWString& sPassw)
 {
+  entry.m_blChanged = true;
+  entry.m_lPasswStamp++;
+  m_passwStrengthCache.erase(entry.m_lId);
+
   if (sPassw.IsStrEmpty()) {
     entry.m_encPassw.Clear();
     entry.Strings[PasswDbEntry::PASSWORD].Clear();
-    entry.m_passwHash.Zeroize();
+    entry.m_passwTag.Zeroize();
     return;
   }
 
-  sha1_hmac(m_pMemSalt, SECMEM_SALT_LENGTH, sPassw.Bytes(), sPassw.SizeBytes(),
-    entry.m_passwHash);
+  ComputePasswTag(sPassw.Bytes(), sPassw.SizeBytes(), entry.m_passwTag);
 
   SecureMem<word8> iv(SECMEM_IV_LENGTH);
   iv.Zeroize();
@@ -1358,35 +2899,334 @@ void PasswDatabase::SetDbEntryPassw(PasswDbEntry& entry,
     entry.Strings[PasswDbEntry::PASSWORD] = sPassw;
 }
 //---------------------------------------------------------------------------
+std::unique_ptr<PasswStrengthJob> PasswDatabase::CreatePasswStrengthJob(
+  int nEstimatorId)
+{
+  CheckDbOpen();
+
+  if (nEstimatorId != m_nPasswStrengthEstimator) {
+    m_passwStrengthCache.clear();
+    m_nPasswStrengthEstimator = nEstimatorId;
+  }
+
+  std::vector<const PasswDbEntry*> entries;
+  for (const auto pEntry : m_db) {
+    if (pEntry->IsPasswEmpty())
+      continue;
+    auto it = m_passwStrengthCache.find(pEntry->m_lId);
+    if (it == m_passwStrengthCache.end() ||
+        it->second.Stamp != pEntry->m_lPasswStamp)
+      entries.push_back(pEntry);
+  }
+
+  if (entries.empty())
+    return std::unique_ptr<PasswStrengthJob>();
+
+  // memory cipher context must not be used by multiple threads
+  const word32 lNumEntries = entries.size();
+  std::unique_ptr<PasswStrengthJob> pJob(new PasswStrengthJob);
+  pJob->m_nEstimatorId = nEstimatorId;
+  pJob->m_ids.reserve(lNumEntries);
+  pJob->m_stamps.reserve(lNumEntries);
+  pJob->m_passwords.resize(lNumEntries);
+  for (word32 lI = 0; lI < lNumEntries; lI++) {
+    pJob->m_ids.push_back(entries[lI]->m_lId);
+    pJob->m_stamps.push_back(entries[lI]->m_lPasswStamp);
+    GetDbEntryPassw(*entries[lI], pJob->m_passwords[lI]);
+  }
+
+  return pJob;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::EstimatePasswStrength(PasswStrengthJob& job,
+  const PasswStrengthFunc& estimate)
+{
+  const word32 lNumEntries = job.m_passwords.size();
+  auto& passwords = job.m_passwords;
+  auto& results = job.m_results;
+  results.assign(lNumEntries, -1);
+
+  RunInParallel(lNumEntries,
+    [&estimate,&passwords,&results](word32 lStart, word32 lEnd)
+    {
+      for (word32 lI = lStart; lI < lEnd; lI++) {
+        try {
+          results[lI] = std::max(0, estimate(passwords[lI]));
+        }
+        catch (...) {
+        }
+        passwords[lI].Clear();
+      }
+    });
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::CompletePasswStrengthJob(const PasswStrengthJob& job)
+{
+  if (job.m_nEstimatorId != m_nPasswStrengthEstimator ||
+      job.m_results.size() != job.m_ids.size())
+    return;
+
+  // the cached stamps are compared with the current ones when reading the
+  // cache, so results of changed passwords are not used
+  for (word32 lI = 0; lI < job.m_ids.size(); lI++)
+    m_passwStrengthCache[job.m_ids[lI]] =
+      { job.m_stamps[lI], job.m_results[lI] };
+}
+//---------------------------------------------------------------------------
+int PasswDatabase::GetCachedPasswStrength(const PasswDbEntry& entry) const
+{
+  if (entry.IsPasswEmpty())
+    return -1;
+
+  auto it = m_passwStrengthCache.find(entry.m_lId);
+  if (it == m_passwStrengthCache.end() ||
+      it->second.Stamp != entry.m_lPasswStamp)
+    return -1;
+
+  return it->second.EntropyBits;
+}
+//---------------------------------------------------------------------------
 SecureWString PasswDatabase::GetDbEntryPassw(const PasswDbEntry& entry)
 {
-  if (entry.m_encPassw.IsEmpty())
-    return SecureWString();
+  SecureWString sPassw;
+  GetDbEntryPassw(entry, sPassw);
+  return sPassw;
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::GetDbEntryPassw(const PasswDbEntry& entry,
+  SecureWString& sDest)
+{
+  if (entry.m_encPassw.IsEmpty()) {
+    if (!sDest.IsEmpty())
+      sDest[0] = '\0';
+    return;
+  }
 
-  if (entry.HasPlaintextPassw())
-    return entry.Strings[PasswDbEntry::PASSWORD];
+  if (entry.HasPlaintextPassw()) {
+    const auto& sPassw = entry.Strings[PasswDbEntry::PASSWORD];
+    if (sDest.Size() < sPassw.Size())
+      sDest.New(sPassw.Size());
+    sDest.Copy(0, sPassw, sPassw.Size());
+    return;
+  }
 
-  SecureWString sPassw(entry.m_encPassw.Size());
+  if (sDest.Size() < entry.m_encPassw.Size())
+    sDest.New(entry.m_encPassw.Size());
 
-  SecureMem<word8> iv(SECMEM_IV_LENGTH);
-  iv.Zeroize();
-  *(reinterpret_cast<word32*>(iv.Data())) = entry.m_lId;
+  if (!DecryptPassw(entry, sDest.Data(), m_pMemCipherCtx))
+    throw EPasswDbError("Internal error: Password decryption failed");
+}
+//---------------------------------------------------------------------------
+void PasswDatabase::ComputePasswTag(const void* pPassw, word32 lSize,
+  word8* pTag) const
+{
+  // BLAKE2s keyed with the session salt replaces HMAC-SHA1 (one compression
+  // per 64 bytes instead of four per password)
+  blake2s(pTag, PASSW_TAG_LENGTH, pPassw, lSize, m_pMemSalt,
+    SECMEM_SALT_LENGTH);
+}
+//---------------------------------------------------------------------------
+bool PasswDatabase::DecryptPassw(const PasswDbEntry& entry, wchar_t* pDest,
+  chacha_ctx* pCipherCtx) const
+{
+  word8 iv[SECMEM_IV_LENGTH];
+  memzero(iv, sizeof(iv));
+  memcpy(iv, &entry.m_lId, sizeof(entry.m_lId));
 
   //size_t iv_off = 0;
   //aes_crypt_cfb128(m_pMemCipherCtx, AES_DECRYPT, pEntry->m_encPassw.SizeBytes(),
   //  &iv_off, iv, pEntry->m_encPassw.Bytes(), sPassw.Bytes());
-  chacha_ivsetup(m_pMemCipherCtx, iv, nullptr);
-  chacha_encrypt_bytes(m_pMemCipherCtx, entry.m_encPassw.Bytes(), sPassw.Bytes(),
-    entry.m_encPassw.SizeBytes());
+  chacha_ivsetup(pCipherCtx, iv, nullptr);
+  chacha_encrypt_bytes(pCipherCtx, entry.m_encPassw.Bytes(),
+    reinterpret_cast<word8*>(pDest), entry.m_encPassw.SizeBytes());
+
+  word8 checkTag[PASSW_TAG_LENGTH];
+  ComputePasswTag(pDest, entry.m_encPassw.SizeBytes(), checkTag);
+
+  bool blValid = entry.m_passwTag.Size() == sizeof(checkTag) &&
+    memcmp(entry.m_passwTag.Data(), checkTag, sizeof(checkTag)) == 0;
+  memzero(checkTag, sizeof(checkTag));
+
+  return blValid;
+}
+//---------------------------------------------------------------------------
+std::vector<word32> PasswDatabase::GetDbEntryPasswBatch(
+  const std::vector<const PasswDbEntry*>& entries, SecureWString& sDest)
+{
+  std::vector<word32> positions;
+  positions.reserve(entries.size());
+
+  word32 lTotalSize = 0;
+  for (const auto pEntry : entries) {
+    positions.push_back(lTotalSize);
+    word32 lSize = pEntry->HasPlaintextPassw() ?
+      pEntry->Strings[PasswDbEntry::PASSWORD].Size() :
+      pEntry->m_encPassw.Size();
+    lTotalSize += std::max(1u, lSize);
+  }
+
+  sDest.New(std::max(1u, lTotalSize));
+
+  // each task works on a private copy of the cipher context (kept in its
+  // stack frame and wiped afterwards), since setting the IV modifies the
+  // context; only the key schedule is shared
+  const chacha_ctx* pMemCipherCtx = m_pMemCipherCtx;
+  std::atomic<bool> blFailed(false);
+  auto decryptRange = [&](word32 lStart, word32 lEnd)
+    {
+      chacha_ctx cipherCtx = *pMemCipherCtx;
+      for (word32 lI = lStart; lI < lEnd && !blFailed; lI++) {
+        const PasswDbEntry& entry = *entries[lI];
+        wchar_t* pDest = sDest.Data() + positions[lI];
+        if (entry.m_encPassw.IsEmpty())
+          *pDest = '\0';
+        else if (entry.HasPlaintextPassw()) {
+          const auto& sPassw = entry.Strings[PasswDbEntry::PASSWORD];
+          wmemcpy(pDest, sPassw.Data(), sPassw.Size());
+        }
+        else if (!DecryptPassw(entry, pDest, &cipherCtx))
+          blFailed = true;
+      }
+      memzero(&cipherCtx, sizeof(cipherCtx));
+    };
 
-  SecureMem<word8> checkHash(entry.m_passwHash.Size());
-  sha1_hmac(m_pMemSalt, SECMEM_SALT_LENGTH, sPassw.Bytes(), sPassw.SizeBytes(),
-    checkHash);
+  // thread startup costs more than decrypting a few hundred passwords
+  if (lTotalSize < PARALLEL_DECRYPT_MIN_SIZE)
+    decryptRange(0, entries.size());
+  else
+    RunInParallel(entries.size(), decryptRange);
 
-  if (entry.m_passwHash != checkHash)
+  if (blFailed) {
+    sDest.Clear();
     throw EPasswDbError("Internal error: Password decryption failed");
+  }
 
-  return sPassw;
+  return positions;
+}
+//---------------------------------------------------------------------------
+std::vector<std::vector<PasswDbEntry*>> PasswDatabase::FindReusedPassw(void)
+{
+  CheckDbOpen();
+
+  std::vector<std::vector<PasswDbEntry*>> groups;
+
+  std::vector<const PasswDbEntry*> entries;
+  for (const auto pEntry : m_db) {
+    if (!pEntry->IsPasswEmpty())
+      entries.push_back(pEntry);
+  }
+
+  const word32 lNumEntries = entries.size();
+  if (lNumEntries < 2)
+    return groups;
+
+  SecureWString sPasswords;
+  auto positions = GetDbEntryPasswBatch(entries, sPasswords);
+
+  // hash passwords with keyed BLAKE2s in parallel
+  SecureMem<word8> digests(lNumEntries * PASSW_DIGEST_LENGTH);
+  const wchar_t* pPasswords = sPasswords.c_str();
+  const word8* pHashKey = m_pMemHashKey;
+  RunInParallel(lNumEntries,
+    [&digests,&positions,pPasswords,pHashKey](word32 lStart, word32 lEnd)
+    {
+      for (word32 lI = lStart; lI < lEnd; lI++) {
+        const wchar_t* pPassw = pPasswords + positions[lI];
+        blake2s(&digests[lI * PASSW_DIGEST_LENGTH], PASSW_DIGEST_LENGTH,
+          pPassw, wcslen(pPassw) * sizeof(wchar_t),
+          pHashKey, SECMEM_HASH_KEY_LENGTH);
+      }
+    });
+
+  // insert digests into hash table with open addressing (linear probing);
+  // each slot refers to the first entry of a group, entries of the same
+  // group are linked in database order
+  const word32 NONE = static_cast<word32>(-1);
+  word32 lTableSize = 2;
+  while (lTableSize < 2 * lNumEntries)
+    lTableSize <<= 1;
+  const word32 lMask = lTableSize - 1;
+
+  std::vector<word32> table(lTableSize, NONE), next(lNumEntries, NONE),
+    last(lNumEntries), groupSize(lNumEntries, 0);
+  word32 lNumGroups = 0;
+
+  for (word32 lI = 0; lI < lNumEntries; lI++) {
+    const word8* pDigest = &digests[lI * PASSW_DIGEST_LENGTH];
+    word32 lSlot;
+    memcpy(&lSlot, pDigest, sizeof(lSlot));
+    for (lSlot &= lMask; ; lSlot = (lSlot + 1) & lMask) {
+      word32 lHead = table[lSlot];
+      if (lHead == NONE) {
+        table[lSlot] = lI;
+        last[lI] = lI;
+        groupSize[lI] = 1;
+        break;
+      }
+      if (memcmp(&digests[lHead * PASSW_DIGEST_LENGTH], pDigest,
+          PASSW_DIGEST_LENGTH) == 0) {
+        next[last[lHead]] = lI;
+        last[lHead] = lI;
+        if (++groupSize[lHead] == 2)
+          lNumGroups++;
+        break;
+      }
+    }
+  }
+
+  groups.reserve(lNumGroups);
+  for (word32 lI = 0; lI < lNumEntries; lI++) {
+    if (groupSize[lI] < 2)
+      continue;
+    std::vector<PasswDbEntry*> group;
+    group.reserve(groupSize[lI]);
+    const wchar_t* pFirst = pPasswords + positions[lI];
+    for (word32 lJ = lI; lJ != NONE; lJ = next[lJ]) {
+      // rule out hash collisions
+      if (lJ == lI || wcscmp(pFirst, pPasswords + positions[lJ]) == 0)
+        group.push_back(m_db[entries[lJ]->m_lIndex]);
+    }
+    if (group.size() >= 2)
+      groups.push_back(std::move(group));
+  }
+
+  return groups;
+}
+//---------------------------------------------------------------------------
+std::vector<std::vector<PasswDbEntry*>> PasswDatabase::FindSimilarPassw(
+  word32 lMaxEditDist)
+{
+  CheckDbOpen();
+
+  std::vector<std::vector<PasswDbEntry*>> groups;
+
+  std::vector<const PasswDbEntry*> entries;
+  for (const auto pEntry : m_db) {
+    if (!pEntry->IsPasswEmpty())
+      entries.push_back(pEntry);
+  }
+
+  if (entries.size() < 2)
+    return groups;
+
+  SecureWString sPasswords;
+  auto positions = GetDbEntryPasswBatch(entries, sPasswords);
+
+  PasswSimilarityClusterer clusterer(lMaxEditDist);
+  for (word32 lPos : positions) {
+    const wchar_t* pPassw = sPasswords.c_str() + lPos;
+    clusterer.AddPassw(pPassw, wcslen(pPassw));
+  }
+
+  for (const auto& cluster : clusterer.Cluster()) {
+    std::vector<PasswDbEntry*> group;
+    group.reserve(cluster.size());
+    for (word32 lI : cluster)
+      group.push_back(m_db[entries[lI]->m_lIndex]);
+    groups.push_back(std::move(group));
+  }
+
+  return groups;
 }
 //---------------------------------------------------------------------------
 void PasswDatabase::SetPlaintextPassw(bool blPlaintextPassw)
@@ -1482,6 +3322,7 @@ void PasswDatabase::ChangeMasterKey(const SecureMem<word8>& newKey,
   }
   if (!(pCancelFlag && *pCancelFlag)) {
     m_lKdfIterations = lKdfIterOverride;
+    m_blFullSaveRequired = true;
   }
 }
 //---------------------------------------------------------------------------
@@ -1495,6 +3336,7 @@ void PasswDatabase::SetRecoveryKey(const SecureMem<word8>& key,
   CheckKeyEmpty(recoveryKey);
 
   m_blRecoveryKey = true;
+  m_blFullSaveRequired = true;
 
   RandomPool::GetInstance().GetData(m_pDbKey, DB_KEY_LENGTH);
 
@@ -1561,16 +3403,16 @@ void PasswDatabase::ExportToCsv(const WString& sFileName, int nColMask,
           sField = GetDbEntryPassw(*pEntry).c_str();
           break;
         case PasswDbEntry::CREATIONTIME:
-          sField = pEntry->CreationTimeString.c_str();
+          sField = pEntry->GetCreationTimeString().c_str();
           break;
         case PasswDbEntry::MODIFICATIONTIME:
-          sField = pEntry->ModificationTimeString.c_str();
+          sField = pEntry->GetModificationTimeString().c_str();
           break;
         case PasswDbEntry::PASSWCHANGETIME:
-          sField = pEntry->PasswChangeTimeString.c_str();
+          sField = pEntry->GetPasswChangeTimeString().c_str();
           break;
         case PasswDbEntry::PASSWEXPIRYDATE:
-          sField = pEntry->PasswExpiryDateString.c_str();
+          sField = pEntry->GetPasswExpiryDateString().c_str();
           break;
         case PasswDbEntry::PASSWHISTORY:
           for (const auto& he : pEntry->GetPasswHistory()) {
@@ -1629,27 +3471,28 @@ void PasswDatabase::CreateKeyFile(const WString& sFileName)
 //---------------------------------------------------------------------------
 SecureMem<word8> PasswDatabase::GetKeyFromKeyFile(const WString& sFileName)
 {
-  std::unique_ptr<TFileStream> pFile(new TFileStream(sFileName, fmOpenRead));
-  if (pFile->Size == 0)
+  MappedFile file(sFileName);
+  if (file.Size() == 0)
     throw EPasswDbError("Key file is empty");
 
   SecureMem<word8> key(DB_KEY_LENGTH);
 
+  // small files are contained completely in the first view
+  word32 lLen;
+  const word8* pData = file.ReadNext(lLen);
+
   // read contents as-is if file size equals key size
-  if (pFile->Size == DB_KEY_LENGTH) {
-    pFile->Read(key, key.Size());
+  if (file.Size() == DB_KEY_LENGTH && lLen == DB_KEY_LENGTH) {
+    memcpy(key, pData, DB_KEY_LENGTH);
     return key;
   }
 
   // check if file contains key in hexadecimal format
-  if (pFile->Size == 2 * DB_KEY_LENGTH) {
-    SecureMem<word8> hexKey(2 * DB_KEY_LENGTH);
-    pFile->Read(hexKey, hexKey.Size());
-
+  if (file.Size() == 2 * DB_KEY_LENGTH && lLen == 2 * DB_KEY_LENGTH) {
     word32 i;
     word8 hiPart, c;
-    for (i = 0; i < hexKey.Size(); i++) {
-      c = hexKey[i];
+    for (i = 0; i < lLen; i++) {
+      c = pData[i];
       if (c >= '0' && c <= '9')
         c -= '0';
       else if (c >= 'A' && c <= 'F')
@@ -1664,21 +3507,17 @@ SecureMem<word8> PasswDatabase::GetKeyFromKeyFile(const WString& sFileName)
     }
 
     hiPart = c = 0;
-    if (i == hexKey.Size())
+    if (i == lLen)
       return key;
-
-    // return to beginning of file
-    pFile->Seek(0, soFromBeginning);
   }
 
   // calculate hash of file contents
   SecureMem<sha256_context> hashCtx(1);
   sha256_init(hashCtx);
   sha256_starts(hashCtx, 0);
-  SecureMem<word8> buf(1024);
-  int nBytesRead;
-  while ((nBytesRead = pFile->Read(buf, buf.Size())) != 0) {
-    sha256_update(hashCtx, buf, nBytesRead);
+  while (pData != nullptr) {
+    sha256_update(hashCtx, pData, lLen);
+    pData = file.ReadNext(lLen);
   }
   sha256_finish(hashCtx, key);
 
@@ -24,6 +24,9 @@
 #include <vector>
 #include <memory>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <functional>
 #include <Classes.hpp>
 #include "UnicodeUtil.h"
 #include "SecureMem.h"
@@ -31,7 +34,202 @@
 #include "SymmetricCipher.h"
 #include "RandomGenerator.h"
 
-// class for password database entry
+class PasswDatabase;
+class PasswDbEntry;
+
+// table of interned strings shared by all entries of a database;
+// strings are reference-counted and identified by 32-bit IDs
+class PasswDbStringTable {
+public:
+  enum : word32 {
+    npos = static_cast<word32>(-1)
+  };
+
+  // add reference to string; string is inserted if it does not exist yet
+  // -> string
+  // <- string ID
+  word32 AddRef(const SecureWString& sStr);
+
+  // add reference to string with the given ID
+  void AddRef(word32 lId)
+  {
+    m_items[lId].RefCount++;
+  }
+
+  // release reference to string; string is removed if it is no longer
+  // referenced, its ID may be reused afterwards
+  void Release(word32 lId);
+
+  // find string
+  // -> string
+  // <- string ID, npos if string does not exist
+  word32 Find(const SecureWString& sStr) const;
+
+  // get string with the given ID
+  const SecureWString& Get(word32 lId) const
+  {
+    return m_items[lId].It->first;
+  }
+
+  // get number of references to string
+  word32 GetRefCount(word32 lId) const
+  {
+    return m_items[lId].RefCount;
+  }
+
+  // get upper bound of string IDs
+  word32 GetIdRange(void) const
+  {
+    return m_items.size();
+  }
+
+  void Clear(void);
+
+private:
+  using Index = std::map<SecureWString,word32>;
+
+  struct Item {
+    Index::const_iterator It;
+    word32 RefCount;
+  };
+
+  Index m_index;
+  std::vector<Item> m_items;
+  std::vector<word32> m_freeIds;
+};
+
+// set of entry indices; indices are grouped into blocks of 65536, each block
+// being stored either as sorted array of 16-bit values or as bitmap,
+// depending on the number of indices in the block
+class PasswDbIndexSet {
+public:
+  PasswDbIndexSet()
+    : m_lCount(0)
+  {}
+
+  // add index to set
+  void Add(word32 lIndex);
+
+  // remove index from set
+  void Remove(word32 lIndex);
+
+  // check if index is contained in set
+  bool Contains(word32 lIndex) const;
+
+  // get number of indices in set
+  word32 GetCount(void) const
+  {
+    return m_lCount;
+  }
+
+  bool IsEmpty(void) const
+  {
+    return m_lCount == 0;
+  }
+
+  void Clear(void)
+  {
+    m_blocks.clear();
+    m_lCount = 0;
+  }
+
+  // add all indices of the set to a plain bitmap
+  // -> bitmap (one bit per index, indices beyond its size are ignored)
+  void AddToBitmap(std::vector<word64>& bitmap) const;
+
+  // count indices contained both in the set and in a plain bitmap
+  // -> bitmap (one bit per index)
+  // <- number of indices in the intersection
+  word32 CountIntersection(const std::vector<word64>& bitmap) const;
+
+private:
+  enum {
+    BLOCK_BITS = 16,
+    BITMAP_WORDS = (1 << BLOCK_BITS) / 64,
+    MAX_ARRAY_SIZE = 4096 // array requires less memory than bitmap
+  };
+
+  struct Block {
+    word16 Key;                 // upper 16 bits of the indices
+    word32 Count;
+    std::vector<word16> Array;  // used if Bitmap is empty
+    std::vector<word64> Bitmap;
+  };
+
+  std::vector<Block> m_blocks;
+  word32 m_lCount;
+};
+
+// tag table of a database combined with the sets of entries carrying each
+// tag; the sets are updated whenever tags are added to or removed from an
+// entry or entries are renumbered, and only rebuilt after all entries have
+// been replaced (e.g., when replaying the journal)
+class PasswDbTagIndex {
+public:
+  PasswDbTagIndex()
+    : m_blValid(true)
+  {}
+
+  // get table of tag strings
+  PasswDbStringTable& GetTable(void)
+  {
+    return m_table;
+  }
+
+  const PasswDbStringTable& GetTable(void) const
+  {
+    return m_table;
+  }
+
+  // add tag to entry
+  // -> tag
+  // -> index of entry
+  // <- tag ID
+  word32 AddRef(const SecureWString& sTag, word32 lIndex);
+
+  // add tag with the given ID to entry
+  void AddRef(word32 lTagId, word32 lIndex);
+
+  // remove tag with the given ID from entry
+  void Release(word32 lTagId, word32 lIndex);
+
+  // get entries carrying the tag with the given ID
+  const PasswDbIndexSet& GetEntries(word32 lTagId) const;
+
+  // check if entry sets are up-to-date
+  bool IsValid(void) const
+  {
+    return m_blValid;
+  }
+
+  // update entry sets after entries have been renumbered
+  // -> renumbered entries together with their previous indices
+  void Renumber(
+    const std::vector<std::pair<const PasswDbEntry*,word32>>& renumbered);
+
+  // mark entry sets as outdated, e.g. after all entries have been replaced
+  void Invalidate(void)
+  {
+    m_blValid = false;
+    m_entries.clear();
+  }
+
+  // rebuild entry sets from the tag IDs of all entries
+  void Rebuild(const std::vector<PasswDbEntry*>& db);
+
+  void Clear(void);
+
+private:
+  PasswDbStringTable m_table;
+  std::vector<PasswDbIndexSet> m_entries; // indexed by tag ID
+  bool m_blValid;
+};
+
+// class for password database entry;
+// only tags are interned (see PasswDbTagIndex), whereas user names and the
+// fixed-size fields (timestamps, expiry date, flags) are still stored in
+// each entry: the UI edits these members in place and list view items point
+// to entries, so the entries are not arranged in a columnar layout
 class PasswDbEntry {
 public:
   friend class PasswDatabase;
@@ -138,10 +336,6 @@ public:
   };
 
   SecureWString Strings[NUM_STRING_FIELDS];
-  SecureWString CreationTimeString;
-  SecureWString ModificationTimeString;
-  SecureWString PasswChangeTimeString;
-  SecureWString PasswExpiryDateString;
   FILETIME CreationTime;
   FILETIME ModificationTime;
   FILETIME PasswChangeTime;
@@ -149,8 +343,15 @@ public:
   word32 UserFlags;
   int UserTag;
 
+  // entries are owned by the database and must not be copied, since the
+  // copy would also release the tag references of the original
+  PasswDbEntry(const PasswDbEntry& other) = delete;
+  PasswDbEntry& operator= (const PasswDbEntry& other) = delete;
+
   ~PasswDbEntry()
   {
+    for (word32 lTagId : m_tagIds)
+      m_pTagIndex->Release(lTagId, m_lIndex);
     memzero(&CreationTime, sizeof(CreationTime));
     memzero(&ModificationTime, sizeof(ModificationTime));
     PasswExpiryDate = 0;
@@ -189,13 +390,29 @@ public:
     SYSTEMTIME st;
     GetLocalTime(&st);
     SystemTimeToFileTime(&st, &ModificationTime);
-    ModificationTimeString = TimeStampToString(ModificationTime);
-    if (blPasswChanged) {
+    if (blPasswChanged)
       PasswChangeTime = ModificationTime;
-      PasswChangeTimeString = ModificationTimeString;
-    }
   }
 
+  // timestamps and expiry date formatted as strings; strings are formatted
+  // on first access and again whenever the underlying value has changed
+  const SecureWString& GetCreationTimeString(void) const
+  {
+    return GetTimeStampString(CreationTime, m_timeStrings[0]);
+  }
+
+  const SecureWString& GetModificationTimeString(void) const
+  {
+    return GetTimeStampString(ModificationTime, m_timeStrings[1]);
+  }
+
+  const SecureWString& GetPasswChangeTimeString(void) const
+  {
+    return GetTimeStampString(PasswChangeTime, m_timeStrings[2]);
+  }
+
+  const SecureWString& GetPasswExpiryDateString(void) const;
+
   // access to key-value list
   const KeyValueList& GetKeyValueList(void) const
   {
@@ -229,21 +446,95 @@ public:
     Strings[KEYVALUELIST] = GetKeyValueListAsString(',');
   }
 
-  // get/set list of tags
-  const std::set<SecureWString>& GetTagList(void) const
+  // list of tags; tags are stored as IDs referring to the tag table of the
+  // database, in the same order as in a std::set<SecureWString>
+  class TagList {
+  public:
+    class const_iterator {
+    public:
+      const_iterator(std::vector<word32>::const_iterator it,
+        const PasswDbStringTable* pTable)
+        : m_it(it), m_pTable(pTable)
+      {}
+
+      const SecureWString& operator*() const
+      {
+        return m_pTable->Get(*m_it);
+      }
+
+      const SecureWString* operator->() const
+      {
+        return &m_pTable->Get(*m_it);
+      }
+
+      const_iterator& operator++()
+      {
+        ++m_it;
+        return *this;
+      }
+
+      bool operator==(const const_iterator& other) const
+      {
+        return m_it == other.m_it;
+      }
+
+      bool operator!=(const const_iterator& other) const
+      {
+        return m_it != other.m_it;
+      }
+
+    private:
+      std::vector<word32>::const_iterator m_it;
+      const PasswDbStringTable* m_pTable;
+    };
+
+    TagList(const std::vector<word32>& ids, const PasswDbStringTable* pTable)
+      : m_ids(ids), m_pTable(pTable)
+    {}
+
+    word32 size(void) const
+    {
+      return m_ids.size();
+    }
+
+    bool empty(void) const
+    {
+      return m_ids.empty();
+    }
+
+    const_iterator begin(void) const
+    {
+      return const_iterator(m_ids.begin(), m_pTable);
+    }
+
+    const_iterator end(void) const
+    {
+      return const_iterator(m_ids.end(), m_pTable);
+    }
+
+  private:
+    const std::vector<word32>& m_ids;
+    const PasswDbStringTable* m_pTable;
+  };
+
+  // get list of tags
+  TagList GetTagList(void) const
   {
-    return m_tags;
+    return TagList(m_tagIds, &m_pTagIndex->GetTable());
   }
 
-  void SetTagList(const std::set<SecureWString>& tags)
+  // get IDs of tags (see PasswDatabase::GetTagTable())
+  const std::vector<word32>& GetTagIds(void) const
   {
-    m_tags = tags;
-    UpdateTagsString();
+    return m_tagIds;
   }
 
   // check if specified tag is available
   bool CheckTag(const SecureWString& sTag) const;
 
+  // check if tag with the specified ID is available
+  bool CheckTagId(word32 lTagId) const;
+
   // add tag to entry
   // <- 'true' if tag was added successfully, 'false' if tag already exists
   bool AddTag(const SecureWString& sTag);
@@ -258,25 +549,32 @@ public:
   }
 
   // clear (empty) list of tags
-  void ClearTagList(void)
-  {
-    m_tags.clear();
-    Strings[TAGS].Clear();
-  }
+  void ClearTagList(void);
 
+  // password history is kept in serialized form after loading the database
+  // and decoded on first access
   PasswHistory& GetPasswHistory(void)
   {
+    DecodePasswHistory();
     return m_passwHistory;
   }
 
   const PasswHistory& GetPasswHistory(void) const
   {
+    DecodePasswHistory();
     return m_passwHistory;
   }
 
+  // get number of history entries without decoding the history
+  word32 GetPasswHistorySize(void) const
+  {
+    return (m_pHistorySrc != nullptr) ? m_historyRef.Count :
+      m_passwHistory.GetSize();
+  }
+
   void AddCurrentPasswToHistory(const SecureWString& sPassw)
   {
-    m_passwHistory.AddEntry({ PasswChangeTime, sPassw });
+    GetPasswHistory().AddEntry({ PasswChangeTime, sPassw });
   }
 
   // convert timestamp to string using Windows API
@@ -294,6 +592,9 @@ public:
     return nYear > 0 && nMonth >= 1 && nMonth <= 12 && nDay >= 1 && nDay <= 31;
   }
 
+  // check if 32-bit expiry date represents a valid calendar date
+  static bool CheckExpiryDate(word32 lDate);
+
   // encode year/month/date specification into 32-bit expiry date
   static word32 EncodeExpiryDate(int nYear, int nMonth, int nDay)
   {
@@ -305,29 +606,57 @@ public:
 
 private:
   // private constructor
+  // -> tag index of the database
   // -> unique 32-bit identifier
   // -> index of entry within database
   // -> 'true': set "creation" and "last modification" timestamps
-  PasswDbEntry(word32 lId, word32 lIndex, bool blSetTimeStamps,
-    word32 lMaxPasswHistorySize, bool blPasswHistoryActive)
-    : m_lId(lId), m_lIndex(lIndex), m_passwHash(20), UserFlags(0), UserTag(0),
-    PasswExpiryDate(0), m_passwHistory(lMaxPasswHistorySize, blPasswHistoryActive)
-  {
-    if (blSetTimeStamps) {
-      SYSTEMTIME st;
-      GetLocalTime(&st);
-      SystemTimeToFileTime(&st, &CreationTime);
-      CreationTimeString = TimeStampToString(CreationTime);
-      ModificationTime = CreationTime;
-      ModificationTimeString = CreationTimeString;
-    }
-    else {
-      CreationTime.dwLowDateTime = CreationTime.dwHighDateTime = 0;
-      ModificationTime.dwLowDateTime = ModificationTime.dwHighDateTime = 0;
-    }
-    PasswChangeTime.dwLowDateTime = PasswChangeTime.dwHighDateTime = 0;
+  PasswDbEntry(PasswDbTagIndex* pTagIndex, word32 lId, word32 lIndex,
+    bool blSetTimeStamps, word32 lMaxPasswHistorySize,
+    bool blPasswHistoryActive);
+
+  // check if entry has been changed since the last time the database was
+  // saved (either explicitly marked or modification timestamp updated)
+  bool IsChangedSinceSave(void) const
+  {
+    return m_blChanged ||
+      m_savedModificationTime.dwLowDateTime != ModificationTime.dwLowDateTime ||
+      m_savedModificationTime.dwHighDateTime != ModificationTime.dwHighDateTime;
+  }
+
+  // reset change state after entry has been saved
+  void ResetChangeState(void)
+  {
+    m_blChanged = false;
+    m_savedModificationTime = ModificationTime;
   }
 
+  // cached string representation of a timestamp
+  struct TimeStampString {
+    word64 Value = 0; // value from which the string was formatted
+    SecureWString Str;
+  };
+
+  // location of a serialized password history in the arena of the database
+  struct PasswHistoryRef {
+    word32 Pos;
+    word32 Size;
+    word32 Count;
+    word32 BlockSize;
+  };
+
+  // format timestamp if cached string is outdated
+  static const SecureWString& GetTimeStampString(const FILETIME& ft,
+    TimeStampString& cache);
+
+  // decode serialized password history, if available
+  void DecodePasswHistory(void) const
+  {
+    if (m_pHistorySrc != nullptr)
+      DecodePasswHistoryFromSrc();
+  }
+
+  void DecodePasswHistoryFromSrc(void) const;
+
   // parse key-value list specified as string
   void ParseKeyValueList(const SecureWString& sList);
 
@@ -338,10 +667,17 @@ private:
   word32 m_lIndex;
   word32 m_lMaxPasswHistorySize;
   SecureMem<wchar_t> m_encPassw;
-  SecureMem<word8> m_passwHash;
+  SecureMem<word8> m_passwTag; // keyed BLAKE2s tag of password
   std::vector<KeyValue> m_keyValueList;
-  std::set<SecureWString> m_tags;
-  PasswHistory m_passwHistory;
+  PasswDbTagIndex* m_pTagIndex;
+  std::vector<word32> m_tagIds;
+  mutable PasswHistory m_passwHistory;
+  mutable PasswDatabase* m_pHistorySrc;
+  PasswHistoryRef m_historyRef;
+  mutable TimeStampString m_timeStrings[4];
+  word32 m_lPasswStamp; // incremented whenever the password is changed
+  bool m_blChanged;
+  FILETIME m_savedModificationTime;
 };
 
 
@@ -376,8 +712,67 @@ public:
 
 const WString E_INVALID_FORMAT = "Invalid/unknown file format";
 
+// serialized database contents and encryption parameters required for saving
+// the database; once created, it is independent of the database object, so
+// that it can be written by a separate thread
+class PasswDbSnapshot {
+public:
+  // get name of target file
+  const WString& GetFileName(void) const
+  {
+    return m_sFileName;
+  }
+
+private:
+  friend class PasswDatabase;
+
+  PasswDbSnapshot()
+    : m_bCipherType(0), m_lKdfIterations(0), m_blRecoveryKey(false),
+      m_lDataSize(0), m_nVersion(0)
+  {}
+
+  WString m_sFileName;
+  word8 m_bCipherType;
+  word32 m_lKdfIterations;
+  bool m_blRecoveryKey;
+  SecureMem<word8> m_key;
+  SecureMem<word8> m_keyParam; // salt or recovery key block
+  SecureMem<word8> m_iv;
+  SecureMem<word8> m_padding;  // random data for block alignment
+  SecureMem<word8> m_data;
+  word32 m_lDataSize;
+  SecureMem<word8> m_hmac;
+  int m_nVersion;  // format version written to the file
+};
+
+// passwords whose strength is estimated outside of the database object
+// (see PasswDatabase::CreatePasswStrengthJob())
+class PasswStrengthJob {
+public:
+  // get number of passwords to be estimated
+  word32 GetSize(void) const
+  {
+    return m_ids.size();
+  }
+
+private:
+  friend class PasswDatabase;
+
+  PasswStrengthJob()
+    : m_nEstimatorId(-1)
+  {}
+
+  int m_nEstimatorId;
+  std::vector<word32> m_ids;
+  std::vector<word32> m_stamps;
+  std::vector<SecureWString> m_passwords;
+  std::vector<int> m_results;
+};
+
 class PasswDatabase {
 private:
+  friend class PasswDbEntry;
+
   enum class DbOpenState {
     Closed,
     Incomplete, // database could not be opened successfully
@@ -389,6 +784,10 @@ private:
     SECMEM_KEY_LENGTH = 32,
     SECMEM_SALT_LENGTH = 16,
     SECMEM_IV_LENGTH = 8,
+    SECMEM_HASH_KEY_LENGTH = 32,
+
+    PASSW_DIGEST_LENGTH = 16,
+    PASSW_TAG_LENGTH = 16,
 
     DB_KEY_LENGTH = 32,
     DB_SALT_LENGTH = 32,
@@ -404,6 +803,18 @@ private:
   };
 
   PasswDbList m_db;
+  PasswDbTagIndex m_tagIndex;
+  std::map<SecureWString,std::pair<SecureWString,word32>> m_userNames;
+  bool m_blUserNamesValid;
+
+  // cached password strength of an entry
+  struct PasswStrength {
+    word32 Stamp;    // password stamp of the entry at the time of estimation
+    int EntropyBits;
+  };
+
+  std::unordered_map<word32,PasswStrength> m_passwStrengthCache; // key: ID
+  int m_nPasswStrengthEstimator;
   int m_nLastVersion;
   word8 m_bCipherType;
   word32 m_lKdfIterations;
@@ -411,11 +822,15 @@ private:
   word8* m_pSecMem;
   chacha_ctx* m_pMemCipherCtx;
   word8* m_pMemSalt;
+  word8* m_pMemHashKey;
   word8* m_pDbSalt;
   word8* m_pDbKey;
   word8* m_pDbRecoveryKeyBlock;
   SecureMem<word8> m_cryptBuf;
   word32 m_lCryptBufPos;
+  SecureWString m_passwBuf;
+  SecureMem<word8> m_historyArena;
+  word32 m_lHistoryArenaSize;
   std::unique_ptr<TFileStream> m_pFile;
   SecureWString m_sDefaultUserName;
   SecureWString m_sPasswFormatSeq;
@@ -426,6 +841,15 @@ private:
   bool m_blRecoveryKey;
   bool m_blCompressed;
   int m_nCompressionLevel;
+  int m_nCompressionAlgo;
+  WString m_sFileName;
+  SecureMem<word8> m_journalBase;
+  word32 m_lJournalSeq;
+  word32 m_lJournalSize;
+  std::vector<word32> m_deletedIds;
+  bool m_blOrderChanged;
+  bool m_blFullSaveRequired;
+  bool m_blSaveInProgress;
 
   // initializes crypto engine (encryption and hash algorithms),
   // allocates RAM to protect the database master key and passwords
@@ -442,9 +866,19 @@ private:
   // -> cipher type
   // -> pointer to 256-bit key
   // -> cipher mode (encryption/decryption)
-  std::unique_ptr<EncryptionAlgorithm::SymmetricCipher> CreateCipher(
+  static std::unique_ptr<EncryptionAlgorithm::SymmetricCipher> CreateCipher(
     int nType, const word8* pKey, EncryptionAlgorithm::Mode mode);
 
+  // reserve space in the output buffer for writing data directly
+  // -> max. number of bytes to be written
+  // <- pointer to the current write position
+  word8* ReserveWrite(word32 lNumOfBytes);
+
+  // advance write position after data has been written to the buffer
+  // returned by ReserveWrite()
+  // -> number of bytes actually written
+  void CommitWrite(word32 lNumOfBytes);
+
   // write buffer contents to file
   // -> buffer of any type
   // -> number of bytes to write
@@ -474,10 +908,57 @@ private:
   // -> index of field (<0: index not applicable)
   void WriteString(const char* pszStr, word32 lLen = -1, int nIndex = -1);
 
+  // start a field of variable size; the size value is written by EndField()
+  // -> index of field (<0: index not applicable)
+  // <- position of the size value in the output buffer
+  word32 BeginField(int nIndex = -1);
+
+  // finish a field started by BeginField()
+  // -> position of the size value
+  void EndField(word32 lSizePos);
+
+  // transcode Unicode string to UTF-8 directly into the output buffer
+  // -> string buffer (need not be zero-terminated)
+  // -> string length
+  void WriteUtf8(const wchar_t* pwszStr, word32 lLen);
+
+  // write Unicode string to file
+  // -> string buffer
+  // -> string length
+  // -> index of field (<0: index not applicable)
+  void WriteString(const wchar_t* pwszStr, word32 lLen, int nIndex = -1);
+
   // write Unicode string to file
   // -> string
   // -> index of field (<0: index not applicable)
-  void WriteString(const SecureWString& sStr, int nIndex = -1);
+  void WriteString(const SecureWString& sStr, int nIndex = -1)
+  {
+    WriteString(sStr.c_str(), sStr.StrLen(), nIndex);
+  }
+
+  // write key-value list of an entry as "key=value" lines
+  void WriteKeyValueList(const PasswDbEntry& entry);
+
+  // write tags of an entry as separate lines
+  void WriteTags(const PasswDbEntry& entry);
+
+  // estimate size of the serialized database to avoid reallocations
+  word32 EstimateSerializedSize(void) const;
+
+  // read password history items and store them in serialized form in the
+  // memory-encrypted history arena instead of decoding them
+  // -> database entry
+  // -> number of items
+  void ReadPasswHistoryDeferred(PasswDbEntry& entry, word32 lNumOfItems);
+
+  // en-/decrypt part of the history arena
+  // -> position in arena
+  // -> number of bytes
+  // -> destination buffer
+  void CryptHistoryArena(word32 lPos, word32 lSize, word8* pDest);
+
+  // decode password history of an entry from the history arena
+  void DecodePasswHistory(PasswDbEntry& entry);
 
   // read index of field
   int ReadFieldIndex(void);
@@ -517,6 +998,52 @@ private:
   // skip current field
   void SkipField(void);
 
+  // write global database settings (variable parameters)
+  // -> receives flags of parameters written
+  // <- number of parameters written
+  word8 WriteDbParams(word32& lFlags);
+
+  // read global database settings written by WriteDbParams()
+  // -> flags of parameters available
+  // -> number of parameters
+  void ReadDbParams(word32 lFlags, int nNumOfParams);
+
+  // write all fields of a database entry, including "end of entry" mark
+  void WriteDbEntry(const PasswDbEntry& entry);
+
+  // read fields of a database entry up to the "end of entry" mark
+  // -> entry to be filled
+  // -> conversion table: field index in file -> field type
+  void ReadDbEntry(PasswDbEntry& entry, const std::vector<int>& idxConv);
+
+  // replay records from journal file belonging to database file
+  // -> name of database file
+  // -> HMAC of database file
+  void ReplayJournal(const WString& sFileName, const SecureMem<word8>& baseHmac);
+
+  // append record containing all changes since the last save to the journal
+  // -> name of database file
+  // <- 'true' if record was written, 'false' if database file has to be
+  //    rewritten entirely (compaction)
+  bool AppendToJournal(const WString& sFileName);
+
+  // mark current database state as saved
+  void ResetChangeState(void);
+
+  // mark entries by their indices
+  // -> entries
+  // <- flags for all positions in the database
+  std::vector<bool> GetIndexMask(const std::vector<PasswDbEntry*>& entries)
+    const;
+
+  // renumber all entries according to their positions
+  // <- 'true' if any index has changed
+  bool UpdateIndices(void);
+
+  // add user name to/remove user name from the user name index
+  void AddUserNameRef(const SecureWString& sUserName);
+  void ReleaseUserNameRef(const SecureWString& sUserName);
+
   // returns version number of last opened/saved database
   int GetLastVersion(void)
   {
@@ -536,6 +1063,8 @@ private:
     CheckCryptoParam();
     if (bType > CIPHER_CHACHA20)
       throw EPasswDbError("Cipher not supported");
+    if (bType != m_bCipherType)
+      m_blFullSaveRequired = true;
     m_bCipherType = bType;
   }
 
@@ -545,18 +1074,37 @@ private:
     CheckCryptoParam();
     if (lIter == 0)
       throw EPasswDbError("Invalid number of KDF iterations");
+    if (lIter != m_lKdfIterations)
+      m_blFullSaveRequired = true;
     m_lKdfIterations = lIter;
   }
 
   // adds an existing entry from the database file
   PasswDbEntry* AddDbEntry(void);
 
+  // computes keyed tag of plaintext password for integrity checks
+  // -> password
+  // -> password size in bytes
+  // -> buffer receiving the tag (PASSW_TAG_LENGTH bytes)
+  void ComputePasswTag(const void* pPassw, word32 lSize, word8* pTag) const;
+
+  // decrypts password of entry (must not be empty or available as plaintext)
+  // -> database entry
+  // -> destination buffer (size of encrypted password)
+  // -> cipher context to use; the IV is overwritten
+  // <- 'true' if the integrity check succeeded
+  bool DecryptPassw(const PasswDbEntry& entry, wchar_t* pDest,
+    chacha_ctx* pCipherCtx) const;
+
 public:
 
   enum {
     VERSION_HIGH = 1,
-    VERSION_LOW = 5,
+    VERSION_LOW = 6,
     VERSION = (VERSION_HIGH << 8) | VERSION_LOW,
+    // files whose data is not compressed in chunks are written with the
+    // previous version number, so that earlier versions can still read them
+    VERSION_UNCHUNKED = 0x105,
 
     KEY_HASH_ITERATIONS = 16384,
 
@@ -564,6 +1112,10 @@ public:
     CIPHER_CHACHA20 = 1,
 
     COMPRESSION_DEFLATE = 1,
+    COMPRESSION_DEFLATE_CHUNKED = 2, // independent chunks (see WriteSnapshot),
+                                     // version >= 1.6
+    COMPRESSION_LZO1X = 3,           // LZO1X-1 in independent chunks,
+                                     // version >= 1.6
 
     MAX_PASSW_HISTORY_SIZE = 0xff
   };
@@ -592,7 +1144,38 @@ public:
   }
 
   // saves database to file
-  void SaveToFile(const WString& sFileName);
+  // -> name of database file
+  // -> 'true': if the file is the currently opened one, only append the
+  //    changes since the last save to the journal file (the entire database
+  //    is rewritten if the journal exceeds its size or age limit)
+  void SaveToFile(const WString& sFileName, bool blUseJournal = false);
+
+  // saving in separate steps, allowing to encrypt and write the database
+  // file in a separate thread (equivalent to SaveToFile()):
+  // 1) serializes database contents into a snapshot; if the changes could
+  //    be appended to the journal instead, nullptr is returned and no further
+  //    steps are necessary
+  std::unique_ptr<PasswDbSnapshot> CreateSnapshot(const WString& sFileName,
+    bool blUseJournal = false);
+
+  // 2) compresses and encrypts the snapshot and writes it to a temporary
+  //    file; does not access the database object and can be called from
+  //    any thread
+  static void WriteSnapshot(PasswDbSnapshot& snapshot);
+
+  // 3) must be called after WriteSnapshot(), whether successful or not;
+  //    replaces the target file by the temporary file if WriteSnapshot()
+  //    succeeded (the opened database file remains write-protected until
+  //    then); throws an exception if the file cannot be replaced
+  // -> snapshot
+  // -> 'true' if WriteSnapshot() succeeded
+  void CompleteSave(const PasswDbSnapshot& snapshot, bool blSuccess);
+
+  // checks whether a snapshot is currently being saved
+  bool IsSaveInProgress(void) const
+  {
+    return m_blSaveInProgress;
+  }
 
   // release write protection of opened database file
   void ReleaseFile(void)
@@ -600,6 +1183,18 @@ public:
     m_pFile.reset();
   }
 
+  // gets name of temporary file used for saving a database file
+  static WString GetSaveTempFileName(const WString& sFileName)
+  {
+    return sFileName + ".tmp";
+  }
+
+  // gets name of journal file belonging to a database file
+  static WString GetJournalFileName(const WString& sFileName)
+  {
+    return sFileName + ".journal";
+  }
+
   // gets list of database entries
   /*const PasswDbList& GetDatabase(void) const
   {
@@ -612,6 +1207,30 @@ public:
     return m_db.size();
   }
 
+  // gets table of tags used by the database entries
+  const PasswDbStringTable& GetTagTable(void) const
+  {
+    return m_tagIndex.GetTable();
+  }
+
+  // gets tag table together with the sets of entries carrying each tag
+  const PasswDbTagIndex& GetTagIndex(void)
+  {
+    if (!m_tagIndex.IsValid())
+      m_tagIndex.Rebuild(m_db);
+    return m_tagIndex;
+  }
+
+  // changes user name of a given database entry and updates the user name
+  // index accordingly
+  // -> database entry
+  // -> user name
+  void SetDbEntryUserName(PasswDbEntry& entry, const SecureWString& sUserName);
+
+  // gets distinct user names of all entries (case-insensitive), sorted
+  // alphabetically
+  std::vector<SecureWString> GetUserNames(void);
+
   // adds a new entry to the database
   PasswDbEntry* NewDbEntry(void);
 
@@ -624,11 +1243,30 @@ public:
   // removes entry from database
   void DeleteDbEntry(PasswDbEntry& pEntry);
 
+  // removes multiple entries from database in a single pass
+  // -> entries to be removed
+  void DeleteDbEntries(const std::vector<PasswDbEntry*>& entries);
+
   // changes position of an entry within the database
   // -> current position
   // -> desired new position
   void MoveDbEntry(word32 lCurrPos, word32 lNewPos);
 
+  // moves multiple entries as a contiguous block to a new position,
+  // preserving their relative order
+  // -> entries to be moved
+  // -> position of the first entry of the block after moving
+  // <- 'true' if the order of the entries has changed
+  bool MoveDbEntries(const std::vector<PasswDbEntry*>& entries,
+    word32 lNewPos);
+
+  // moves each of the specified entries one position up or down by swapping
+  // it with the nearest neighbor that is not to be moved
+  // -> entries to be moved
+  // -> 'true': move up, 'false': move down
+  // <- 'true' if the order of the entries has changed
+  bool ShiftDbEntries(const std::vector<PasswDbEntry*>& entries, bool blUp);
+
   // changes password of a given database entry
   // -> database entry
   // <- password
@@ -639,6 +1277,69 @@ public:
   // -> database entry
   SecureWString GetDbEntryPassw(const PasswDbEntry& entry);
 
+  // decrypts password of database entry into an existing buffer, which is
+  // only reallocated if it is too small; the buffer may thus be larger than
+  // the zero-terminated password
+  // -> database entry
+  // <- password buffer
+  void GetDbEntryPassw(const PasswDbEntry& entry, SecureWString& sDest);
+
+  // decrypts passwords of multiple entries into a single buffer in one pass;
+  // passwords are stored consecutively as zero-terminated strings; large
+  // batches are decrypted in parallel using private copies of the cipher
+  // context
+  // -> database entries
+  // -> buffer receiving the passwords
+  // <- positions of the passwords in the buffer
+  std::vector<word32> GetDbEntryPasswBatch(
+    const std::vector<const PasswDbEntry*>& entries, SecureWString& sDest);
+
+  // finds entries sharing the same password; passwords are compared by
+  // their hashes keyed with a random session key
+  // <- groups of at least 2 entries with identical passwords, in database
+  //    order
+  std::vector<std::vector<PasswDbEntry*>> FindReusedPassw(void);
+
+  // finds entries with passwords that can be derived from each other by a
+  // few edits (see PasswSimilarityClusterer)
+  // -> max. edit distance between passwords
+  // <- clusters of at least 2 entries with similar passwords, in database
+  //    order
+  std::vector<std::vector<PasswDbEntry*>> FindSimilarPassw(
+    word32 lMaxEditDist);
+
+  // function for estimating the strength of a password in bits;
+  // must be thread-safe
+  typedef std::function<int(const SecureWString&)> PasswStrengthFunc;
+
+  // filling the strength cache in separate steps, allowing to estimate the
+  // passwords in a separate thread:
+  // 1) decrypts all passwords not contained in the strength cache yet;
+  //    returns nullptr if all passwords are cached
+  // -> ID of the estimator; the cache is cleared if it differs from the ID
+  //    used previously (i.e., if a different estimator is used now)
+  std::unique_ptr<PasswStrengthJob> CreatePasswStrengthJob(int nEstimatorId);
+
+  // 2) estimates the passwords in parallel by tasks of the system thread
+  //    pool and wipes them afterwards; does not access the database object
+  //    and can be called from any thread
+  // -> job
+  // -> estimator function
+  static void EstimatePasswStrength(PasswStrengthJob& job,
+    const PasswStrengthFunc& estimate);
+
+  // 3) adds the results to the strength cache (including failed
+  //    estimations, which are not repeated); results of a different
+  //    estimator and of passwords changed in the meantime are ignored
+  // -> job
+  void CompletePasswStrengthJob(const PasswStrengthJob& job);
+
+  // gets cached strength of entry password
+  // -> database entry
+  // <- strength in bits, -1 if password is empty, not cached or could not
+  //    be estimated
+  int GetCachedPasswStrength(const PasswDbEntry& entry) const;
+
   // determines whether passwords of all entries are stored in plaintext
   // or ciphertext format in memory (encrypted with a key stored in RAM)
   void SetPlaintextPassw(bool blPlaintextPassw);
@@ -774,6 +1475,10 @@ public:
   // compression level (0 if uncompressed)
   __property int CompressionLevel =
   { read=m_nCompressionLevel, write=m_nCompressionLevel };
+
+  // compression algorithm (COMPRESSION_DEFLATE or COMPRESSION_LZO1X)
+  __property int CompressionAlgo =
+  { read=m_nCompressionAlgo, write=m_nCompressionAlgo };
 };
 
 
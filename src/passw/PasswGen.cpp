@@ -30,7 +30,8 @@
 #include "Main.h"
 #include "PhoneticTrigram.h"
 #include "Language.h"
-#include "StringFileStreamW.h"
+#include "MappedFile.h"
+#include "PhoneticModel.h"
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
 
@@ -142,15 +143,6 @@ template<class T> inline int strchpos(const T* pStr, T c)
   return -1;
 }
 
-template<class T> inline int strchpos(const T* pStr, int nLen, T c)
-{
-  for (int nI = 0; nI < nLen; nI++) {
-    if (pStr[nI] == c)
-      return nI;
-  }
-  return -1;
-}
-
 template<class T> int removeWhitespace(T* pStr, int nLen)
 {
   if (nLen < 2)
@@ -173,6 +165,12 @@ template<class T> int removeWhitespace(T* pStr, int nLen)
   return nLen;
 }
 
+inline bool isAsciiString(const w32string& sStr)
+{
+  return std::all_of(sStr.begin(), sStr.end(),
+    [](word32 lChar) { return lChar < 0x80; });
+}
+
 
 static w32string s_charSetCodes[PASSWGEN_NUMCHARSETCODES_EXT];
 
@@ -202,20 +200,20 @@ w32string PasswordGenerator::MakeCharSetUnique(const w32string& sSrc,
   const std::vector<w32string>* pAmbigGroups,
   w32string* psRemovedAmbigChars)
 {
-  std::set<word32> chset(sSrc.begin(), sSrc.end());
+  CharSet chset(sSrc);
 
   if (pAmbigGroups != nullptr && pAmbigGroups->size() >= 2) {
     for (auto g_it = pAmbigGroups->begin(); g_it != pAmbigGroups->end(); g_it++)
     {
       int nMatches = 0;
       for (auto it = g_it->begin(); it != g_it->end(); it++) {
-        if (chset.count(*it))
+        if (chset.Contains(*it))
           nMatches++;
       }
 
       if (nMatches >= 2) {
         for (auto it = g_it->begin(); it != g_it->end(); it++) {
-          if (chset.erase(*it) && psRemovedAmbigChars)
+          if (chset.Erase(*it) && psRemovedAmbigChars)
             psRemovedAmbigChars->push_back(*it);
         }
       }
@@ -223,22 +221,19 @@ w32string PasswordGenerator::MakeCharSetUnique(const w32string& sSrc,
   }
   else if (psAmbigChars != nullptr) {
     for (auto it = psAmbigChars->begin(); it != psAmbigChars->end(); it++) {
-      if (chset.erase(*it) && psRemovedAmbigChars)
+      if (chset.Erase(*it) && psRemovedAmbigChars)
         psRemovedAmbigChars->push_back(*it);
     }
   }
 
-//  w32string y(chset.begin(),chset.end());
-//  WString x=W32StringToWString(y);
-
-  return w32string(chset.begin(), chset.end());
+  return chset.Chars();
 }
 //---------------------------------------------------------------------------
 w32string PasswordGenerator::CreateSetOfAmbiguousChars(
   const w32string& sAmbigChars,
   std::vector<w32string>& ambigGroups)
 {
-  std::set<word32> chset;
+  CharSet chset;
   std::vector<w32string> groups;
   int nSepPos;
 
@@ -254,21 +249,18 @@ w32string PasswordGenerator::CreateSetOfAmbiguousChars(
           groups.push_back(sGroup);
         sGroup.clear();
       }
-      else {
-        auto ret = chset.insert(*it);
-        if (ret.second)
-          sGroup.push_back(*it);
-      }
+      else if (chset.Insert(*it))
+        sGroup.push_back(*it);
     }
     while (it++ != sAmbigChars.end());
   }
   else
-    chset.insert(sAmbigChars.begin(), sAmbigChars.end());
+    chset.Insert(sAmbigChars);
 
   if (groups.size() >= 2)
     ambigGroups = groups;
 
-  return w32string(chset.begin(), chset.end());
+  return chset.Chars();
 }
 //---------------------------------------------------------------------------
 std::optional<std::pair<w32string,CharSetType>> PasswordGenerator::ParseCharSet(
@@ -663,13 +655,12 @@ WString PasswordGenerator::SetupCharSets(const WString& sCustomChars,
       {
         m_dCustomCharSetEntropy = Log2(static_cast<double>(
           m_sCustomCharSet.length())); // rough estimate
-        std::set<word32> chset;
+        CharSet chset;
         int nUniqueSize = 0;
         for (const auto& p : m_customCharSetFreq.value()) {
           int nCurrSize = 0;
           for (auto ch : p.first) {
-            auto ret = chset.insert(ch);
-            if (ret.second && ++nCurrSize == p.second)
+            if (chset.Insert(ch) && ++nCurrSize == p.second)
               break;
           }
           nUniqueSize += nCurrSize;
@@ -701,6 +692,9 @@ WString PasswordGenerator::SetupCharSets(const WString& sCustomChars,
     }
   }
 
+  for (int i = 0; i < PASSWGEN_NUMINCLUDECHARSETS; i++)
+    m_includeCharSetsLookup[i] = CharSet(m_includeCharSets[i]);
+
   for (int i = 0; i < PASSWGEN_NUMFORMATCHARSETS; i++)
     m_formatCharSets[i] = AsciiCharToW32String(CHARSET_FORMAT[i]);
 
@@ -725,14 +719,36 @@ WString PasswordGenerator::SetupCharSets(const WString& sCustomChars,
   if (blDetermineSubsets) {
     for (int i = 0; i < PASSWGEN_NUMINCLUDECHARSETS; i++) {
       w32string sSubset;
-      size_t pos = 0;
-      while ((pos = m_sCustomCharSet.find_first_of(m_includeCharSets[i], pos))
-               != w32string::npos)
-        sSubset.push_back(m_sCustomCharSet[pos++]);
+      for (word32 lChar : m_sCustomCharSet) {
+        if (m_includeCharSetsLookup[i].Contains(lChar))
+          sSubset.push_back(lChar);
+      }
       m_customSubsets[i] = sSubset;
+      m_customSubsetsLookup[i] = CharSet(sSubset);
     }
   }
 
+  // check character sets for the 8-bit code paths of the generators
+  m_blCustomCharSetAscii = isAsciiString(m_sCustomCharSet);
+  if (m_blCustomCharSetAscii && m_customCharSetFreq) {
+    for (const auto& p : m_customCharSetFreq.value()) {
+      if (!isAsciiString(p.first)) {
+        m_blCustomCharSetAscii = false;
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < PASSWGEN_NUMINCLUDECHARSETS; i++) {
+    if (!isAsciiString(m_includeCharSets[i]))
+      m_blCustomCharSetAscii = false;
+  }
+
+  m_lFormatCharSetsAscii = 0;
+  for (int i = 0; i < PASSWGEN_NUMFORMATCHARSETS; i++) {
+    if (isAsciiString(m_formatCharSets[i]))
+      m_lFormatCharSetsAscii |= 1 << i;
+  }
+
   return sCustomCharSet;
 }
 //---------------------------------------------------------------------------
@@ -752,8 +768,7 @@ int PasswordGenerator::LoadWordListFile(WString sFileName,
     std::vector<std::wstring> wordListVec;
 
     try {
-      auto pFile = std::make_unique<TStringFileStreamW>(
-          sFileName, fmOpenRead, ceAnsi, true, 65536, "\n\t ");
+      MappedTextReader file(sFileName, ceAnsi, "\n\t ");
 
       const int WORDBUF_SIZE = 1024;
       wchar_t wszWord[WORDBUF_SIZE];
@@ -761,7 +776,7 @@ int PasswordGenerator::LoadWordListFile(WString sFileName,
       nMaxWordLen = std::max(nMinWordLen, nMaxWordLen);
       int nWordLen;
 
-      while ((nWordLen = pFile->ReadString(wszWord, WORDBUF_SIZE)) > 0 &&
+      while ((nWordLen = file.ReadString(wszWord, WORDBUF_SIZE)) > 0 &&
         wordListVec.size() < WORDLIST_MAX_SIZE)
       {
         WString sWord = WString(wszWord, nWordLen).Trim();
@@ -793,6 +808,13 @@ int PasswordGenerator::LoadWordListFile(WString sFileName,
       return 0;
 
     m_wordList.swap(wordListVec);
+
+    m_blWordListAscii = std::all_of(m_wordList.begin(), m_wordList.end(),
+      [](const std::wstring& sWord)
+      {
+        return std::all_of(sWord.begin(), sWord.end(),
+          [](wchar_t ch) { return ch < 0x80; });
+      });
   }
   else if (!m_wordList.empty()) {
     m_wordList.clear();
@@ -804,13 +826,39 @@ int PasswordGenerator::LoadWordListFile(WString sFileName,
     m_wordList.swap(temp);
   }
 
+  if (m_wordList.empty())
+    m_blWordListAscii = true; // default word list
+
   m_nWordListSize = nNumOfWords;
   m_dWordListEntropy = Log2(static_cast<double>(nNumOfWords));
 
   return nNumOfWords;
 }
 //---------------------------------------------------------------------------
-int PasswordGenerator::GetPassword(SecureW32String& sDest,
+template<class T> int PasswordGenerator::GetWordImpl(int nIndex,
+  SecureMem<T>& sWord) const
+{
+  if constexpr (std::is_same<T, word32>::value) {
+    if (m_wordList.empty())
+      return AsciiCharToW32Char(getDiceWd(nIndex), sWord);
+    return WCharToW32Char(m_wordList[nIndex].c_str(), sWord);
+  }
+  else {
+    int nLen = 0;
+    if (m_wordList.empty()) {
+      for (const char* p = getDiceWd(nIndex); *p != '\0'; p++)
+        sWord[nLen++] = *p;
+    }
+    else {
+      for (wchar_t ch : m_wordList[nIndex])
+        sWord[nLen++] = static_cast<T>(ch);
+    }
+    sWord[nLen] = '\0';
+    return nLen;
+  }
+}
+//---------------------------------------------------------------------------
+template<class T> int PasswordGenerator::GetPasswordImpl(SecureMem<T>& sDest,
   int nLength,
   int nFlags) const
 {
@@ -818,7 +866,7 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
     return 0;
 
   word32 lChar;
-  std::unique_ptr<std::set<word32>> pPasswCharSet;
+  CharSet passwCharSet;
 
   if (static_cast<word32>(nLength + 1) < sDest.Size())
     sDest.New(nLength + 1);
@@ -841,7 +889,7 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
     for (auto& p : charSetFreq) {
       for (int i = 0; i < p.second && !p.first.empty() && nPos < nLength; i++) {
         lChar = p.first[m_pRandGen->GetNumRange(p.first.length())];
-        sDest[nPos++] = lChar;
+        sDest[nPos++] = static_cast<T>(lChar);
         if ((nFlags & PASSW_FLAG_EACHCHARONLYONCE) && nPos < nLength) {
           for (int j = nItemIdx; j < charSetFreq.size(); j++) {
             //removeChar(charSetFreq[j].first, lChar);
@@ -869,13 +917,14 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
 
     nLength = nPos;
     if (nLength >= 2)
-      m_pRandGen->Permute<word32>(sDest, nLength);
+      m_pRandGen->Permute<T>(sDest, nLength);
+
+    if (nFlags & PASSW_FLAG_EACHCHARONLYONCE) {
+      for (int nI = 0; nI < nLength; nI++)
+        passwCharSet.Insert(sDest[nI]);
+    }
   }
   else {
-    if ((nFlags & PASSW_FLAG_EACHCHARONLYONCE) &&
-        (nFlags & PASSW_FLAG_CHECKDUPLICATESBYSET))
-      pPasswCharSet.reset(new std::set<word32>);
-
     int nSetSize = m_sCustomCharSet.length();
     for (int nI = 0; nI < nLength; ) {
       lChar = m_sCustomCharSet[m_pRandGen->GetNumRange(nSetSize)];
@@ -883,17 +932,12 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
         && lChar >= 'a' && lChar <= 'z')
         continue;
       if (nFlags & PASSW_FLAG_EACHCHARONLYONCE) {
-        if (pPasswCharSet) {
-          auto ret = pPasswCharSet->insert(lChar);
-          if (!ret.second)
-            continue;
-        }
-        else if (nI > 0 && strchpos(sDest.begin(), nI, lChar) >= 0)
+        if (!passwCharSet.Insert(lChar))
           continue;
       }
       else if (nI > 0 && nFlags & PASSW_FLAG_EXCLUDEREPCHARS && lChar == sDest[nI-1])
         continue;
-      sDest[nI++] = lChar;
+      sDest[nI++] = static_cast<T>(lChar);
     }
   }
 
@@ -903,6 +947,8 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
     SecureMem<int> randPerm(PASSWGEN_NUMINCLUDECHARSETS);
     const w32string* psCharSets = (nFlags & PASSW_FLAG_INCLUDESUBSET) ?
       m_customSubsets : m_includeCharSets;
+    const CharSet* pCharSetsLookup = (nFlags & PASSW_FLAG_INCLUDESUBSET) ?
+      m_customSubsetsLookup : m_includeCharSetsLookup;
 
     int nRand;
     for (int nI = 0, nJ = 0; nI < PASSWGEN_NUMINCLUDECHARSETS && nJ < nLength; nI++) {
@@ -933,24 +979,22 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
 
       randPerm[nJ++] = nRand;
 
-      if (psCharSets[nI].find(sDest[nRand]) != w32string::npos)
+      if (pCharSetsLookup[nI].Contains(sDest[nRand]))
         continue;
 
-      if (nFlags & PASSW_FLAG_EACHCHARONLYONCE &&
-        psCharSets[nI].find_first_not_of(sDest) == w32string::npos)
-        continue;
+      if (nFlags & PASSW_FLAG_EACHCHARONLYONCE) {
+        if (passwCharSet.ContainsAll(psCharSets[nI].c_str(),
+            psCharSets[nI].length()))
+          continue;
+        // the character to be replaced is free again
+        passwCharSet.Erase(sDest[nRand]);
+      }
 
       int nSetSize = psCharSets[nI].length();
       while (true) {
         lChar = psCharSets[nI][m_pRandGen->GetNumRange(nSetSize)];
         if (nFlags & PASSW_FLAG_EACHCHARONLYONCE) {
-          if (pPasswCharSet) {
-            std::pair<std::set<word32>::iterator, bool> ret =
-              pPasswCharSet->insert(lChar);
-            if (!ret.second)
-              continue;
-          }
-          else if (strchpos(sDest.begin(), nLength, lChar) >= 0)
+          if (!passwCharSet.Insert(lChar))
             continue;
         }
         else if (nFlags & PASSW_FLAG_EXCLUDEREPCHARS && nSetSize >= 3) {
@@ -961,13 +1005,14 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
         }
         break;
       }
-      sDest[nRand] = lChar;
+      sDest[nRand] = static_cast<T>(lChar);
     }
 
     nRand = 0;
   }
 
   lChar = 0;
+  passwCharSet.Clear();
 
 #if 0 //ifdef _DEBUG
   if (nFlags & (PASSW_FLAG_EACHCHARONLYONCE | PASSW_FLAG_EXCLUDEREPCHARS)) {
@@ -997,9 +1042,23 @@ int PasswordGenerator::GetPassword(SecureW32String& sDest,
   return nLength;
 }
 //---------------------------------------------------------------------------
-int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
+int PasswordGenerator::GetPassword(SecureW32String& sDest,
+  int nLength,
+  int nFlags) const
+{
+  return GetPasswordImpl(sDest, nLength, nFlags);
+}
+//---------------------------------------------------------------------------
+int PasswordGenerator::GetPassword(SecureAnsiString& sDest,
+  int nLength,
+  int nFlags) const
+{
+  return GetPasswordImpl(sDest, nLength, nFlags);
+}
+//---------------------------------------------------------------------------
+template<class T> int PasswordGenerator::GetPassphraseImpl(SecureMem<T>& sDest,
   int nWords,
-  const word32* pChars,
+  const T* pChars,
   int nCharsLen,
   int nFlags,
   int* pnNetWordsLen) const
@@ -1007,6 +1066,10 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
   if (nWords < 1)
     return 0;
 
+  const std::basic_string<T> sWordSep(m_sWordSep.begin(), m_sWordSep.end());
+  const std::basic_string<T> sWordCharSep(m_sWordCharSep.begin(),
+    m_sWordCharSep.end());
+
   //int nCharsLen = (pChars != nullptr) ? w32strlen(pChars) : 0;
   //int nLength = 0;
   word32 lPos = 0;
@@ -1020,10 +1083,10 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
       //nLength = nCharsLen;
       //pDest[nLength++] = ' ';
       sDest.StrCat(pChars, nCharsLen, lPos);
-      if (m_sWordSep.empty())
+      if (sWordSep.empty())
         sDest.StrCat(' ', lPos);
       else
-        sDest.StrCat(m_sWordSep.c_str(), m_sWordSep.length(), lPos);
+        sDest.StrCat(sWordSep.c_str(), sWordSep.length(), lPos);
     }
   }
 
@@ -1031,7 +1094,7 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
   const int nCharsPerWord = (nCharsLen > 0) ? nCharsLen / nWords : 0;
   const int nCharsRest = (nCharsLen > 0) ? nCharsLen % nWords : 0;
   int nCharsPos = 0;
-  SecureW32String sWord(WORDLIST_MAX_WORDLEN + 1);
+  SecureMem<T> sWord(WORDLIST_MAX_WORDLEN + 1);
   std::unique_ptr<std::set<int>> pUniqueWordIdx;
 
   if (nFlags & PASSPHR_FLAG_EACHWORDONLYONCE)
@@ -1048,11 +1111,7 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
         continue;
     }
 
-    int nWordLen;
-    if (m_wordList.empty())
-      nWordLen = AsciiCharToW32Char(getDiceWd(nRand), sWord);
-    else
-      nWordLen = WCharToW32Char(m_wordList[nRand].c_str(), sWord);
+    int nWordLen = GetWordImpl(nRand, sWord);
 
     if (nFlags & PASSPHR_FLAG_CAPITALIZEWORDS)
       sWord[0] = toupper(sWord[0]);
@@ -1068,14 +1127,14 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
         sDest.StrCat(pChars + nCharsPos, nToCopy, lPos);
 
         if (!(nFlags & PASSPHR_FLAG_DONTSEPWCH)) {
-          if (m_sWordCharSep.empty())
+          if (sWordCharSep.empty())
             //pDest[nLength++] = '-';
             sDest.StrCat('-', lPos);
           else {
             //memcpy(pDest + nLength, m_sWordCharSep.c_str(),
             //  m_sWordCharSep.length() * sizeof(word32));
             //nLength += m_sWordCharSep.length();
-            sDest.StrCat(m_sWordCharSep.c_str(), m_sWordCharSep.length(), lPos);
+            sDest.StrCat(sWordCharSep.c_str(), sWordCharSep.length(), lPos);
           }
         }
 
@@ -1089,14 +1148,14 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
         sDest.StrCat(sWord, lPos);
 
         if (!(nFlags & PASSPHR_FLAG_DONTSEPWCH)) {
-          if (m_sWordCharSep.empty())
+          if (sWordCharSep.empty())
             //pDest[nLength++] = '-';
             sDest.StrCat('-', lPos);
           else {
             //memmcpy(pDest + nLength, m_sWordCharSep.c_str(),
             //m_sWordCharSep.length() * sizeof(word32));
             //nLength += m_sWordCharSep.length();
-            sDest.StrCat(m_sWordCharSep.c_str(), m_sWordCharSep.length(), lPos);
+            sDest.StrCat(sWordCharSep.c_str(), sWordCharSep.length(), lPos);
           }
         }
 
@@ -1117,7 +1176,7 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
 
     if (++i < nWords) {
       if (!(nFlags & PASSPHR_FLAG_DONTSEPWORDS)) {
-        if (m_sWordSep.empty()) {
+        if (sWordSep.empty()) {
           //pDest[nLength++] = ' ';
           sDest.StrCat(' ', lPos);
           nNetWordsLen++;
@@ -1126,8 +1185,8 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
           //memcpy(pDest + nLength, m_sWordSep.c_str(),
           //  m_sWordSep.length() * sizeof(word32));
           //nLength += m_sWordSep.length();
-          sDest.StrCat(m_sWordSep.c_str(), m_sWordSep.length(), lPos);
-          nNetWordsLen += m_sWordSep.length();
+          sDest.StrCat(sWordSep.c_str(), sWordSep.length(), lPos);
+          nNetWordsLen += sWordSep.length();
         }
       }
     }
@@ -1137,10 +1196,10 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
     //pDest[nLength++] = ' ';
     //memcpy(pDest + nLength, pChars, nCharsLen * sizeof(word32));
     //nLength += nCharsLen;
-    if (m_sWordSep.empty())
+    if (sWordSep.empty())
       sDest.StrCat(' ', lPos);
     else
-      sDest.StrCat(m_sWordSep.c_str(), m_sWordSep.length(), lPos);
+      sDest.StrCat(sWordSep.c_str(), sWordSep.length(), lPos);
     sDest.StrCat(pChars, nCharsLen, lPos);
   }
 
@@ -1154,10 +1213,32 @@ int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
   return lPos; //nLength;
 }
 //---------------------------------------------------------------------------
-int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
+int PasswordGenerator::GetPassphrase(SecureW32String& sDest,
+  int nWords,
+  const word32* pChars,
+  int nCharsLen,
+  int nFlags,
+  int* pnNetWordsLen) const
+{
+  return GetPassphraseImpl(sDest, nWords, pChars, nCharsLen, nFlags,
+    pnNetWordsLen);
+}
+//---------------------------------------------------------------------------
+int PasswordGenerator::GetPassphrase(SecureAnsiString& sDest,
+  int nWords,
+  const char* pChars,
+  int nCharsLen,
+  int nFlags,
+  int* pnNetWordsLen) const
+{
+  return GetPassphraseImpl(sDest, nWords, pChars, nCharsLen, nFlags,
+    pnNetWordsLen);
+}
+//---------------------------------------------------------------------------
+template<class T> int PasswordGenerator::GetFormatPasswImpl(SecureMem<T>& sDest,
   const w32string& sFormat,
   int nFlags,
-  const word32* pPassw,
+  const T* pPassw,
   int* pnPasswUsed,
   w32string* pInvalidSpec,
   double* pdSecurity)
@@ -1165,7 +1246,7 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
   if (sDest.Size() < 2 || sFormat.empty())
     return 0;
 
-  word32* pDest = sDest.begin();
+  T* pDest = sDest.begin();
   const int nMaxDestLen = std::min(1'000'000'000u, sDest.Size() - 1);
   const int nFormatLen = sFormat.length();
   int nSrcIdx = 0, nDestIdx = 0, nI;
@@ -1188,6 +1269,10 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
   int nToCopy;
   word32 lRand;
   double dPermSecurity;
+  // parsed user-defined character sets, which may occur repeatedly
+  std::map<w32string,w32string> userCharSets;
+  CharSet uniqueChars;
+  const std::basic_string<T> sWordSep(m_sWordSep.begin(), m_sWordSep.end());
 
   if (pnPasswUsed != nullptr)
     *pnPasswUsed = pPassw ? PASSFORMAT_PWUSED_NOSPECIFIER : 0;
@@ -1225,7 +1310,7 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
     }
 
     if (blVerbatim) {
-      pDest[nDestIdx++] = lChar;
+      pDest[nDestIdx++] = static_cast<T>(lChar);
       continue;
     }
 
@@ -1284,10 +1369,14 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
         int nUserCharSetLen = nSrcIdx - nUserCharSetStart - 1;
         if (nUserCharSetLen >= 2) {
           sUserCharSet = sFormat.substr(nUserCharSetStart, nUserCharSetLen);
-          auto userCharSetResult = ParseCharSet(sUserCharSet);
-          if (userCharSetResult) {
-            sUserCharSet = userCharSetResult->first;
-            psCharSet = &sUserCharSet;
+          auto it = userCharSets.find(sUserCharSet);
+          if (it == userCharSets.end()) {
+            auto userCharSetResult = ParseCharSet(sUserCharSet);
+            it = userCharSets.emplace(sUserCharSet, userCharSetResult ?
+              userCharSetResult->first : w32string()).first;
+          }
+          if (!it->second.empty()) {
+            psCharSet = &it->second;
             nNum = nUserCharSetNum;
           }
         }
@@ -1297,8 +1386,8 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
 
     case 'P': // copy password to dest
       if (pPassw != nullptr) {
-        nToCopy = std::min<int>(w32strlen(pPassw), nMaxDestLen - nDestIdx);
-        memcpy(pDest + nDestIdx, pPassw, nToCopy * sizeof(word32));
+        nToCopy = std::min<int>(_tcslen(pPassw), nMaxDestLen - nDestIdx);
+        memcpy(pDest + nDestIdx, pPassw, nToCopy * sizeof(T));
         nDestIdx += nToCopy;
         if (pnPasswUsed != nullptr) {
           *pnPasswUsed = nToCopy;
@@ -1327,7 +1416,7 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
     case 'W': // add word
     case 'w': // add word + separator string
     {
-      SecureW32String sWord(WORDLIST_MAX_WORDLEN + 1);
+      SecureMem<T> sWord(WORDLIST_MAX_WORDLEN + 1);
       std::unique_ptr<std::set<word32>> pUniqueWordIdx;
 
       if (blUnique) {
@@ -1336,25 +1425,21 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
       }
       for (nI = 0; nI < nNum && nDestIdx < nMaxDestLen; ) {
         lRand = m_pRandGen->GetNumRange(m_nWordListSize);
-        int nWordLen;
-        if (m_wordList.empty())
-          nWordLen = AsciiCharToW32Char(getDiceWd(lRand), sWord);
-        else
-          nWordLen = WCharToW32Char(m_wordList[lRand].c_str(), sWord);
+        int nWordLen = GetWordImpl(lRand, sWord);
         if (blUnique) {
           auto ret = pUniqueWordIdx->insert(lRand);
           if (!ret.second)
             continue;
         }
         nToCopy = std::min(nWordLen, nMaxDestLen - nDestIdx);
-        memcpy(pDest + nDestIdx, sWord, nToCopy * sizeof(word32));
+        memcpy(pDest + nDestIdx, sWord, nToCopy * sizeof(T));
         nDestIdx += nToCopy;
         if (lChar == 'w' && nI < nNum-1 && nDestIdx < nMaxDestLen) {
-          if (m_sWordSep.empty())
+          if (sWordSep.empty())
             pDest[nDestIdx++] = ' ';
           else {
-            nToCopy = std::min<int>(m_sWordSep.length(), nMaxDestLen - nDestIdx);
-            memcpy(pDest + nDestIdx, m_sWordSep.c_str(), nToCopy * sizeof(word32));
+            nToCopy = std::min<int>(sWordSep.length(), nMaxDestLen - nDestIdx);
+            memcpy(pDest + nDestIdx, sWordSep.c_str(), nToCopy * sizeof(T));
             nDestIdx += nToCopy;
           }
         }
@@ -1397,7 +1482,7 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
       if (nPermNum >= 0) {
         int nPermSize = nDestIdx - nPermStart;
         if (nPermSize >= 2) { // now permute!
-          m_pRandGen->Permute<word32>(pDest + nPermStart, nPermSize);
+          m_pRandGen->Permute<T>(pDest + nPermStart, nPermSize);
           int nToUse = (nPermNum == 0) ? nPermSize : std::min(nPermNum, nPermSize);
           nDestIdx = nPermStart + nToUse;
           if (pdSecurity != nullptr && nToUse < nPermSize)
@@ -1423,7 +1508,7 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
         }
       }
       else {
-        pDest[nDestIdx++] = lChar;
+        pDest[nDestIdx++] = static_cast<T>(lChar);
       }
     }
 
@@ -1439,17 +1524,16 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
       int nLen = std::min(nNum, nMaxDestLen - nDestIdx);
       SecureW32String phoneticPassw(nLen + 1);
       nLen = GetPhoneticPassw(phoneticPassw, nLen, nFlags);
-      memcpy(pDest + nDestIdx, phoneticPassw, nLen * sizeof(word32));
+      std::copy(phoneticPassw.begin(), phoneticPassw.begin() + nLen,
+        pDest + nDestIdx);
 
       nDestIdx += nLen;
 
       if (pdSecurity != nullptr)
-        *pdSecurity += (m_dPhoneticEntropy +
-            ((charSetType == cstPhoneticMixedCase) ? 1 : 0)) * nLen;
+        *pdSecurity += CalcPhoneticEntropy(nLen, nFlags);
     }
     else if (psCharSet != nullptr && psCharSet->length() >= 2) {
       int nSetSize = psCharSet->length();
-      int nStartIdx = nDestIdx;
 
       if (blUnique)
         nNum = (blNumDefault) ? nSetSize : std::min(nNum, nSetSize);
@@ -1458,18 +1542,23 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
         lRand = (*psCharSet)[m_pRandGen->GetNumRange(nSetSize)];
         //bool checkRep = nDestIdx > 0;
         if (blUnique && nI > 0) {
-          if (strchpos(pDest + nStartIdx, nI, lRand) >= 0)
+          if (uniqueChars.Contains(lRand))
             continue;
           //checkRep = false;
         }
         else if (nFlags & PASSFORMAT_FLAG_EXCLUDEREPCHARS &&
           nDestIdx > 0 &&
-          lRand == pDest[nDestIdx-1])
+          static_cast<T>(lRand) == pDest[nDestIdx-1])
           continue;
-        pDest[nDestIdx++] = lRand;
+        if (blUnique)
+          uniqueChars.Insert(lRand);
+        pDest[nDestIdx++] = static_cast<T>(lRand);
         nI++;
       }
 
+      if (blUnique)
+        uniqueChars.Clear();
+
       if (pdSecurity != nullptr) {
         if (blUnique)
           *pdSecurity += CalcPermSetEntropy(nSetSize, nI);
@@ -1497,6 +1586,79 @@ int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
   return nDestIdx;
 }
 //---------------------------------------------------------------------------
+int PasswordGenerator::GetFormatPassw(SecureW32String& sDest,
+  const w32string& sFormat,
+  int nFlags,
+  const word32* pPassw,
+  int* pnPasswUsed,
+  w32string* pInvalidSpec,
+  double* pdSecurity)
+{
+  return GetFormatPasswImpl(sDest, sFormat, nFlags, pPassw, pnPasswUsed,
+    pInvalidSpec, pdSecurity);
+}
+//---------------------------------------------------------------------------
+int PasswordGenerator::GetFormatPassw(SecureAnsiString& sDest,
+  const w32string& sFormat,
+  int nFlags,
+  const char* pPassw,
+  int* pnPasswUsed,
+  w32string* pInvalidSpec,
+  double* pdSecurity)
+{
+  return GetFormatPasswImpl(sDest, sFormat, nFlags, pPassw, pnPasswUsed,
+    pInvalidSpec, pdSecurity);
+}
+//---------------------------------------------------------------------------
+bool PasswordGenerator::IsPassphraseAscii(void) const
+{
+  return m_blWordListAscii && isAsciiString(m_sWordSep) &&
+    isAsciiString(m_sWordCharSep);
+}
+//---------------------------------------------------------------------------
+bool PasswordGenerator::IsFormatAscii(const w32string& sFormat) const
+{
+  // conservative check: every letter is treated as a placeholder, even if it
+  // is part of a verbatim sequence or user-defined character set, and every
+  // "<<" is treated as the beginning of a user-defined character set
+  const int nFormatLen = sFormat.length();
+  for (int nI = 0; nI < nFormatLen; nI++) {
+    const word32 lChar = sFormat[nI];
+    if (lChar >= 0x80)
+      return false;
+    if (lChar == 'w' || lChar == 'W') {
+      if (!IsPassphraseAscii())
+        return false;
+    }
+    else if (isalpha(lChar)) {
+      int nPlaceholder = strchpos(FORMAT_PLACEHOLDERS, static_cast<char>(lChar));
+      if (nPlaceholder >= 0 && !(m_lFormatCharSetsAscii & (1 << nPlaceholder)))
+        return false;
+    }
+    else if (lChar == '<' && nI < nFormatLen-1 && sFormat[nI+1] == '<') {
+      // user-defined character sets may contain character set codes
+      // referring to non-ASCII characters (e.g., <high>, <sym>); the set
+      // ends in the same way as in GetFormatPassw()
+      const int nStart = nI + 2;
+      int nEnd = nStart;
+      while (nEnd < nFormatLen-1 &&
+             !(sFormat[nEnd] == '>' && sFormat[nEnd+1] == '>'))
+        nEnd++;
+      if (nEnd >= nFormatLen-1)
+        continue;
+      while (nEnd < nFormatLen-1 && sFormat[nEnd+1] == '>')
+        nEnd++;
+      const int nLen = nEnd - nStart - 1;
+      if (nLen >= 2) {
+        auto userCharSetResult = ParseCharSet(sFormat.substr(nStart, nLen));
+        if (userCharSetResult && !isAsciiString(userCharSetResult->first))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+//---------------------------------------------------------------------------
 WString PasswordGenerator::GetWord(int nIndex) const
 {
   if (m_wordList.empty())
@@ -1509,51 +1671,18 @@ WString PasswordGenerator::GetWord(int nIndex) const
 void PasswordGenerator::CreateTrigramFile(const WString& sSrcFileName,
   const WString& sDestFileName,
   word32* plNumOfTris,
-  double* pdEntropy)
+  double* pdEntropy,
+  const WString& sNGramFileName,
+  int nNGramOrder)
 {
-  auto pSrcFile = std::make_unique<TStringFileStreamW>(
-    sSrcFileName, fmOpenRead, ceAnsi, true, 65536, "\n\t ");
-
-  const int WORDBUF_SIZE = 1024;
-  wchar_t wszWord[WORDBUF_SIZE];
-  std::vector<word32> tris(PHONETIC_TRIS_NUM, 0);
-  word32 lSigma = 0;
-
-  int nWordLen;
-  while ((nWordLen = pSrcFile->ReadString(wszWord, WORDBUF_SIZE)) > 0) {
-    WString sWord = Trim(WString(wszWord, nWordLen));
-    nWordLen = sWord.Length();
-
-    if (nWordLen < 3)
-      continue;
-
-    const wchar_t* pwszWord = sWord.c_str();
-    wchar_t wch;
-    char ch1 = -1, ch2 = -1, ch3;
-
-    while ((wch = *pwszWord++) != '\0') {
-      if (wch <= 'z' && (ch3 = tolower(wch) - 'a') >= 0 && ch3 <= 25) {
-        if (ch1 >= 0) {
-          tris[676*ch1+26*ch2+ch3]++;
-          lSigma++;
-        }
+  const bool blNGrams = !sNGramFileName.IsEmpty();
+  NGramCounter counter(blNGrams ? nNGramOrder : 3);
+  counter.CountFile(sSrcFileName);
 
-        ch1 = ch2;
-        ch2 = ch3;
-      }
-    }
-  }
-
-  double dEntropy = 0;
-  if (lSigma != 0) {
-    double dProb;
-    for (int nI = 0; nI < PHONETIC_TRIS_NUM; nI++) {
-      dProb = static_cast<double>(tris[nI]) / lSigma;
-      if (dProb > 0)
-        dEntropy += dProb * Log2(dProb);
-    }
-    dEntropy = -dEntropy / 3;
-  }
+  // counts of huge corpora are scaled down to fit into the file format
+  std::vector<word32> tris;
+  word32 lSigma = ScaleNGramCounts(counter.GetCounts(3), tris);
+  double dEntropy = CalcNGramEntropy(counter.GetCounts(3), 3);
 
   if (plNumOfTris != nullptr)
     *plNumOfTris = lSigma;
@@ -1569,6 +1698,11 @@ void PasswordGenerator::CreateTrigramFile(const WString& sSrcFileName,
   pDestFile->Write(&lSigma, sizeof(word32));
   pDestFile->Write(&dEntropy, sizeof(double));
   pDestFile->Write(&tris[0], tris.size() * sizeof(word32));
+  pDestFile.reset();
+
+  if (blNGrams)
+    WriteNGramModelFile(sNGramFileName, nNGramOrder,
+      counter.GetCounts(nNGramOrder));
 }
 //---------------------------------------------------------------------------
 int PasswordGenerator::LoadTrigramFile(WString sFileName)
@@ -1585,8 +1719,27 @@ int PasswordGenerator::LoadTrigramFile(WString sFileName)
       auto pFile = std::make_unique<TFileStream>(sFileName, fmOpenRead);
 
       if (pFile->Size != PHONETIC_TRIS_NUM * sizeof(word32) +
-          sizeof(word32) + sizeof(double))
-        return 0;
+          sizeof(word32) + sizeof(double)) {
+        char magic[4];
+        if (pFile->Size < sizeof(NGramModelHeader) ||
+            pFile->Read(magic, sizeof(magic)) != sizeof(magic) ||
+            memcmp(magic, "PWNG", 4) != 0)
+          return 0;
+
+        pFile.reset();
+
+        auto pModel = std::make_unique<NGramModel>();
+        if (!pModel->Load(sFileName))
+          return 0;
+
+        m_phoneticTris.clear();
+        m_lPhoneticSigma = PHONETIC_SIGMA;
+        // only for display; passwords use CalcPhoneticEntropy()
+        m_dPhoneticEntropy = pModel->Entropy();
+        m_pNGramModel = std::move(pModel);
+
+        return 1;
+      }
 
       tris.resize(PHONETIC_TRIS_NUM);
 
@@ -1614,6 +1767,7 @@ int PasswordGenerator::LoadTrigramFile(WString sFileName)
   m_phoneticTris = std::move(tris);
   m_lPhoneticSigma = lSigma;
   m_dPhoneticEntropy = dEntropy;
+  m_pNGramModel.reset();
 
   return 1;
 }
@@ -1630,7 +1784,7 @@ int PasswordGenerator::GetPhoneticPassw(SecureW32String& sDest,
   const bool blDefaultTris = m_phoneticTris.empty();
   const bool blMixedCase = nFlags & PASSW_FLAG_PHONETICMIXEDCASE;
   word32 lSumFreq = m_lPhoneticSigma;
-  word32 lRand = m_pRandGen->GetNumRange(lSumFreq);
+  word32 lRand = 0;
   word32 lSum = 0;
   int nChars = 0, nI;
   char base = (nFlags & PASSW_FLAG_PHONETICUPPERCASE) ? 'A' : 'a';
@@ -1645,60 +1799,70 @@ int PasswordGenerator::GetPhoneticPassw(SecureW32String& sDest,
   else
     getLetter = [base](char c) { return c + base; };
 
-  for (nI = 0; nI < PHONETIC_TRIS_NUM; nI++) {
-    if (blDefaultTris)
-      lSum += PHONETIC_TRIS[nI];
-    else
-      lSum += m_phoneticTris[nI];
-    if (lSum > lRand) {
-      ch1 = nI / 676;
-      ch2 = (nI / 26) % 26;
-      ch3 = nI % 26;
-      break;
-    }
+  if (m_pNGramModel) {
+    SecureMem<word8> letters(nLength);
+    m_pNGramModel->Generate(m_pRandGen, letters, nLength);
+    for ( ; nChars < nLength; nChars++)
+      sDest[nChars] = getLetter(letters[nChars]);
   }
+  else {
+    lRand = m_pRandGen->GetNumRange(lSumFreq);
 
-  if (nLength >= 1)
-    sDest[nChars++] = getLetter(ch1);
-  if (nLength >= 2)
-    sDest[nChars++] = getLetter(ch2);
-  if (nLength >= 3)
-    sDest[nChars++] = getLetter(ch3);
-
-  while (nChars < nLength) {
-    ch1 = ch2;
-    ch2 = ch3;
-
-    lSumFreq = 0;
-    for (ch3 = 0; ch3 < 26; ch3++) {
-      int nIndex = 676*ch1+26*ch2+ch3;
+    for (nI = 0; nI < PHONETIC_TRIS_NUM; nI++) {
       if (blDefaultTris)
-        lSumFreq += PHONETIC_TRIS[nIndex];
+        lSum += PHONETIC_TRIS[nI];
       else
-        lSumFreq += m_phoneticTris[nIndex];
+        lSum += m_phoneticTris[nI];
+      if (lSum > lRand) {
+        ch1 = nI / 676;
+        ch2 = (nI / 26) % 26;
+        ch3 = nI % 26;
+        break;
+      }
     }
 
-    if (lSumFreq == 0) {
-      // if we can't find anything, just insert a vowel...
-      static const char VOWELS[5] = { 0, 4, 8, 14, 20 };
-      ch3 = VOWELS[m_pRandGen->GetNumRange(5)];
-    }
-    else {
-      lRand = m_pRandGen->GetNumRange(lSumFreq);
-      lSum = 0;
+    if (nLength >= 1)
+      sDest[nChars++] = getLetter(ch1);
+    if (nLength >= 2)
+      sDest[nChars++] = getLetter(ch2);
+    if (nLength >= 3)
+      sDest[nChars++] = getLetter(ch3);
 
+    while (nChars < nLength) {
+      ch1 = ch2;
+      ch2 = ch3;
+
+      lSumFreq = 0;
       for (ch3 = 0; ch3 < 26; ch3++) {
         int nIndex = 676*ch1+26*ch2+ch3;
         if (blDefaultTris)
-          lSum += PHONETIC_TRIS[nIndex];
+          lSumFreq += PHONETIC_TRIS[nIndex];
         else
-          lSum += m_phoneticTris[nIndex];
-        if (lSum > lRand)
-          break;
+          lSumFreq += m_phoneticTris[nIndex];
+      }
+
+      if (lSumFreq == 0) {
+        // if we can't find anything, just insert a vowel...
+        static const char VOWELS[5] = { 0, 4, 8, 14, 20 };
+        ch3 = VOWELS[m_pRandGen->GetNumRange(5)];
+      }
+      else {
+        lRand = m_pRandGen->GetNumRange(lSumFreq);
+        lSum = 0;
+
+        for (ch3 = 0; ch3 < 26; ch3++) {
+          int nIndex = 676*ch1+26*ch2+ch3;
+          if (blDefaultTris)
+            lSum += PHONETIC_TRIS[nIndex];
+          else
+            lSum += m_phoneticTris[nIndex];
+          if (lSum > lRand)
+            break;
+        }
       }
-    }
 
-    sDest[nChars++] = getLetter(ch3);
+      sDest[nChars++] = getLetter(ch3);
+    }
   }
 
   sDest[nChars] = '\0';
@@ -1763,6 +1927,21 @@ int PasswordGenerator::GetPhoneticPassw(SecureW32String& sDest,
   return nChars;
 }
 //---------------------------------------------------------------------------
+double PasswordGenerator::CalcPhoneticEntropy(int nLength,
+  int nFlags) const
+{
+  if (nLength < 1)
+    return 0;
+
+  double dEntropy = m_pNGramModel ? m_pNGramModel->Entropy(nLength) :
+    m_dPhoneticEntropy * nLength;
+
+  if (nFlags & PASSW_FLAG_PHONETICMIXEDCASE)
+    dEntropy += nLength;
+
+  return dEntropy;
+}
+//---------------------------------------------------------------------------
 static double logFactorial(int nNum)
 {
   if (nNum < 2)
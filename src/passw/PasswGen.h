@@ -27,6 +27,8 @@
 #include "SecureMem.h"
 #include "RandomGenerator.h"
 #include "UnicodeUtil.h"
+#include "PhoneticModel.h"
+#include "CharSet.h"
 
 
 const int
@@ -49,7 +51,6 @@ PASSW_FLAG_INCLUDESPECIAL       = 0x0040,
 PASSW_FLAG_PHONETICUPPERCASE    = 0x0080,
 PASSW_FLAG_PHONETICMIXEDCASE    = 0x0100, // mixed-case characters in phonetic passwords
 PASSW_FLAG_EACHCHARONLYONCE     = 0x0200, // each character must occur only once
-PASSW_FLAG_CHECKDUPLICATESBYSET = 0x0400,
 PASSW_FLAG_REMOVEWHITESPACE     = 0x0800,
 
 PASSPHR_FLAG_COMBINEWCH         = 0x0001,  // combine words & chars
@@ -87,20 +88,27 @@ private:
   //int m_nCustomCharSetSize;
   double m_dCustomCharSetEntropy;
   bool m_blCustomCharSetNonLC;
+  bool m_blCustomCharSetAscii;
   w32string m_charSetDecodes[PASSWGEN_NUMCHARSETCODES];
   w32string m_includeCharSets[PASSWGEN_NUMINCLUDECHARSETS];
   w32string m_customSubsets[PASSWGEN_NUMINCLUDECHARSETS];
+  // same sets as above for fast membership tests
+  CharSet m_includeCharSetsLookup[PASSWGEN_NUMINCLUDECHARSETS];
+  CharSet m_customSubsetsLookup[PASSWGEN_NUMINCLUDECHARSETS];
   w32string m_formatCharSets[PASSWGEN_NUMFORMATCHARSETS];
+  word32 m_lFormatCharSetsAscii; // bit i set: m_formatCharSets[i] is ASCII
   w32string m_sWordSep;
   w32string m_sWordCharSep;
   std::vector<std::wstring> m_wordList;
   int m_nWordListSize;
+  bool m_blWordListAscii;
   double m_dWordListEntropy;
   w32string m_sAmbigCharSet;
   std::vector<w32string> m_ambigGroups;
   word32 m_lPhoneticSigma;
   std::vector<word32> m_phoneticTris;
   double m_dPhoneticEntropy;
+  std::unique_ptr<NGramModel> m_pNGramModel;
 
   // convert ("parse") the input string into a "unique" character set
   // -> input string
@@ -118,6 +126,32 @@ private:
     return W32StringToWString(m_sCustomCharSet);
   }
 
+  // generator implementations for the code unit types word32 (UTF-32) and
+  // char (ASCII only); see the public functions for descriptions
+  template<class T> int GetPasswordImpl(SecureMem<T>& sDest,
+    int nLength,
+    int nFlags) const;
+
+  template<class T> int GetPassphraseImpl(SecureMem<T>& sDest,
+    int nWords,
+    const T* pChars,
+    int nCharsLen,
+    int nFlags,
+    int* pnNetWordsLen) const;
+
+  template<class T> int GetFormatPasswImpl(SecureMem<T>& sDest,
+    const w32string& sFormat,
+    int nFlags,
+    const T* pPassw,
+    int* pnPasswUsed,
+    w32string* pInvalidSpec,
+    double* pdSecurity);
+
+  // copies a word from the word list to the buffer
+  // <- length of the word
+  template<class T> int GetWordImpl(int nIndex,
+    SecureMem<T>& sWord) const;
+
 public:
   // constructor
   // -> pointer to a random generator
@@ -150,6 +184,12 @@ public:
     int nLength,
     int nFlags) const;
 
+  // same as above, generates an 8-bit string; may be called only if
+  // IsCustomCharSetAscii is 'true'
+  int GetPassword(SecureAnsiString& sPassw,
+    int nLength,
+    int nFlags) const;
+
   // generates a pass"phrase" containing words and possibly characters
   // -> where to store the passphrase - buffer is resized automatically
   // -> desired number of words
@@ -168,6 +208,16 @@ public:
     int nFlags,
     int* pnNetWordsLen = nullptr) const;
 
+  // same as above, generates an 8-bit string; may be called only if
+  // IsPassphraseAscii() returns 'true' and pChars is ASCII
+  int GetPassphrase(
+    SecureAnsiString& sDest,
+    int nWords,
+    const char* pChars,
+    int nCharsLen,
+    int nFlags,
+    int* pnNetWordsLen = nullptr) const;
+
   // generates a "formatted" password
   // -> destination buffer (where to store the password)
   // -> max. length of the resulting password (*without* terminating zero!)
@@ -193,6 +243,25 @@ public:
     w32string* pInvalidSpec = nullptr,
     double* pdSecurity = nullptr);
 
+  // same as above, generates an 8-bit string; may be called only if
+  // IsFormatAscii() returns 'true' for the format string and pPassw is ASCII
+  int GetFormatPassw(SecureAnsiString& sDest,
+    const w32string& sFormat,
+    int nFlags,
+    const char* pPassw = nullptr,
+    int* pnPasswUsed = nullptr,
+    w32string* pInvalidSpec = nullptr,
+    double* pdSecurity = nullptr);
+
+  // checks whether passphrases consist of ASCII characters only, i.e., the
+  // word list and the separators are ASCII strings
+  bool IsPassphraseAscii(void) const;
+
+  // checks whether a format string generates ASCII characters only, i.e.,
+  // the format string itself and all character sets and words referenced
+  // by it are ASCII (apart from the password inserted via "P")
+  bool IsFormatAscii(const w32string& sFormat) const;
+
   // call this function to set up all character sets by providing user-defined
   // ambiguous characters and special symbols
   // -> custom character set for generating passwords (via 'GetPassword()')
@@ -241,13 +310,21 @@ public:
   //                      17,576 32-bit numbers (i.e., 4 bytes each)
   // -> number of evaluated trigrams (nullptr -> don't receive anything)
   // -> bits of entropy per letter (may be nullptr); min. entropy is 1.0!
+  // -> name of an n-gram model file to be created additionally (see
+  //    WriteNGramModelFile() in PhoneticModel.h); empty -> none
+  // -> order of the n-gram model (NGRAM_MIN_ORDER..NGRAM_MAX_ORDER)
+  // the source file is processed on multiple threads (see NGramCounter)
   // function throws an exception in case of errors
   static void CreateTrigramFile(const WString& sSrcFileName,
     const WString& sDestFileName,
     word32* plNumOfTris,
-    double* pdEntropy);
+    double* pdEntropy,
+    const WString& sNGramFileName = WString(),
+    int nNGramOrder = 4);
 
-  // load a trigram file created with CreateTrigramFile()
+  // load a trigram file created with CreateTrigramFile(), or an n-gram
+  // model file created with WriteNGramModelFile() (identified by its
+  // header), which is used instead of the trigrams then
   // -> name of the trigram file; if empty, use default trigrams in
   //    PhoneticTrigram.h
   // <- if  < 0: i/o error
@@ -270,6 +347,15 @@ public:
     int nLength,
     int nFlags) const;
 
+  // calculates the entropy of a phonetic password; with an n-gram model,
+  // the entropy is exact or a lower bound (see NGramModel), otherwise it is
+  // estimated from the entropy per letter of the trigrams
+  // -> password length
+  // -> flags passed to GetPhoneticPassw()
+  // <- entropy bits
+  double CalcPhoneticEntropy(int nLength,
+    int nFlags) const;
+
   // calculate entropy for randomly permuting a "set" (i.e., collection of
   // unique elements): S = log_2(N!/(N-M!)) with N being the set size
   // and M being the number of samples taken from the permuted set
@@ -307,6 +393,11 @@ public:
   __property int CustomCharSetUniqueSize =
   { read=m_nCustomCharSetUniqueSize };
 
+  // 'true' if the custom character set (standard type) and the additional
+  // character sets for the "include" options consist of ASCII characters only
+  __property bool IsCustomCharSetAscii =
+  { read=m_blCustomCharSetAscii };
+
   __property double WordListEntropy =
   { read=m_dWordListEntropy };
 
@@ -0,0 +1,255 @@
+// PasswSimilarity.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#include <vcl.h>
+#include <algorithm>
+#pragma hdrstop
+
+#include "PasswSimilarity.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static inline word64 mix64(word64 x)
+{
+  // finalizer of SplitMix64
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+//---------------------------------------------------------------------------
+PasswSimilarityClusterer::PasswSimilarityClusterer(word32 lMaxEditDist)
+  : m_lMaxEditDist(lMaxEditDist)
+{
+  // hash functions h(x) = (a*x + b) >> 32 with odd multipliers;
+  // the coefficients are taken from a fixed SplitMix64 sequence, so that
+  // candidate pairs (and thus the clusters) do not change between calls
+  const word64 GOLDEN_GAMMA = 0x9e3779b97f4a7c15ull;
+  word64 qState = 0;
+  for (int nK = 0; nK < MAX_SIGNATURE_LENGTH; nK++) {
+    m_qMulSeeds[nK] = mix64(qState += GOLDEN_GAMMA) | 1;
+    m_qAddSeeds[nK] = mix64(qState += GOLDEN_GAMMA);
+  }
+}
+//---------------------------------------------------------------------------
+void PasswSimilarityClusterer::AddPassw(const wchar_t* pwszPassw, word32 lLen)
+{
+  m_passwords.push_back({ pwszPassw, lLen });
+}
+//---------------------------------------------------------------------------
+void PasswSimilarityClusterer::ComputeSignature(const Passw& passw,
+  word32 lShingleLen, word32 lSigLen, word32* pSignature) const
+{
+  std::fill(pSignature, pSignature + lSigLen, 0xffffffff);
+
+  // passwords shorter than a shingle form a single shingle
+  word32 lNumShingles = (passw.Len >= lShingleLen) ?
+    passw.Len - lShingleLen + 1 : 1;
+
+  for (word32 lI = 0; lI < lNumShingles; lI++) {
+    word64 qShingle = 0;
+    for (word32 lJ = lI; lJ < std::min(lI + lShingleLen, passw.Len); lJ++)
+      qShingle = (qShingle << 16) | passw.Str[lJ];
+    word64 qHash = mix64(qShingle);
+
+    for (word32 lK = 0; lK < lSigLen; lK++) {
+      word32 lValue = (m_qMulSeeds[lK] * qHash + m_qAddSeeds[lK]) >> 32;
+      if (lValue < pSignature[lK])
+        pSignature[lK] = lValue;
+    }
+  }
+}
+//---------------------------------------------------------------------------
+word32 PasswSimilarityClusterer::FindRoot(word32 lIndex)
+{
+  while (m_parents[lIndex] != lIndex) {
+    m_parents[lIndex] = m_parents[m_parents[lIndex]];
+    lIndex = m_parents[lIndex];
+  }
+  return lIndex;
+}
+//---------------------------------------------------------------------------
+void PasswSimilarityClusterer::Merge(word32 lIndexA, word32 lIndexB)
+{
+  // lower index becomes the root
+  if (lIndexA < lIndexB)
+    m_parents[lIndexB] = lIndexA;
+  else
+    m_parents[lIndexA] = lIndexB;
+}
+//---------------------------------------------------------------------------
+void PasswSimilarityClusterer::CheckPair(word32 lIndexA, word32 lIndexB)
+{
+  word32 lRootA = FindRoot(lIndexA), lRootB = FindRoot(lIndexB);
+  if (lRootA == lRootB)
+    return;
+
+  const Passw& a = m_passwords[lIndexA];
+  const Passw& b = m_passwords[lIndexB];
+  if (IsWithinEditDist(a.Str, a.Len, b.Str, b.Len, m_lMaxEditDist))
+    Merge(lRootA, lRootB);
+}
+//---------------------------------------------------------------------------
+void PasswSimilarityClusterer::CheckBuckets(const word32* pSignatures,
+  const std::vector<word32>& indices, int nNumBands, int nRowsPerBand)
+{
+  const word32 lNum = indices.size();
+  const word32 lSigLen = nNumBands * nRowsPerBand;
+
+  // for each band, sort passwords by the hash of their band signature;
+  // passwords with equal hashes form a bucket of candidates
+  std::vector<std::pair<word64,word32>> buckets(lNum);
+  for (int nBand = 0; nBand < nNumBands; nBand++) {
+    for (word32 lI = 0; lI < lNum; lI++) {
+      const word32* pRows = pSignatures + lI * lSigLen + nBand * nRowsPerBand;
+      word64 qHash = nBand;
+      for (int nR = 0; nR < nRowsPerBand; nR++)
+        qHash = mix64(qHash ^ pRows[nR]);
+      buckets[lI] = { qHash, indices[lI] };
+    }
+    std::sort(buckets.begin(), buckets.end());
+
+    for (word32 lStart = 0, lEnd; lStart < lNum; lStart = lEnd) {
+      for (lEnd = lStart + 1; lEnd < lNum &&
+           buckets[lEnd].first == buckets[lStart].first; lEnd++);
+
+      word32 lSize = lEnd - lStart;
+      if (lSize < 2)
+        continue;
+
+      if (lSize <= MAX_FULL_BUCKET_SIZE) {
+        for (word32 lI = lStart; lI < lEnd; lI++) {
+          for (word32 lJ = lI + 1; lJ < lEnd; lJ++)
+            CheckPair(buckets[lI].second, buckets[lJ].second);
+        }
+      }
+      else {
+        // compare each member only with its predecessor and the first member
+        // to keep the effort linear (e.g., for many identical passwords)
+        for (word32 lI = lStart + 1; lI < lEnd; lI++) {
+          CheckPair(buckets[lI - 1].second, buckets[lI].second);
+          CheckPair(buckets[lStart].second, buckets[lI].second);
+        }
+      }
+    }
+  }
+
+  std::fill(buckets.begin(), buckets.end(), std::make_pair(0ull, 0u));
+}
+//---------------------------------------------------------------------------
+std::vector<std::vector<word32>> PasswSimilarityClusterer::Cluster(void)
+{
+  const word32 lNumPassw = m_passwords.size();
+  std::vector<std::vector<word32>> clusters;
+  if (lNumPassw < 2)
+    return clusters;
+
+  m_parents.resize(lNumPassw);
+  for (word32 lI = 0; lI < lNumPassw; lI++)
+    m_parents[lI] = lI;
+
+  std::vector<word32> indices(lNumPassw);
+  for (word32 lI = 0; lI < lNumPassw; lI++)
+    indices[lI] = lI;
+
+  {
+    SecureMem<word32> signatures(lNumPassw * SIGNATURE_LENGTH);
+    for (word32 lI = 0; lI < lNumPassw; lI++)
+      ComputeSignature(m_passwords[lI], SHINGLE_LENGTH, SIGNATURE_LENGTH,
+        &signatures[lI * SIGNATURE_LENGTH]);
+
+    CheckBuckets(signatures.Data(), indices, NUM_BANDS, ROWS_PER_BAND);
+  }
+
+  // passwords that may be within edit distance of a short password
+  indices.clear();
+  for (word32 lI = 0; lI < lNumPassw; lI++) {
+    if (m_passwords[lI].Len < SHORT_PASSW_LENGTH + m_lMaxEditDist)
+      indices.push_back(lI);
+  }
+
+  if (indices.size() >= 2) {
+    SecureMem<word32> signatures(indices.size() * SHORT_SIGNATURE_LENGTH);
+    for (word32 lI = 0; lI < indices.size(); lI++)
+      ComputeSignature(m_passwords[indices[lI]], SHORT_SHINGLE_LENGTH,
+        SHORT_SIGNATURE_LENGTH, &signatures[lI * SHORT_SIGNATURE_LENGTH]);
+
+    CheckBuckets(signatures.Data(), indices, SHORT_NUM_BANDS,
+      SHORT_ROWS_PER_BAND);
+  }
+
+  // collect clusters; roots are the lowest indices of their clusters
+  std::vector<word32> clusterIdx(lNumPassw, static_cast<word32>(-1));
+  for (word32 lI = 0; lI < lNumPassw; lI++) {
+    word32 lRoot = FindRoot(lI);
+    if (lRoot == lI)
+      continue;
+    if (clusterIdx[lRoot] == static_cast<word32>(-1)) {
+      clusterIdx[lRoot] = clusters.size();
+      clusters.push_back({ lRoot });
+    }
+    clusters[clusterIdx[lRoot]].push_back(lI);
+  }
+
+  m_parents.clear();
+
+  return clusters;
+}
+//---------------------------------------------------------------------------
+bool PasswSimilarityClusterer::IsWithinEditDist(const wchar_t* pA,
+  word32 lLenA, const wchar_t* pB, word32 lLenB, word32 lMaxDist)
+{
+  if (lLenA > lLenB) {
+    std::swap(pA, pB);
+    std::swap(lLenA, lLenB);
+  }
+  if (lLenB - lLenA > lMaxDist)
+    return false;
+
+  // dynamic programming restricted to a band of width 2*lMaxDist+1 around
+  // the diagonal; values exceeding the limit are capped
+  const word32 INF = lMaxDist + 1;
+  std::vector<word32> row(lLenB + 1, INF);
+  for (word32 lJ = 0; lJ <= std::min(lLenB, lMaxDist); lJ++)
+    row[lJ] = lJ;
+
+  for (word32 lI = 1; lI <= lLenA; lI++) {
+    word32 lStart = (lI > lMaxDist) ? lI - lMaxDist : 1;
+    word32 lEnd = std::min(lLenB, lI + lMaxDist);
+    word32 lDiag = row[lStart - 1];
+    word32 lLeft = (lStart == 1 && lI <= lMaxDist) ? lI : INF;
+    word32 lRowMin = lLeft;
+    row[lStart - 1] = lLeft;
+    for (word32 lJ = lStart; lJ <= lEnd; lJ++) {
+      word32 lUp = row[lJ];
+      word32 lValue = std::min(std::min(lUp, lLeft) + 1,
+        lDiag + (pA[lI - 1] != pB[lJ - 1]));
+      lValue = std::min(lValue, INF);
+      lDiag = lUp;
+      row[lJ] = lLeft = lValue;
+      lRowMin = std::min(lRowMin, lValue);
+    }
+    if (lRowMin > lMaxDist)
+      return false;
+  }
+
+  return row[lLenB] <= lMaxDist;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,128 @@
+// PasswSimilarity.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef PasswSimilarityH
+#define PasswSimilarityH
+//---------------------------------------------------------------------------
+#include <vector>
+#include "SecureMem.h"
+
+// clusters passwords which can be derived from each other by a few edits
+// (e.g., "Summer2023!" and "Summer2024!"):
+// 1) passwords are split into character trigrams ("shingles"), and a MinHash
+//    signature is computed for each set of trigrams
+// 2) signatures are divided into bands; passwords whose signatures agree in
+//    at least one band become candidate pairs (locality-sensitive hashing);
+//    since a single edit affects a large share of the trigrams of a short
+//    password, short passwords are additionally banded by a signature of
+//    their bigrams, using more bands with fewer rows
+// 3) candidate pairs are verified by a bounded edit distance check, and
+//    verified pairs are merged into clusters
+// The effort is nearly linear in the number of passwords, since only
+// candidate pairs are compared. The hash functions are fixed, so the
+// results are reproducible.
+class PasswSimilarityClusterer {
+public:
+  enum {
+    DEFAULT_MAX_EDIT_DIST = 2
+  };
+
+  // constructor
+  // -> max. edit distance (Levenshtein) between passwords of a cluster
+  PasswSimilarityClusterer(word32 lMaxEditDist = DEFAULT_MAX_EDIT_DIST);
+
+  // adds password to be clustered; the string is not copied and has to
+  // remain valid until Cluster() has been called
+  // -> password
+  // -> length of password
+  void AddPassw(const wchar_t* pwszPassw, word32 lLen);
+
+  // gets number of passwords added
+  word32 GetSize(void) const
+  {
+    return m_passwords.size();
+  }
+
+  // clusters passwords added so far
+  // <- clusters consisting of at least 2 passwords; each cluster contains
+  //    the indices of the passwords in ascending order (index = order in
+  //    which the passwords were added), clusters are sorted by their first
+  //    index
+  std::vector<std::vector<word32>> Cluster(void);
+
+  // checks whether edit distance between two strings is within a limit
+  // -> strings and their lengths
+  // -> max. edit distance
+  // <- 'true' if distance <= max. distance
+  static bool IsWithinEditDist(const wchar_t* pA, word32 lLenA,
+    const wchar_t* pB, word32 lLenB, word32 lMaxDist);
+
+private:
+  enum {
+    SHINGLE_LENGTH = 3,
+    NUM_BANDS = 16,
+    ROWS_PER_BAND = 3,
+    SIGNATURE_LENGTH = NUM_BANDS * ROWS_PER_BAND,
+    SHORT_PASSW_LENGTH = 12, // passwords shorter than this are "short"
+    SHORT_SHINGLE_LENGTH = 2,
+    SHORT_NUM_BANDS = 32,
+    SHORT_ROWS_PER_BAND = 2,
+    SHORT_SIGNATURE_LENGTH = SHORT_NUM_BANDS * SHORT_ROWS_PER_BAND,
+    MAX_SIGNATURE_LENGTH = SHORT_SIGNATURE_LENGTH,
+    MAX_FULL_BUCKET_SIZE = 16 // larger buckets are not compared pairwise
+  };
+
+  struct Passw {
+    const wchar_t* Str;
+    word32 Len;
+  };
+
+  // compute MinHash signature of a password
+  // -> password
+  // -> length of shingles
+  // -> length of signature
+  // <- signature
+  void ComputeSignature(const Passw& passw, word32 lShingleLen,
+    word32 lSigLen, word32* pSignature) const;
+
+  // divide signatures into bands and check passwords falling into the same
+  // bucket of a band
+  // -> signatures of all passwords, stored consecutively
+  // -> indices of the passwords the signatures belong to
+  // -> number of bands
+  // -> rows per band
+  void CheckBuckets(const word32* pSignatures,
+    const std::vector<word32>& indices, int nNumBands, int nRowsPerBand);
+
+  // union-find operations on clusters
+  word32 FindRoot(word32 lIndex);
+  void Merge(word32 lIndexA, word32 lIndexB);
+
+  // verify candidate pair and merge clusters if passwords are similar
+  void CheckPair(word32 lIndexA, word32 lIndexB);
+
+  word32 m_lMaxEditDist;
+  std::vector<Passw> m_passwords;
+  std::vector<word32> m_parents;
+  word64 m_qMulSeeds[MAX_SIGNATURE_LENGTH];
+  word64 m_qAddSeeds[MAX_SIGNATURE_LENGTH];
+};
+
+#endif
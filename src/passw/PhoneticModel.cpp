@@ -0,0 +1,830 @@
+// PhoneticModel.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#include <vcl.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <System.Threading.hpp>
+#pragma hdrstop
+
+#include "PhoneticModel.h"
+#include "MappedFile.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const word32
+  NGRAM_VIEW_SIZE       = 64 << 20,
+  NGRAM_MIN_TASK_SIZE   = 1 << 20,
+  NGRAM_MAX_THREAD_MEM  = 256 << 20,
+  NGRAM_MAX_MODEL_SIZE  = 256 << 20;
+
+static const word32 POW26[NGRAM_MAX_ORDER + 1] = {
+  1, 26, 676, 17576, 456976, 11881376
+};
+
+template<CharacterEncoding ENC>
+static inline word32 readCodeUnit(const word8* p)
+{
+  if (ENC == ceUtf16)
+    return p[0] | (p[1] << 8);
+  if (ENC == ceUtf16BigEndian)
+    return (p[0] << 8) | p[1];
+  return p[0];
+}
+
+template<CharacterEncoding ENC>
+static inline bool isSeparator(const word8* p)
+{
+  word32 lChar = readCodeUnit<ENC>(p);
+  return lChar == ' ' || lChar == '\n' || lChar == '\t';
+}
+
+// counts the n-grams of order NGRAM_MIN_ORDER..ORDER in a range of text
+template<CharacterEncoding ENC, int ORDER>
+static void countNGrams(const word8* p,
+  const word8* pEnd,
+  NGramState& state,
+  word32* const* ppCounts)
+{
+  const int UNIT = (ENC == ceUtf16 || ENC == ceUtf16BigEndian) ? 2 : 1;
+  word32 lIndex = state.Index;
+  int nLetters = state.Letters;
+
+  for ( ; p + UNIT <= pEnd; p += UNIT) {
+    word32 lChar = readCodeUnit<ENC>(p);
+    if (lChar == ' ' || lChar == '\n' || lChar == '\t') {
+      lIndex = 0;
+      nLetters = 0;
+      continue;
+    }
+
+    // ASCII letters only, converted to lower case
+    word32 lLetter = (lChar | 0x20) - 'a';
+    if (lChar > 'z' || lLetter >= NGRAM_ALPHABET_SIZE)
+      continue;
+
+    lIndex = lIndex * NGRAM_ALPHABET_SIZE + lLetter;
+    if (nLetters < ORDER)
+      nLetters++;
+
+    for (int nOrder = NGRAM_MIN_ORDER; nOrder <= ORDER; nOrder++) {
+      if (nLetters >= nOrder)
+        ppCounts[nOrder - NGRAM_MIN_ORDER][lIndex % POW26[nOrder]]++;
+    }
+
+    lIndex %= POW26[ORDER - 1];
+  }
+
+  state.Index = lIndex;
+  state.Letters = nLetters;
+}
+
+template<CharacterEncoding ENC>
+static void countNGramsOrder(int nMaxOrder,
+  const word8* p,
+  const word8* pEnd,
+  NGramState& state,
+  word32* const* ppCounts)
+{
+  switch (nMaxOrder) {
+  case 3:
+    countNGrams<ENC,3>(p, pEnd, state, ppCounts);
+    break;
+  case 4:
+    countNGrams<ENC,4>(p, pEnd, state, ppCounts);
+    break;
+  default:
+    countNGrams<ENC,5>(p, pEnd, state, ppCounts);
+  }
+}
+
+// checks whether the ANSI code page is a multi-byte code page, in which
+// trail bytes may look like ASCII letters
+static bool isDBCSCodePage(void)
+{
+  CPINFO info;
+  return GetCPInfo(CP_ACP, &info) && info.MaxCharSize > 1;
+}
+
+//---------------------------------------------------------------------------
+NGramCounter::NGramCounter(int nMaxOrder)
+  : m_nMaxOrder(std::max(NGRAM_MIN_ORDER, std::min(NGRAM_MAX_ORDER, nMaxOrder)))
+{
+  for (int nOrder = NGRAM_MIN_ORDER; nOrder <= m_nMaxOrder; nOrder++)
+    m_counts[nOrder - NGRAM_MIN_ORDER].resize(POW26[nOrder], 0);
+}
+//---------------------------------------------------------------------------
+word64 NGramCounter::GetTotal(int nOrder) const
+{
+  word64 qTotal = 0;
+  for (word64 qCount : GetCounts(nOrder))
+    qTotal += qCount;
+  return qTotal;
+}
+//---------------------------------------------------------------------------
+void NGramCounter::CountRange(const word8* p,
+  const word8* pEnd,
+  CharacterEncoding enc,
+  NGramState& state,
+  word32 lThread)
+{
+  word32* ppCounts[NUM_ORDERS];
+  for (int nOrder = NGRAM_MIN_ORDER; nOrder <= m_nMaxOrder; nOrder++)
+    ppCounts[nOrder - NGRAM_MIN_ORDER] = GetThreadCounts(lThread, nOrder);
+
+  switch (enc) {
+  case ceUtf16:
+    countNGramsOrder<ceUtf16>(m_nMaxOrder, p, pEnd, state, ppCounts);
+    break;
+  case ceUtf16BigEndian:
+    countNGramsOrder<ceUtf16BigEndian>(m_nMaxOrder, p, pEnd, state, ppCounts);
+    break;
+  default:
+    countNGramsOrder<ceAnsi>(m_nMaxOrder, p, pEnd, state, ppCounts);
+  }
+}
+//---------------------------------------------------------------------------
+word32 NGramCounter::MaxThreads(void) const
+{
+  word32 lBytesPerThread = 0;
+  for (int nOrder = NGRAM_MIN_ORDER; nOrder <= m_nMaxOrder; nOrder++)
+    lBytesPerThread += POW26[nOrder] * sizeof(word32);
+
+  return std::max<word32>(1, NGRAM_MAX_THREAD_MEM / lBytesPerThread);
+}
+//---------------------------------------------------------------------------
+void NGramCounter::AllocThreadCounts(word32 lNumThreads)
+{
+  // counts per view always fit into 32 bits
+  while (m_threadCounts.size() < lNumThreads * NUM_ORDERS) {
+    int nOrder = NGRAM_MIN_ORDER + m_threadCounts.size() % NUM_ORDERS;
+    m_threadCounts.emplace_back(nOrder <= m_nMaxOrder ? POW26[nOrder] : 1, 0);
+  }
+}
+//---------------------------------------------------------------------------
+void NGramCounter::MergeThreadCounts(word32 lNumThreads)
+{
+  for (word32 lThread = 0; lThread < lNumThreads; lThread++) {
+    for (int nOrder = NGRAM_MIN_ORDER; nOrder <= m_nMaxOrder; nOrder++) {
+      auto& counts = m_counts[nOrder - NGRAM_MIN_ORDER];
+      word32* pThreadCounts = GetThreadCounts(lThread, nOrder);
+      for (word32 lI = 0; lI < POW26[nOrder]; lI++)
+        counts[lI] += pThreadCounts[lI];
+      std::fill(pThreadCounts, pThreadCounts + POW26[nOrder], 0);
+    }
+  }
+}
+//---------------------------------------------------------------------------
+void NGramCounter::CountView(const word8* pData,
+  word32 lLen,
+  CharacterEncoding enc,
+  NGramState& state)
+{
+  const word32 lUnit = (enc == ceUtf16 || enc == ceUtf16BigEndian) ? 2 : 1;
+  lLen -= lLen % lUnit;
+
+  const word32 lNumThreads = std::max<word32>(1, std::min<word32>(
+    std::min<word32>(std::max(1, TThread::ProcessorCount), MaxThreads()),
+    lLen / NGRAM_MIN_TASK_SIZE));
+
+  AllocThreadCounts(lNumThreads);
+
+  auto isSep = [enc](const word8* p)
+  {
+    switch (enc) {
+    case ceUtf16:
+      return isSeparator<ceUtf16>(p);
+    case ceUtf16BigEndian:
+      return isSeparator<ceUtf16BigEndian>(p);
+    default:
+      return isSeparator<ceAnsi>(p);
+    }
+  };
+
+  // first and last separator in the view; the words before/after them may
+  // continue from the previous view or in the next view
+  word32 lHead = 0, lTail = lLen;
+  if (lNumThreads > 1) {
+    while (lHead < lLen && !isSep(pData + lHead))
+      lHead += lUnit;
+    while (lTail > lHead && !isSep(pData + lTail - lUnit))
+      lTail -= lUnit;
+  }
+
+  if (lNumThreads <= 1 || lTail <= lHead + lUnit) {
+    CountRange(pData, pData + lLen, enc, state, 0);
+    MergeThreadCounts(1);
+    return;
+  }
+
+  CountRange(pData, pData + lHead, enc, state, 0);
+
+  // split the range between the separators into parts starting at word
+  // boundaries, so that each part can be counted independently
+  std::vector<word32> bounds(lNumThreads + 1);
+  bounds[0] = lHead;
+  bounds[lNumThreads] = lTail;
+  for (word32 lI = 1; lI < lNumThreads; lI++) {
+    word32 lPos = lHead + static_cast<word32>(
+      static_cast<word64>(lTail - lHead) * lI / lNumThreads);
+    lPos -= (lPos - lHead) % lUnit;
+    while (lPos < lTail && !isSep(pData + lPos))
+      lPos += lUnit;
+    bounds[lI] = lPos;
+  }
+
+  std::vector<_di_ITask> tasks;
+  for (word32 lI = 0; lI < lNumThreads; lI++) {
+    tasks.push_back(TTask::Create([this,pData,enc,lI,&bounds]() {
+      NGramState partState = { 0, 0 };
+      CountRange(pData + bounds[lI], pData + bounds[lI + 1], enc, partState,
+        lI);
+    }));
+    tasks.back()->Start();
+  }
+  for (auto& pTask : tasks)
+    pTask->Wait();
+
+  state = { 0, 0 };
+  CountRange(pData + lTail, pData + lLen, enc, state, 0);
+
+  MergeThreadCounts(lNumThreads);
+}
+//---------------------------------------------------------------------------
+void NGramCounter::CountFileDBCS(const WString& sFileName)
+{
+  MappedTextReader reader(sFileName, ceAnsi, "\n\t ");
+
+  AllocThreadCounts(1);
+
+  const int WORDBUF_SIZE = 1024;
+  wchar_t wszWord[WORDBUF_SIZE];
+  int nWordLen;
+  while ((nWordLen = reader.ReadString(wszWord, WORDBUF_SIZE)) > 0) {
+    NGramState state = { 0, 0 };
+    CountRange(reinterpret_cast<word8*>(wszWord),
+      reinterpret_cast<word8*>(wszWord + nWordLen), ceUtf16, state, 0);
+  }
+
+  MergeThreadCounts(1);
+}
+//---------------------------------------------------------------------------
+void NGramCounter::CountFile(const WString& sFileName)
+{
+  MappedFile file(sFileName, NGRAM_VIEW_SIZE);
+
+  word32 lLen;
+  const word8* pData = file.ReadNext(lLen);
+  if (pData == nullptr)
+    return;
+
+  CharacterEncoding enc = ceAnsi;
+  word32 lStart = 0;
+  if (lLen >= 2 && memcmp(pData, UNICODE_BOM, 2) == 0) {
+    enc = ceUtf16;
+    lStart = 2;
+  }
+  else if (lLen >= 2 && memcmp(pData, UNICODE_BOM_SWAPPED, 2) == 0) {
+    enc = ceUtf16BigEndian;
+    lStart = 2;
+  }
+  else if (lLen >= 3 && memcmp(pData, UTF8_BOM, 3) == 0) {
+    enc = ceUtf8;
+    lStart = 3;
+  }
+
+  // ANSI text in multi-byte code pages must be decoded first
+  if (enc == ceAnsi && isDBCSCodePage()) {
+    CountFileDBCS(sFileName);
+    return;
+  }
+
+  NGramState state = { 0, 0 };
+  while (pData != nullptr) {
+    CountView(pData + lStart, lLen - lStart, enc, state);
+    lStart = 0;
+    pData = file.ReadNext(lLen);
+  }
+}
+//---------------------------------------------------------------------------
+// scales down counts so that their sum does not exceed a limit; non-zero
+// counts remain non-zero
+static word32 scaleCounts(const word64* pCounts,
+  word32 lNum,
+  word64 qLimit,
+  word32* pDest)
+{
+  word64 qTotal = 0;
+  for (word32 lI = 0; lI < lNum; lI++)
+    qTotal += pCounts[lI];
+
+  // reserve space for rounding up small counts to 1
+  qLimit -= lNum;
+  const word64 qDiv = (qTotal <= qLimit) ? 1 : qTotal / qLimit + 1;
+
+  word32 lTotal = 0;
+  for (word32 lI = 0; lI < lNum; lI++) {
+    word64 qCount = pCounts[lI];
+    pDest[lI] = (qCount == 0) ? 0 : std::max<word64>(1, qCount / qDiv);
+    lTotal += pDest[lI];
+  }
+
+  return lTotal;
+}
+//---------------------------------------------------------------------------
+word32 ScaleNGramCounts(const std::vector<word64>& counts,
+  std::vector<word32>& dest)
+{
+  dest.resize(counts.size());
+  if (counts.empty())
+    return 0;
+
+  return scaleCounts(&counts[0], counts.size(), 0xffffffffull, &dest[0]);
+}
+//---------------------------------------------------------------------------
+double CalcNGramEntropy(const std::vector<word64>& counts,
+  int nOrder)
+{
+  word64 qTotal = 0;
+  for (word64 qCount : counts)
+    qTotal += qCount;
+
+  if (qTotal == 0)
+    return 0;
+
+  double dEntropy = 0;
+  for (word64 qCount : counts) {
+    if (qCount != 0) {
+      double dProb = static_cast<double>(qCount) / qTotal;
+      dEntropy += dProb * std::log2(dProb);
+    }
+  }
+
+  return -dEntropy / nOrder;
+}
+//---------------------------------------------------------------------------
+// calculates the entropy of a context from the letter weights realized by
+// its alias table
+static double calcContextEntropy(const word32* pKeys,
+  word32 lWeight,
+  const word32* pThresholds,
+  const word32* pNext,
+  const word32* pAliasNext,
+  word32 lNumEntries)
+{
+  word64 weights[NGRAM_ALPHABET_SIZE] = { 0 };
+  for (word32 lI = 0; lI < lNumEntries; lI++) {
+    weights[pKeys[pNext[lI]] % NGRAM_ALPHABET_SIZE] += pThresholds[lI];
+    weights[pKeys[pAliasNext[lI]] % NGRAM_ALPHABET_SIZE] +=
+      lWeight - pThresholds[lI];
+  }
+
+  const double dTotal = static_cast<double>(lWeight) * lNumEntries;
+  double dEntropy = 0;
+  for (int nI = 0; nI < NGRAM_ALPHABET_SIZE; nI++) {
+    if (weights[nI] != 0) {
+      double dProb = weights[nI] / dTotal;
+      dEntropy -= dProb * std::log2(dProb);
+    }
+  }
+
+  return dEntropy;
+}
+//---------------------------------------------------------------------------
+double WriteNGramModelFile(const WString& sFileName,
+  int nOrder,
+  const std::vector<word64>& counts)
+{
+  if (nOrder < NGRAM_MIN_ORDER || nOrder > NGRAM_MAX_ORDER ||
+      counts.size() != POW26[nOrder])
+    throw Exception("Invalid n-gram order");
+
+  const word32 lNumContextsMax = POW26[nOrder - 1];
+  const word32 lSuccMod = POW26[nOrder - 2];
+
+  // remove contexts without successors: a context is active if at least one
+  // of its n-grams leads to another active context
+  std::vector<bool> active(lNumContextsMax, false);
+  for (word32 lCtx = 0; lCtx < lNumContextsMax; lCtx++) {
+    const word64* pCounts = &counts[lCtx * NGRAM_ALPHABET_SIZE];
+    active[lCtx] = std::any_of(pCounts, pCounts + NGRAM_ALPHABET_SIZE,
+      [](word64 qCount) { return qCount != 0; });
+  }
+
+  bool blChanged;
+  do {
+    blChanged = false;
+    for (word32 lCtx = 0; lCtx < lNumContextsMax; lCtx++) {
+      if (!active[lCtx])
+        continue;
+      const word64* pCounts = &counts[lCtx * NGRAM_ALPHABET_SIZE];
+      const word32 lSuccBase = (lCtx % lSuccMod) * NGRAM_ALPHABET_SIZE;
+      int nI = 0;
+      while (nI < NGRAM_ALPHABET_SIZE &&
+             (pCounts[nI] == 0 || !active[lSuccBase + nI]))
+        nI++;
+      if (nI == NGRAM_ALPHABET_SIZE) {
+        active[lCtx] = false;
+        blChanged = true;
+      }
+    }
+  } while (blChanged);
+
+  std::vector<word32> contextIndex(lNumContextsMax, 0);
+  std::vector<word32> contextKeys;
+  for (word32 lCtx = 0; lCtx < lNumContextsMax; lCtx++) {
+    if (active[lCtx]) {
+      contextIndex[lCtx] = contextKeys.size();
+      contextKeys.push_back(lCtx);
+    }
+  }
+
+  const word32 lNumContexts = contextKeys.size();
+  if (lNumContexts == 0)
+    throw Exception("Source file does not contain enough n-grams");
+
+  std::vector<word32> weights(lNumContexts), startWeights(lNumContexts),
+    offsets(lNumContexts + 1), thresholds, next, aliasNext;
+  std::vector<word64> contextTotals(lNumContexts);
+  std::vector<double> contextEntropies(lNumContexts);
+
+  for (word32 lI = 0; lI < lNumContexts; lI++) {
+    const word32 lCtx = contextKeys[lI];
+    const word64* pCounts = &counts[lCtx * NGRAM_ALPHABET_SIZE];
+    const word32 lSuccBase = (lCtx % lSuccMod) * NGRAM_ALPHABET_SIZE;
+
+    word64 entryCounts[NGRAM_ALPHABET_SIZE];
+    word32 entrySucc[NGRAM_ALPHABET_SIZE];
+    word32 lNumEntries = 0;
+    for (int nI = 0; nI < NGRAM_ALPHABET_SIZE; nI++) {
+      if (pCounts[nI] != 0 && active[lSuccBase + nI]) {
+        entryCounts[lNumEntries] = pCounts[nI];
+        entrySucc[lNumEntries++] = contextIndex[lSuccBase + nI];
+        contextTotals[lI] += pCounts[nI];
+      }
+    }
+
+    // scale the weights so that a single random number in the range
+    // [0, k*W) suffices for selecting a letter
+    word32 entryWeights[NGRAM_ALPHABET_SIZE];
+    const word32 lWeight = scaleCounts(entryCounts, lNumEntries,
+      0xffffffffu / lNumEntries, entryWeights);
+
+    // build alias table (Vose's method) with integer arithmetic: each entry
+    // represents a total weight of W, distributed between the entry itself
+    // (weight = threshold) and its alias (weight = W - threshold)
+    word64 scaled[NGRAM_ALPHABET_SIZE];
+    word32 small[NGRAM_ALPHABET_SIZE], large[NGRAM_ALPHABET_SIZE];
+    word32 lNumSmall = 0, lNumLarge = 0;
+    word32 entryThresh[NGRAM_ALPHABET_SIZE], entryAlias[NGRAM_ALPHABET_SIZE];
+    for (word32 lJ = 0; lJ < lNumEntries; lJ++) {
+      scaled[lJ] = static_cast<word64>(entryWeights[lJ]) * lNumEntries;
+      entryThresh[lJ] = lWeight;
+      entryAlias[lJ] = entrySucc[lJ];
+      if (scaled[lJ] < lWeight)
+        small[lNumSmall++] = lJ;
+      else
+        large[lNumLarge++] = lJ;
+    }
+    while (lNumSmall != 0 && lNumLarge != 0) {
+      word32 lSmall = small[--lNumSmall];
+      word32 lLarge = large[lNumLarge - 1];
+      entryThresh[lSmall] = scaled[lSmall];
+      entryAlias[lSmall] = entrySucc[lLarge];
+      scaled[lLarge] -= lWeight - scaled[lSmall];
+      if (scaled[lLarge] < lWeight) {
+        lNumLarge--;
+        small[lNumSmall++] = lLarge;
+      }
+    }
+
+    weights[lI] = lWeight;
+    offsets[lI] = thresholds.size();
+    for (word32 lJ = 0; lJ < lNumEntries; lJ++) {
+      thresholds.push_back(entryThresh[lJ]);
+      next.push_back(entrySucc[lJ]);
+      aliasNext.push_back(entryAlias[lJ]);
+    }
+
+    contextEntropies[lI] = calcContextEntropy(&contextKeys[0], lWeight,
+      &thresholds[offsets[lI]], &next[offsets[lI]], &aliasNext[offsets[lI]],
+      lNumEntries);
+  }
+  offsets[lNumContexts] = thresholds.size();
+
+  const word32 lTotal = scaleCounts(&contextTotals[0], lNumContexts,
+    0xffffffffull, &startWeights[0]);
+
+  double dEntropy = 0;
+  word32 lCumWeight = 0;
+  for (word32 lI = 0; lI < lNumContexts; lI++) {
+    dEntropy += contextEntropies[lI] * startWeights[lI] / lTotal;
+    lCumWeight += startWeights[lI];
+    startWeights[lI] = lCumWeight;
+  }
+
+  if (dEntropy < 1.0)
+    throw Exception("Source file does not contain enough n-grams");
+
+  NGramModelHeader header;
+  memcpy(header.Magic, "PWNG", 4);
+  header.Version = NGRAM_MODEL_VERSION;
+  header.Order = nOrder;
+  header.NumContexts = lNumContexts;
+  header.NumEntries = thresholds.size();
+  header.Reserved = 0;
+  header.Entropy = dEntropy;
+
+  auto pFile = std::make_unique<TFileStream>(sFileName, fmCreate);
+  pFile->WriteBuffer(&header, sizeof(header));
+  for (const auto* pArray : { &contextKeys, &weights, &startWeights, &offsets,
+       &thresholds, &next, &aliasNext })
+    pFile->WriteBuffer(&(*pArray)[0], pArray->size() * sizeof(word32));
+
+  return dEntropy;
+}
+//---------------------------------------------------------------------------
+NGramModel::NGramModel()
+{
+  Clear();
+}
+//---------------------------------------------------------------------------
+NGramModel::~NGramModel()
+{
+}
+//---------------------------------------------------------------------------
+void NGramModel::Clear(void)
+{
+  m_pFile.reset();
+  m_copy.clear();
+  m_nOrder = 0;
+  m_lNumContexts = m_lNumEntries = 0;
+  m_dEntropy = m_dMinEntropy = 0;
+  m_entropies.clear();
+  m_pKeys = m_pWeights = m_pStartWeights = m_pOffsets = nullptr;
+  m_pThresholds = m_pNext = m_pAliasNext = nullptr;
+}
+//---------------------------------------------------------------------------
+bool NGramModel::Init(const word8* pData,
+  word64 qSize)
+{
+  NGramModelHeader header;
+  if (qSize < sizeof(header))
+    return false;
+
+  memcpy(&header, pData, sizeof(header));
+
+  if (memcmp(header.Magic, "PWNG", 4) != 0 ||
+      header.Version != NGRAM_MODEL_VERSION ||
+      header.Order < NGRAM_MIN_ORDER || header.Order > NGRAM_MAX_ORDER)
+    return false;
+
+  const word32 lNumContextsMax = POW26[header.Order - 1];
+  const word32 lSuccMod = POW26[header.Order - 2];
+  const word32 lNumContexts = header.NumContexts;
+  const word32 lNumEntries = header.NumEntries;
+
+  if (lNumContexts == 0 || lNumContexts > lNumContextsMax ||
+      lNumEntries < lNumContexts ||
+      lNumEntries > lNumContexts * NGRAM_ALPHABET_SIZE ||
+      qSize != sizeof(header) + (4ull * lNumContexts + 1 + 3ull * lNumEntries) *
+      sizeof(word32))
+    return false;
+
+  const word32* p = reinterpret_cast<const word32*>(pData + sizeof(header));
+  const word32* pKeys = p;
+  const word32* pWeights = pKeys + lNumContexts;
+  const word32* pStartWeights = pWeights + lNumContexts;
+  const word32* pOffsets = pStartWeights + lNumContexts;
+  const word32* pThresholds = pOffsets + lNumContexts + 1;
+  const word32* pNext = pThresholds + lNumEntries;
+  const word32* pAliasNext = pNext + lNumEntries;
+
+  if (pOffsets[0] != 0 || pOffsets[lNumContexts] != lNumEntries)
+    return false;
+
+  for (word32 lI = 0; lI < lNumContexts; lI++) {
+    if (pKeys[lI] >= lNumContextsMax || (lI > 0 && pKeys[lI] <= pKeys[lI - 1]))
+      return false;
+    if (pStartWeights[lI] <= (lI > 0 ? pStartWeights[lI - 1] : 0))
+      return false;
+  }
+
+  double dEntropy = 0;
+  const double dTotal = pStartWeights[lNumContexts - 1];
+  std::vector<double> contextEntropies(lNumContexts);
+
+  for (word32 lI = 0; lI < lNumContexts; lI++) {
+    const word32 lOffset = pOffsets[lI];
+    if (pOffsets[lI + 1] <= lOffset ||
+        pOffsets[lI + 1] - lOffset > NGRAM_ALPHABET_SIZE)
+      return false;
+    const word32 lNum = pOffsets[lI + 1] - lOffset;
+    const word32 lWeight = pWeights[lI];
+    if (lWeight == 0 || static_cast<word64>(lWeight) * lNum > 0xffffffffull)
+      return false;
+
+    // successors must continue the context
+    const word32 lSuccPrefix = pKeys[lI] % lSuccMod;
+    for (word32 lJ = lOffset; lJ < lOffset + lNum; lJ++) {
+      if (pThresholds[lJ] > lWeight ||
+          pNext[lJ] >= lNumContexts || pAliasNext[lJ] >= lNumContexts ||
+          pKeys[pNext[lJ]] / NGRAM_ALPHABET_SIZE != lSuccPrefix ||
+          pKeys[pAliasNext[lJ]] / NGRAM_ALPHABET_SIZE != lSuccPrefix)
+        return false;
+    }
+
+    const double dStartWeight = pStartWeights[lI] -
+      (lI > 0 ? pStartWeights[lI - 1] : 0);
+    contextEntropies[lI] = calcContextEntropy(pKeys, lWeight,
+      pThresholds + lOffset, pNext + lOffset, pAliasNext + lOffset, lNum);
+    dEntropy += contextEntropies[lI] * dStartWeight / dTotal;
+  }
+
+  // the header contains the conditional entropy averaged over the start
+  // distribution, which only serves as a check of the model
+  if (dEntropy < 1.0 || dEntropy > std::log2(26.0) ||
+      std::fabs(dEntropy - header.Entropy) > 1e-6)
+    return false;
+
+  m_nOrder = header.Order;
+  m_lNumContexts = lNumContexts;
+  m_lNumEntries = lNumEntries;
+  m_pKeys = pKeys;
+  m_pWeights = pWeights;
+  m_pStartWeights = pStartWeights;
+  m_pOffsets = pOffsets;
+  m_pThresholds = pThresholds;
+  m_pNext = pNext;
+  m_pAliasNext = pAliasNext;
+
+  CalcEntropies(contextEntropies);
+
+  return true;
+}
+//---------------------------------------------------------------------------
+void NGramModel::CalcEntropies(const std::vector<double>& contextEntropies)
+{
+  const int nContextLen = m_nOrder - 1;
+  const double dTotal = m_pStartWeights[m_lNumContexts - 1];
+
+  m_entropies.assign(NGRAM_EXACT_ENTROPY_LEN + 1, 0);
+
+  std::vector<double> prob(m_lNumContexts), nextProb(m_lNumContexts);
+  for (word32 lI = 0; lI < m_lNumContexts; lI++)
+    prob[lI] = (m_pStartWeights[lI] -
+      (lI > 0 ? m_pStartWeights[lI - 1] : 0)) / dTotal;
+
+  // first n-1 letters: entropy of the prefixes of the start contexts; the
+  // keys are sorted, so contexts with the same prefix are adjacent
+  for (int nLen = 1; nLen <= nContextLen; nLen++) {
+    const word32 lDiv = POW26[nContextLen - nLen];
+    double dEntropy = 0, dPrefixProb = 0;
+    for (word32 lI = 0; lI < m_lNumContexts; lI++) {
+      dPrefixProb += prob[lI];
+      if (lI + 1 == m_lNumContexts ||
+          m_pKeys[lI + 1] / lDiv != m_pKeys[lI] / lDiv) {
+        dEntropy -= dPrefixProb * std::log2(dPrefixProb);
+        dPrefixProb = 0;
+      }
+    }
+    m_entropies[nLen] = dEntropy;
+  }
+
+  // further letters: add the conditional entropy for the distribution of
+  // the preceding context, then propagate the distribution to the next
+  // position
+  for (int nLen = nContextLen + 1; nLen <= NGRAM_EXACT_ENTROPY_LEN; nLen++) {
+    double dEntropy = 0;
+    std::fill(nextProb.begin(), nextProb.end(), 0.0);
+    for (word32 lI = 0; lI < m_lNumContexts; lI++) {
+      if (prob[lI] == 0)
+        continue;
+      dEntropy += prob[lI] * contextEntropies[lI];
+      const word32 lOffset = m_pOffsets[lI];
+      const word32 lNum = m_pOffsets[lI + 1] - lOffset;
+      const word32 lWeight = m_pWeights[lI];
+      const double dScale = prob[lI] / (static_cast<double>(lWeight) * lNum);
+      for (word32 lJ = lOffset; lJ < lOffset + lNum; lJ++) {
+        nextProb[m_pNext[lJ]] += dScale * m_pThresholds[lJ];
+        nextProb[m_pAliasNext[lJ]] += dScale * (lWeight - m_pThresholds[lJ]);
+      }
+    }
+    m_entropies[nLen] = m_entropies[nLen - 1] + dEntropy;
+    prob.swap(nextProb);
+  }
+
+  // every context may be reached in longer sequences
+  m_dMinEntropy = *std::min_element(contextEntropies.begin(),
+    contextEntropies.end());
+
+  m_dEntropy = m_entropies[1];
+  for (int nLen = 2; nLen <= NGRAM_EXACT_ENTROPY_LEN; nLen++)
+    m_dEntropy = std::min(m_dEntropy, m_entropies[nLen] / nLen);
+}
+//---------------------------------------------------------------------------
+double NGramModel::Entropy(int nLength) const
+{
+  if (nLength < 1 || m_entropies.empty())
+    return 0;
+
+  if (nLength <= NGRAM_EXACT_ENTROPY_LEN)
+    return m_entropies[nLength];
+
+  return m_entropies[NGRAM_EXACT_ENTROPY_LEN] +
+    (nLength - NGRAM_EXACT_ENTROPY_LEN) * m_dMinEntropy;
+}
+//---------------------------------------------------------------------------
+bool NGramModel::Load(const WString& sFileName)
+{
+  Clear();
+
+  auto pFile = std::make_unique<MappedFile>(sFileName, NGRAM_MAX_MODEL_SIZE);
+  const word64 qSize = pFile->Size();
+  if (qSize < sizeof(NGramModelHeader) || qSize > NGRAM_MAX_MODEL_SIZE)
+    return false;
+
+  word32 lLen;
+  const word8* pData = pFile->ReadNext(lLen);
+  if (pData == nullptr)
+    return false;
+
+  if (lLen == qSize)
+    m_pFile = std::move(pFile);
+  else {
+    // file could not be mapped as a whole: keep a copy in memory
+    m_copy.resize((qSize + 3) / 4);
+    word8* pCopy = reinterpret_cast<word8*>(&m_copy[0]);
+    word64 qPos = 0;
+    while (pData != nullptr) {
+      if (qPos + lLen > qSize)
+        return false;
+      memcpy(pCopy + qPos, pData, lLen);
+      qPos += lLen;
+      pData = pFile->ReadNext(lLen);
+    }
+    if (qPos != qSize)
+      return false;
+    pData = pCopy;
+  }
+
+  if (!Init(pData, qSize)) {
+    Clear();
+    return false;
+  }
+
+  return true;
+}
+//---------------------------------------------------------------------------
+void NGramModel::Generate(RandomGenerator* pRandGen,
+  word8* pDest,
+  int nLength) const
+{
+  if (nLength < 1 || m_lNumContexts == 0)
+    return;
+
+  // select the first n-1 letters according to the start weights
+  const word32* pStartEnd = m_pStartWeights + m_lNumContexts;
+  word32 lRand = pRandGen->GetNumRange(pStartEnd[-1]);
+  word32 lCtx = std::upper_bound(m_pStartWeights, pStartEnd, lRand) -
+    m_pStartWeights;
+
+  const int nContextLen = m_nOrder - 1;
+  word32 lKey = m_pKeys[lCtx];
+  for (int nI = nContextLen - 1; nI >= 0; nI--) {
+    if (nI < nLength)
+      pDest[nI] = lKey % NGRAM_ALPHABET_SIZE;
+    lKey /= NGRAM_ALPHABET_SIZE;
+  }
+
+  for (int nI = nContextLen; nI < nLength; nI++) {
+    const word32 lOffset = m_pOffsets[lCtx];
+    const word32 lWeight = m_pWeights[lCtx];
+    lRand = pRandGen->GetNumRange((m_pOffsets[lCtx + 1] - lOffset) * lWeight);
+    const word32 lEntry = lOffset + lRand / lWeight;
+    lCtx = (lRand % lWeight < m_pThresholds[lEntry]) ?
+      m_pNext[lEntry] : m_pAliasNext[lEntry];
+    pDest[nI] = m_pKeys[lCtx] % NGRAM_ALPHABET_SIZE;
+  }
+
+  lRand = lKey = lCtx = 0;
+}
+//---------------------------------------------------------------------------
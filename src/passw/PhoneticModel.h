@@ -0,0 +1,252 @@
+// PhoneticModel.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef PhoneticModelH
+#define PhoneticModelH
+//---------------------------------------------------------------------------
+#include <vector>
+#include <memory>
+#include "types.h"
+#include "UnicodeUtil.h"
+#include "RandomGenerator.h"
+
+class MappedFile;
+
+const int
+NGRAM_ALPHABET_SIZE = 26,
+NGRAM_MIN_ORDER     = 3,
+NGRAM_MAX_ORDER     = 5;
+
+// maximum password length for which NGramModel computes the entropy
+// exactly
+const int NGRAM_EXACT_ENTROPY_LEN = 128;
+
+// letters of the current word preceding the counting position
+struct NGramState {
+  word32 Index;   // n-gram index of the last NGRAM_MAX_ORDER-1 letters
+  int Letters;    // number of letters
+};
+
+// counts n-grams of letters (a..z, case-insensitive) in a text file, such
+// as a dictionary or word list
+// - words are separated by spaces, tabs and line breaks; n-grams consist of
+//   consecutive letters within a word, all other characters are ignored
+// - the file is mapped into memory, and each view is split at word
+//   boundaries into parts which are counted on multiple threads
+// - encodings: ANSI or UTF-8, UTF-16 (little/big endian) with BOM
+// - n-gram index: c_1 * 26^(n-1) + ... + c_n, where c_i = 0..25
+// - counting 5-grams requires dense tables of 26^5 entries (~48 MB per
+//   thread), so fewer threads are used in this case
+
+class NGramCounter
+{
+public:
+
+  // constructor
+  // -> max. order of n-grams to count (NGRAM_MIN_ORDER..NGRAM_MAX_ORDER);
+  //    n-grams of all orders from NGRAM_MIN_ORDER up to this value are
+  //    counted
+  NGramCounter(int nMaxOrder = NGRAM_MIN_ORDER);
+
+  // counts the n-grams in a file and adds them to the current counts
+  // throws EStreamError if the file cannot be read
+  // -> name of the file
+  void CountFile(const WString& sFileName);
+
+  // returns the counts of all n-grams of the given order (26^n entries)
+  const std::vector<word64>& GetCounts(int nOrder) const
+  {
+    return m_counts[nOrder - NGRAM_MIN_ORDER];
+  }
+
+  // returns the total number of n-grams of the given order
+  word64 GetTotal(int nOrder) const;
+
+private:
+  static const int NUM_ORDERS = NGRAM_MAX_ORDER - NGRAM_MIN_ORDER + 1;
+
+  int m_nMaxOrder;
+  std::vector<word64> m_counts[NUM_ORDERS];
+  // counts of the current view per thread (index: thread, order)
+  std::vector<std::vector<word32>> m_threadCounts;
+
+  word32* GetThreadCounts(word32 lThread,
+    int nOrder)
+  {
+    return &m_threadCounts[lThread * NUM_ORDERS + nOrder - NGRAM_MIN_ORDER][0];
+  }
+
+  void CountRange(const word8* p,
+    const word8* pEnd,
+    CharacterEncoding enc,
+    NGramState& state,
+    word32 lThread);
+  void CountView(const word8* pData,
+    word32 lLen,
+    CharacterEncoding enc,
+    NGramState& state);
+  void CountFileDBCS(const WString& sFileName);
+  word32 MaxThreads(void) const;
+  void AllocThreadCounts(word32 lNumThreads);
+  void MergeThreadCounts(word32 lNumThreads);
+};
+
+// scales down n-gram counts so that their sum fits into 32 bits; non-zero
+// counts remain non-zero
+// -> n-gram counts
+// -> receives the scaled counts
+// <- sum of the scaled counts
+word32 ScaleNGramCounts(const std::vector<word64>& counts,
+  std::vector<word32>& dest);
+
+// calculates the entropy per letter of an n-gram distribution according to
+//   E = -1/n * \sum_i p_i * log_2(p_i)   (for all p_i != 0)
+// -> n-gram counts
+// -> order n
+double CalcNGramEntropy(const std::vector<word64>& counts,
+  int nOrder);
+
+const word32 NGRAM_MODEL_VERSION = 2;
+
+struct NGramModelHeader {
+  char Magic[4];
+  word32 Version;
+  word32 Order;
+  word32 NumContexts;
+  word32 NumEntries;
+  word32 Reserved;
+  double Entropy;
+};
+
+static_assert(sizeof(NGramModelHeader) == 32, "Invalid n-gram header size");
+
+// creates a sparse n-gram model file which can be used by NGramModel
+// without any further processing; all numbers are little endian:
+//   header (32 bytes):
+//     magic "PWNG", format version (32-bit), order n (32-bit),
+//     number of contexts C (32-bit), number of entries E (32-bit),
+//     reserved (32-bit), conditional entropy per letter (64-bit double)
+//   C context keys: indices of the (n-1)-letter contexts, in ascending order
+//   C context weights W_i: sum of the letter weights of context i;
+//     (no. of entries of context i) * W_i < 2^32
+//   C start weights: cumulative weights of the contexts for selecting the
+//     first n-1 letters (the last value is the total weight)
+//   C+1 entry offsets: the entries of context i are stored at positions
+//     offset[i]..offset[i+1]-1
+//   E thresholds, E successors, E alias successors: alias table of each
+//     context (one entry for each letter following the context); the
+//     successors are the indices of the contexts reached by appending the
+//     letter of an entry or its alias, respectively
+// all values are 32-bit integers. Contexts without successors ("dead ends")
+// are removed from the model, so that every generated context is contained
+// in the model.
+// throws an exception in case of errors
+// -> name of the file
+// -> order n (NGRAM_MIN_ORDER..NGRAM_MAX_ORDER)
+// -> n-gram counts (26^n entries)
+// <- conditional entropy per letter
+double WriteNGramModelFile(const WString& sFileName,
+  int nOrder,
+  const std::vector<word64>& counts);
+
+// class NGramModel: generation of phonetic passwords with an n-gram model
+// created by WriteNGramModelFile()
+// features:
+//   - the file is mapped into memory and used in place; only the header is
+//     validated and the entropy recomputed when loading
+//   - each letter is generated in constant time with the alias method: one
+//     random number in the range [0, k*W) (k = no. of entries, W = context
+//     weight) selects an entry and decides between the entry and its alias
+//   - the entropy of a password of length L is computed from the
+//     probabilities realized by the start weights and alias tables:
+//       E(L) = H(ctx_1) + \sum_{t=n}^{L} \sum_i p_t(ctx_i) * H(letter|ctx_i)
+//     with H(ctx_1) being the entropy of the first n-1 letters (selected
+//     together from the start distribution) and p_t the distribution of the
+//     context preceding letter t, propagated through the alias tables;
+//     for L < n-1, E(L) is the entropy of the L-letter prefixes
+//   - E(L) is exact for L <= NGRAM_EXACT_ENTROPY_LEN; each further letter
+//     adds the minimum conditional entropy of all contexts, which is a lower
+//     bound
+
+class NGramModel
+{
+public:
+
+  // constructor
+  NGramModel();
+
+  // destructor
+  ~NGramModel();
+
+  // loads a model file
+  // throws EStreamError if the file cannot be read
+  // -> name of the file
+  // <- 'true' if the file is valid
+  bool Load(const WString& sFileName);
+
+  // generates a sequence of letters
+  // -> random generator
+  // -> receives the letters (0..25)
+  // -> number of letters to generate
+  void Generate(RandomGenerator* pRandGen,
+    word8* pDest,
+    int nLength) const;
+
+  int Order(void) const
+  {
+    return m_nOrder;
+  }
+
+  // entropy of a sequence of letters
+  // -> number of letters
+  // <- entropy bits (exact or lower bound, see above)
+  double Entropy(int nLength) const;
+
+  // minimum of E(L)/L for L <= NGRAM_EXACT_ENTROPY_LEN (see above); only
+  // for displaying the entropy per letter, use Entropy(int) for passwords
+  double Entropy(void) const
+  {
+    return m_dEntropy;
+  }
+
+private:
+  std::unique_ptr<MappedFile> m_pFile;
+  std::vector<word32> m_copy;
+  int m_nOrder;
+  word32 m_lNumContexts;
+  word32 m_lNumEntries;
+  double m_dEntropy;
+  double m_dMinEntropy;
+  std::vector<double> m_entropies;
+  const word32* m_pKeys;
+  const word32* m_pWeights;
+  const word32* m_pStartWeights;
+  const word32* m_pOffsets;
+  const word32* m_pThresholds;
+  const word32* m_pNext;
+  const word32* m_pAliasNext;
+
+  bool Init(const word8* pData,
+    word64 qSize);
+  void CalcEntropies(const std::vector<double>& contextEntropies);
+  void Clear(void);
+};
+
+#endif
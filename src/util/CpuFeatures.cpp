@@ -0,0 +1,49 @@
+// CpuFeatures.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#pragma hdrstop
+
+#include "CpuFeatures.h"
+
+#ifdef CPU_X86_SIMD
+#include <cpuid.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static CpuFeatures detectCpuFeatures(void)
+{
+  CpuFeatures features = { false, false };
+#ifdef CPU_X86_SIMD
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    features.SSE2 = (edx & bit_SSE2) != 0;
+    features.SSSE3 = (ecx & bit_SSSE3) != 0;
+  }
+#endif
+  return features;
+}
+//---------------------------------------------------------------------------
+const CpuFeatures& GetCpuFeatures(void)
+{
+  static const CpuFeatures features = detectCpuFeatures();
+  return features;
+}
+//---------------------------------------------------------------------------
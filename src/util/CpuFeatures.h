@@ -0,0 +1,44 @@
+// CpuFeatures.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef CpuFeaturesH
+#define CpuFeaturesH
+//---------------------------------------------------------------------------
+
+// SIMD code paths are compiled with function-specific target attributes and
+// selected at runtime, so that the program still runs on CPUs without the
+// respective instruction set extensions
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define CPU_X86_SIMD
+#define TARGET_SSE2  __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+
+struct CpuFeatures {
+  bool SSE2;
+  bool SSSE3;
+};
+
+// detects the instruction set extensions supported by the CPU
+// <- supported features (detected once)
+const CpuFeatures& GetCpuFeatures(void);
+
+#endif
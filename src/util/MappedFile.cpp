@@ -0,0 +1,375 @@
+// MappedFile.cpp
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#include <vcl.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#pragma hdrstop
+
+#include "MappedFile.h"
+#include "Language.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const word32
+  VIEW_ALIGNMENT    = 65536, // allocation granularity on Windows
+  BUFFER_SIZE       = 1 << 20,
+  MAX_CARRY_SIZE    = 65536;
+
+//---------------------------------------------------------------------------
+MappedFile::MappedFile(const WString& sFileName,
+  word32 lViewSize)
+  : m_blMapped(false), m_pView(nullptr), m_lViewLen(0), m_qSize(0), m_qPos(0)
+{
+  lViewSize = std::max(lViewSize, VIEW_ALIGNMENT);
+  m_lViewSize = (lViewSize + VIEW_ALIGNMENT - 1) & ~(VIEW_ALIGNMENT - 1);
+
+#ifdef _WIN32
+  m_hMapping = nullptr;
+  m_hFile = CreateFileW(sFileName.c_str(), GENERIC_READ, FILE_SHARE_READ,
+    nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (m_hFile == INVALID_HANDLE_VALUE)
+    throw EFOpenError(TRLFormat("Cannot open file \"%1\".", { sFileName }) +
+      " " + SysErrorMessage(GetLastError()));
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(m_hFile, &size)) {
+    CloseHandle(m_hFile);
+    throw EFOpenError(TRLFormat("Cannot determine size of file \"%1\".",
+      { sFileName }));
+  }
+  m_qSize = size.QuadPart;
+
+  // mapping objects cannot be created for empty files
+  if (m_qSize != 0) {
+    m_hMapping = CreateFileMappingW(m_hFile, nullptr, PAGE_READONLY, 0, 0,
+      nullptr);
+    m_blMapped = m_hMapping != nullptr;
+  }
+#else
+  m_nFile = open(UTF8String(sFileName).c_str(), O_RDONLY | O_CLOEXEC);
+  if (m_nFile < 0)
+    throw EFOpenError(TRLFormat("Cannot open file \"%1\".", { sFileName }) +
+      " " + SysErrorMessage(errno));
+
+  struct stat st;
+  if (fstat(m_nFile, &st) != 0) {
+    close(m_nFile);
+    throw EFOpenError(TRLFormat("Cannot determine size of file \"%1\".",
+      { sFileName }));
+  }
+  m_qSize = st.st_size;
+  m_blMapped = S_ISREG(st.st_mode) && m_qSize != 0;
+  if (!m_blMapped)
+    posix_fadvise(m_nFile, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+//---------------------------------------------------------------------------
+MappedFile::~MappedFile()
+{
+  UnmapView();
+  CloseMapping();
+#ifdef _WIN32
+  CloseHandle(m_hFile);
+#else
+  close(m_nFile);
+#endif
+}
+//---------------------------------------------------------------------------
+bool MappedFile::MapView(word32 lLen)
+{
+#ifdef _WIN32
+  m_pView = reinterpret_cast<word8*>(MapViewOfFile(m_hMapping, FILE_MAP_READ,
+    static_cast<DWORD>(m_qPos >> 32), static_cast<DWORD>(m_qPos), lLen));
+  if (m_pView == nullptr)
+    return false;
+#else
+  void* pView = mmap(nullptr, lLen, PROT_READ, MAP_PRIVATE, m_nFile, m_qPos);
+  if (pView == MAP_FAILED)
+    return false;
+  // let the kernel read ahead aggressively and drop pages already processed
+  madvise(pView, lLen, MADV_SEQUENTIAL);
+  m_pView = reinterpret_cast<word8*>(pView);
+#endif
+  m_lViewLen = lLen;
+  return true;
+}
+//---------------------------------------------------------------------------
+void MappedFile::UnmapView(void)
+{
+  if (m_pView != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(m_pView);
+#else
+    munmap(m_pView, m_lViewLen);
+#endif
+    m_pView = nullptr;
+    m_lViewLen = 0;
+  }
+}
+//---------------------------------------------------------------------------
+void MappedFile::CloseMapping(void)
+{
+#ifdef _WIN32
+  if (m_hMapping != nullptr) {
+    CloseHandle(m_hMapping);
+    m_hMapping = nullptr;
+  }
+#endif
+  m_blMapped = false;
+}
+//---------------------------------------------------------------------------
+word32 MappedFile::ReadBuffer(word32 lLen)
+{
+  if (m_buf.IsEmpty())
+    m_buf.New(BUFFER_SIZE);
+
+  lLen = std::min(lLen, m_buf.Size());
+
+#ifdef _WIN32
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = static_cast<DWORD>(m_qPos);
+  ov.OffsetHigh = static_cast<DWORD>(m_qPos >> 32);
+  DWORD dwBytesRead;
+  if (!ReadFile(m_hFile, m_buf, lLen, &dwBytesRead, &ov) &&
+      GetLastError() != ERROR_HANDLE_EOF)
+    throw EReadError(SysErrorMessage(GetLastError()));
+  return dwBytesRead;
+#else
+  ssize_t nBytesRead;
+  do {
+    nBytesRead = pread(m_nFile, m_buf, lLen, m_qPos);
+  } while (nBytesRead < 0 && errno == EINTR);
+  if (nBytesRead < 0)
+    throw EReadError(SysErrorMessage(errno));
+  return nBytesRead;
+#endif
+}
+//---------------------------------------------------------------------------
+const word8* MappedFile::ReadNext(word32& lLen)
+{
+  UnmapView();
+
+  if (m_qPos >= m_qSize) {
+    lLen = 0;
+    return nullptr;
+  }
+
+  word32 lRequested = static_cast<word32>(
+    std::min<word64>(m_lViewSize, m_qSize - m_qPos));
+
+  if (m_blMapped) {
+    if (MapView(lRequested)) {
+      m_qPos += lRequested;
+      lLen = lRequested;
+      return m_pView;
+    }
+    // the view could not be mapped (e.g., address space is exhausted),
+    // so continue with buffered reads
+    CloseMapping();
+  }
+
+  lLen = ReadBuffer(lRequested);
+  if (lLen == 0)
+    return nullptr;
+
+  m_qPos += lLen;
+  return m_buf;
+}
+//---------------------------------------------------------------------------
+void MappedFile::Rewind(void)
+{
+  UnmapView();
+  m_qPos = 0;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+MappedTextReader::MappedTextReader(const WString& sFileName,
+  CharacterEncoding enc,
+  const char* pszSepChars)
+  : m_file(sFileName), m_enc((enc == ceUtf8) ? ceUtf8 : ceAnsi),
+    m_nCodeUnitSize(1), m_pData(nullptr), m_lDataLen(0), m_lDataPos(0),
+    m_lCarryLen(0)
+{
+  memset(m_sepChars, 0, sizeof(m_sepChars));
+  while (*pszSepChars != '\0') {
+    word8 bChar = *pszSepChars++;
+    if (bChar < 128)
+      m_sepChars[bChar] = true;
+  }
+
+  if (NextView()) {
+    if (m_lDataLen >= 2 && memcmp(m_pData, UNICODE_BOM, 2) == 0) {
+      m_enc = ceUtf16;
+      m_lDataPos = 2;
+    }
+    else if (m_lDataLen >= 2 && memcmp(m_pData, UNICODE_BOM_SWAPPED, 2) == 0) {
+      m_enc = ceUtf16BigEndian;
+      m_lDataPos = 2;
+    }
+    else if (m_lDataLen >= 3 && memcmp(m_pData, UTF8_BOM, 3) == 0) {
+      m_enc = ceUtf8;
+      m_lDataPos = 3;
+    }
+  }
+
+  m_nCodeUnitSize = (m_enc == ceUtf16 || m_enc == ceUtf16BigEndian) ? 2 : 1;
+}
+//---------------------------------------------------------------------------
+bool MappedTextReader::IsSeparator(const word8* p) const
+{
+  word32 lChar;
+  if (m_nCodeUnitSize == 1)
+    lChar = p[0];
+  else if (m_enc == ceUtf16)
+    lChar = p[0] | (p[1] << 8);
+  else
+    lChar = (p[0] << 8) | p[1];
+  return lChar < 128 && m_sepChars[lChar];
+}
+//---------------------------------------------------------------------------
+bool MappedTextReader::NextView(void)
+{
+  m_pData = m_file.ReadNext(m_lDataLen);
+  m_lDataPos = 0;
+  return m_pData != nullptr;
+}
+//---------------------------------------------------------------------------
+void MappedTextReader::AppendCarry(const word8* pSrc,
+  word32 lLen)
+{
+  if (lLen == 0)
+    return;
+  if (m_lCarryLen + lLen > MAX_CARRY_SIZE)
+    throw EMappedTextError(TRL("Unicode string too long"));
+  if (m_carry.IsEmpty())
+    m_carry.New(MAX_CARRY_SIZE);
+  memcpy(m_carry + m_lCarryLen, pSrc, lLen);
+  m_lCarryLen += lLen;
+}
+//---------------------------------------------------------------------------
+int MappedTextReader::ConvertString(const word8* pSrc,
+  word32 lLen,
+  wchar_t* pwszDest,
+  int nDestBufSize)
+{
+  int nResult;
+
+  switch (m_enc) {
+  case ceAnsi:
+    nResult = MultiByteToWideChar(CP_ACP, 0,
+      reinterpret_cast<const char*>(pSrc), lLen, pwszDest, nDestBufSize - 1);
+    break;
+  case ceUtf8:
+    // the decoder substitutes U+FFFD for malformed input and never fails,
+    // so validate explicitly
+    if (!IsValidUtf8(reinterpret_cast<const char*>(pSrc), lLen))
+      throw EMappedTextError(TRL("Invalid UTF-8 character encoding"));
+    nResult = GetUtf8DecodedLength(reinterpret_cast<const char*>(pSrc), lLen);
+    if (nResult < nDestBufSize)
+      Utf8ToWChar(reinterpret_cast<const char*>(pSrc), lLen, pwszDest);
+    else
+      nResult = 0;
+    break;
+  default:
+    if (lLen % 2 != 0)
+      throw EMappedTextError(TRL("Invalid UTF-16 character encoding"));
+    nResult = lLen / 2;
+    if (nResult >= nDestBufSize)
+      nResult = 0;
+    else if (m_enc == ceUtf16)
+      memcpy(pwszDest, pSrc, lLen);
+    else {
+      for (int i = 0; i < nResult; i++)
+        pwszDest[i] = (pSrc[2*i] << 8) | pSrc[2*i+1];
+    }
+  }
+
+  if (nResult == 0)
+    throw EMappedTextError(
+      TRL("Invalid ANSI or UTF-8 character encoding, or Unicode string too long"));
+
+  pwszDest[nResult] = '\0';
+
+  return nResult;
+}
+//---------------------------------------------------------------------------
+int MappedTextReader::ReadString(wchar_t* pwszDest,
+  int nDestBufSize)
+{
+  if (nDestBufSize < 1)
+    return 0;
+
+  const word32 lUnit = m_nCodeUnitSize;
+
+  while (true) {
+    if (m_lDataPos >= m_lDataLen) {
+      if (NextView())
+        continue;
+
+      // end of file: return the remaining string, if any
+      if (m_lCarryLen == 0)
+        return 0;
+      word32 lLen = m_lCarryLen;
+      m_lCarryLen = 0;
+      return ConvertString(m_carry, lLen, pwszDest, nDestBufSize);
+    }
+
+    const word8* pEnd = m_pData + m_lDataLen;
+    const word8* p = m_pData + m_lDataPos;
+
+    // skip separators unless a string from the previous view is continued
+    if (m_lCarryLen == 0) {
+      while (p + lUnit <= pEnd && IsSeparator(p))
+        p += lUnit;
+    }
+
+    const word8* pStart = p;
+    while (p + lUnit <= pEnd && !IsSeparator(p))
+      p += lUnit;
+
+    if (p + lUnit > pEnd) {
+      // string continues in the next view (or is the last one in the file)
+      AppendCarry(pStart, pEnd - pStart);
+      m_lDataPos = m_lDataLen;
+      continue;
+    }
+
+    m_lDataPos = p + lUnit - m_pData;
+
+    if (m_lCarryLen != 0) {
+      AppendCarry(pStart, p - pStart);
+      word32 lLen = m_lCarryLen;
+      m_lCarryLen = 0;
+      return ConvertString(m_carry, lLen, pwszDest, nDestBufSize);
+    }
+
+    if (p != pStart)
+      return ConvertString(pStart, p - pStart, pwszDest, nDestBufSize);
+  }
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,180 @@
+// MappedFile.h
+//
+// PASSWORD TECH
+// Copyright (c) 2002-2024 by Christian Thoeing <c.thoeing@web.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+// 02111-1307, USA.
+//---------------------------------------------------------------------------
+#ifndef MappedFileH
+#define MappedFileH
+//---------------------------------------------------------------------------
+#include <Classes.hpp>
+#include "types.h"
+#include "SecureMem.h"
+#include "UnicodeUtil.h"
+
+// class MappedFile: sequential read-only access to (possibly huge) files
+// features:
+//   - the file is mapped into memory in consecutive views (file mapping
+//     objects on Windows, mmap() with MADV_SEQUENTIAL on POSIX systems), so
+//     that the data is accessed directly in the system cache without copying
+//   - only one view is mapped at a time, so files larger than the address
+//     space can be processed as well
+//   - if the file cannot be mapped, it is read into an internal buffer
+//     instead; callers don't have to distinguish both cases
+
+class MappedFile
+{
+public:
+  static const word32 DEFAULT_VIEW_SIZE = 16 << 20; // 16 MB
+
+  // constructor
+  // throws EFOpenError if the file cannot be opened
+  // -> name of the file to be opened
+  // -> max. size of a view (rounded up to a multiple of 64 KB)
+  MappedFile(const WString& sFileName,
+    word32 lViewSize = DEFAULT_VIEW_SIZE);
+
+  MappedFile(const MappedFile& other) = delete;
+  MappedFile& operator= (const MappedFile& other) = delete;
+
+  ~MappedFile();
+
+  // provides the next portion of the file
+  // throws EReadError if an I/O error occurred
+  // -> receives the number of bytes available
+  // <- pointer to the data (valid until the next call to ReadNext() or
+  //    Rewind()); nullptr at the end of the file
+  const word8* ReadNext(word32& lLen);
+
+  // sets the position to the beginning of the file
+  void Rewind(void);
+
+  // returns the file size in bytes
+  word64 Size(void) const
+  {
+    return m_qSize;
+  }
+
+  // returns the number of bytes provided so far
+  word64 Position(void) const
+  {
+    return m_qPos;
+  }
+
+  // checks whether the file is memory-mapped ('false' if the buffered
+  // fallback is used)
+  bool IsMapped(void) const
+  {
+    return m_blMapped;
+  }
+
+private:
+#ifdef _WIN32
+  void* m_hFile;
+  void* m_hMapping;
+#else
+  int m_nFile;
+#endif
+  bool m_blMapped;
+  word8* m_pView;
+  word32 m_lViewLen;
+  word32 m_lViewSize;
+  word64 m_qSize;
+  word64 m_qPos;
+  SecureMem<word8> m_buf;
+
+  bool MapView(word32 lLen);
+  void UnmapView(void);
+  void CloseMapping(void);
+  word32 ReadBuffer(word32 lLen);
+};
+
+
+class EMappedTextError : public EStreamError
+{
+public:
+
+  __fastcall EMappedTextError(const WString& sMsg)
+    : EStreamError(sMsg)
+  {
+  }
+};
+
+// class MappedTextReader: splits a text file into single strings (e.g.,
+// words or lines) delimited by separator characters, reading the file
+// via MappedFile
+// features:
+//   - identification of character encoding by byte-order mark (BOM); files
+//     without BOM are decoded as ANSI or UTF-8 as specified by the caller
+//   - strings are converted to UTF-16 directly from the mapped data; only
+//     strings crossing a view boundary are copied
+
+class MappedTextReader
+{
+public:
+
+  // constructor
+  // throws EFOpenError if the file cannot be opened
+  // -> name of the file to be opened
+  // -> character encoding if the file has no BOM (ANSI or UTF-8)
+  // -> characters separating the strings (ASCII only)
+  MappedTextReader(const WString& sFileName,
+    CharacterEncoding enc = ceAnsi,
+    const char* pszSepChars = "\n");
+
+  // reads the next string; empty strings between consecutive separators
+  // are skipped
+  // throws EMappedTextError if the string is too long or the encoding
+  // is invalid, and EReadError if an I/O error occurred
+  // -> pointer to the dest. buffer
+  // -> size (no. of characters, including '\0') of dest. buffer
+  // <- number of characters, 0 at the end of the file
+  int ReadString(wchar_t* pwszDest,
+    int nDestBufSize);
+
+  CharacterEncoding CharEncoding(void) const
+  {
+    return m_enc;
+  }
+
+  word64 FileSize(void) const
+  {
+    return m_file.Size();
+  }
+
+private:
+  MappedFile m_file;
+  CharacterEncoding m_enc;
+  int m_nCodeUnitSize;
+  bool m_sepChars[128];
+  const word8* m_pData;
+  word32 m_lDataLen;
+  word32 m_lDataPos;
+  SecureMem<word8> m_carry;
+  word32 m_lCarryLen;
+
+  bool IsSeparator(const word8* p) const;
+  bool NextView(void);
+  void AppendCarry(const word8* pSrc,
+    word32 lLen);
+  int ConvertString(const word8* pSrc,
+    word32 lLen,
+    wchar_t* pwszDest,
+    int nDestBufSize);
+};
+
+#endif
@@ -156,9 +156,7 @@ int script_phonetic(lua_State* L)
   SecureAnsiString asUtf8 = w32ToUtf8(sPassw);
   lua_pushstring(L, asUtf8);
 
-  double dPasswSec = s_pPasswGen->PhoneticEntropy;
-  dPasswSec = nLength *
-    ((nFlags & PASSW_FLAG_PHONETICMIXEDCASE) ? dPasswSec + 1 : dPasswSec);
+  double dPasswSec = s_pPasswGen->CalcPhoneticEntropy(nLength, nFlags);
 
   lua_pushnumber(L, dPasswSec);
 
@@ -211,3 +211,21 @@ void __fastcall TStringFileStreamW::WriteString(const wchar_t* pwszSrc,
   }
 }
 //---------------------------------------------------------------------------
+void __fastcall TStringFileStreamW::WriteAsciiString(const char* pszSrc,
+  int nStrLen)
+{
+  if (nStrLen < 1)
+    return;
+
+  if (m_enc == ceAnsi || m_enc == ceUtf8) {
+    if (Write(pszSrc, nStrLen) != nStrLen)
+      OutOfDiskSpaceError();
+  }
+  else {
+    SecureWString sWideBuf(nStrLen);
+    for (int nI = 0; nI < nStrLen; nI++)
+      sWideBuf[nI] = pszSrc[nI];
+    WriteString(sWideBuf, nStrLen);
+  }
+}
+//---------------------------------------------------------------------------
@@ -99,6 +99,14 @@ public:
   void __fastcall WriteString(const wchar_t* pwszSrc,
     int nStrLen);
 
+  // write ASCII string to file; ASCII strings are written directly to
+  // ANSI and UTF-8 files without transcoding
+  // throws exception if write error occurred
+  // -> pointer to the source buffer (8-bit string, characters < 0x80 only)
+  // -> string length (no. of characters)
+  void __fastcall WriteAsciiString(const char* pszSrc,
+    int nStrLen);
+
   // set file pointer to beginning of file
   void __fastcall FileBeginning(void)
   {
@@ -20,11 +20,17 @@
 //---------------------------------------------------------------------------
 #include <vcl.h>
 #include <vector>
+#include <algorithm>
 #include <stdio.h>
 #pragma hdrstop
 
 #include "UnicodeUtil.h"
 #include "Language.h"
+#include "CpuFeatures.h"
+
+#ifdef CPU_X86_SIMD
+#include <emmintrin.h>
+#endif
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
 
@@ -35,16 +41,371 @@ static void formatError(void)
   throw EUnicodeError("Error while formatting string");
 }
 
-static void utf8EncodeError(void)
+static void utf16DecodeError(void)
+{
+  throw EUnicodeError("Invalid UTF-16 character encoding");
+}
+
+static const word32 REPLACEMENT_CHAR = 0xfffd;
+
+static const bool s_blUseSse2 = GetCpuFeatures().SSE2;
+
+// The conversion functions below consist of vectorized main loops (SSE2),
+// which process blocks of 8 or 16 code units at once as long as the blocks
+// contain only "simple" characters (e.g., ASCII), and scalar code for all
+// other characters. Since the SSE2 code is compiled for a specific target,
+// each main loop exists in a vectorized and a purely scalar version, both
+// sharing the same per-character helper functions.
+// Null-terminated strings are read by aligned 16-byte loads, which never
+// cross page boundaries and are therefore safe even beyond the terminator.
+
+static inline bool isSurrogate(word32 lChar)
+{
+  return lChar - 0xd800 < 0x800;
+}
+
+static inline bool isHighSurrogate(word32 lChar)
 {
-  throw EUnicodeError("Error while converting string to UTF-8");
+  return lChar - 0xd800 < 0x400;
 }
 
-static void utf8DecodeError(void)
+static inline bool isLowSurrogate(word32 lChar)
 {
-  throw EUnicodeError("Error while decoding UTF-8 string");
+  return lChar - 0xdc00 < 0x400;
 }
 
+static inline bool isAligned16(const void* p)
+{
+  return (reinterpret_cast<uintptr_t>(p) & 15) == 0;
+}
+
+//---------------------------------------------------------------------------
+// counts UTF-8 bytes required for the character at pSrc;
+// unpaired surrogates are replaced by U+FFFD (3 bytes)
+static inline const wchar_t* countUtf8Char(const wchar_t* pSrc,
+  const wchar_t* pSrcEnd,
+  int& nLen)
+{
+  word32 lChar = *pSrc++;
+  if (lChar < 0x80)
+    nLen += 1;
+  else if (lChar < 0x800)
+    nLen += 2;
+  else if (isHighSurrogate(lChar) && pSrc < pSrcEnd && isLowSurrogate(*pSrc)) {
+    pSrc++;
+    nLen += 4;
+  }
+  else
+    nLen += 3;
+  return pSrc;
+}
+//---------------------------------------------------------------------------
+// encodes the character at pSrc as UTF-8;
+// unpaired surrogates are replaced by U+FFFD
+static inline const wchar_t* encodeUtf8Char(const wchar_t* pSrc,
+  const wchar_t* pSrcEnd,
+  char*& pDest)
+{
+  word32 lChar = *pSrc++;
+  if (lChar < 0x80)
+    *pDest++ = lChar;
+  else if (lChar < 0x800) {
+    *pDest++ = 0xc0 | (lChar >> 6);
+    *pDest++ = 0x80 | (lChar & 0x3f);
+  }
+  else {
+    if (isSurrogate(lChar)) {
+      if (isHighSurrogate(lChar) && pSrc < pSrcEnd && isLowSurrogate(*pSrc)) {
+        lChar = 0x10000 + ((lChar - 0xd800) << 10) + (*pSrc++ - 0xdc00);
+        *pDest++ = 0xf0 | (lChar >> 18);
+        *pDest++ = 0x80 | ((lChar >> 12) & 0x3f);
+        *pDest++ = 0x80 | ((lChar >> 6) & 0x3f);
+        *pDest++ = 0x80 | (lChar & 0x3f);
+        return pSrc;
+      }
+      lChar = REPLACEMENT_CHAR;
+    }
+    *pDest++ = 0xe0 | (lChar >> 12);
+    *pDest++ = 0x80 | ((lChar >> 6) & 0x3f);
+    *pDest++ = 0x80 | (lChar & 0x3f);
+  }
+  return pSrc;
+}
+//---------------------------------------------------------------------------
+// decodes a UTF-8 sequence; invalid or incomplete sequences, overlong
+// encodings, surrogates and values beyond U+10FFFF yield U+FFFD
+static inline word32 decodeUtf8Char(const word8*& pSrc,
+  const word8* pSrcEnd)
+{
+  word32 lChar = *pSrc++;
+  if (lChar < 0x80)
+    return lChar;
+
+  int nTrailing;
+  word32 lMin;
+  if (lChar >= 0xc2 && lChar <= 0xdf) {
+    nTrailing = 1;
+    lChar &= 0x1f;
+    lMin = 0x80;
+  }
+  else if (lChar >= 0xe0 && lChar <= 0xef) {
+    nTrailing = 2;
+    lChar &= 0x0f;
+    lMin = 0x800;
+  }
+  else if (lChar >= 0xf0 && lChar <= 0xf4) {
+    nTrailing = 3;
+    lChar &= 0x07;
+    lMin = 0x10000;
+  }
+  else
+    return REPLACEMENT_CHAR;
+
+  for ( ; nTrailing > 0; nTrailing--) {
+    if (pSrc == pSrcEnd || (*pSrc & 0xc0) != 0x80)
+      return REPLACEMENT_CHAR;
+    lChar = (lChar << 6) | (*pSrc++ & 0x3f);
+  }
+
+  if (lChar < lMin || lChar > 0x10ffff || isSurrogate(lChar))
+    return REPLACEMENT_CHAR;
+
+  return lChar;
+}
+//---------------------------------------------------------------------------
+static inline void putWChar(word32 lChar,
+  wchar_t*& pDest)
+{
+  if (lChar < 0x10000)
+    *pDest++ = lChar;
+  else {
+    lChar -= 0x10000;
+    *pDest++ = 0xd800 + (lChar >> 10);
+    *pDest++ = 0xdc00 + (lChar & 0x3ff);
+  }
+}
+//---------------------------------------------------------------------------
+// converts the character at pSrc to the 32-bit encoding
+static inline const wchar_t* convertW32Char(const wchar_t* pSrc,
+  word32*& pDest)
+{
+  if (isHighSurrogate(pSrc[0])) {
+    if (!isLowSurrogate(pSrc[1]))
+      utf16DecodeError();
+    *pDest++ = (pSrc[1] << 16) | pSrc[0];
+    return pSrc + 2;
+  }
+  *pDest++ = *pSrc;
+  return pSrc + 1;
+}
+//---------------------------------------------------------------------------
+#ifdef CPU_X86_SIMD
+// unsigned 16-bit comparison x < lLimit via signed comparison
+TARGET_SSE2 static inline __m128i lessThanU16(__m128i x,
+  int nLimit)
+{
+  const __m128i bias = _mm_set1_epi16(-0x8000);
+  return _mm_cmplt_epi16(_mm_xor_si128(x, bias),
+    _mm_set1_epi16(static_cast<short>(nLimit ^ 0x8000)));
+}
+//---------------------------------------------------------------------------
+// mask of surrogates (0xD800..0xDFFF)
+TARGET_SSE2 static inline __m128i surrogateMask(__m128i x)
+{
+  return lessThanU16(_mm_sub_epi16(x, _mm_set1_epi16(-0x2800)), 0x800);
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static int numOfUnicodeCharsSse2(const wchar_t* pwszStr)
+{
+  int nChars = 0;
+
+  for (;;) {
+    if (isAligned16(pwszStr)) {
+      __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(pwszStr));
+      __m128i special = _mm_or_si128(_mm_cmpeq_epi16(v, _mm_setzero_si128()),
+        lessThanU16(_mm_sub_epi16(v, _mm_set1_epi16(-0x2800)), 0x400));
+      if (_mm_movemask_epi8(special) == 0) {
+        pwszStr += 8;
+        nChars += 8;
+        continue;
+      }
+    }
+    if (*pwszStr == '\0')
+      break;
+    if (isHighSurrogate(*pwszStr) && pwszStr[1] != '\0')
+      pwszStr++;
+    pwszStr++;
+    nChars++;
+  }
+
+  return nChars;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static word32* wcharToW32CharSse2(const wchar_t* pwszSrc,
+  word32* pDest)
+{
+  for (;;) {
+    if (isAligned16(pwszSrc)) {
+      __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(pwszSrc));
+      __m128i special = _mm_or_si128(_mm_cmpeq_epi16(v, _mm_setzero_si128()),
+        surrogateMask(v));
+      if (_mm_movemask_epi8(special) == 0) {
+        __m128i zero = _mm_setzero_si128();
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest),
+          _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + 4),
+          _mm_unpackhi_epi16(v, zero));
+        pwszSrc += 8;
+        pDest += 8;
+        continue;
+      }
+    }
+    if (*pwszSrc == '\0')
+      break;
+    pwszSrc = convertW32Char(pwszSrc, pDest);
+  }
+
+  return pDest;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static wchar_t* w32CharToWCharInternalSse2(word32* pBuf32,
+  wchar_t* pBuf16)
+{
+  for (;;) {
+    if (isAligned16(pBuf32)) {
+      // 4 characters which are neither zero nor exceed 16 bits
+      __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(pBuf32));
+      __m128i zero = _mm_setzero_si128();
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) == 0 &&
+          _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(v, 16), zero))
+            == 0xffff) {
+        // the destination never overtakes the source, so the (overlapping)
+        // 8-byte store only overwrites characters which have been read
+        __m128i v16 = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pBuf16),
+          _mm_packs_epi32(v16, v16));
+        pBuf32 += 4;
+        pBuf16 += 4;
+        continue;
+      }
+    }
+    if (*pBuf32 == '\0')
+      break;
+    *pBuf16++ = *pBuf32;
+    if (*pBuf32 > 0xFFFF)
+      *pBuf16++ = *pBuf32 >> 16;
+    pBuf32++;
+  }
+
+  return pBuf16;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static int utf8EncodedLengthSse2(const wchar_t* pSrc,
+  const wchar_t* pSrcEnd)
+{
+  int nLen = 0;
+
+  while (pSrc < pSrcEnd) {
+    if (pSrcEnd - pSrc >= 8) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+      if (_mm_movemask_epi8(surrogateMask(v)) == 0) {
+        // each character requires 1 byte, plus 1 byte if >= 0x80, plus
+        // another byte if >= 0x800 (masks are -1)
+        __m128i sum = _mm_add_epi16(
+          _mm_andnot_si128(lessThanU16(v, 0x80), _mm_set1_epi16(1)),
+          _mm_andnot_si128(lessThanU16(v, 0x800), _mm_set1_epi16(1)));
+        sum = _mm_madd_epi16(sum, _mm_set1_epi16(1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+        nLen += 8 + _mm_cvtsi128_si32(sum);
+        pSrc += 8;
+        continue;
+      }
+    }
+    const wchar_t* pStop = std::min(pSrc + 8, pSrcEnd);
+    do {
+      pSrc = countUtf8Char(pSrc, pSrcEnd, nLen);
+    } while (pSrc < pStop);
+  }
+
+  return nLen;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static char* wcharToUtf8Sse2(const wchar_t* pSrc,
+  const wchar_t* pSrcEnd,
+  char* pDest)
+{
+  while (pSrc < pSrcEnd) {
+    if (pSrcEnd - pSrc >= 8) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+      if (_mm_movemask_epi8(lessThanU16(v, 0x80)) == 0xffff) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pDest),
+          _mm_packus_epi16(v, v));
+        pSrc += 8;
+        pDest += 8;
+        continue;
+      }
+    }
+    const wchar_t* pStop = std::min(pSrc + 8, pSrcEnd);
+    do {
+      pSrc = encodeUtf8Char(pSrc, pSrcEnd, pDest);
+    } while (pSrc < pStop);
+  }
+
+  return pDest;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static int utf8DecodedLengthSse2(const word8* pSrc,
+  const word8* pSrcEnd)
+{
+  int nLen = 0;
+
+  while (pSrc < pSrcEnd) {
+    if (pSrcEnd - pSrc >= 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+      if (_mm_movemask_epi8(v) == 0) {
+        pSrc += 16;
+        nLen += 16;
+        continue;
+      }
+    }
+    const word8* pStop = std::min(pSrc + 16, pSrcEnd);
+    do {
+      nLen += (decodeUtf8Char(pSrc, pSrcEnd) < 0x10000) ? 1 : 2;
+    } while (pSrc < pStop);
+  }
+
+  return nLen;
+}
+//---------------------------------------------------------------------------
+TARGET_SSE2 static wchar_t* utf8ToWCharSse2(const word8* pSrc,
+  const word8* pSrcEnd,
+  wchar_t* pDest)
+{
+  while (pSrc < pSrcEnd) {
+    if (pSrcEnd - pSrc >= 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+      if (_mm_movemask_epi8(v) == 0) {
+        __m128i zero = _mm_setzero_si128();
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest),
+          _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + 8),
+          _mm_unpackhi_epi8(v, zero));
+        pSrc += 16;
+        pDest += 16;
+        continue;
+      }
+    }
+    const word8* pStop = std::min(pSrc + 16, pSrcEnd);
+    do {
+      putWChar(decodeUtf8Char(pSrc, pSrcEnd), pDest);
+    } while (pSrc < pStop);
+  }
+
+  return pDest;
+}
+#endif
+
 //---------------------------------------------------------------------------
 std::wstring FormatW_(const WString& sFormat,
   const std::vector<WString>& args)
@@ -106,11 +467,15 @@ SecureWString FormatW_Secure(const WString& sFormat,
 //---------------------------------------------------------------------------
 int GetNumOfUnicodeChars(const wchar_t* pwszStr)
 {
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    return numOfUnicodeCharsSse2(pwszStr);
+#endif
+
   int nChars = 0;
 
   for (; *pwszStr != '\0'; pwszStr++, nChars++) {
-    //if (word32(*pwszStr - 0xD800) <= 0x3FF)
-    if (*pwszStr >= 0xd800 && *pwszStr <= 0xdbff)
+    if (isHighSurrogate(*pwszStr) && pwszStr[1] != '\0')
       pwszStr++;
   }
 
@@ -133,16 +498,14 @@ int WCharToW32Char(const wchar_t* pwszSrc, word32* pDest)
 {
   const word32* pDestStart = pDest;
 
-  while (*pwszSrc != '\0') {
-    if (pwszSrc[0] >= 0xd800 && pwszSrc[0] <= 0xdbff) {
-      if (pwszSrc[1] >= 0xdc00 && pwszSrc[1] <= 0xdfff)
-        *pDest++ = (pwszSrc[1] << 16) | pwszSrc[0];
-      else
-        throw EUnicodeError("Invalid UTF-16 character encoding");
-      pwszSrc += 2;
-    }
-    else
-      *pDest++ = *pwszSrc++;
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    pDest = wcharToW32CharSse2(pwszSrc, pDest);
+  else
+#endif
+  {
+    while (*pwszSrc != '\0')
+      pwszSrc = convertW32Char(pwszSrc, pDest);
   }
 
   *pDest = '\0';
@@ -195,6 +558,14 @@ void W32CharToWCharInternal(void* pBuf)
   word32* pBuf32 = reinterpret_cast<word32*>(pBuf);
   wchar_t* pBuf16 = reinterpret_cast<wchar_t*>(pBuf);
 
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2) {
+    pBuf16 = w32CharToWCharInternalSse2(pBuf32, pBuf16);
+    *pBuf16 = '\0';
+    return;
+  }
+#endif
+
   for (; *pBuf32 != '\0'; pBuf32++) {
     *pBuf16++ = *pBuf32;
     if (*pBuf32 > 0xFFFF)
@@ -237,72 +608,138 @@ w32string AsciiCharToW32String(const char* pszStr)
   return sDest;
 }
 //---------------------------------------------------------------------------
-AnsiString WStringToUtf8(const WString& sSrc)
+int GetUtf8EncodedLength(const wchar_t* pwszSrc, int nSrcLen)
 {
-  if (sSrc.IsEmpty())
-    return AnsiString();
+  const wchar_t* pSrcEnd = pwszSrc + nSrcLen;
 
-  int nDestLen = WideCharToMultiByte(CP_UTF8, 0, sSrc.c_str(), -1,
-    nullptr, 0, nullptr, nullptr);
-  if (nDestLen == 0)
-    utf8EncodeError();
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    return utf8EncodedLengthSse2(pwszSrc, pSrcEnd);
+#endif
 
-  AnsiString asDest;
-  asDest.SetLength(nDestLen - 1);
+  int nLen = 0;
+  while (pwszSrc < pSrcEnd)
+    pwszSrc = countUtf8Char(pwszSrc, pSrcEnd, nLen);
 
-  WideCharToMultiByte(CP_UTF8, 0, sSrc.c_str(), -1, &asDest[1], nDestLen,
-    nullptr, nullptr);
+  return nLen;
+}
+//---------------------------------------------------------------------------
+int WCharToUtf8(const wchar_t* pwszSrc, int nSrcLen, char* pDest)
+{
+  const wchar_t* pSrcEnd = pwszSrc + nSrcLen;
+  char* pDestStart = pDest;
+
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    pDest = wcharToUtf8Sse2(pwszSrc, pSrcEnd, pDest);
+  else
+#endif
+  {
+    while (pwszSrc < pSrcEnd)
+      pwszSrc = encodeUtf8Char(pwszSrc, pSrcEnd, pDest);
+  }
 
-  return asDest;
+  return pDest - pDestStart;
 }
 //---------------------------------------------------------------------------
-SecureAnsiString WStringToUtf8(const wchar_t* pwszSrc)
+int GetUtf8DecodedLength(const char* pszSrc, int nSrcLen)
 {
-  if (pwszSrc == nullptr || *pwszSrc == '\0')
-    return SecureAnsiString();
+  const word8* pSrc = reinterpret_cast<const word8*>(pszSrc);
+  const word8* pSrcEnd = pSrc + nSrcLen;
+
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    return utf8DecodedLengthSse2(pSrc, pSrcEnd);
+#endif
+
+  int nLen = 0;
+  while (pSrc < pSrcEnd)
+    nLen += (decodeUtf8Char(pSrc, pSrcEnd) < 0x10000) ? 1 : 2;
+
+  return nLen;
+}
+//---------------------------------------------------------------------------
+bool IsValidUtf8(const char* pszSrc, int nSrcLen)
+{
+  const word8* pSrc = reinterpret_cast<const word8*>(pszSrc);
+  const word8* pSrcEnd = pSrc + nSrcLen;
+
+  while (pSrc < pSrcEnd) {
+    if (*pSrc < 0x80) {
+      pSrc++;
+      continue;
+    }
+    // U+FFFD also results from invalid input; accept it only if it was
+    // actually encoded in the source (EF BF BD)
+    const word8* pSeq = pSrc;
+    if (decodeUtf8Char(pSrc, pSrcEnd) == REPLACEMENT_CHAR &&
+        (pSrc - pSeq != 3 || pSeq[0] != 0xef || pSeq[1] != 0xbf ||
+         pSeq[2] != 0xbd))
+      return false;
+  }
+
+  return true;
+}
+//---------------------------------------------------------------------------
+int Utf8ToWChar(const char* pszSrc, int nSrcLen, wchar_t* pDest)
+{
+  const word8* pSrc = reinterpret_cast<const word8*>(pszSrc);
+  const word8* pSrcEnd = pSrc + nSrcLen;
+  wchar_t* pDestStart = pDest;
+
+#ifdef CPU_X86_SIMD
+  if (s_blUseSse2)
+    pDest = utf8ToWCharSse2(pSrc, pSrcEnd, pDest);
+  else
+#endif
+  {
+    while (pSrc < pSrcEnd)
+      putWChar(decodeUtf8Char(pSrc, pSrcEnd), pDest);
+  }
 
-  int nLen = WideCharToMultiByte(CP_UTF8, 0, pwszSrc, -1, nullptr, 0,
-    nullptr, nullptr);
-  if (nLen == 0)
-    utf8EncodeError();
+  return pDest - pDestStart;
+}
+//---------------------------------------------------------------------------
+AnsiString WStringToUtf8(const WString& sSrc)
+{
+  if (sSrc.IsEmpty())
+    return AnsiString();
+
+  int nSrcLen = sSrc.Length();
+  AnsiString asDest;
+  asDest.SetLength(GetUtf8EncodedLength(sSrc.c_str(), nSrcLen));
 
-  SecureAnsiString asDest(nLen);
+  WCharToUtf8(sSrc.c_str(), nSrcLen, &asDest[1]);
 
-  WideCharToMultiByte(CP_UTF8, 0, pwszSrc, -1, asDest, nLen, nullptr, nullptr);
   return asDest;
 }
 //---------------------------------------------------------------------------
-/*SecureAnsiString WStringToUtf8(const SecureWString& sSrc)
+SecureAnsiString WStringToUtf8(const wchar_t* pwszSrc)
 {
-  if (sSrc.IsStrEmpty())
+  if (pwszSrc == nullptr || *pwszSrc == '\0')
     return SecureAnsiString();
 
-  int nSrcLen = sSrc.StrLen() + 1;
-  int nDestLen = WideCharToMultiByte(CP_UTF8, 0, sSrc.c_str(), nSrcLen,
-    nullptr, 0, nullptr, nullptr);
-  if (nDestLen == 0)
-    utf8EncodeError();
+  int nSrcLen = wcslen(pwszSrc);
+  int nLen = GetUtf8EncodedLength(pwszSrc, nSrcLen);
 
-  SecureAnsiString asDest(nDestLen);
+  SecureAnsiString asDest(nLen + 1);
+
+  WCharToUtf8(pwszSrc, nSrcLen, asDest);
+  asDest[nLen] = '\0';
 
-  WideCharToMultiByte(CP_UTF8, 0, sSrc.c_str(), nSrcLen, asDest, nDestLen,
-    nullptr, nullptr);
   return asDest;
-}*/
+}
 //---------------------------------------------------------------------------
 WString Utf8ToWString(const AnsiString& asSrc)
 {
   if (asSrc.IsEmpty())
     return WString();
 
-  int nDestLen = MultiByteToWideChar(CP_UTF8, 0, asSrc.c_str(), -1, nullptr, 0);
-  if (nDestLen == 0)
-    utf8DecodeError();
-
+  int nSrcLen = asSrc.Length();
   WString sDest;
-  sDest.SetLength(nDestLen - 1);
+  sDest.SetLength(GetUtf8DecodedLength(asSrc.c_str(), nSrcLen));
 
-  MultiByteToWideChar(CP_UTF8, 0, asSrc.c_str(), -1, sDest.FirstChar(), nDestLen);
+  Utf8ToWChar(asSrc.c_str(), nSrcLen, sDest.FirstChar());
 
   return sDest;
 }
@@ -312,13 +749,14 @@ SecureWString Utf8ToWString(const char* pszSrc)
   if (pszSrc == nullptr || *pszSrc == '\0')
     return SecureWString();
 
-  int nLen = MultiByteToWideChar(CP_UTF8, 0, pszSrc, -1, nullptr, 0);
-  if (nLen == 0)
-    utf8DecodeError();
+  int nSrcLen = strlen(pszSrc);
+  int nLen = GetUtf8DecodedLength(pszSrc, nSrcLen);
+
+  SecureWString sDest(nLen + 1);
 
-  SecureWString sDest(nLen);
+  Utf8ToWChar(pszSrc, nSrcLen, sDest);
+  sDest[nLen] = '\0';
 
-  MultiByteToWideChar(CP_UTF8, 0, pszSrc, -1, sDest, nLen);
   return sDest;
 }
 //---------------------------------------------------------------------------
@@ -122,6 +122,43 @@ WString W32StringToWString(const w32string& sSrc);
 // <- resulting wide string (32-bit)
 w32string AsciiCharToW32String(const char* pszStr);
 
+// determine number of bytes required for converting a 16-bit wide string
+// to UTF-8 (see WCharToUtf8())
+// -> source string (16-bit), need not be null-terminated
+// -> source length in characters
+// <- number of UTF-8 bytes (without terminating zero)
+int GetUtf8EncodedLength(const wchar_t* pwszSrc, int nSrcLen);
+
+// convert 16-bit wide string to UTF-8 within a caller-provided buffer;
+// unpaired surrogates are replaced by U+FFFD
+// -> source string (16-bit), need not be null-terminated
+// -> source length in characters
+// -> dest. buffer; must have space for GetUtf8EncodedLength() bytes
+// <- number of bytes written (no terminating zero is added)
+int WCharToUtf8(const wchar_t* pwszSrc, int nSrcLen, char* pDest);
+
+// determine number of 16-bit characters resulting from decoding a UTF-8
+// string (see Utf8ToWChar())
+// -> source string (UTF-8), need not be null-terminated
+// -> source length in bytes
+// <- number of 16-bit characters (without terminating zero)
+int GetUtf8DecodedLength(const char* pszSrc, int nSrcLen);
+
+// check whether a string is well-formed UTF-8 (no invalid or incomplete
+// sequences, overlong encodings, surrogates or values beyond U+10FFFF)
+// -> source string (UTF-8), need not be null-terminated
+// -> source length in bytes
+// <- true if valid
+bool IsValidUtf8(const char* pszSrc, int nSrcLen);
+
+// convert UTF-8 string to 16-bit wide string within a caller-provided
+// buffer; invalid sequences are replaced by U+FFFD
+// -> source string (UTF-8), need not be null-terminated
+// -> source length in bytes
+// -> dest. buffer; must have space for GetUtf8DecodedLength() characters
+// <- number of characters written (no terminating zero is added)
+int Utf8ToWChar(const char* pszSrc, int nSrcLen, wchar_t* pDest);
+
 // convert 16-bit wide string to UTF-8 characters which can be stored
 // in an 8-bit AnsiString
 // -> source 16-bit wide string
@@ -38,7 +38,7 @@
 #include "EntropyManager.h"
 #include "dragdrop.h"
 #include "TopMostManager.h"
-#include "base64.h"
+#include "FastBase64.h"
 #include "ProgramDef.h"
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
@@ -758,15 +758,15 @@ std::tuple<int, int, AnsiString> CheckDonorKey(const AnsiString& asInput)
   if (asKey.Length() != 16)
     return { DONOR_KEY_INVALID, nType, asDonorId };
 
-  word8 buf[13];
-  buf[12] = '\0';
-  size_t destLen = 12;
-
-  base64_decode(buf, &destLen, reinterpret_cast<const word8*>(asKey.c_str()), 16);
+  // fastBase64DecodedMaxLen(16) = 14
+  word8 buf[14];
+  word32 lDestLen;
 
-  if (destLen != 12)
+  if (!fastBase64Decode(buf, &lDestLen, asKey.c_str(), 16) || lDestLen != 12)
     return { DONOR_KEY_INVALID, nType, asDonorId };
 
+  buf[12] = '\0';
+
   const word32 param[4] =  { 0x77adb64b, 0x959561b7, 0x8799de93, 0x22ef89dd };
 
   if (!decode_96bit(reinterpret_cast<word32*>(buf), param))